@@ -32,6 +32,7 @@
 #include <nih/timer.h>
 #include <nih/io.h>
 #include <nih/main.h>
+#include <nih/loop.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
@@ -61,6 +62,9 @@ static void              nih_dbus_timer             (DBusTimeout *timeout,
 static void              nih_dbus_wakeup_main       (void *data);
 static void              nih_dbus_callback          (DBusConnection *connection,
 						     NihMainLoopFunc *loop);
+static void              nih_dbus_dispatch_status   (DBusConnection *connection,
+						     DBusDispatchStatus status,
+						     void *data);
 static DBusHandlerResult nih_dbus_connection_disconnected (DBusConnection *connection,
 							   DBusMessage *message,
 							   NihDBusDisconnectHandler handler);
@@ -260,9 +264,13 @@ nih_dbus_setup (DBusConnection *         connection,
 		 * this means it will be automatically freed.  Until this
 		 * succeeds, all of the above functions will be reset each
 		 * time.
+		 *
+		 * The function is only called once woken by the connection
+		 * telling us that it has messages to dispatch, so idle
+		 * connections cost nothing each iteration.
 		 */
-		loop = nih_main_loop_add_func (NULL, (NihMainLoopCb)nih_dbus_callback,
-					       connection);
+		loop = nih_main_loop_add_ready_func (
+			NULL, (NihMainLoopCb)nih_dbus_callback, connection);
 		if (! loop)
 			goto error;
 
@@ -271,6 +279,14 @@ nih_dbus_setup (DBusConnection *         connection,
 			nih_free (loop);
 			goto error;
 		}
+
+		dbus_connection_set_dispatch_status_function (
+			connection, nih_dbus_dispatch_status, NULL, NULL);
+
+		/* Messages may already have been queued before we set the
+		 * function, so dispatch once anyway.
+		 */
+		nih_main_loop_func_wake (loop);
 	}
 
 	/* Add the filter for the disconnect handler (which may be NULL,
@@ -507,7 +523,8 @@ nih_dbus_watch_toggled (DBusWatch *watch,
 		events |= NIH_IO_WRITE;
 
 	if (dbus_watch_get_enabled (watch)) {
-		nih_list_add (nih_io_watches, &io_watch->entry);
+		nih_list_add (nih_loop_current ()->io_watches,
+			      &io_watch->entry);
 	} else {
 		nih_list_remove (&io_watch->entry);
 	}
@@ -640,7 +657,7 @@ nih_dbus_timeout_toggled (DBusTimeout *timeout,
 	timer->due = now.tv_sec + timer->period;
 
 	if (dbus_timeout_get_enabled (timeout)) {
-		nih_list_add (nih_timers, &timer->entry);
+		nih_list_add (nih_loop_current ()->timers, &timer->entry);
 	} else {
 		nih_list_remove (&timer->entry);
 	}
@@ -697,6 +714,34 @@ nih_dbus_callback (DBusConnection * connection,
 		;
 }
 
+/**
+ * nih_dbus_dispatch_status:
+ * @connection: D-Bus connection,
+ * @status: new dispatch status,
+ * @data: not used.
+ *
+ * Called by D-Bus when the dispatch status of @connection changes; when
+ * there are messages to be dispatched, wakes the main loop function we
+ * stored in the connection so that nih_dbus_callback() will be called in
+ * the next main loop iteration.
+ **/
+static void
+nih_dbus_dispatch_status (DBusConnection *   connection,
+			  DBusDispatchStatus status,
+			  void *             data)
+{
+	NihMainLoopFunc *loop;
+
+	nih_assert (connection != NULL);
+
+	if (status != DBUS_DISPATCH_DATA_REMAINS)
+		return;
+
+	loop = dbus_connection_get_data (connection, main_loop_slot);
+	if (loop)
+		nih_main_loop_func_wake (loop);
+}
+
 
 /**
  * nih_dbus_connection_disconnected:
@@ -28,13 +28,22 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include <dbus/dbus.h>
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
+#include <nih/coro.h>
 #include <nih/logging.h>
+#include <nih/error.h>
 
 #include "dbus_util.h"
 
 
+/* Prototypes for static functions */
+static void nih_dbus_pending_call_wake (DBusPendingCall *pending,
+					void *data);
+
+
 /**
  * nih_dbus_path:
  * @parent: parent object for new string,
@@ -126,3 +135,66 @@ nih_dbus_path (const void *parent,
 
 	return path;
 }
+
+
+/**
+ * nih_dbus_pending_call_await:
+ * @pending: pending call to wait for.
+ *
+ * Suspends the running coroutine until @pending has completed, and
+ * returns the reply; this may be an error reply, including one generated
+ * by libdbus if the call timed out.
+ *
+ * The coroutine must not be freed while it is waiting, since libdbus
+ * holds a pointer to it; cancel @pending with dbus_pending_call_cancel()
+ * first if that may happen.
+ *
+ * This may only be called from a coroutine run by the loop that the
+ * connection of @pending was set up with.
+ *
+ * Returns: reply message, which the caller must unreference, or NULL on
+ * raised error.
+ **/
+DBusMessage *
+nih_dbus_pending_call_await (DBusPendingCall *pending)
+{
+	NihCoro *coro;
+
+	nih_assert (pending != NULL);
+
+	coro = nih_coro_current ();
+	nih_assert (coro != NULL);
+
+	if (! dbus_pending_call_get_completed (pending)) {
+		if (! dbus_pending_call_set_notify (
+			    pending, nih_dbus_pending_call_wake, coro, NULL))
+			nih_return_no_memory_error (NULL);
+
+		while (! dbus_pending_call_get_completed (pending))
+			nih_coro_suspend ();
+
+		dbus_pending_call_set_notify (pending, NULL, NULL, NULL);
+	}
+
+	return dbus_pending_call_steal_reply (pending);
+}
+
+/**
+ * nih_dbus_pending_call_wake:
+ * @pending: pending call that has completed,
+ * @data: coroutine waiting for it.
+ *
+ * Called by libdbus once @pending has completed, wakes the coroutine so
+ * that the reply is returned by nih_dbus_pending_call_await().
+ **/
+static void
+nih_dbus_pending_call_wake (DBusPendingCall *pending,
+			    void            *data)
+{
+	NihCoro *coro = data;
+
+	nih_assert (pending != NULL);
+	nih_assert (coro != NULL);
+
+	nih_coro_wake (coro);
+}
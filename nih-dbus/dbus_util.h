@@ -22,12 +22,18 @@
 
 #include <nih/macros.h>
 
+#include <dbus/dbus.h>
+
 
 NIH_BEGIN_EXTERN
 
-char *nih_dbus_path (const void *parent, const char *root, ...)
+char *       nih_dbus_path               (const void *parent,
+					  const char *root, ...)
 	__attribute__ ((sentinel, warn_unused_result, malloc));
 
+DBusMessage *nih_dbus_pending_call_await (DBusPendingCall *pending)
+	__attribute__ ((warn_unused_result));
+
 NIH_END_EXTERN
 
 #endif /* NIH_DBUS_UTIL_H */
@@ -37,6 +37,7 @@
 #include <nih/child.h>
 #include <nih/io.h>
 #include <nih/main.h>
+#include <nih/loop.h>
 #include <nih/error.h>
 
 #include <nih-dbus/dbus_error.h>
@@ -44,6 +45,12 @@
 #include <nih-dbus/errors.h>
 
 
+/* The main loop function for a connection is only in the ready list of the
+ * default loop until it is next called.
+ */
+#define ready_list (nih_loop_default ()->ready_functions)
+
+
 static DBusConnection *client_connection = NULL;
 
 static void
@@ -256,10 +263,10 @@ test_connect (void)
 		TEST_EQ_P (io_watch->entry.next, nih_io_watches);
 
 		/* Should be a single main loop function. */
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+		TEST_LIST_NOT_EMPTY (ready_list);
+		loop_func = (NihMainLoopFunc *)ready_list->next;
 		TEST_EQ_P (loop_func->data, conn);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_unref (conn);
 
@@ -325,8 +332,8 @@ test_connect (void)
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -411,8 +418,8 @@ test_connect (void)
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -497,8 +504,8 @@ test_connect (void)
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -528,10 +535,10 @@ test_connect (void)
 
 		/* Still should be a single main loop function */
 		TEST_NOT_FREE (loop_func);
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		TEST_EQ_P ((NihMainLoopFunc *)nih_main_loop_functions->next,
+		TEST_LIST_NOT_EMPTY (ready_list);
+		TEST_EQ_P ((NihMainLoopFunc *)ready_list->next,
 			   loop_func);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		/* Disconnection should free both references */
 		disconnected = FALSE;
@@ -599,8 +606,8 @@ test_connect (void)
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -952,10 +959,10 @@ test_bus (void)
 		TEST_EQ_P (io_watch->entry.next, nih_io_watches);
 
 		/* Should be a single main loop function. */
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+		TEST_LIST_NOT_EMPTY (ready_list);
+		loop_func = (NihMainLoopFunc *)ready_list->next;
 		TEST_EQ_P (loop_func->data, conn);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_unref (conn);
 		dbus_shutdown ();
@@ -1003,10 +1010,10 @@ system_bus:
 		TEST_EQ_P (io_watch->entry.next, nih_io_watches);
 
 		/* Should be a single main loop function. */
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+		TEST_LIST_NOT_EMPTY (ready_list);
+		loop_func = (NihMainLoopFunc *)ready_list->next;
 		TEST_EQ_P (loop_func->data, conn);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_unref (conn);
 		dbus_shutdown ();
@@ -1027,8 +1034,8 @@ system_bus:
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -1057,10 +1064,10 @@ system_bus:
 
 		/* Still should be a single main loop function */
 		TEST_NOT_FREE (loop_func);
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		TEST_EQ_P ((NihMainLoopFunc *)nih_main_loop_functions->next,
+		TEST_LIST_NOT_EMPTY (ready_list);
+		TEST_EQ_P ((NihMainLoopFunc *)ready_list->next,
 			   loop_func);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_unref (conn);
 		dbus_connection_unref (last_conn);
@@ -1239,10 +1246,10 @@ test_setup (void)
 		TEST_EQ_P (io_watch->entry.next, nih_io_watches);
 
 		/* Should be a single main loop function. */
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+		TEST_LIST_NOT_EMPTY (ready_list);
+		loop_func = (NihMainLoopFunc *)ready_list->next;
 		TEST_EQ_P (loop_func->data, conn);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_close (conn);
 		dbus_connection_unref (conn);
@@ -1272,8 +1279,8 @@ test_setup (void)
 			dbus_connection_get_unix_fd (conn, &fd);
 			assert (io_watch->fd == fd);
 
-			assert (! NIH_LIST_EMPTY (nih_main_loop_functions));
-			loop_func = (NihMainLoopFunc *)nih_main_loop_functions->next;
+			assert (! NIH_LIST_EMPTY (ready_list));
+			loop_func = (NihMainLoopFunc *)ready_list->next;
 			assert (loop_func->data == conn);
 		}
 
@@ -1296,10 +1303,10 @@ test_setup (void)
 
 		/* Still should be a single main loop function */
 		TEST_NOT_FREE (loop_func);
-		TEST_LIST_NOT_EMPTY (nih_main_loop_functions);
-		TEST_EQ_P ((NihMainLoopFunc *)nih_main_loop_functions->next,
+		TEST_LIST_NOT_EMPTY (ready_list);
+		TEST_EQ_P ((NihMainLoopFunc *)ready_list->next,
 			   loop_func);
-		TEST_EQ_P (loop_func->entry.next, nih_main_loop_functions);
+		TEST_EQ_P (loop_func->entry.next, ready_list);
 
 		dbus_connection_close (conn);
 		dbus_connection_unref (conn);
@@ -22,9 +22,14 @@
 #include <nih/test.h>
 #include <nih-dbus/test_dbus.h>
 
+#include <dbus/dbus.h>
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
+#include <nih/main.h>
+#include <nih/coro.h>
 
+#include <nih-dbus/dbus_connection.h>
 #include <nih-dbus/dbus_util.h>
 
 
@@ -151,11 +156,80 @@ test_path (void)
 }
 
 
+static DBusMessage *await_reply = NULL;
+
+static void
+my_await_func (void    *data,
+	       NihCoro *coro)
+{
+	DBusConnection * conn = data;
+	DBusMessage *    method_call;
+	DBusPendingCall *pending;
+
+	method_call = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+						    DBUS_PATH_DBUS,
+						    DBUS_INTERFACE_DBUS,
+						    "GetId");
+	assert (method_call != NULL);
+
+	assert (dbus_connection_send_with_reply (conn, method_call,
+						 &pending, -1));
+	dbus_message_unref (method_call);
+
+	await_reply = nih_dbus_pending_call_await (pending);
+	dbus_pending_call_unref (pending);
+
+	nih_main_loop_exit (0);
+}
+
+void
+test_pending_call_await (void)
+{
+	pid_t           dbus_pid;
+	DBusConnection *conn;
+	NihCoro *       coro;
+	const char *    id;
+
+	/* Check that a coroutine can make a method call and wait for the
+	 * reply, the main loop handling the connection meanwhile.
+	 */
+	TEST_FUNCTION ("nih_dbus_pending_call_await");
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	assert0 (nih_dbus_setup (conn, NULL));
+
+	coro = nih_coro_new (NULL, 0, my_await_func, conn);
+
+	TEST_FREE_TAG (coro);
+
+	await_reply = NULL;
+
+	nih_main_loop ();
+
+	TEST_FREE (coro);
+	TEST_NE_P (await_reply, NULL);
+	TEST_EQ (dbus_message_get_type (await_reply),
+		 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	TEST_TRUE (dbus_message_get_args (await_reply, NULL,
+					  DBUS_TYPE_STRING, &id,
+					  DBUS_TYPE_INVALID));
+
+	dbus_message_unref (await_reply);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
 int
 main (int   argc,
       char *argv[])
 {
 	test_path ();
+	test_pending_call_await ();
 
 	return 0;
 }
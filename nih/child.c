@@ -25,18 +25,88 @@
 
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if HAVE_DECL_P_PIDFD
+# include <sys/syscall.h>
+
+# ifdef __NR_pidfd_open
+#  define HAVE_PIDFD 1
+# endif /* __NR_pidfd_open */
+#endif /* HAVE_DECL_P_PIDFD */
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/list.h>
+#include <nih/io.h>
+#include <nih/loop.h>
 #include <nih/logging.h>
+#include <nih/error.h>
 
 #include "child.h"
 
 
+/**
+ * NIH_CHILD_SPAWN_STACK:
+ *
+ * Size of the stack used by a spawned child until it executes the new
+ * program.
+ **/
+#define NIH_CHILD_SPAWN_STACK 65536
+
+
+/**
+ * NihChildSpawn:
+ * @path: program to execute,
+ * @argv: arguments for program,
+ * @env: environment for program,
+ * @options: options given, or NULL,
+ * @tmp_fds: array for temporary copies of descriptors,
+ * @tmp_base: lowest descriptor number for temporary copies,
+ * @mask: signal mask to restore in the child,
+ * @error_fd: write end of the pipe to report errors through.
+ *
+ * State shared with a child process spawned by nih_child_spawn() while it
+ * runs in our memory.
+ **/
+typedef struct nih_child_spawn {
+	const char            *path;
+	char * const          *argv;
+	char * const          *env;
+	const NihChildOptions *options;
+
+	int                   *tmp_fds;
+	int                    tmp_base;
+
+	sigset_t               mask;
+	int                    error_fd;
+} NihChildSpawn;
+
+
+/* Prototypes for static functions */
+static int  nih_child_watch_destroy (NihChildWatch *watch);
+static int  nih_child_watch_pidfd   (NihChildWatch *watch);
+static void nih_child_dispatch      (const siginfo_t *info);
+#if HAVE_PIDFD
+static void nih_child_pidfd_watcher (NihChildWatch *watch,
+				     NihIoWatch *io_watch,
+				     NihIoEvents events);
+#endif /* HAVE_PIDFD */
+static int  nih_child_spawn_child (NihChildSpawn *spawn);
+static void nih_child_spawn_fail  (NihChildSpawn *spawn)
+	__attribute__ ((noreturn));
+
+
 /**
  * WAITOPTS:
  *
@@ -80,6 +150,17 @@ nih_child_init (void)
  * process with id @pid.  If @pid is -1 then @handler is called for all
  * children.
  *
+ * Where the kernel supports it, a watch on a particular process also
+ * watches a descriptor referring to it with the current loop, so that
+ * its termination is delivered by that loop as soon as it happens without
+ * depending on SIGCHLD, and may be delivered by loops other than the
+ * default.  Other events, and events for watches with a @pid of -1, are
+ * only found by nih_child_poll() in the default loop.
+ *
+ * The list of watches is not locked, so such a loop must be run by the
+ * same thread that adds watches and calls nih_child_poll(); it may not be
+ * used to deliver child events in another thread.
+ *
  * The watch structure is allocated using nih_alloc() and stored in a linked
  * list; there is no non-allocated version because of this and because it
  * will be automatically freed once called if @pid is not -1 and the event
@@ -114,7 +195,7 @@ nih_child_add_watch (const void      *parent,
 
 	nih_list_init (&watch->entry);
 
-	nih_alloc_set_destructor (watch, nih_list_destroy);
+	nih_alloc_set_destructor (watch, nih_child_watch_destroy);
 
 	watch->pid = pid;
 	watch->events = events;
@@ -122,11 +203,404 @@ nih_child_add_watch (const void      *parent,
 	watch->handler = handler;
 	watch->data = data;
 
+	watch->pidfd = -1;
+	watch->io_watch = NULL;
+
+	if ((pid > 0) && (nih_child_watch_pidfd (watch) < 0)) {
+		nih_free (watch);
+		return NULL;
+	}
+
 	nih_list_add (nih_child_watches, &watch->entry);
 
 	return watch;
 }
 
+/**
+ * nih_child_watch_destroy:
+ * @watch: watch to be destroyed.
+ *
+ * Closes the descriptor referring to the process watched by @watch, if
+ * any, and removes it from the list of child watches.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_child_watch_destroy (NihChildWatch *watch)
+{
+	nih_assert (watch != NULL);
+
+	nih_list_destroy (&watch->entry);
+
+	if (watch->pidfd >= 0)
+		close (watch->pidfd);
+
+	return 0;
+}
+
+/**
+ * nih_child_watch_pidfd:
+ * @watch: watch on particular process.
+ *
+ * Opens a descriptor referring to the process watched by @watch and
+ * watches it with the current loop, so that nih_child_pidfd_watcher() is
+ * called once the process terminates.  When the kernel cannot give us
+ * a descriptor, @watch is left to nih_child_poll().
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+static int
+nih_child_watch_pidfd (NihChildWatch *watch)
+{
+	nih_assert (watch != NULL);
+	nih_assert (watch->pid > 0);
+
+#if HAVE_PIDFD
+	watch->pidfd = syscall (__NR_pidfd_open, watch->pid, 0);
+	if (watch->pidfd < 0) {
+		watch->pidfd = -1;
+		return 0;
+	}
+
+	watch->io_watch = nih_io_add_watch (
+		watch, watch->pidfd, NIH_IO_READ,
+		(NihIoWatcher)nih_child_pidfd_watcher, watch);
+	if (! watch->io_watch) {
+		close (watch->pidfd);
+		watch->pidfd = -1;
+		return -1;
+	}
+#endif /* HAVE_PIDFD */
+
+	return 0;
+}
+
+#if HAVE_PIDFD
+/**
+ * nih_child_pidfd_watcher:
+ * @watch: watch on particular process,
+ * @io_watch: watch on its descriptor,
+ * @events: events that occurred.
+ *
+ * Called by the loop when the process watched by @watch has terminated,
+ * reaps it and calls the handlers of the watches on it.
+ *
+ * If the process has already been reaped, perhaps because it is not our
+ * child, @watch stops watching the descriptor since it would otherwise
+ * stay readable.
+ **/
+static void
+nih_child_pidfd_watcher (NihChildWatch *watch,
+			 NihIoWatch    *io_watch,
+			 NihIoEvents    events)
+{
+	siginfo_t info;
+
+	nih_assert (watch != NULL);
+	nih_assert (io_watch != NULL);
+
+	memset (&info, 0, sizeof (info));
+
+	if ((waitid (P_PIDFD, watch->pidfd, &info, WAITOPTS | WNOHANG) < 0)
+	    || (! info.si_pid)) {
+		nih_free (watch->io_watch);
+		watch->io_watch = NULL;
+
+		close (watch->pidfd);
+		watch->pidfd = -1;
+		return;
+	}
+
+	nih_child_dispatch (&info);
+}
+#endif /* HAVE_PIDFD */
+
+
+/**
+ * nih_child_spawn:
+ * @parent: parent object for new watch,
+ * @path: full path of program to execute,
+ * @argv: NULL-terminated arguments for program,
+ * @options: options for child, or NULL,
+ * @handler: function to call when child terminates,
+ * @data: pointer to pass to @handler.
+ *
+ * Spawns a child process executing @path with the arguments @argv, set
+ * up as described by @options, and adds a watch that calls @handler once
+ * the child has exited, been killed or dumped core.
+ *
+ * The child shares our memory and we are suspended until it has executed
+ * @path, as with vfork(), so unlike fork() the cost of spawning does not
+ * grow with the size of our process.  All signals are blocked meanwhile;
+ * the child resets any caught signals to their default action and
+ * restores our signal mask before executing @path.
+ *
+ * Failure to set up or execute the child is reported to us through a
+ * pipe closed on exec, in which case the child is reaped, the error
+ * raised and no watch is returned.
+ *
+ * The watch structure is allocated using nih_alloc() and stored in the
+ * list of child watches, it is freed once @handler has been called; the
+ * process id of the child may be obtained from its pid member.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned watch.  When all parents
+ * of the returned watch are freed, the returned watch will also be
+ * freed.
+ *
+ * Returns: watch on the child, or NULL on raised error.
+ **/
+NihChildWatch *
+nih_child_spawn (const void             *parent,
+		 const char             *path,
+		 char * const            argv[],
+		 const NihChildOptions  *options,
+		 NihChildHandler         handler,
+		 void                   *data)
+{
+	NihChildWatch *watch;
+	NihChildSpawn  spawn;
+	sigset_t       all;
+	void          *stack;
+	int            fds[2], child_errno;
+	ssize_t        len;
+	pid_t          pid;
+	size_t         i;
+
+	nih_assert (path != NULL);
+	nih_assert (argv != NULL);
+	nih_assert (handler != NULL);
+
+	nih_child_init ();
+
+	/* Allocate the watch up front so that once the child is running,
+	 * nothing can stop us watching it; it's only placed in the list
+	 * once we know the pid.
+	 */
+	watch = nih_new (parent, NihChildWatch);
+	if (! watch)
+		nih_return_no_memory_error (NULL);
+
+	nih_list_init (&watch->entry);
+
+	nih_alloc_set_destructor (watch, nih_child_watch_destroy);
+
+	watch->pid = -1;
+	watch->events = NIH_CHILD_EXITED | NIH_CHILD_KILLED | NIH_CHILD_DUMPED;
+
+	watch->handler = handler;
+	watch->data = data;
+
+	watch->pidfd = -1;
+	watch->io_watch = NULL;
+
+	spawn.path = path;
+	spawn.argv = argv;
+	spawn.env = (options && options->env) ? options->env : environ;
+	spawn.options = options;
+	spawn.tmp_fds = NULL;
+	spawn.tmp_base = 0;
+
+	/* The child first copies each descriptor it's given above any of
+	 * the descriptors it's to set up, so that none are overwritten
+	 * before being copied.
+	 */
+	if (options && options->nfds) {
+		spawn.tmp_fds = nih_alloc (watch, (sizeof (int)
+						   * options->nfds));
+		if (! spawn.tmp_fds) {
+			nih_free (watch);
+			nih_return_no_memory_error (NULL);
+		}
+
+		for (i = 0; i < options->nfds; i++)
+			spawn.tmp_base = nih_max (spawn.tmp_base,
+						  options->fds[i].child_fd + 1);
+	}
+
+	stack = mmap (NULL, NIH_CHILD_SPAWN_STACK, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		nih_error_raise_system ();
+		nih_free (watch);
+		return NULL;
+	}
+
+	if (pipe2 (fds, O_CLOEXEC) < 0) {
+		nih_error_raise_system ();
+		munmap (stack, NIH_CHILD_SPAWN_STACK);
+		nih_free (watch);
+		return NULL;
+	}
+
+	spawn.error_fd = fds[1];
+
+	/* Block all signals so that none of our handlers are called in
+	 * the child while it shares our memory.
+	 */
+	sigfillset (&all);
+	pthread_sigmask (SIG_BLOCK, &all, &spawn.mask);
+
+	pid = clone ((int (*)(void *))nih_child_spawn_child,
+		     (char *)stack + NIH_CHILD_SPAWN_STACK,
+		     CLONE_VM | CLONE_VFORK | SIGCHLD, &spawn);
+	child_errno = errno;
+
+	pthread_sigmask (SIG_SETMASK, &spawn.mask, NULL);
+
+	munmap (stack, NIH_CHILD_SPAWN_STACK);
+	close (fds[1]);
+
+	if (pid < 0) {
+		close (fds[0]);
+		nih_free (watch);
+
+		errno = child_errno;
+		nih_return_system_error (NULL);
+	}
+
+	/* By now the child has either executed the program, closing the
+	 * pipe, or written the error that stopped it and exited.
+	 */
+	while (((len = read (fds[0], &child_errno, sizeof (child_errno))) < 0)
+	       && (errno == EINTR))
+		;
+	close (fds[0]);
+
+	if (len == sizeof (child_errno)) {
+		while ((waitpid (pid, NULL, 0) < 0) && (errno == EINTR))
+			;
+		nih_free (watch);
+
+		errno = child_errno;
+		nih_return_system_error (NULL);
+	}
+
+	/* Should there not be the memory to watch its descriptor, the
+	 * child is still found by nih_child_poll().
+	 */
+	watch->pid = pid;
+	nih_child_watch_pidfd (watch);
+
+	nih_list_add (nih_child_watches, &watch->entry);
+
+	return watch;
+}
+
+/**
+ * nih_child_spawn_child:
+ * @spawn: spawn state.
+ *
+ * Runs in the child process spawned by nih_child_spawn(), on its own
+ * stack but in our memory, and so may only use async-signal-safe
+ * functions and must not modify anything other than @spawn.  Sets up the
+ * child as described by the options and executes the program, reporting
+ * any failure through the error pipe.
+ *
+ * Returns: does not return.
+ **/
+static int
+nih_child_spawn_child (NihChildSpawn *spawn)
+{
+	const NihChildOptions *options = spawn->options;
+	struct sigaction       act;
+	size_t                 i;
+	int                    signum;
+
+	/* Reset caught signals to their default action, so that our
+	 * handlers are never called in the child.
+	 */
+	for (signum = 1; signum < _NSIG; signum++) {
+		if (sigaction (signum, NULL, &act) < 0)
+			continue;
+		if ((act.sa_handler == SIG_DFL) || (act.sa_handler == SIG_IGN))
+			continue;
+
+		act.sa_handler = SIG_DFL;
+		act.sa_flags = 0;
+		sigemptyset (&act.sa_mask);
+		sigaction (signum, &act, NULL);
+	}
+
+	if (options) {
+		/* Move the error pipe out of the way too, otherwise it
+		 * could be one of the descriptors we set up and a later
+		 * error would be written to that instead.
+		 */
+		if (options->nfds && (spawn->error_fd < spawn->tmp_base)) {
+			int error_fd;
+
+			error_fd = fcntl (spawn->error_fd, F_DUPFD_CLOEXEC,
+					  spawn->tmp_base);
+			if (error_fd < 0)
+				nih_child_spawn_fail (spawn);
+
+			spawn->error_fd = error_fd;
+		}
+
+		for (i = 0; i < options->nfds; i++) {
+			const NihChildFd *fd = &options->fds[i];
+
+			if ((fd->fd < 0) || (fd->fd == fd->child_fd)) {
+				spawn->tmp_fds[i] = fd->fd;
+				continue;
+			}
+
+			spawn->tmp_fds[i] = fcntl (fd->fd, F_DUPFD_CLOEXEC,
+						   spawn->tmp_base);
+			if (spawn->tmp_fds[i] < 0)
+				nih_child_spawn_fail (spawn);
+		}
+
+		for (i = 0; i < options->nfds; i++) {
+			const NihChildFd *fd = &options->fds[i];
+
+			if (spawn->tmp_fds[i] < 0) {
+				close (fd->child_fd);
+			} else if (spawn->tmp_fds[i] == fd->child_fd) {
+				if (fcntl (fd->child_fd, F_SETFD, 0) < 0)
+					nih_child_spawn_fail (spawn);
+			} else if (dup2 (spawn->tmp_fds[i],
+					 fd->child_fd) < 0) {
+				nih_child_spawn_fail (spawn);
+			}
+		}
+
+		if (options->setsid && (setsid () < 0))
+			nih_child_spawn_fail (spawn);
+
+		for (i = 0; i < options->nrlimits; i++)
+			if (setrlimit (options->rlimits[i].resource,
+				       &options->rlimits[i].limit) < 0)
+				nih_child_spawn_fail (spawn);
+	}
+
+	sigprocmask (SIG_SETMASK, &spawn->mask, NULL);
+
+	execve (spawn->path, spawn->argv, spawn->env);
+	nih_child_spawn_fail (spawn);
+}
+
+/**
+ * nih_child_spawn_fail:
+ * @spawn: spawn state.
+ *
+ * Reports the error in errno through the error pipe and exits the child
+ * process spawned by nih_child_spawn().
+ **/
+static void
+nih_child_spawn_fail (NihChildSpawn *spawn)
+{
+	int child_errno = errno;
+
+	while ((write (spawn->error_fd, &child_errno,
+		       sizeof (child_errno)) < 0)
+	       && (errno == EINTR))
+		;
+
+	_exit (255);
+}
+
 
 /**
  * nih_child_poll:
@@ -155,72 +629,96 @@ nih_child_poll (void)
 	memset (&info, 0, sizeof (info));
 
 	while (waitid (P_ALL, 0, &info, WAITOPTS | WNOHANG) == 0) {
-		pid_t          pid;
-		NihChildEvents event;
-		int            status, free_watch = TRUE;
-
-		pid = info.si_pid;
-		if (! pid)
+		if (! info.si_pid)
 			break;
 
-		/* Convert siginfo information to handler function arguments;
-		 * in practice this is mostly just copying, with a few bits
-		 * of lore.
-		 */
-		switch (info.si_code) {
-		case CLD_EXITED:
-			event = NIH_CHILD_EXITED;
-			status = info.si_status;
-			break;
-		case CLD_KILLED:
-			event = NIH_CHILD_KILLED;
-			status = info.si_status;
-			break;
-		case CLD_DUMPED:
-			event = NIH_CHILD_DUMPED;
-			status = info.si_status;
-			break;
-		case CLD_TRAPPED:
-			if (((info.si_status & 0x7f) == SIGTRAP)
-			    && (info.si_status & ~0x7f)) {
-				event = NIH_CHILD_PTRACE;
-				status = info.si_status >> 8;
-			} else {
-				event = NIH_CHILD_TRAPPED;
-				status = info.si_status;
-			}
-			free_watch = FALSE;
-			break;
-		case CLD_STOPPED:
-			event = NIH_CHILD_STOPPED;
-			status = info.si_status;
-			free_watch = FALSE;
-			break;
-		case CLD_CONTINUED:
-			event = NIH_CHILD_CONTINUED;
-			status = info.si_status;
-			free_watch = FALSE;
-			break;
-		default:
-			nih_assert_not_reached ();
-		}
+		nih_child_dispatch (&info);
 
-		NIH_LIST_FOREACH_SAFE (nih_child_watches, iter) {
-			NihChildWatch *watch = (NihChildWatch *)iter;
+		/* For next waitid call */
+		memset (&info, 0, sizeof (info));
+	}
+}
 
-			if ((watch->pid != pid) && (watch->pid != -1))
-				continue;
+/**
+ * nih_child_dispatch:
+ * @info: information returned by waitid().
+ *
+ * Calls the handlers of the watches on the process in @info that match the
+ * event it describes, freeing those for the particular process once it
+ * has terminated.
+ **/
+static void
+nih_child_dispatch (const siginfo_t *info)
+{
+	pid_t          pid;
+	NihChildEvents event;
+	int            status, free_watch = TRUE;
 
-			if (! (watch->events & event))
-				continue;
+	nih_assert (info != NULL);
 
-			watch->handler (watch->data, pid, event, status);
+	pid = info->si_pid;
 
-			if (free_watch && (watch->pid != -1))
-				nih_free (watch);
+	/* Convert siginfo information to handler function arguments;
+	 * in practice this is mostly just copying, with a few bits
+	 * of lore.
+	 */
+	switch (info->si_code) {
+	case CLD_EXITED:
+		event = NIH_CHILD_EXITED;
+		status = info->si_status;
+		break;
+	case CLD_KILLED:
+		event = NIH_CHILD_KILLED;
+		status = info->si_status;
+		break;
+	case CLD_DUMPED:
+		event = NIH_CHILD_DUMPED;
+		status = info->si_status;
+		break;
+	case CLD_TRAPPED:
+		if (((info->si_status & 0x7f) == SIGTRAP)
+		    && (info->si_status & ~0x7f)) {
+			event = NIH_CHILD_PTRACE;
+			status = info->si_status >> 8;
+		} else {
+			event = NIH_CHILD_TRAPPED;
+			status = info->si_status;
 		}
+		free_watch = FALSE;
+		break;
+	case CLD_STOPPED:
+		event = NIH_CHILD_STOPPED;
+		status = info->si_status;
+		free_watch = FALSE;
+		break;
+	case CLD_CONTINUED:
+		event = NIH_CHILD_CONTINUED;
+		status = info->si_status;
+		free_watch = FALSE;
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
 
-		/* For next waitid call */
-		memset (&info, 0, sizeof (info));
+	NIH_LIST_FOREACH_SAFE (nih_child_watches, iter) {
+		NihChildWatch * watch = (NihChildWatch *)iter;
+		NihChildHandler handler = watch->handler;
+		struct timespec start;
+
+		if ((watch->pid != pid) && (watch->pid != -1))
+			continue;
+
+		if (! (watch->events & event))
+			continue;
+
+		nih_loop_dispatch_begin (&start, NIH_LOOP_CHILD_WATCH,
+					 (NihLoopCallback)handler,
+					 watch, pid);
+		watch->handler (watch->data, pid, event, status);
+		nih_loop_dispatch_end (&start, NIH_LOOP_CHILD_WATCH,
+				       (NihLoopCallback)handler, watch, pid);
+
+		if (free_watch && (watch->pid != -1))
+			nih_free (watch);
 	}
 }
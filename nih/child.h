@@ -22,9 +22,11 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include <nih/macros.h>
 #include <nih/list.h>
+#include <nih/io.h>
 
 
 /**
@@ -68,13 +70,23 @@ typedef void (*NihChildHandler) (void *data, pid_t pid,
  * @pid: process id to watch or -1,
  * @events: events to watch for,
  * @handler: function called when events occur to child,
- * @data: pointer passed to @reaper.
+ * @data: pointer passed to @reaper,
+ * @pidfd: descriptor referring to @pid, or -1,
+ * @io_watch: watch on @pidfd.
  *
  * This structure represents a watch on a particular child, the @reaper
  * function is called when an event in @events occurs to a child with
  * process id @pid.  If @pid is -1 then this function is called when @events
  * occur for all processes.
  *
+ * Where the kernel supports it, a watch on a particular child holds a
+ * descriptor referring to it in @pidfd, watched by the loop that was
+ * current when the watch was added; termination of the child is then
+ * delivered directly by that loop rather than found by nih_child_poll().
+ * The list of watches is not locked, so that loop must be run by the
+ * thread that owns the list: the one adding watches and calling
+ * nih_child_poll().
+ *
  * The watch can be cancelled by calling nih_list_remove() on the structure
  * as they are held in a list internally.
  **/
@@ -85,8 +97,63 @@ typedef struct nih_child_watch {
 
 	NihChildHandler  handler;
 	void            *data;
+
+	int              pidfd;
+	NihIoWatch      *io_watch;
 } NihChildWatch;
 
+/**
+ * NihChildFd:
+ * @fd: descriptor in the parent, or -1,
+ * @child_fd: descriptor number in the child.
+ *
+ * Describes a file descriptor to be set up in a child process spawned
+ * with nih_child_spawn(); @fd is duplicated to @child_fd, or @child_fd
+ * closed if @fd is -1.  @fd may be the same as @child_fd, in which case it
+ * is simply made to be inherited.
+ **/
+typedef struct nih_child_fd {
+	int fd;
+	int child_fd;
+} NihChildFd;
+
+/**
+ * NihChildRlimit:
+ * @resource: resource to limit,
+ * @limit: soft and hard limits.
+ *
+ * Describes a resource limit to be set in a child process spawned with
+ * nih_child_spawn(), see setrlimit().
+ **/
+typedef struct nih_child_rlimit {
+	int           resource;
+	struct rlimit limit;
+} NihChildRlimit;
+
+/**
+ * NihChildOptions:
+ * @env: environment for the child, or NULL to inherit ours,
+ * @fds: file descriptors to set up in the child,
+ * @nfds: number of entries in @fds,
+ * @rlimits: resource limits to set in the child,
+ * @nrlimits: number of entries in @rlimits,
+ * @setsid: TRUE if the child should be made the leader of a new session.
+ *
+ * Options for a child process spawned with nih_child_spawn(); a zeroed
+ * structure gives the default behaviour of a child like its parent.
+ **/
+typedef struct nih_child_options {
+	char * const         *env;
+
+	const NihChildFd     *fds;
+	size_t                nfds;
+
+	const NihChildRlimit *rlimits;
+	size_t                nrlimits;
+
+	int                   setsid;
+} NihChildOptions;
+
 
 NIH_BEGIN_EXTERN
 
@@ -100,6 +167,12 @@ NihChildWatch *nih_child_add_watch (const void *parent, pid_t pid,
 				    NihChildHandler handler, void *data)
 	__attribute__ ((warn_unused_result, malloc));
 
+NihChildWatch *nih_child_spawn     (const void *parent, const char *path,
+				    char * const argv[],
+				    const NihChildOptions *options,
+				    NihChildHandler handler, void *data)
+	__attribute__ ((warn_unused_result, malloc));
+
 void           nih_child_poll      (void);
 
 NIH_END_EXTERN
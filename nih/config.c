@@ -47,105 +47,236 @@ static int              nih_config_block_end  (const char *file, size_t len,
 	__attribute__ ((warn_unused_result));
 static NihConfigStanza *nih_config_get_stanza (const char *name,
 					       NihConfigStanza *stanzas);
+static int              nih_config_do_parse_stanza (const char *file,
+						    size_t len, size_t *pos,
+						    size_t *lineno,
+						    NihConfigStanza *stanzas,
+						    NihConfigStanzaTable *table,
+						    void *data)
+	__attribute__ ((warn_unused_result));
+static int              nih_config_do_parse_file (const char *file,
+						  size_t len, size_t *pos,
+						  size_t *lineno,
+						  NihConfigStanza *stanzas,
+						  NihConfigStanzaTable *table,
+						  void *data)
+	__attribute__ ((warn_unused_result));
 
 
 /**
- * nih_config_has_token:
- * @file: file or string to parse,
- * @len: length of @file,
- * @pos: offset within @file,
- * @lineno: line number.
+ * NIH_CONFIG_COPY_SIZE:
  *
- * Checks the current position in @file to see whether it has a parseable
- * token at this position; ie. we're not at the end of file, and the
- * current character is neither a comment or newline character.
+ * Number of bytes of a token copied into the buffer on the stack before
+ * it is moved to allocated memory; most tokens fit, so only one
+ * allocation of the exact size is needed for them.
+ **/
+#define NIH_CONFIG_COPY_SIZE 256
+
+/**
+ * NihConfigClass:
  *
- * If this returns FALSE, it's normal to call nih_config_skip_comment()
- * to move to the next parseable point and check again.
+ * Bits in the table filled by nih_config_classes() for each character;
+ * a character with no bits set can be copied without further checks
+ * outside of a quoted string.
+ **/
+typedef enum {
+	NIH_CONFIG_CLASS_WS      = 01,
+	NIH_CONFIG_CLASS_DELIM   = 02,
+	NIH_CONFIG_CLASS_SPECIAL = 04,
+} NihConfigClass;
+
+/**
+ * NihConfigCopy:
+ * @parent: parent object for allocated buffer,
+ * @buf: buffer token is copied into,
+ * @size: size of @buf, or zero if the caller allocated it,
+ * @len: number of bytes copied so far,
+ * @failed: TRUE if growing @buf failed,
+ * @local: initial buffer.
+ *
+ * Destination for a token copied while it is being parsed; @buf begins as
+ * @local and is moved to allocated memory that is doubled in size each
+ * time it fills.
+ **/
+typedef struct nih_config_copy {
+	const void *parent;
+	char       *buf;
+	size_t      size;
+	size_t      len;
+	int         failed;
+	char        local[NIH_CONFIG_COPY_SIZE];
+} NihConfigCopy;
+
+
+/**
+ * nih_config_classes:
+ * @class: table to fill,
+ * @delim: characters to stop on.
+ *
+ * Fills @class with the class of each character when parsing a token
+ * stopped by any character in @delim; the table is small enough to be
+ * built on the stack for each token, so no state is shared between
+ * threads.
+ *
+ * The NULL character is always both whitespace and a delimiter, since
+ * strchr() finds the terminator and that is what the parser matched
+ * before this table.
+ **/
+static void
+nih_config_classes (unsigned char  class[256],
+		    const char    *delim)
+{
+	const char *c;
+
+	nih_assert (class != NULL);
+	nih_assert (delim != NULL);
+
+	memset (class, 0, 256);
+	class[0] = NIH_CONFIG_CLASS_WS | NIH_CONFIG_CLASS_DELIM;
+
+	for (c = NIH_CONFIG_WS; *c; c++)
+		class[(unsigned char)*c] |= NIH_CONFIG_CLASS_WS;
+	for (c = delim; *c; c++)
+		class[(unsigned char)*c] |= NIH_CONFIG_CLASS_DELIM;
+	for (c = "\\\"\'\n"; *c; c++)
+		class[(unsigned char)*c] |= NIH_CONFIG_CLASS_SPECIAL;
+}
+
+
+/**
+ * nih_config_copy_reserve:
+ * @copy: destination of token,
+ * @len: number of bytes needed.
  *
- * @file may be a memory mapped file, in which case @pos should be given
- * as the offset within and @len should be the length of the file as a
- * whole.
+ * Ensures that there is room for at least @len more bytes in @copy,
+ * moving it to allocated memory or doubling its size as necessary.
  *
- * @pos is used as the offset within @file to begin, otherwise the start
- * is assumed.
+ * Once this has failed, the token is still parsed so that the position
+ * and line number are correct, but nothing more is copied.
  *
- * Returns: TRUE if the current character is before the end of file and
- * is neither a comment or newline, FALSE otherwise.
+ * Returns: pointer to copy the next byte to, or NULL if insufficient
+ * memory.
  **/
-int
-nih_config_has_token (const char *file,
-		      size_t      len,
-		      size_t     *pos,
-		      size_t     *lineno)
+static char *
+nih_config_copy_reserve (NihConfigCopy *copy,
+			 size_t         len)
 {
-	size_t p;
+	size_t  size;
+	char   *buf;
 
-	nih_assert (file != NULL);
+	nih_assert (copy != NULL);
 
-	p = (pos ? *pos : 0);
-	if ((p < len) && (! strchr (NIH_CONFIG_CNL, file[p]))) {
-		return TRUE;
+	if (copy->failed)
+		return NULL;
+
+	if ((! copy->size) || (copy->len + len <= copy->size))
+		return copy->buf + copy->len;
+
+	size = copy->size;
+	while (copy->len + len > size)
+		size *= 2;
+
+	if (copy->buf == copy->local) {
+		buf = nih_alloc (copy->parent, size);
+		if (buf)
+			memcpy (buf, copy->buf, copy->len);
 	} else {
-		return FALSE;
+		buf = nih_realloc (copy->buf, copy->parent, size);
+	}
+
+	if (! buf) {
+		copy->failed = TRUE;
+		return NULL;
+	}
+
+	copy->buf = buf;
+	copy->size = size;
+
+	return copy->buf + copy->len;
+}
+
+/**
+ * nih_config_copy_finish:
+ * @copy: destination of token,
+ * @toklen: length of token.
+ *
+ * Moves the token copied into @copy into memory allocated for @toklen
+ * bytes and the NULL terminator, freeing any other memory used.
+ *
+ * @toklen is that returned by nih_config_scan(), which may count a
+ * trailing escaped newline that was never copied.
+ *
+ * Returns: newly allocated token or NULL if insufficient memory.
+ **/
+static char *
+nih_config_copy_finish (NihConfigCopy *copy,
+			size_t         toklen)
+{
+	char *str;
+
+	nih_assert (copy != NULL);
+	nih_assert (copy->size > 0);
+
+	if (toklen < copy->len)
+		toklen = copy->len;
+
+	if (copy->failed) {
+		str = NULL;
+	} else if (copy->buf == copy->local) {
+		str = nih_alloc (copy->parent, toklen + 1);
+		if (str)
+			memcpy (str, copy->buf, copy->len + 1);
+	} else {
+		str = nih_realloc (copy->buf, copy->parent, toklen + 1);
 	}
+
+	if ((! str) && (copy->buf != copy->local))
+		nih_free (copy->buf);
+
+	copy->buf = copy->local;
+	copy->len = 0;
+
+	return str;
 }
 
 
 /**
- * nih_config_token:
+ * nih_config_scan:
  * @file: file or string to parse,
  * @len: length of @file,
  * @pos: offset within @file,
  * @lineno: line number,
- * @dest: destination to copy to,
- * @delim: characters to stop on,
+ * @copy: destination to copy to,
+ * @class: table from nih_config_classes(),
  * @dequote: remove quotes and escapes.
  * @toklen: pointer to store token length in.
  *
- * Parses a single token from @file which is stopped when any character
- * in @delim is encountered outside of a quoted string and not escaped
- * using a backslash.  The length of the parsed token is stored in @toklen
- * if given.
- *
- * @file may be a memory mapped file, in which case @pos should be given
- * as the offset within and @len should be the length of the file as a
- * whole.  Usually when @dest is given, @file is instead the pointer to
- * the start of the token and @len is the difference between the start
- * and end of the token (NOT the return value from this function).
- *
- * If @pos is given then it will be used as the offset within @file to
- * begin (otherwise the start is assumed), and will be updated to point
- * to @delim or past the end of the file.
- *
- * If @lineno is given it will be incremented each time a new line is
- * discovered in the file.
- *
- * To copy the token into another string, collapsing any newlines and
- * surrounding whitespace to a single space, pass @dest which should be
- * pre-allocated to the right size (obtained by calling this function
- * with NULL).
+ * Parses a single token from @file, copying it into @copy if given in the
+ * same pass; otherwise behaves exactly as nih_config_token(), which
+ * documents the arguments.
  *
- * If you also want quotes to be removed and escaped characters to be
- * replaced with the character itself, set @dequote to TRUE.
+ * Runs of characters without any class in @class are copied at once,
+ * since they can only be part of the token when not within a quoted
+ * string or following a backslash or whitespace.
  *
  * Returns: zero on success, negative value on raised error.
  **/
-int
-nih_config_token (const char *file,
-		  size_t      len,
-		  size_t     *pos,
-		  size_t     *lineno,
-		  char       *dest,
-		  const char *delim,
-		  int         dequote,
-		  size_t     *toklen)
+static int
+nih_config_scan (const char          *file,
+		 size_t               len,
+		 size_t              *pos,
+		 size_t              *lineno,
+		 NihConfigCopy       *copy,
+		 const unsigned char *class,
+		 int                  dequote,
+		 size_t              *toklen)
 {
-	size_t  p, ws = 0, nlws = 0, qc = 0, i = 0;
+	size_t  p, q, ws = 0, nlws = 0, qc = 0;
 	int     slash = FALSE, quote = 0, nl = FALSE, ret = 0;
+	char   *dest;
 
 	nih_assert (file != NULL);
-	nih_assert (delim != NULL);
+	nih_assert (class != NULL);
 
 	/* We keep track of the following:
 	 *   slash  whether a \ is in effect
@@ -157,48 +288,69 @@ nih_config_token (const char *file,
 	 */
 
 	for (p = (pos ? *pos : 0); p < len; p++) {
-		int extra = 0, isq = FALSE;
+		unsigned char c = file[p];
+		int           extra = 0, isq = FALSE;
+
+		if ((! class[c]) && (! (slash || quote || nl || ws))) {
+			q = p + 1;
+			while ((q < len) && (! class[(unsigned char)file[q]]))
+				q++;
+
+			if (copy && (dest = nih_config_copy_reserve (copy,
+								     q - p))) {
+				memcpy (dest, file + p, q - p);
+				copy->len += q - p;
+			}
+
+			p = q - 1;
+			continue;
+		}
+
+		/* At most the slash, the whitespace or newline before,
+		 * an extra slash and the character itself are copied.
+		 */
+		dest = copy ? nih_config_copy_reserve (copy, ws + 4) : NULL;
 
 		if (slash) {
 			slash = FALSE;
 
 			/* Escaped newline */
-			if (file[p] == '\n') {
+			if (c == '\n') {
 				nlws++;
 				nl = TRUE;
 				if (lineno)
 					(*lineno)++;
 				continue;
-			} else if ((file[p] == '\\')
-				   || strchr (NIH_CONFIG_WS, file[p])) {
+			} else if ((c == '\\')
+				   || (class[c] & NIH_CONFIG_CLASS_WS)) {
 				extra++;
 				if (dequote)
 					qc++;
 			} else if (dest) {
-				dest[i++] = '\\';
+				*(dest++) = '\\';
 			}
-		} else if (file[p] == '\\') {
+		} else if (c == '\\') {
 			slash = TRUE;
 			continue;
 		} else if (quote) {
-			if (file[p] == quote) {
+			if (c == quote) {
 				quote = 0;
 				isq = TRUE;
-			} else if (file[p] == '\n') {
+			} else if (c == '\n') {
 				nl = TRUE;
 				if (lineno)
 					(*lineno)++;
 				continue;
-			} else if (strchr (NIH_CONFIG_WS, file[p])) {
+			} else if (class[c] & NIH_CONFIG_CLASS_WS) {
 				ws++;
 				continue;
 			}
-		} else if ((file[p] == '\"') || (file[p] == '\'')) {
-			quote = file[p];
+		} else if ((c == '\"') || (c == '\'')) {
+			quote = c;
 			isq = TRUE;
-		} else if (strchr (delim, file[p])) {
+		} else if (class[c] & NIH_CONFIG_CLASS_DELIM) {
 			break;
-		} else if (strchr (NIH_CONFIG_WS, file[p])) {
+		} else if (class[c] & NIH_CONFIG_CLASS_WS) {
 			ws++;
 			continue;
 		}
@@ -209,37 +361,40 @@ nih_config_token (const char *file,
 			 */
 			nlws += ws;
 			if (dest)
-				dest[i++] = ' ';
+				*(dest++) = ' ';
 		} else if (ws && dest) {
 			/* Whitespace that we've encountered to date is
 			 * copied as it is.
 			 */
-			memcpy (dest + i, file + p - ws - extra, ws);
-			i += ws;
+			memcpy (dest, file + p - ws - extra, ws);
+			dest += ws;
 		}
 
 		/* Extra characters (the slash) needs to be copied
 		 * unless we're dequoting the string
 		 */
 		if (extra && dest && (! dequote)) {
-			memcpy (dest + i, file + p - extra, extra);
-			i += extra;
+			memcpy (dest, file + p - extra, extra);
+			dest += extra;
 		}
 
 		if (dest && (! (isq && dequote)))
-			dest[i++] = file[p];
+			*(dest++) = c;
 
 		if (isq && dequote)
 			qc++;
 
+		if (dest)
+			copy->len = dest - copy->buf;
+
 		ws = 0;
 		nl = FALSE;
 		extra = 0;
 	}
 
-	/* Add the NULL byte */
-	if (dest)
-		dest[i++] = '\0';
+	/* Add the NULL byte, which isn't counted in the length */
+	if (copy && (dest = nih_config_copy_reserve (copy, 1)))
+		*dest = '\0';
 
 
 	/* A trailing slash on the end of the file makes no sense. */
@@ -275,6 +430,122 @@ finish:
 	return ret;
 }
 
+
+/**
+ * nih_config_has_token:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Checks the current position in @file to see whether it has a parseable
+ * token at this position; ie. we're not at the end of file, and the
+ * current character is neither a comment or newline character.
+ *
+ * If this returns FALSE, it's normal to call nih_config_skip_comment()
+ * to move to the next parseable point and check again.
+ *
+ * @file may be a memory mapped file, in which case @pos should be given
+ * as the offset within and @len should be the length of the file as a
+ * whole.
+ *
+ * @pos is used as the offset within @file to begin, otherwise the start
+ * is assumed.
+ *
+ * Returns: TRUE if the current character is before the end of file and
+ * is neither a comment or newline, FALSE otherwise.
+ **/
+int
+nih_config_has_token (const char *file,
+		      size_t      len,
+		      size_t     *pos,
+		      size_t     *lineno)
+{
+	size_t p;
+
+	nih_assert (file != NULL);
+
+	p = (pos ? *pos : 0);
+	if ((p < len) && (! strchr (NIH_CONFIG_CNL, file[p]))) {
+		return TRUE;
+	} else {
+		return FALSE;
+	}
+}
+
+
+/**
+ * nih_config_token:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @dest: destination to copy to,
+ * @delim: characters to stop on,
+ * @dequote: remove quotes and escapes.
+ * @toklen: pointer to store token length in.
+ *
+ * Parses a single token from @file which is stopped when any character
+ * in @delim is encountered outside of a quoted string and not escaped
+ * using a backslash.  The length of the parsed token is stored in @toklen
+ * if given.
+ *
+ * @file may be a memory mapped file, in which case @pos should be given
+ * as the offset within and @len should be the length of the file as a
+ * whole.  Usually when @dest is given, @file is instead the pointer to
+ * the start of the token and @len is the difference between the start
+ * and end of the token (NOT the return value from this function).
+ *
+ * If @pos is given then it will be used as the offset within @file to
+ * begin (otherwise the start is assumed), and will be updated to point
+ * to @delim or past the end of the file.
+ *
+ * If @lineno is given it will be incremented each time a new line is
+ * discovered in the file.
+ *
+ * To copy the token into another string, collapsing any newlines and
+ * surrounding whitespace to a single space, pass @dest which should be
+ * pre-allocated to the right size (obtained by calling this function
+ * with NULL).
+ *
+ * If you also want quotes to be removed and escaped characters to be
+ * replaced with the character itself, set @dequote to TRUE.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_config_token (const char *file,
+		  size_t      len,
+		  size_t     *pos,
+		  size_t     *lineno,
+		  char       *dest,
+		  const char *delim,
+		  int         dequote,
+		  size_t     *toklen)
+{
+	NihConfigCopy copy;
+	unsigned char class[256];
+
+	nih_assert (file != NULL);
+	nih_assert (delim != NULL);
+
+	nih_config_classes (class, delim);
+
+	if (! dest)
+		return nih_config_scan (file, len, pos, lineno, NULL, class,
+					dequote, toklen);
+
+	/* The caller allocated the destination, so it's never grown */
+	copy.parent = NULL;
+	copy.buf = dest;
+	copy.size = 0;
+	copy.len = 0;
+	copy.failed = FALSE;
+
+	return nih_config_scan (file, len, pos, lineno, &copy, class,
+				dequote, toklen);
+}
+
 /**
  * nih_config_next_token:
  * @parent: parent object for returned token,
@@ -321,18 +592,29 @@ nih_config_next_token (const void *parent,
 		       const char *delim,
 		       int         dequote)
 {
-	size_t  p, arg_start, arg_len, arg_end;
-	char   *arg = NULL;
+	NihConfigCopy copy;
+	unsigned char class[256];
+	size_t        p, arg_len;
+	char         *arg = NULL;
 
 	nih_assert (file != NULL);
 
+	nih_config_classes (class, delim);
+
+	/* Copy the token while parsing it; the position isn't updated
+	 * should the copy fail, but the line number is.
+	 */
+	copy.parent = parent;
+	copy.buf = copy.local;
+	copy.size = sizeof (copy.local);
+	copy.len = 0;
+	copy.failed = FALSE;
+
 	p = (pos ? *pos : 0);
-	arg_start = p;
-	if (nih_config_token (file, len, &p, lineno, NULL, delim, dequote,
-			      &arg_len) < 0)
+	if (nih_config_scan (file, len, &p, lineno, &copy, class, dequote,
+			     &arg_len) < 0)
 		goto finish;
 
-	arg_end = p;
 	if (! arg_len) {
 		nih_error_raise (NIH_CONFIG_EXPECTED_TOKEN,
 				 _(NIH_CONFIG_EXPECTED_TOKEN_STR));
@@ -341,16 +623,14 @@ nih_config_next_token (const void *parent,
 
 	nih_config_skip_whitespace (file, len, &p, lineno);
 
-	/* Copy in the new token */
-	arg = nih_alloc (parent, arg_len + 1);
+	arg = nih_config_copy_finish (&copy, arg_len);
 	if (! arg)
 		nih_return_system_error (NULL);
 
-	if (nih_config_token (file + arg_start, arg_end - arg_start, NULL,
-			      NULL, arg, delim, dequote, NULL) < 0)
-		goto finish;
-
 finish:
+	if (copy.buf != copy.local)
+		nih_free (copy.buf);
+
 	if (pos)
 		*pos = p;
 
@@ -666,38 +946,43 @@ nih_config_parse_command (const void *parent,
 			  size_t     *pos,
 			  size_t     *lineno)
 {
-	char   *cmd = NULL;
-	size_t  p, cmd_start, cmd_len, cmd_end;
+	NihConfigCopy  copy;
+	unsigned char  class[256];
+	char          *cmd = NULL;
+	size_t         p, cmd_len;
 
 	nih_assert (file != NULL);
 
-	/* Find the length of string up to the first unescaped comment
-	 * or newline.
+	nih_config_classes (class, NIH_CONFIG_CNL);
+
+	/* Copy the string up to the first unescaped comment or newline
+	 * while finding its length.
 	 */
+	copy.parent = parent;
+	copy.buf = copy.local;
+	copy.size = sizeof (copy.local);
+	copy.len = 0;
+	copy.failed = FALSE;
+
 	p = (pos ? *pos : 0);
-	cmd_start = p;
-	if (nih_config_token (file, len, &p, lineno, NULL,
-			      NIH_CONFIG_CNL, FALSE, &cmd_len) < 0)
+	if (nih_config_scan (file, len, &p, lineno, &copy, class, FALSE,
+			     &cmd_len) < 0)
 		goto finish;
 
-	cmd_end = p;
-
-	/* nih_config_token will eat up to the end of the file, a comment
+	/* nih_config_scan will eat up to the end of the file, a comment
 	 * or a newline; so this must always succeed.
 	 */
 	if (nih_config_skip_comment (file, len, &p, lineno) < 0)
 		nih_assert_not_reached ();
 
-	/* Now copy the string into the destination. */
-	cmd = nih_alloc (parent, cmd_len + 1);
+	cmd = nih_config_copy_finish (&copy, cmd_len);
 	if (! cmd)
 		nih_return_system_error (NULL);
 
-	if (nih_config_token (file + cmd_start, cmd_end - cmd_start, NULL,
-			      NULL, cmd, NIH_CONFIG_CNL, FALSE, NULL) < 0)
-		goto finish;
-
 finish:
+	if (copy.buf != copy.local)
+		nih_free (copy.buf);
+
 	if (pos)
 		*pos = p;
 
@@ -1018,7 +1303,7 @@ nih_config_get_stanza (const char      *name,
 	NihConfigStanza *stanza, *catch = NULL;
 
 	for (stanza = stanzas; (stanza->name && stanza->handler); stanza++) {
-		if (! strlen (stanza->name))
+		if (! stanza->name[0])
 			catch = stanza;
 
 		if (! strcmp (stanza->name, name))
@@ -1028,6 +1313,110 @@ nih_config_get_stanza (const char      *name,
 	return catch;
 }
 
+/**
+ * nih_config_stanza_table_new:
+ * @parent: parent object for new table,
+ * @stanzas: table of stanza handlers.
+ *
+ * Compiles the @stanzas array into a hash table so that each stanza can
+ * be found without comparing its name against every entry; the table may
+ * then be passed to nih_config_parse_table() and friends in place of the
+ * array, and should be created once and used for every file parsed.
+ *
+ * The last entry in @stanzas should have NULL for both the name and
+ * handler function pointers.  Where more than one entry has the same
+ * name, the first is used just as when the array is searched, and the
+ * last entry with the name "" is used for any stanza not found.
+ *
+ * The table refers to the entries of @stanzas, which must not be freed or
+ * modified while it is in use.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned table.  When all parents
+ * of the returned table are freed, the returned table will also be
+ * freed.
+ *
+ * Returns: newly allocated table or NULL if insufficient memory.
+ **/
+NihConfigStanzaTable *
+nih_config_stanza_table_new (const void      *parent,
+			     NihConfigStanza *stanzas)
+{
+	NihConfigStanzaTable *table;
+	NihConfigStanza      *stanza;
+	size_t                nstanzas = 0;
+
+	nih_assert (stanzas != NULL);
+
+	for (stanza = stanzas; (stanza->name && stanza->handler); stanza++)
+		nstanzas++;
+
+	table = nih_new (parent, NihConfigStanzaTable);
+	if (! table)
+		return NULL;
+
+	table->catch_all = NULL;
+
+	table->stanzas = nih_hash_string_new (table, nstanzas);
+	if (! table->stanzas) {
+		nih_free (table);
+		return NULL;
+	}
+
+	for (stanza = stanzas; (stanza->name && stanza->handler); stanza++) {
+		NihConfigStanzaEntry *entry;
+
+		if (! stanza->name[0])
+			table->catch_all = stanza;
+
+		if (nih_hash_lookup (table->stanzas, stanza->name))
+			continue;
+
+		entry = nih_new (table->stanzas, NihConfigStanzaEntry);
+		if (! entry) {
+			nih_free (table);
+			return NULL;
+		}
+
+		nih_list_init (&entry->entry);
+		nih_alloc_set_destructor (entry, nih_list_destroy);
+
+		entry->name = stanza->name;
+		entry->stanza = stanza;
+
+		nih_hash_add (table->stanzas, &entry->entry);
+	}
+
+	return table;
+}
+
+/**
+ * nih_config_table_get_stanza:
+ * @name: name of stanza,
+ * @table: compiled table of stanza handlers.
+ *
+ * Locates the handler for the @name stanza in @table, as
+ * nih_config_get_stanza() does for the array it was compiled from.
+ *
+ * Returns: stanza found or NULL if no handler for @name.
+ **/
+static NihConfigStanza *
+nih_config_table_get_stanza (const char           *name,
+			     NihConfigStanzaTable *table)
+{
+	NihConfigStanzaEntry *entry;
+
+	nih_assert (name != NULL);
+	nih_assert (table != NULL);
+
+	entry = (NihConfigStanzaEntry *)nih_hash_lookup (table->stanzas,
+							 name);
+	if (entry)
+		return entry->stanza;
+
+	return table->catch_all;
+}
+
 /**
  * nih_config_parse_stanza:
  * @file: file or string to parse,
@@ -1061,6 +1450,69 @@ nih_config_parse_stanza (const char      *file,
 			 size_t          *lineno,
 			 NihConfigStanza *stanzas,
 			 void            *data)
+{
+	nih_assert (file != NULL);
+	nih_assert (stanzas != NULL);
+
+	return nih_config_do_parse_stanza (file, len, pos, lineno,
+					   stanzas, NULL, data);
+}
+
+/**
+ * nih_config_parse_stanza_table:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @table: compiled table of stanza handlers,
+ * @data: pointer to pass to stanza handler.
+ *
+ * Extracts a configuration stanza from @file and calls the handler
+ * function for that stanza found in @table, created with
+ * nih_config_stanza_table_new(); otherwise identical to
+ * nih_config_parse_stanza().
+ *
+ * Returns: zero on success or negative value on raised error.
+ **/
+int
+nih_config_parse_stanza_table (const char           *file,
+			       size_t                len,
+			       size_t               *pos,
+			       size_t               *lineno,
+			       NihConfigStanzaTable *table,
+			       void                 *data)
+{
+	nih_assert (file != NULL);
+	nih_assert (table != NULL);
+
+	return nih_config_do_parse_stanza (file, len, pos, lineno,
+					   NULL, table, data);
+}
+
+/**
+ * nih_config_do_parse_stanza:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @stanzas: table of stanza handlers,
+ * @table: compiled table of stanza handlers,
+ * @data: pointer to pass to stanza handler.
+ *
+ * Extracts a configuration stanza from @file and calls the handler
+ * function for that stanza found in @table if given, otherwise in the
+ * @stanzas array.
+ *
+ * Returns: zero on success or negative value on raised error.
+ **/
+static int
+nih_config_do_parse_stanza (const char           *file,
+			    size_t                len,
+			    size_t               *pos,
+			    size_t               *lineno,
+			    NihConfigStanza      *stanzas,
+			    NihConfigStanzaTable *table,
+			    void                 *data)
 {
 	NihConfigStanza *stanza;
 	nih_local char  *name = NULL;
@@ -1068,7 +1520,7 @@ nih_config_parse_stanza (const char      *file,
 	int              ret = -1;
 
 	nih_assert (file != NULL);
-	nih_assert (stanzas != NULL);
+	nih_assert ((stanzas != NULL) || (table != NULL));
 
 	p = (pos ? *pos : 0);
 
@@ -1079,7 +1531,11 @@ nih_config_parse_stanza (const char      *file,
 		goto finish;
 
 	/* Lookup the stanza for it */
-	stanza = nih_config_get_stanza (name, stanzas);
+	if (table) {
+		stanza = nih_config_table_get_stanza (name, table);
+	} else {
+		stanza = nih_config_get_stanza (name, stanzas);
+	}
 	if (! stanza)
 		nih_return_error (-1, NIH_CONFIG_UNKNOWN_STANZA,
 				  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
@@ -1127,12 +1583,73 @@ nih_config_parse_file (const char      *file,
 		       size_t          *lineno,
 		       NihConfigStanza *stanzas,
 		       void            *data)
+{
+	nih_assert (file != NULL);
+	nih_assert (stanzas != NULL);
+
+	return nih_config_do_parse_file (file, len, pos, lineno,
+					 stanzas, NULL, data);
+}
+
+/**
+ * nih_config_parse_file_table:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @table: compiled table of stanza handlers,
+ * @data: pointer to pass to stanza handler.
+ *
+ * Parses configuration file lines from @file, calling
+ * nih_config_parse_stanza_table() for each stanza found; otherwise
+ * identical to nih_config_parse_file().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_config_parse_file_table (const char           *file,
+			     size_t                len,
+			     size_t               *pos,
+			     size_t               *lineno,
+			     NihConfigStanzaTable *table,
+			     void                 *data)
+{
+	nih_assert (file != NULL);
+	nih_assert (table != NULL);
+
+	return nih_config_do_parse_file (file, len, pos, lineno,
+					 NULL, table, data);
+}
+
+/**
+ * nih_config_do_parse_file:
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @stanzas: table of stanza handlers,
+ * @table: compiled table of stanza handlers,
+ * @data: pointer to pass to stanza handler.
+ *
+ * Parses configuration file lines from @file, looking up each stanza in
+ * @table if given, otherwise in the @stanzas array.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_config_do_parse_file (const char           *file,
+			  size_t                len,
+			  size_t               *pos,
+			  size_t               *lineno,
+			  NihConfigStanza      *stanzas,
+			  NihConfigStanzaTable *table,
+			  void                 *data)
 {
 	int    ret = -1;
 	size_t p;
 
 	nih_assert (file != NULL);
-	nih_assert (stanzas != NULL);
+	nih_assert ((stanzas != NULL) || (table != NULL));
 
 	p = (pos ? *pos : 0);
 
@@ -1154,8 +1671,8 @@ nih_config_parse_file (const char      *file,
 		}
 
 		/* Must have a stanza, parse it */
-		if (nih_config_parse_stanza (file, len, &p, lineno,
-						     stanzas, data) < 0)
+		if (nih_config_do_parse_stanza (file, len, &p, lineno,
+						stanzas, table, data) < 0)
 			goto finish;
 	}
 
@@ -1212,3 +1729,50 @@ nih_config_parse (const char      *filename,
 
 	return ret;
 }
+
+/**
+ * nih_config_parse_table:
+ * @filename: name of file to parse,
+ * @pos: offset within @file,
+ * @lineno: line number,
+ * @table: compiled table of stanza handlers,
+ * @data: pointer to pass to stanza handler.
+ *
+ * Reads @filename into memory and them parses configuration lines from it
+ * using nih_config_parse_file_table().
+ *
+ * If @pos is given then it will be used as the offset within @file to
+ * begin (otherwise the start is assumed), and will be updated to point
+ * to @delim or past the end of the file.
+ *
+ * If @lineno is given it will be incremented each time a new line is
+ * discovered in the file.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_config_parse_table (const char           *filename,
+			size_t               *pos,
+			size_t               *lineno,
+			NihConfigStanzaTable *table,
+			void                 *data)
+{
+	nih_local char *file = NULL;
+	size_t          len;
+	int             ret;
+
+	nih_assert (filename != NULL);
+	nih_assert (table != NULL);
+
+	file = nih_file_read (NULL, filename, &len);
+	if (! file)
+		return -1;
+
+	if (lineno)
+		*lineno = 1;
+
+	ret = nih_config_parse_file_table (file, len, pos, lineno,
+					   table, data);
+
+	return ret;
+}
@@ -35,11 +35,17 @@
  *
  * Configuration can be parsed as a file with nih_config_parse_file() or
  * as a string with nih_config_parse().
+ *
+ * When the same stanzas are used to parse many files, the array may be
+ * compiled once into a hash table with nih_config_stanza_table_new() and
+ * passed to nih_config_parse_table() and friends instead.
  **/
 
 #include <sys/types.h>
 
 #include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 
 
 /**
@@ -95,6 +101,37 @@ struct nih_config_stanza {
 };
 
 
+/**
+ * NihConfigStanzaEntry:
+ * @entry: list header,
+ * @name: stanza name,
+ * @stanza: stanza in array.
+ *
+ * This structure is an entry in the hash table of an NihConfigStanzaTable,
+ * referring to the first @stanza in the array with @name.
+ **/
+typedef struct nih_config_stanza_entry {
+	NihList          entry;
+	const char      *name;
+	NihConfigStanza *stanza;
+} NihConfigStanzaEntry;
+
+/**
+ * NihConfigStanzaTable:
+ * @stanzas: hash table of NihConfigStanzaEntry members,
+ * @catch_all: stanza with the name "" if any.
+ *
+ * This structure is a precompiled form of an array of NihConfigStanza
+ * members, created with nih_config_stanza_table_new() and passed to
+ * nih_config_parse_file_table() and friends to find each stanza by hash
+ * rather than comparing against each name in the array.
+ **/
+typedef struct nih_config_stanza_table {
+	NihHash         *stanzas;
+	NihConfigStanza *catch_all;
+} NihConfigStanzaTable;
+
+
 /**
  * NIH_CONFIG_LAST:
  *
@@ -169,6 +206,10 @@ int       nih_config_skip_block      (const char *file, size_t len,
 				      const char *type, size_t *endpos)
 	__attribute__ ((warn_unused_result));
 
+NihConfigStanzaTable *nih_config_stanza_table_new (const void *parent,
+						  NihConfigStanza *stanzas)
+	__attribute__ ((warn_unused_result, malloc));
+
 int       nih_config_parse_stanza    (const char *file, size_t len,
 				      size_t *pos, size_t *lineno,
 				      NihConfigStanza *stanzas, void *data)
@@ -183,6 +224,22 @@ int       nih_config_parse           (const char *filename, size_t *pos,
 				      void *data)
 	__attribute__ ((warn_unused_result));
 
+int       nih_config_parse_stanza_table (const char *file, size_t len,
+					 size_t *pos, size_t *lineno,
+					 NihConfigStanzaTable *table,
+					 void *data)
+	__attribute__ ((warn_unused_result));
+int       nih_config_parse_file_table   (const char *file, size_t len,
+					 size_t *pos, size_t *lineno,
+					 NihConfigStanzaTable *table,
+					 void *data)
+	__attribute__ ((warn_unused_result));
+int       nih_config_parse_table        (const char *filename,
+					 size_t *pos, size_t *lineno,
+					 NihConfigStanzaTable *table,
+					 void *data)
+	__attribute__ ((warn_unused_result));
+
 NIH_END_EXTERN
 
 #endif /* NIH_CONFIG_H */
@@ -0,0 +1,604 @@
+/* libnih
+ *
+ * coro.c - coroutines run by the main loop
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/timer.h>
+#include <nih/child.h>
+#include <nih/io.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "coro.h"
+
+
+/**
+ * NihCoroWait:
+ * @coro: coroutine waiting,
+ * @done: TRUE once the wait is over,
+ * @events: I/O or child events that occurred,
+ * @status: exit status or signal of child.
+ *
+ * Holds the state of a waiting function on the stack of the coroutine,
+ * for the callback that ends the wait.
+ **/
+typedef struct nih_coro_wait {
+	NihCoro *coro;
+	int      done;
+	int      events;
+	int      status;
+} NihCoroWait;
+
+
+/* Prototypes for static functions */
+static void nih_coro_start    (void);
+static void nih_coro_resume   (NihCoro *coro, NihMainLoopFunc *waker);
+static void nih_coro_timer    (NihCoroWait *wait, NihTimer *timer);
+static void nih_coro_watcher  (NihCoroWait *wait, NihIoWatch *watch,
+			       NihIoEvents events);
+static void nih_coro_reaper   (NihCoroWait *wait, pid_t pid,
+			       NihChildEvents event, int status);
+
+
+/**
+ * current_coro:
+ *
+ * Coroutine running in this thread, or NULL.
+ **/
+static __thread NihCoro *current_coro = NULL;
+
+
+/**
+ * nih_coro_new:
+ * @parent: parent object for new coroutine,
+ * @stack_size: size of stack, or zero for the default,
+ * @func: function to run,
+ * @data: pointer to pass to @func.
+ *
+ * Creates a new coroutine that calls @func with its own stack of
+ * @stack_size bytes, rounded up to a whole number of pages, or
+ * NIH_CORO_STACK_SIZE if zero.  @func is first called during the next
+ * iteration of the current loop, normally the default loop, and the
+ * coroutine is always resumed by that loop.
+ *
+ * The coroutine structure is allocated using nih_alloc(), the stack is
+ * unmapped by nih_coro_destroy(), which is set as the destructor.  The
+ * coroutine is freed once @func returns.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned coroutine.  When all parents
+ * of the returned coroutine are freed, the returned coroutine will also be
+ * freed.
+ *
+ * Returns: new coroutine, or NULL on raised error.
+ **/
+NihCoro *
+nih_coro_new (const void  *parent,
+	      size_t       stack_size,
+	      NihCoroFunc  func,
+	      void        *data)
+{
+	NihCoro         *coro;
+	size_t           page_size;
+	volatile size_t  size;
+
+	nih_assert (func != NULL);
+
+	if (! stack_size)
+		stack_size = NIH_CORO_STACK_SIZE;
+
+	page_size = sysconf (_SC_PAGESIZE);
+	stack_size = (stack_size + page_size - 1) / page_size * page_size;
+
+	coro = nih_new (parent, NihCoro);
+	if (! coro)
+		nih_return_no_memory_error (NULL);
+
+	coro->func = func;
+	coro->data = data;
+
+	coro->waker = NULL;
+	coro->running = FALSE;
+	coro->finished = FALSE;
+
+	/* The stack grows down, so the guard page goes at the bottom */
+	coro->stack_size = stack_size + page_size;
+	coro->stack = mmap (NULL, coro->stack_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (coro->stack == MAP_FAILED) {
+		nih_error_raise_system ();
+		nih_free (coro);
+		return NULL;
+	}
+
+	nih_alloc_set_destructor (coro, nih_coro_destroy);
+
+	if (mprotect (coro->stack, page_size, PROT_NONE) < 0) {
+		nih_error_raise_system ();
+		nih_free (coro);
+		return NULL;
+	}
+
+	/* getcontext() may clobber the argument, so keep a copy */
+	size = stack_size;
+
+	nih_assert (getcontext (&coro->context) == 0);
+	coro->context.uc_stack.ss_sp = (char *)coro->stack + page_size;
+	coro->context.uc_stack.ss_size = size;
+	coro->context.uc_link = NULL;
+	makecontext (&coro->context, nih_coro_start, 0);
+
+	coro->waker = nih_main_loop_add_ready_func (
+		coro, (NihMainLoopCb)nih_coro_resume, coro);
+	if (! coro->waker) {
+		nih_free (coro);
+		nih_return_no_memory_error (NULL);
+	}
+
+	nih_coro_wake (coro);
+
+	return coro;
+}
+
+/**
+ * nih_coro_destroy:
+ * @coro: coroutine to be destroyed.
+ *
+ * Unmaps the stack of @coro so that it can be freed; if it was suspended,
+ * it is never resumed.  A coroutine may not be freed while it is running.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_coro_destroy (NihCoro *coro)
+{
+	nih_assert (coro != NULL);
+	nih_assert (! coro->running);
+
+	if (coro->stack != MAP_FAILED)
+		munmap (coro->stack, coro->stack_size);
+
+	return 0;
+}
+
+
+/**
+ * nih_coro_current:
+ *
+ * Returns: coroutine running in this thread, or NULL if not called from
+ * a coroutine.
+ **/
+NihCoro *
+nih_coro_current (void)
+{
+	return current_coro;
+}
+
+
+/**
+ * nih_coro_wake:
+ * @coro: coroutine to wake.
+ *
+ * Arranges for @coro to be resumed by its loop once it is suspended; this
+ * is normally called by callbacks to end a wait.  If @coro is already
+ * running, it is resumed in the next iteration after it is suspended.
+ * Waking a coroutine more than once before it is resumed has no further
+ * effect.
+ *
+ * Since the coroutine is resumed by its loop rather than here, this is
+ * safe to call from any callback of that loop, including from another
+ * coroutine.
+ **/
+void
+nih_coro_wake (NihCoro *coro)
+{
+	nih_assert (coro != NULL);
+
+	nih_main_loop_func_wake (coro->waker);
+}
+
+/**
+ * nih_coro_suspend:
+ *
+ * Suspends the running coroutine, returning control to its loop until it
+ * has been woken with nih_coro_wake().  Since the coroutine may be woken
+ * for reasons other than what it is waiting for, this should be called
+ * in a loop that checks whether the wait is over.
+ *
+ * This may only be called from a coroutine.
+ **/
+void
+nih_coro_suspend (void)
+{
+	NihCoro *coro;
+
+	coro = current_coro;
+	nih_assert (coro != NULL);
+
+	nih_assert (swapcontext (&coro->context, &coro->caller) == 0);
+}
+
+/**
+ * nih_coro_yield:
+ *
+ * Suspends the running coroutine until the next iteration of its loop, so
+ * that other work may be done between the steps of a long computation.
+ *
+ * This may only be called from a coroutine.
+ **/
+void
+nih_coro_yield (void)
+{
+	nih_assert (current_coro != NULL);
+
+	nih_coro_wake (current_coro);
+	nih_coro_suspend ();
+}
+
+
+/**
+ * nih_coro_start:
+ *
+ * Called on the stack of the coroutine being resumed for the first time,
+ * runs its function, marks it as finished and returns to the loop, which
+ * frees it.
+ **/
+static void
+nih_coro_start (void)
+{
+	NihCoro *coro;
+
+	coro = current_coro;
+	nih_assert (coro != NULL);
+
+	coro->func (coro->data, coro);
+
+	coro->finished = TRUE;
+	setcontext (&coro->caller);
+
+	nih_assert_not_reached ();
+}
+
+/**
+ * nih_coro_resume:
+ * @coro: coroutine to resume,
+ * @waker: loop function called.
+ *
+ * Called by the loop when @coro has been woken, switches to the stack of
+ * the coroutine until it is suspended again or its function returns, in
+ * which case it is freed.
+ *
+ * Errors raised by the coroutine are held in their own context, which
+ * must be empty when it is suspended.
+ **/
+static void
+nih_coro_resume (NihCoro         *coro,
+		 NihMainLoopFunc *waker)
+{
+	NihCoro *previous;
+
+	nih_assert (coro != NULL);
+	nih_assert (waker == coro->waker);
+	nih_assert (! coro->running);
+
+	previous = current_coro;
+	current_coro = coro;
+	coro->running = TRUE;
+
+	nih_error_push_context ();
+	nih_assert (swapcontext (&coro->caller, &coro->context) == 0);
+	nih_error_pop_context ();
+
+	coro->running = FALSE;
+	current_coro = previous;
+
+	if (coro->finished)
+		nih_free (coro);
+}
+
+
+/**
+ * nih_coro_sleep:
+ * @seconds: seconds to sleep for.
+ *
+ * Suspends the running coroutine until @seconds have passed.
+ *
+ * This may only be called from a coroutine.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_coro_sleep (time_t seconds)
+{
+	NihCoroWait  wait;
+	NihTimer    *timer;
+
+	nih_assert (current_coro != NULL);
+
+	wait.coro = current_coro;
+	wait.done = FALSE;
+
+	/* The timer is freed by the loop once it has been called */
+	timer = nih_timer_add_timeout (wait.coro, seconds,
+				       (NihTimerCb)nih_coro_timer, &wait);
+	if (! timer)
+		nih_return_no_memory_error (-1);
+
+	while (! wait.done)
+		nih_coro_suspend ();
+
+	return 0;
+}
+
+/**
+ * nih_coro_timer:
+ * @wait: wait state,
+ * @timer: timer that is due.
+ *
+ * Called by the loop once the timer of nih_coro_sleep() is due, ends the
+ * wait and wakes the coroutine.
+ **/
+static void
+nih_coro_timer (NihCoroWait *wait,
+		NihTimer    *timer)
+{
+	nih_assert (wait != NULL);
+
+	wait->done = TRUE;
+	nih_coro_wake (wait->coro);
+}
+
+
+/**
+ * nih_coro_wait_io:
+ * @fd: file descriptor or socket to wait on,
+ * @events: events to wait for.
+ *
+ * Suspends the running coroutine until any of @events occur on @fd.
+ *
+ * This may only be called from a coroutine.
+ *
+ * Returns: events that occurred, or negative value on raised error.
+ **/
+int
+nih_coro_wait_io (int         fd,
+		  NihIoEvents events)
+{
+	NihCoroWait  wait;
+	NihIoWatch  *watch;
+
+	nih_assert (current_coro != NULL);
+	nih_assert (fd >= 0);
+	nih_assert (events != NIH_IO_NONE);
+
+	wait.coro = current_coro;
+	wait.done = FALSE;
+	wait.events = NIH_IO_NONE;
+
+	watch = nih_io_add_watch (wait.coro, fd, events,
+				  (NihIoWatcher)nih_coro_watcher, &wait);
+	if (! watch)
+		nih_return_no_memory_error (-1);
+
+	while (! wait.done)
+		nih_coro_suspend ();
+
+	nih_free (watch);
+
+	return wait.events;
+}
+
+/**
+ * nih_coro_watcher:
+ * @wait: wait state,
+ * @watch: I/O watch,
+ * @events: events that occurred.
+ *
+ * Called by the loop when the events waited for by nih_coro_wait_io()
+ * occur, ends the wait and wakes the coroutine.
+ **/
+static void
+nih_coro_watcher (NihCoroWait *wait,
+		  NihIoWatch  *watch,
+		  NihIoEvents  events)
+{
+	nih_assert (wait != NULL);
+
+	wait->done = TRUE;
+	wait->events = events;
+	nih_coro_wake (wait->coro);
+}
+
+/**
+ * nih_coro_read:
+ * @fd: file descriptor to read from,
+ * @buf: buffer to read into,
+ * @len: size of @buf.
+ *
+ * Reads up to @len bytes from @fd into @buf, suspending the running
+ * coroutine until @fd is readable if no data is available yet.  @fd
+ * must be non-blocking, see nih_io_set_nonblock().
+ *
+ * This may only be called from a coroutine.
+ *
+ * Returns: number of bytes read, zero at end of file, or negative value
+ * on raised error.
+ **/
+ssize_t
+nih_coro_read (int     fd,
+	       void   *buf,
+	       size_t  len)
+{
+	ssize_t len_read;
+
+	nih_assert (current_coro != NULL);
+	nih_assert (buf != NULL);
+
+	for (;;) {
+		len_read = read (fd, buf, len);
+		if (len_read >= 0)
+			return len_read;
+
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			nih_return_system_error (-1);
+
+		if (nih_coro_wait_io (fd, NIH_IO_READ) < 0)
+			return -1;
+	}
+}
+
+/**
+ * nih_coro_write:
+ * @fd: file descriptor to write to,
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Writes all @len bytes of @buf to @fd, suspending the running coroutine
+ * whenever @fd cannot accept more.  @fd must be non-blocking, see
+ * nih_io_set_nonblock().
+ *
+ * This may only be called from a coroutine.
+ *
+ * Returns: @len on success, negative value on raised error.
+ **/
+ssize_t
+nih_coro_write (int         fd,
+		const void *buf,
+		size_t      len)
+{
+	size_t done = 0;
+
+	nih_assert (current_coro != NULL);
+	nih_assert (buf != NULL);
+
+	while (done < len) {
+		ssize_t len_written;
+
+		len_written = write (fd, (const char *)buf + done,
+				     len - done);
+		if (len_written >= 0) {
+			done += len_written;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			nih_return_system_error (-1);
+
+		if (nih_coro_wait_io (fd, NIH_IO_WRITE) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+
+/**
+ * nih_coro_wait_child:
+ * @pid: process id of child,
+ * @event: pointer to store event in,
+ * @status: pointer to store status in.
+ *
+ * Suspends the running coroutine until the child process @pid has
+ * terminated, storing whether it exited, was killed or dumped core in
+ * @event and its exit status or the signal in @status; either may be
+ * NULL.
+ *
+ * Child processes are only reaped by the default loop, so this may only
+ * be called from a coroutine run by it.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_coro_wait_child (pid_t           pid,
+		     NihChildEvents *event,
+		     int            *status)
+{
+	NihCoroWait    wait;
+	NihChildWatch *watch;
+
+	nih_assert (current_coro != NULL);
+	nih_assert (pid > 0);
+
+	wait.coro = current_coro;
+	wait.done = FALSE;
+	wait.events = 0;
+	wait.status = 0;
+
+	/* The watch is freed once the child has terminated */
+	watch = nih_child_add_watch (wait.coro, pid,
+				     (NIH_CHILD_EXITED | NIH_CHILD_KILLED
+				      | NIH_CHILD_DUMPED),
+				     (NihChildHandler)nih_coro_reaper, &wait);
+	if (! watch)
+		nih_return_no_memory_error (-1);
+
+	while (! wait.done)
+		nih_coro_suspend ();
+
+	if (event)
+		*event = wait.events;
+	if (status)
+		*status = wait.status;
+
+	return 0;
+}
+
+/**
+ * nih_coro_reaper:
+ * @wait: wait state,
+ * @pid: process id of child,
+ * @event: event that occurred,
+ * @status: exit status or signal.
+ *
+ * Called by the loop once the child waited for by nih_coro_wait_child()
+ * has terminated, ends the wait and wakes the coroutine.
+ **/
+static void
+nih_coro_reaper (NihCoroWait    *wait,
+		 pid_t           pid,
+		 NihChildEvents  event,
+		 int             status)
+{
+	nih_assert (wait != NULL);
+
+	wait->done = TRUE;
+	wait->events = event;
+	wait->status = status;
+	nih_coro_wake (wait->coro);
+}
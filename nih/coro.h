@@ -0,0 +1,137 @@
+/* libnih
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NIH_CORO_H
+#define NIH_CORO_H
+
+/**
+ * Coroutines allow a sequence of steps that each wait for the main loop,
+ * such as a protocol exchange over a socket, to be written as ordinary
+ * sequential code rather than a state machine spread across callbacks.
+ *
+ * A coroutine is created with nih_coro_new() in the loop that should run
+ * it, and its function is called with its own stack from that loop in its
+ * next iteration.  Whenever the function calls one of the waiting
+ * functions, such as nih_coro_read(), nih_coro_sleep() or
+ * nih_coro_wait_child(), the coroutine is suspended and the loop carries
+ * on; once what it was waiting for has happened, it is resumed by the loop
+ * from where it left off.
+ *
+ * Anything else may be waited for by calling nih_coro_suspend() until a
+ * callback has woken the coroutine with nih_coro_wake().
+ *
+ * The coroutine is freed once its function returns.  Freeing it, or any
+ * of its parents, while it is suspended cancels it; it is never resumed,
+ * and anything it was waiting on is freed, but objects it allocated
+ * without a parent are leaked since its stack is simply discarded.
+ *
+ * A coroutine must not be suspended with an unhandled error raised, nor
+ * may it free itself; it should instead return.
+ **/
+
+#include <nih/macros.h>
+#include <nih/io.h>
+#include <nih/main.h>
+#include <nih/child.h>
+
+#include <sys/types.h>
+
+#include <ucontext.h>
+
+
+/**
+ * NIH_CORO_STACK_SIZE:
+ *
+ * Default size of the stack of a coroutine; pages of the stack are only
+ * allocated once used, so thousands of coroutines cost little more than
+ * the stack they each actually use.
+ **/
+#define NIH_CORO_STACK_SIZE 65536
+
+
+/**
+ * NihCoroFunc:
+ * @data: pointer given with coroutine,
+ * @coro: coroutine running.
+ *
+ * The coroutine function is called from the loop with the stack of @coro,
+ * and may suspend @coro by calling any of the waiting functions.  @coro is
+ * freed once it returns.
+ **/
+typedef struct nih_coro NihCoro;
+typedef void (*NihCoroFunc) (void *data, NihCoro *coro);
+
+
+/**
+ * NihCoro:
+ * @func: function run by the coroutine,
+ * @data: pointer passed to @func,
+ * @stack: memory mapped for stack, including guard page,
+ * @stack_size: size of @stack,
+ * @context: saved context of the coroutine,
+ * @caller: saved context of the loop while the coroutine runs,
+ * @waker: loop function that resumes the coroutine when woken,
+ * @running: TRUE while the coroutine is running,
+ * @finished: TRUE once @func has returned.
+ *
+ * This structure holds the state of a coroutine.  The lowest page of
+ * @stack is inaccessible, so that overflowing the stack results in a
+ * segmentation fault rather than corruption of other memory.
+ **/
+struct nih_coro {
+	NihCoroFunc      func;
+	void            *data;
+
+	void            *stack;
+	size_t           stack_size;
+	ucontext_t       context;
+	ucontext_t       caller;
+
+	NihMainLoopFunc *waker;
+	int              running;
+	int              finished;
+};
+
+
+NIH_BEGIN_EXTERN
+
+NihCoro *nih_coro_new        (const void *parent, size_t stack_size,
+			      NihCoroFunc func, void *data)
+	__attribute__ ((warn_unused_result, malloc));
+int      nih_coro_destroy    (NihCoro *coro);
+
+NihCoro *nih_coro_current    (void);
+
+void     nih_coro_wake       (NihCoro *coro);
+void     nih_coro_suspend    (void);
+void     nih_coro_yield      (void);
+
+int      nih_coro_sleep      (time_t seconds)
+	__attribute__ ((warn_unused_result));
+int      nih_coro_wait_io    (int fd, NihIoEvents events)
+	__attribute__ ((warn_unused_result));
+ssize_t  nih_coro_read       (int fd, void *buf, size_t len)
+	__attribute__ ((warn_unused_result));
+ssize_t  nih_coro_write      (int fd, const void *buf, size_t len)
+	__attribute__ ((warn_unused_result));
+int      nih_coro_wait_child (pid_t pid, NihChildEvents *event, int *status)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* NIH_CORO_H */
@@ -42,6 +42,8 @@ enum {
 
 	NIH_DIR_LOOP_DETECTED,
 
+	NIH_WATCH_INVALID_SNAPSHOT,
+
 	/* 0x20000 thru 0x2FFFF reserved for applications */
 	NIH_ERROR_APPLICATION_START = 0x20000L,
 
@@ -62,4 +64,6 @@ enum {
 
 #define NIH_DIR_LOOP_DETECTED_STR          N_("Directory loop detected")
 
+#define NIH_WATCH_INVALID_SNAPSHOT_STR     N_("Invalid watch snapshot")
+
 #endif /* NIH_ERRORS_H */
@@ -0,0 +1,178 @@
+/* libnih
+ *
+ * event.c - eventfd based wakeups
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/io.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "event.h"
+
+
+/* Prototypes for static functions */
+static void nih_event_watcher (NihEvent *event, NihIoWatch *watch,
+			       NihIoEvents events);
+
+
+/**
+ * nih_event_new:
+ * @parent: parent object for new event,
+ * @handler: function to call when signalled,
+ * @data: pointer to pass to @handler.
+ *
+ * Creates a new event, which when signalled with nih_event_signal() will
+ * result in @handler being called by the current loop.
+ *
+ * The event structure is allocated using nih_alloc(), the eventfd is
+ * closed by nih_event_destroy(), which is set as the destructor.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned event.  When all parents
+ * of the returned event are freed, the returned event will also be
+ * freed.
+ *
+ * Returns: new event, or NULL on raised error.
+ **/
+NihEvent *
+nih_event_new (const void      *parent,
+	       NihEventHandler  handler,
+	       void            *data)
+{
+	NihEvent *event;
+
+	nih_assert (handler != NULL);
+
+	event = nih_new (parent, NihEvent);
+	if (! event)
+		nih_return_no_memory_error (NULL);
+
+	event->watch = NULL;
+	event->handler = handler;
+	event->data = data;
+
+	event->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event->fd < 0) {
+		nih_error_raise_system ();
+		nih_free (event);
+		return NULL;
+	}
+
+	nih_alloc_set_destructor (event, nih_event_destroy);
+
+	event->watch = nih_io_add_watch (event, event->fd, NIH_IO_READ,
+					 (NihIoWatcher)nih_event_watcher,
+					 event);
+	if (! event->watch) {
+		nih_free (event);
+		nih_return_no_memory_error (NULL);
+	}
+
+	return event;
+}
+
+/**
+ * nih_event_destroy:
+ * @event: event to be destroyed.
+ *
+ * Closes the eventfd of @event so that it can be freed; any signals not
+ * yet handled are lost.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_event_destroy (NihEvent *event)
+{
+	nih_assert (event != NULL);
+
+	close (event->fd);
+
+	return 0;
+}
+
+
+/**
+ * nih_event_signal:
+ * @event: event to signal.
+ *
+ * Signals @event, so that its handler will be called during the current
+ * or next iteration of the loop it was created in.
+ *
+ * This may be called from any thread, or from a signal handler, but the
+ * caller must ensure @event is not freed meanwhile.
+ **/
+void
+nih_event_signal (NihEvent *event)
+{
+	uint64_t value = 1;
+	int      saved_errno;
+
+	nih_assert (event != NULL);
+
+	/* Adding to the counter only fails if it would overflow, in which
+	 * case the event is already signalled.
+	 */
+	saved_errno = errno;
+	while ((write (event->fd, &value, sizeof (value)) < 0)
+	       && (errno == EINTR))
+		;
+	errno = saved_errno;
+}
+
+
+/**
+ * nih_event_watcher:
+ * @event: event signalled,
+ * @watch: I/O watch on eventfd,
+ * @events: events that occurred.
+ *
+ * Called from the loop when the eventfd of @event is readable; resets the
+ * counter to zero and calls the handler once, no matter how many times
+ * the event was signalled.
+ **/
+static void
+nih_event_watcher (NihEvent    *event,
+		   NihIoWatch  *watch,
+		   NihIoEvents  events)
+{
+	uint64_t value;
+
+	nih_assert (event != NULL);
+	nih_assert (watch != NULL);
+
+	if (read (event->fd, &value, sizeof (value)) < 0)
+		return;
+
+	event->handler (event->data, event);
+}
@@ -0,0 +1,81 @@
+/* libnih
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NIH_EVENT_H
+#define NIH_EVENT_H
+
+/**
+ * Events are the simplest kind of wakeup; an event is created with
+ * nih_event_new() in the loop that should handle it, and may then be
+ * signalled with nih_event_signal() from any thread or from a signal
+ * handler.
+ *
+ * Signals are coalesced, however many times the event is signalled
+ * before the loop next handles it, the handler is called only once.
+ **/
+
+#include <nih/macros.h>
+#include <nih/io.h>
+
+
+/**
+ * NihEventHandler:
+ * @data: pointer given with event,
+ * @event: event that was signalled.
+ *
+ * The event handler is called from the loop once the event has been
+ * signalled; any further signals received before or while it is called
+ * will result in it being called again.
+ *
+ * It is safe to free the event from this function.
+ **/
+typedef struct nih_event NihEvent;
+typedef void (*NihEventHandler) (void *data, NihEvent *event);
+
+
+/**
+ * NihEvent:
+ * @fd: eventfd descriptor,
+ * @watch: I/O watch on @fd,
+ * @handler: function called when signalled,
+ * @data: pointer passed to @handler.
+ *
+ * This structure wraps an eventfd() counter; signalling the event adds to
+ * the counter, and the loop resets it to zero before calling @handler.
+ **/
+struct nih_event {
+	int              fd;
+	NihIoWatch      *watch;
+
+	NihEventHandler  handler;
+	void            *data;
+};
+
+
+NIH_BEGIN_EXTERN
+
+NihEvent *nih_event_new     (const void *parent, NihEventHandler handler,
+			     void *data)
+	__attribute__ ((warn_unused_result, malloc));
+int       nih_event_destroy (NihEvent *event);
+
+void      nih_event_signal  (NihEvent *event);
+
+NIH_END_EXTERN
+
+#endif /* NIH_EVENT_H */
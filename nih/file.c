@@ -30,14 +30,19 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/string.h>
 #include <nih/io.h>
 #include <nih/file.h>
@@ -47,31 +52,276 @@
 
 
 /**
- * NihDirEntry:
- * @entry: list header,
+ * NihDirSetState:
+ *
+ * States of a slot in a set of directories.
+ **/
+typedef enum nih_dir_set_state {
+	NIH_DIR_SET_FREE,
+	NIH_DIR_SET_USED,
+	NIH_DIR_SET_REMOVED,
+} NihDirSetState;
+
+/**
+ * NihDirSetEntry:
  * @dev: device number,
- * @ino: inode number.
+ * @ino: inode number,
+ * @state: whether the slot is free, in use or was removed.
+ *
+ * This structure is a slot in a set of directories.
+ **/
+typedef struct nih_dir_set_entry {
+	dev_t dev;
+	ino_t ino;
+	int   state;
+} NihDirSetEntry;
+
+/**
+ * NihDirSet:
+ * @entries: open-addressed table of slots,
+ * @size: number of slots in @entries, a power of two,
+ * @used: number of slots in use or removed.
+ *
+ * This structure is used to detect directory loops by recording the
+ * device and inode numbers of the directories we're in, or have been in,
+ * so that each may be checked without searching through all of them.
+ **/
+typedef struct nih_dir_set {
+	NihDirSetEntry *entries;
+	size_t          size;
+	size_t          used;
+} NihDirSet;
+
+/**
+ * NihDirWalkEnt:
+ * @name: name of object,
+ * @offset: offset of @name in the buffer of names,
+ * @type: type of object from readdir().
+ *
+ * This structure is used to hold the list of objects found in a directory
+ * while they are sorted and visited.
+ **/
+typedef struct nih_dir_walk_ent {
+	char          *name;
+	size_t         offset;
+	unsigned char  type;
+} NihDirWalkEnt;
+
+/**
+ * NihDirWalk:
+ * @flags: flags given to nih_dir_walk_at(),
+ * @filter: path filter,
+ * @visitor: function to call for each object,
+ * @error: function to call on error,
+ * @data: data to pass to @filter, @visitor and @error,
+ * @path: buffer holding path of the current object,
+ * @path_size: allocated size of @path,
+ * @dirs: set of visited directories,
+ * @pool: worker threads for a parallel walk, or NULL.
+ *
+ * This structure holds the state of a directory tree walk; the path of each
+ * object is built in @path on top of that of its directory, so that no
+ * string need be allocated for each object.
+ **/
+typedef struct nih_dir_walk {
+	NihDirWalkFlags     flags;
+	NihFileFilter       filter;
+	NihDirVisitor       visitor;
+	NihDirErrorHandler  error;
+	void               *data;
+
+	char               *path;
+	size_t              path_size;
+
+	NihDirSet           dirs;
+
+	struct nih_dir_walk_pool *pool;
+} NihDirWalk;
+
+/**
+ * NihDirWalkPath:
+ * @dirname: top-level path being walked,
+ * @visitor: path-based visitor,
+ * @error: path-based error handler,
+ * @data: data to pass to @visitor and @error.
+ *
+ * This structure is used by nih_dir_walk() to call path-based visitors and
+ * error handlers from nih_dir_walk_at().
+ **/
+typedef struct nih_dir_walk_path {
+	const char          *dirname;
+	NihFileVisitor       visitor;
+	NihFileErrorHandler  error;
+	void                *data;
+} NihDirWalkPath;
+
+/**
+ * NihDirScanState:
+ *
+ * States of a directory read by nih_dir_walk_parallel().
+ **/
+typedef enum nih_dir_scan_state {
+	NIH_DIR_SCAN_QUEUED,
+	NIH_DIR_SCAN_RUNNING,
+	NIH_DIR_SCAN_DONE,
+} NihDirScanState;
+
+/**
+ * NihDirScanEnt:
+ * @ent: name and type of object,
+ * @skip: TRUE if the filter matched the object,
+ * @is_dir: TRUE if the object is, or links to, a directory,
+ * @error: errno from examining the object, or zero.
+ *
+ * This structure holds an object found by a worker thread while reading a
+ * directory; @ent must come first so that nih_dir_walk_sort() may be used.
+ **/
+typedef struct nih_dir_scan_ent {
+	NihDirWalkEnt ent;
+	int           skip;
+	int           is_dir;
+	int           error;
+} NihDirScanEnt;
+
+/**
+ * NihDirScan:
+ * @entry: list header for queue,
+ * @pool: pool reading the directory,
+ * @state: whether the directory is queued, being read or has been read,
+ * @prefetched: TRUE while counted in the outstanding reads of @pool,
+ * @at_fd: descriptor of parent directory,
+ * @at_name: name of directory within @at_fd,
+ * @dir: open directory,
+ * @statbuf: stat of @dir,
+ * @error: errno from opening or reading @dir, or zero,
+ * @ents: sorted objects found in @dir,
+ * @nents: number of entries in @ents,
+ * @names: buffer holding names of @ents,
+ * @stats: stat of each of @ents when NIH_DIR_WALK_STAT was given.
+ *
+ * This structure is used by nih_dir_walk_parallel() to have a worker
+ * thread read a directory and examine the objects in it ahead of them
+ * being visited.  Only @state is shared with the workers once queued, and
+ * the remaining members may only be read once it is NIH_DIR_SCAN_DONE;
+ * the buffers are allocated with malloc() since nih_alloc() may only be
+ * used from the main thread.
+ **/
+typedef struct nih_dir_scan {
+	NihList                   entry;
+	struct nih_dir_walk_pool *pool;
+	NihDirScanState           state;
+	int                       prefetched;
+
+	int                       at_fd;
+	const char               *at_name;
+
+	DIR                      *dir;
+	struct stat               statbuf;
+	int                       error;
+
+	NihDirScanEnt            *ents;
+	size_t                    nents;
+	char                     *names;
+	struct stat              *stats;
+} NihDirScan;
+
+/**
+ * NihDirWalkPool:
+ * @mutex: mutex protecting @queue, @shutdown and the state of scans,
+ * @work_cond: condition signalled when a scan is queued,
+ * @done_cond: condition signalled when a scan has been read,
+ * @queue: list of scans waiting for a worker,
+ * @flags: flags given to nih_dir_walk_parallel(),
+ * @threads: worker threads,
+ * @nthreads: number of worker threads started,
+ * @shutdown: TRUE once the workers should exit,
+ * @window: maximum number of directories read ahead,
+ * @outstanding: number of directories read ahead and not yet visited.
  *
- * This structure is used to detect directory loops, and is stored in a stack
- * as we recurse down the directory tree.
+ * This structure holds the worker threads used by nih_dir_walk_parallel();
+ * @window and @outstanding are only used by the walking thread.
  **/
-typedef struct nih_dir_entry {
-	NihList entry;
-	dev_t   dev;
-	ino_t   ino;
-} NihDirEntry;
+typedef struct nih_dir_walk_pool {
+	pthread_mutex_t  mutex;
+	pthread_cond_t   work_cond;
+	pthread_cond_t   done_cond;
+	NihList          queue;
+	NihDirWalkFlags  flags;
+
+	pthread_t       *threads;
+	size_t           nthreads;
+	int              shutdown;
+
+	size_t           window;
+	size_t           outstanding;
+} NihDirWalkPool;
 
 
 /* Prototypes for static functions */
-static char **nih_dir_walk_scan  (const char *path, NihFileFilter filter,
-				  void *data)
+static void *nih_file_map_fd          (int fd, int prot, int flags,
+				       size_t *length)
+	__attribute__ ((warn_unused_result));
+static void nih_file_map_advise       (void *map, size_t length,
+				       NihFileMapFlags flags);
+static int  nih_file_reader_destroy   (NihFileReader *reader);
+static int  nih_file_reader_fill      (NihFileReader *reader)
+	__attribute__ ((warn_unused_result));
+static int  nih_file_mapping_destroy  (NihFileMapping *mapping);
+static int  nih_file_window_destroy   (NihFileWindow *window);
+static size_t nih_file_split          (const char *path, const char **name,
+				       const char **dot, const char **semi);
+static int  nih_file_ignore_name      (const char *name, size_t len,
+				       const char *dot, const char *semi);
+static int  nih_file_matcher_insert   (NihFileMatcher *matcher,
+				       NihFileMatcherNode **root,
+				       const char *str, size_t len,
+				       int reverse)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_walk_path_visitor (NihDirWalkPath *walk_path, int dirfd,
+				       const char *name, const char *path,
+				       int is_dir, struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_walk_path_error   (NihDirWalkPath *walk_path, int dirfd,
+				       const char *name, const char *path,
+				       struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static DIR *nih_dir_walk_open         (int dirfd, const char *name,
+				       struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_walk_mode         (int dirfd, const char *name,
+				       int follow, mode_t *mode)
+	__attribute__ ((warn_unused_result));
+static void nih_dir_walk_path_set     (NihDirWalk *walk, size_t len,
+				       const char *name);
+static int  nih_dir_walk_dir          (NihDirWalk *walk, DIR *dir,
+				       size_t len)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_walk_visit        (NihDirWalk *walk, int dirfd,
+				       NihDirWalkEnt *ent, size_t len)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_walk_error        (NihDirWalk *walk, int dirfd,
+				       const char *name, struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static int  nih_dir_set_add           (NihDirSet *set,
+				       const struct stat *statbuf);
+static void nih_dir_set_remove        (NihDirSet *set,
+				       const struct stat *statbuf);
+static void nih_dir_pool_start        (NihDirWalkPool *pool,
+				       NihDirWalkFlags flags, size_t nthreads);
+static void nih_dir_pool_stop         (NihDirWalkPool *pool);
+static void *nih_dir_pool_thread      (NihDirWalkPool *pool);
+static NihDirScan *nih_dir_scan_new   (NihDirWalkPool *pool, int at_fd,
+				       const char *at_name)
 	__attribute__ ((warn_unused_result, malloc));
-static int    nih_dir_walk_visit (const char *dirname, NihList *dirs,
-				  const char *path, NihFileFilter filter,
-				  NihFileVisitor visitor,
-				  NihFileErrorHandler error, void *data)
+static int  nih_dir_scan_destroy      (NihDirScan *scan);
+static void nih_dir_scan_wait         (NihDirScan *scan);
+static void nih_dir_scan_run          (NihDirScan *scan,
+				       NihDirWalkFlags flags);
+static int  nih_dir_scan_walk         (NihDirWalk *walk, NihDirScan *scan,
+				       size_t len)
 	__attribute__ ((warn_unused_result));
-
+static void nih_dir_scan_prefetch     (NihDirWalk *walk, NihDirScan *scan,
+				       NihDirScan **children, size_t *next);
 
 /**
  * nih_file_read:
@@ -82,7 +332,10 @@ static int    nih_dir_walk_visit (const char *dirname, NihList *dirs,
  * Opens the file at @path and reads the contents into memory, returning
  * a newly allocated string.  If the file is particularly large, it may
  * not be possible to read into memory at all, and you'll need to use
- * nih_file_map() instead.
+ * nih_file_reader_new() or nih_file_mapping_new() instead.
+ *
+ * Files whose size isn't known in advance, such as those in /proc, are
+ * read until the end, as are those that grow while being read.
  *
  * The returned data will NOT be NULL terminated.
  *
@@ -99,17 +352,18 @@ nih_file_read (const void *parent,
 	       size_t     *length)
 {
 	struct stat  statbuf;
-	FILE        *fp;
 	char        *file = NULL;
+	size_t       size, len;
+	int          fd;
 
 	nih_assert (path != NULL);
 	nih_assert (length != NULL);
 
-	fp = fopen (path, "r");
-	if (! fp)
+	fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
 		nih_return_system_error (NULL);
 
-	if (fstat (fileno (fp), &statbuf) < 0)
+	if (fstat (fd, &statbuf) < 0)
 		goto error;
 
 	if ((size_t)statbuf.st_size > SIZE_MAX) {
@@ -117,24 +371,57 @@ nih_file_read (const void *parent,
 		goto error;
 	}
 
-	*length = statbuf.st_size;
-
-	file = nih_alloc (parent, statbuf.st_size);
+	/* Allocate exactly the size of the file, which is all we need
+	 * unless it's one that reports no size or it grows; in which case
+	 * we read into a buffer that doubles each time it's filled.
+	 */
+	size = statbuf.st_size;
+	file = nih_alloc (parent, size ?: 1);
 	if (! file)
 		goto error;
 
-	if (fread (file, 1, statbuf.st_size, fp) != (size_t)statbuf.st_size) {
-		errno = EILSEQ;
-		goto error;
+	len = 0;
+	for (;;) {
+		char    extra[BUFSIZ];
+		ssize_t ret;
+
+		if (len < size) {
+			ret = read (fd, file + len, size - len);
+		} else {
+			ret = read (fd, extra, sizeof (extra));
+		}
+
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret < 0)
+			goto error;
+		if (ret == 0)
+			break;
+
+		if (len >= size) {
+			char *new_file;
+
+			size = (len + sizeof (extra)) * 2;
+			new_file = nih_realloc (file, parent, size);
+			if (! new_file)
+				goto error;
+
+			file = new_file;
+			memcpy (file + len, extra, ret);
+		}
+
+		len += ret;
 	}
 
-	fclose (fp);
+	*length = len;
+
+	close (fd);
 	return file;
 error:
 	nih_error_raise_system ();
 	if (file)
 		nih_free (file);
-	fclose (fp);
+	close (fd);
 
 	return NULL;
 }
@@ -156,9 +443,8 @@ nih_file_map (const char *path,
 	      int         flags,
 	      size_t     *length)
 {
-	struct stat  statbuf;
-	char        *map;
-	int          fd, prot;
+	char *map;
+	int   fd, prot;
 
 	nih_assert (path != NULL);
 	nih_assert (length != NULL);
@@ -174,26 +460,80 @@ nih_file_map (const char *path,
 	if ((flags & O_ACCMODE) == O_RDWR)
 		prot |= PROT_WRITE;
 
+	map = nih_file_map_fd (fd, prot, 0, length);
+
+	close (fd);
+	return map;
+}
+
+/**
+ * nih_file_map_fd:
+ * @fd: open file,
+ * @prot: memory protection of mapping,
+ * @flags: additional flags for mmap(),
+ * @length: pointer to store file length.
+ *
+ * Maps the whole of the file open as @fd into memory, with the @prot
+ * and @flags given, returning the mapped pointer and storing the length
+ * of the file in @length.  @fd may be closed afterwards.
+ *
+ * Returns: memory mapped file or NULL on raised error.
+ **/
+static void *
+nih_file_map_fd (int     fd,
+		 int     prot,
+		 int     flags,
+		 size_t *length)
+{
+	struct stat  statbuf;
+	char        *map;
+
+	nih_assert (fd >= 0);
+	nih_assert (length != NULL);
+
 	if (fstat (fd, &statbuf) < 0)
-		goto error;
+		nih_return_system_error (NULL);
 
 	if ((size_t)statbuf.st_size > SIZE_MAX) {
 		errno = EFBIG;
-		goto error;
+		nih_return_system_error (NULL);
 	}
 
 	*length = statbuf.st_size;
 
-	map = mmap (NULL, *length, prot, MAP_SHARED, fd, 0);
+	map = mmap (NULL, *length, prot, MAP_SHARED | flags, fd, 0);
 	if (map == MAP_FAILED)
-		goto error;
+		nih_return_system_error (NULL);
 
-	close (fd);
 	return map;
-error:
-	nih_error_raise_system ();
-	close (fd);
-	return NULL;
+}
+
+/**
+ * nih_file_map_advise:
+ * @map: memory mapped file,
+ * @length: length of @map,
+ * @flags: advice for the kernel.
+ *
+ * Gives the kernel the advice in @flags about how @map will be accessed.
+ * The advice is only a hint, so failure to take it is not an error.
+ **/
+static void
+nih_file_map_advise (void            *map,
+		     size_t           length,
+		     NihFileMapFlags  flags)
+{
+	nih_assert (map != NULL);
+
+	if (flags & NIH_FILE_MAP_SEQUENTIAL)
+		madvise (map, length, MADV_SEQUENTIAL);
+	if (flags & NIH_FILE_MAP_RANDOM)
+		madvise (map, length, MADV_RANDOM);
+	if (flags & NIH_FILE_MAP_WILLNEED)
+		madvise (map, length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	if (flags & NIH_FILE_MAP_HUGEPAGE)
+		madvise (map, length, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
 }
 
 /**
@@ -219,568 +559,2629 @@ nih_file_unmap (void   *map,
 
 
 /**
- * nih_file_is_hidden:
- * @path: path to check.
+ * nih_file_reader_new:
+ * @parent: parent object for new reader,
+ * @path: path to read,
+ * @size: size of buffer, or zero for the default,
+ * @flags: flags changing how the file is read.
  *
- * Determines whether @path represents a hidden file, matching it against
- * common patterns for that type of file.
+ * Opens the file at @path to be read in chunks of up to @size bytes with
+ * nih_file_reader_read(), or line by line with nih_file_reader_line(),
+ * so that a file of any size can be processed with a single buffer that
+ * is reused for each chunk; it only grows for a line longer than it.
+ * Unlike nih_file_map(), this works for any file that can be read,
+ * including pipes and those in /proc.
  *
- * Returns: TRUE if it matches, FALSE otherwise.
+ * If @flags includes NIH_FILE_READ_NOATIME the access time of the file is
+ * not updated, where the process is permitted to ask for that; and if it
+ * includes NIH_FILE_READ_SEQUENTIAL the kernel is advised that the file
+ * will be read from start to end.
+ *
+ * The file is closed when the reader is freed.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned reader.  When all parents
+ * of the returned reader are freed, the returned reader will also be
+ * freed.
+ *
+ * Returns: new file reader or NULL on raised error.
  **/
-int
-nih_file_is_hidden (const char *path)
+NihFileReader *
+nih_file_reader_new (const void         *parent,
+		     const char         *path,
+		     size_t              size,
+		     NihFileReaderFlags  flags)
 {
-	const char *ptr;
-	size_t      len;
+	NihFileReader *reader;
+	int            fd = -1;
 
 	nih_assert (path != NULL);
 
-	ptr = strrchr (path, '/');
-	if (ptr)
-		path = ptr + 1;
+	if (flags & NIH_FILE_READ_NOATIME) {
+		fd = open (path, (O_RDONLY | O_NOCTTY | O_CLOEXEC
+				  | O_NOATIME));
+		if ((fd < 0) && (errno != EPERM))
+			nih_return_system_error (NULL);
+	}
 
-	len = strlen (path);
+	/* Only the owner of a file may ask not to update its access time,
+	 * so we try again without doing so.
+	 */
+	if (fd < 0) {
+		fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+		if (fd < 0)
+			nih_return_system_error (NULL);
+	}
 
-	/* Matches .*; standard hidden pattern */
-	if ((len >= 1) && (path[0] == '.'))
-		return TRUE;
+	if (flags & NIH_FILE_READ_SEQUENTIAL)
+		posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	return FALSE;
+	reader = nih_new (parent, NihFileReader);
+	if (! reader) {
+		errno = ENOMEM;
+		goto error;
+	}
+
+	reader->fd = fd;
+	reader->size = size ?: NIH_FILE_READER_SIZE;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = FALSE;
+
+	nih_alloc_set_destructor (reader, nih_file_reader_destroy);
+
+	reader->buf = nih_alloc (reader, reader->size);
+	if (! reader->buf) {
+		nih_free (reader);
+		errno = ENOMEM;
+		nih_return_system_error (NULL);
+	}
+
+	return reader;
+error:
+	nih_error_raise_system ();
+	close (fd);
+	return NULL;
 }
 
 /**
- * nih_file_is_backup:
- * @path: path to check.
+ * nih_file_reader_destroy:
+ * @reader: reader to be destroyed.
  *
- * Determines whether @path represents a backup file, matching it against
- * common patterns for that type of file.
+ * Closes the file being read by @reader.  Normally used or called from an
+ * nih_alloc() destructor.
  *
- * Returns: TRUE if it matches, FALSE otherwise.
+ * Returns: zero.
  **/
-int
-nih_file_is_backup (const char *path)
+static int
+nih_file_reader_destroy (NihFileReader *reader)
 {
-	const char *ptr;
-	size_t      len;
+	nih_assert (reader != NULL);
 
-	nih_assert (path != NULL);
+	close (reader->fd);
 
-	ptr = strrchr (path, '/');
-	if (ptr)
-		path = ptr + 1;
+	return 0;
+}
 
-	len = strlen (path);
-	ptr = path + len;
+/**
+ * nih_file_reader_fill:
+ * @reader: reader to fill.
+ *
+ * Reads as much as will fit into the buffer of @reader after what is
+ * already there, setting the eof member if the end of the file has been
+ * reached.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_file_reader_fill (NihFileReader *reader)
+{
+	ssize_t ret;
 
-	/* Matches *~; standard backup style */
-	if ((len >= 1) && (ptr[-1] == '~'))
-		return TRUE;
+	nih_assert (reader != NULL);
+	nih_assert (reader->end < reader->size);
 
-	/* Matches *.bak; common backup extension */
-	if ((len >= 4) && (! strcmp (&ptr[-4], ".bak")))
-		return TRUE;
+	do {
+		ret = read (reader->fd, reader->buf + reader->end,
+			    reader->size - reader->end);
+	} while ((ret < 0) && (errno == EINTR));
 
-	/* Matches *.BAK; as above, but on case-insensitive filesystems */
-	if ((len >= 4) && (! strcmp (&ptr[-4], ".BAK")))
-		return TRUE;
+	if (ret < 0)
+		nih_return_system_error (-1);
 
-	/* Matches #*#; used by emacs for unsaved files */
-	if ((len >= 2) && (path[0] == '#') && (ptr[-1] == '#'))
-		return TRUE;
+	if (ret == 0)
+		reader->eof = TRUE;
 
-	return FALSE;
+	reader->end += ret;
+
+	return 0;
 }
 
 /**
- * nih_file_is_swap:
- * @path: path to check.
+ * nih_file_reader_read:
+ * @reader: reader to read from,
+ * @data: pointer to store data read.
  *
- * Determines whether @path represents an editor swap file, matching it
- * against common patterns for that type of file.
+ * Reads the next chunk of the file being read by @reader, storing a
+ * pointer to it in @data.  The chunk is within the buffer of @reader, and
+ * remains valid only until the next call.
  *
- * Returns: TRUE if it matches, FALSE otherwise.
+ * Returns: length of chunk, zero at the end of the file, or negative
+ * value on raised error.
  **/
-int
-nih_file_is_swap (const char *path)
+ssize_t
+nih_file_reader_read (NihFileReader  *reader,
+		      const char    **data)
 {
-	const char *ptr;
-	size_t      len;
+	size_t len;
 
-	nih_assert (path != NULL);
-
-	ptr = strrchr (path, '/');
-	if (ptr)
-		path = ptr + 1;
-
-	len = strlen (path);
-	ptr = path + len;
+	nih_assert (reader != NULL);
+	nih_assert (data != NULL);
 
-	/* Matches *.swp; used by vi */
-	if ((len >= 4) && (! strcmp (&ptr[-4], ".swp")))
-		return TRUE;
+	if (reader->start == reader->end) {
+		reader->start = reader->end = 0;
 
-	/* Matches *.swo; used by vi */
-	if ((len >= 4) && (! strcmp (&ptr[-4], ".swo")))
-		return TRUE;
+		if ((! reader->eof) && (nih_file_reader_fill (reader) < 0))
+			return -1;
+	}
 
-	/* Matches *.swn; used by vi */
-	if ((len >= 4) && (! strcmp (&ptr[-4], ".swn")))
-		return TRUE;
+	*data = reader->buf + reader->start;
+	len = reader->end - reader->start;
 
-	/* Matches .#*; used by emacs */
-	if ((len >= 2) && (! strncmp (path, ".#", 2)))
-		return TRUE;
+	reader->start = reader->end;
 
-	return FALSE;
+	return len;
 }
 
 /**
- * nih_file_is_rcs:
- * @path: path to check.
+ * nih_file_reader_line:
+ * @reader: reader to read from,
+ * @line: pointer to store line read.
  *
- * Determines whether @path represents a file or directory used by a
- * common revision control system, matching it against common patterns
- * for known RCSs.
+ * Reads the next line of the file being read by @reader, storing a
+ * pointer to it in @line.  The line includes the newline character that
+ * ends it, unless it is the last line of a file that doesn't end with
+ * one, and is not nul-terminated.  It is within the buffer of @reader,
+ * and remains valid only until the next call.
  *
- * Returns: TRUE if it matches, FALSE otherwise.
+ * Lines longer than the buffer of @reader cause the buffer to be doubled
+ * in size, since they must be returned whole.
+ *
+ * Returns: length of line, zero at the end of the file, or negative
+ * value on raised error.
  **/
-int
-nih_file_is_rcs (const char *path)
+ssize_t
+nih_file_reader_line (NihFileReader  *reader,
+		      const char    **line)
 {
-	const char *ptr;
-	size_t      len;
+	size_t scanned = 0;
+
+	nih_assert (reader != NULL);
+	nih_assert (line != NULL);
+
+	for (;;) {
+		const char *nl;
+		size_t      len;
+
+		nl = memchr (reader->buf + reader->start + scanned, '\n',
+			     reader->end - reader->start - scanned);
+		if (nl || (reader->eof && (reader->start < reader->end))) {
+			*line = reader->buf + reader->start;
+			len = (nl ? (size_t)(nl + 1 - *line)
+			       : reader->end - reader->start);
+
+			reader->start += len;
+			return len;
+		} else if (reader->eof) {
+			return 0;
+		}
 
-	nih_assert (path != NULL);
+		scanned = reader->end - reader->start;
 
-	ptr = strrchr (path, '/');
-	if (ptr)
-		path = ptr + 1;
+		/* Move the partial line to the start of the buffer, and
+		 * if it's still full, make room for the rest.
+		 */
+		if (reader->start) {
+			memmove (reader->buf, reader->buf + reader->start,
+				 scanned);
+			reader->start = 0;
+			reader->end = scanned;
+		}
 
-	len = strlen (path);
-	ptr = path + len;
+		if (reader->end == reader->size) {
+			char *buf;
 
-	/* Matches *,v; used by rcs and cvs */
-	if ((len >= 2) && (! strcmp (&ptr[-2], ",v")))
-		return TRUE;
+			buf = nih_realloc (reader->buf, reader,
+					   reader->size * 2);
+			if (! buf) {
+				errno = ENOMEM;
+				nih_return_system_error (-1);
+			}
 
-	/* RCS; used by rcs */
-	if (! strcmp (path, "RCS"))
+			reader->buf = buf;
+			reader->size *= 2;
+		}
+
+		if (nih_file_reader_fill (reader) < 0)
+			return -1;
+	}
+}
+
+
+/**
+ * nih_file_mapping_new:
+ * @parent: parent object for new mapping,
+ * @path: path to map,
+ * @flags: advice for the kernel.
+ *
+ * Opens the file at @path and maps the whole of it into memory for
+ * reading, returning an object holding the mapped data and its length.
+ * The file is unmapped when the object is freed, so code that shares the
+ * data should take a reference to the object with nih_ref() and drop it
+ * with nih_unref(); the data remains mapped until the last is dropped.
+ *
+ * @flags advises the kernel how the data will be accessed:
+ * NIH_FILE_MAP_SEQUENTIAL that it will be read from start to end, so
+ * pages may be read well ahead and dropped soon after, NIH_FILE_MAP_RANDOM
+ * that it will not, so reading ahead is wasted, and NIH_FILE_MAP_WILLNEED
+ * that all of it will be needed soon, so it may be read in the background.
+ * NIH_FILE_MAP_HUGEPAGE asks for it to be backed by huge pages where the
+ * filesystem allows.  NIH_FILE_MAP_POPULATE goes further than
+ * NIH_FILE_MAP_WILLNEED, reading the whole file in before returning so
+ * that accessing it never faults.
+ *
+ * An empty file results in an object with NULL data and zero length.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned mapping.  When all parents
+ * of the returned mapping are freed, the returned mapping will also be
+ * freed.
+ *
+ * Returns: new mapping or NULL on raised error.
+ **/
+NihFileMapping *
+nih_file_mapping_new (const void      *parent,
+		      const char      *path,
+		      NihFileMapFlags  flags)
+{
+	NihFileMapping *mapping;
+	struct stat     statbuf;
+	int             fd;
+
+	nih_assert (path != NULL);
+
+	fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (NULL);
+
+	mapping = nih_new (parent, NihFileMapping);
+	if (! mapping) {
+		close (fd);
+		errno = ENOMEM;
+		nih_return_system_error (NULL);
+	}
+
+	mapping->data = NULL;
+	mapping->length = 0;
+
+	nih_alloc_set_destructor (mapping, nih_file_mapping_destroy);
+
+	if (fstat (fd, &statbuf) < 0) {
+		nih_error_raise_system ();
+		goto error;
+	}
+
+	if (statbuf.st_size) {
+		mapping->data = nih_file_map_fd (
+			fd, PROT_READ,
+			(flags & NIH_FILE_MAP_POPULATE) ? MAP_POPULATE : 0,
+			&mapping->length);
+		if (! mapping->data)
+			goto error;
+
+		nih_file_map_advise (mapping->data, mapping->length, flags);
+	}
+
+	close (fd);
+	return mapping;
+error:
+	nih_free (mapping);
+	close (fd);
+	return NULL;
+}
+
+/**
+ * nih_file_mapping_destroy:
+ * @mapping: mapping to be destroyed.
+ *
+ * Unmaps the data of @mapping.  Normally used or called from an nih_alloc()
+ * destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_file_mapping_destroy (NihFileMapping *mapping)
+{
+	nih_assert (mapping != NULL);
+
+	if (mapping->data)
+		munmap (mapping->data, mapping->length);
+
+	return 0;
+}
+
+
+/**
+ * nih_file_window_new:
+ * @parent: parent object for new window,
+ * @path: path to map,
+ * @size: size of window,
+ * @flags: advice for the kernel.
+ *
+ * Opens the file at @path to be mapped into memory a window of @size
+ * bytes at a time, for files too large to sensibly map whole.  Nothing
+ * is mapped until nih_file_window_move() is called; the window is then
+ * moved along the file by calling it again, and each part of the file is
+ * mapped with the advice given in @flags, as for nih_file_mapping_new().
+ *
+ * @size is rounded up to a whole number of pages.
+ *
+ * The file is unmapped and closed when the window is freed.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned window.  When all parents
+ * of the returned window are freed, the returned window will also be
+ * freed.
+ *
+ * Returns: new window or NULL on raised error.
+ **/
+NihFileWindow *
+nih_file_window_new (const void      *parent,
+		     const char      *path,
+		     size_t           size,
+		     NihFileMapFlags  flags)
+{
+	NihFileWindow *window;
+	size_t         page_size;
+	int            fd;
+
+	nih_assert (path != NULL);
+	nih_assert (size > 0);
+
+	fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (NULL);
+
+	window = nih_new (parent, NihFileWindow);
+	if (! window) {
+		close (fd);
+		errno = ENOMEM;
+		nih_return_system_error (NULL);
+	}
+
+	page_size = sysconf (_SC_PAGESIZE);
+
+	window->fd = fd;
+	window->size = (size + page_size - 1) / page_size * page_size;
+	window->flags = flags;
+
+	window->data = NULL;
+	window->offset = 0;
+	window->length = 0;
+
+	nih_alloc_set_destructor (window, nih_file_window_destroy);
+
+	return window;
+}
+
+/**
+ * nih_file_window_destroy:
+ * @window: window to be destroyed.
+ *
+ * Unmaps the part of the file mapped by @window and closes it.  Normally
+ * used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_file_window_destroy (NihFileWindow *window)
+{
+	nih_assert (window != NULL);
+
+	if (window->data)
+		munmap (window->data, window->length);
+
+	close (window->fd);
+
+	return 0;
+}
+
+/**
+ * nih_file_window_move:
+ * @window: window to move,
+ * @offset: offset within file.
+ *
+ * Moves @window so that it maps the part of the file beginning with the
+ * page containing @offset, setting its data member to the mapped data,
+ * its offset member to the offset within the file of the first byte of
+ * the data, and its length member to the length of the data; that is the
+ * size of the window, or less at the end of the file.  The byte at
+ * @offset is thus at data + (@offset - offset), and the file is read in
+ * order by moving the window to offset + length each time.
+ *
+ * If @offset is already within the window, it is not moved.
+ *
+ * When @offset is at or beyond the end of the file, nothing is mapped;
+ * data is set to NULL and length to zero.  The size of the file is
+ * checked each time, so one that is growing may be followed.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_file_window_move (NihFileWindow *window,
+		      off_t          offset)
+{
+	struct stat  statbuf;
+	size_t       page_size, length;
+	off_t        start;
+	char        *data;
+
+	nih_assert (window != NULL);
+	nih_assert (offset >= 0);
+
+	if (window->data && (offset >= window->offset)
+	    && (offset < window->offset + (off_t)window->length))
+		return 0;
+
+	if (fstat (window->fd, &statbuf) < 0)
+		nih_return_system_error (-1);
+
+	page_size = sysconf (_SC_PAGESIZE);
+	start = offset / page_size * page_size;
+
+	if (offset < statbuf.st_size) {
+		length = statbuf.st_size - start;
+		if (length > window->size)
+			length = window->size;
+	} else {
+		length = 0;
+	}
+
+	data = NULL;
+	if (length) {
+		data = mmap (NULL, length, PROT_READ,
+			     (MAP_SHARED
+			      | ((window->flags & NIH_FILE_MAP_POPULATE)
+				 ? MAP_POPULATE : 0)),
+			     window->fd, start);
+		if (data == MAP_FAILED)
+			nih_return_system_error (-1);
+
+		nih_file_map_advise (data, length, window->flags);
+	}
+
+	if (window->data)
+		munmap (window->data, window->length);
+
+	window->data = data;
+	window->offset = length ? start : offset;
+	window->length = length;
+
+	return 0;
+}
+
+
+/**
+ * nih_file_is_hidden:
+ * @path: path to check.
+ *
+ * Determines whether @path represents a hidden file, matching it against
+ * common patterns for that type of file.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_is_hidden (const char *path)
+{
+	const char *ptr;
+	size_t      len;
+
+	nih_assert (path != NULL);
+
+	ptr = strrchr (path, '/');
+	if (ptr)
+		path = ptr + 1;
+
+	len = strlen (path);
+
+	/* Matches .*; standard hidden pattern */
+	if ((len >= 1) && (path[0] == '.'))
 		return TRUE;
 
-	/* CVS; used by cvs */
-	if (! strcmp (path, "CVS"))
+	return FALSE;
+}
+
+/**
+ * nih_file_is_backup:
+ * @path: path to check.
+ *
+ * Determines whether @path represents a backup file, matching it against
+ * common patterns for that type of file.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_is_backup (const char *path)
+{
+	const char *ptr;
+	size_t      len;
+
+	nih_assert (path != NULL);
+
+	ptr = strrchr (path, '/');
+	if (ptr)
+		path = ptr + 1;
+
+	len = strlen (path);
+	ptr = path + len;
+
+	/* Matches *~; standard backup style */
+	if ((len >= 1) && (ptr[-1] == '~'))
 		return TRUE;
 
-	/* CVS.adm; used by cvs */
-	if (! strcmp (path, "CVS.adm"))
+	/* Matches *.bak; common backup extension */
+	if ((len >= 4) && (! strcmp (&ptr[-4], ".bak")))
+		return TRUE;
+
+	/* Matches *.BAK; as above, but on case-insensitive filesystems */
+	if ((len >= 4) && (! strcmp (&ptr[-4], ".BAK")))
+		return TRUE;
+
+	/* Matches #*#; used by emacs for unsaved files */
+	if ((len >= 2) && (path[0] == '#') && (ptr[-1] == '#'))
+		return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * nih_file_is_swap:
+ * @path: path to check.
+ *
+ * Determines whether @path represents an editor swap file, matching it
+ * against common patterns for that type of file.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_is_swap (const char *path)
+{
+	const char *ptr;
+	size_t      len;
+
+	nih_assert (path != NULL);
+
+	ptr = strrchr (path, '/');
+	if (ptr)
+		path = ptr + 1;
+
+	len = strlen (path);
+	ptr = path + len;
+
+	/* Matches *.swp; used by vi */
+	if ((len >= 4) && (! strcmp (&ptr[-4], ".swp")))
+		return TRUE;
+
+	/* Matches *.swo; used by vi */
+	if ((len >= 4) && (! strcmp (&ptr[-4], ".swo")))
+		return TRUE;
+
+	/* Matches *.swn; used by vi */
+	if ((len >= 4) && (! strcmp (&ptr[-4], ".swn")))
+		return TRUE;
+
+	/* Matches .#*; used by emacs */
+	if ((len >= 2) && (! strncmp (path, ".#", 2)))
 		return TRUE;
 
-	/* SCCS; used by sccs */
-	if (! strcmp (path, "SCCS"))
-		return TRUE;
+	return FALSE;
+}
+
+/**
+ * nih_file_is_rcs:
+ * @path: path to check.
+ *
+ * Determines whether @path represents a file or directory used by a
+ * common revision control system, matching it against common patterns
+ * for known RCSs.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_is_rcs (const char *path)
+{
+	const char *ptr;
+	size_t      len;
+
+	nih_assert (path != NULL);
+
+	ptr = strrchr (path, '/');
+	if (ptr)
+		path = ptr + 1;
+
+	len = strlen (path);
+	ptr = path + len;
+
+	/* Matches *,v; used by rcs and cvs */
+	if ((len >= 2) && (! strcmp (&ptr[-2], ",v")))
+		return TRUE;
+
+	/* RCS; used by rcs */
+	if (! strcmp (path, "RCS"))
+		return TRUE;
+
+	/* CVS; used by cvs */
+	if (! strcmp (path, "CVS"))
+		return TRUE;
+
+	/* CVS.adm; used by cvs */
+	if (! strcmp (path, "CVS.adm"))
+		return TRUE;
+
+	/* SCCS; used by sccs */
+	if (! strcmp (path, "SCCS"))
+		return TRUE;
+
+	/* .bzr; used by bzr */
+	if (! strcmp (path, ".bzr"))
+		return TRUE;
+
+	/* .bzr.log; used by bzr */
+	if (! strcmp (path, ".bzr.log"))
+		return TRUE;
+
+	/* .hg; used by hg */
+	if (! strcmp (path, ".hg"))
+		return TRUE;
+
+	/* .git; used by git */
+	if (! strcmp (path, ".git"))
+		return TRUE;
+
+	/* .svn; used by subversion */
+	if (! strcmp (path, ".svn"))
+		return TRUE;
+
+	/* BitKeeper; used by BitKeeper */
+	if (! strcmp (path, "BitKeeper"))
+		return TRUE;
+
+	/* .arch-ids; used by tla */
+	if (! strcmp (path, ".arch-ids"))
+		return TRUE;
+
+	/* .arch-inventory; used by tla */
+	if (! strcmp (path, ".arch-inventory"))
+		return TRUE;
+
+	/* {arch}; used by tla */
+	if (! strcmp (path, "{arch}"))
+		return TRUE;
+
+	/* _darcs; used by darcs */
+	if (! strcmp (path, "_darcs"))
+		return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * nih_file_is_packaging:
+ * @path: path to check.
+ *
+ * Determines whether @path represents a file or directory used by a
+ * common package manager, matching it against common patterns.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_is_packaging (const char *path)
+{
+	const char *ptr;
+
+	nih_assert (path != NULL);
+
+	ptr = strrchr (path, '/');
+	if (ptr)
+		path = ptr + 1;
+
+	/* Matches *.dpkg-*; used by dpkg */
+	ptr = strrchr (path, '.');
+	if (ptr && (! strncmp (ptr, ".dpkg-", 6)))
+		return TRUE;
+
+	/* Matches *.rpm{save,orig,new}; used by rpm */
+	if (ptr && (! strncmp (ptr, ".rpmsave", 9)))
+		return TRUE;
+	if (ptr && (! strncmp (ptr, ".rpmorig", 9)))
+		return TRUE;
+	if (ptr && (! strncmp (ptr, ".rpmnew", 8)))
+		return TRUE;
+
+	/* Matches *;[a-fA-F0-9]{8}; used by rpm */
+	ptr = strrchr (path, ';');
+	if (ptr && (strspn (ptr + 1, "abcdefABCDEF0123456789") == 8)
+	    && (! ptr[9]))
+		return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * nih_file_ignore:
+ * @data: data pointer,
+ * @path: path to check.
+ *
+ * Determines whether @path should normally be ignored when walking a
+ * directory tree.  Files ignored are those that are hidden, represent
+ * backup files, editor swap files and both files and directories used
+ * by revision control systems.
+ *
+ * This matches the same files as calling each of nih_file_is_hidden(),
+ * nih_file_is_backup(), nih_file_is_swap(), nih_file_is_rcs() and
+ * nih_file_is_packaging(), but with a single pass over @path.
+ *
+ * Returns: TRUE if it should be ignored, FALSE otherwise.
+ **/
+int
+nih_file_ignore (void       *data,
+		 const char *path)
+{
+	const char *name, *dot, *semi;
+	size_t      len;
+
+	nih_assert (path != NULL);
+
+	len = nih_file_split (path, &name, &dot, &semi);
+
+	return nih_file_ignore_name (name, len, dot, semi);
+}
+
+/**
+ * nih_file_split:
+ * @path: path to split,
+ * @name: pointer to store last component of @path,
+ * @dot: pointer to store last '.' in @name, or NULL,
+ * @semi: pointer to store last ';' in @name, or NULL.
+ *
+ * Finds the last component of @path, and the characters within it that
+ * the built-in patterns depend upon, with a single pass over @path.
+ *
+ * Returns: length of @name.
+ **/
+static size_t
+nih_file_split (const char  *path,
+		const char **name,
+		const char **dot,
+		const char **semi)
+{
+	const char *ptr;
+
+	nih_assert (path != NULL);
+	nih_assert (name != NULL);
+	nih_assert (dot != NULL);
+	nih_assert (semi != NULL);
+
+	*name = path;
+	*dot = *semi = NULL;
+
+	for (ptr = path; *ptr; ptr++) {
+		switch (*ptr) {
+		case '/':
+			*name = ptr + 1;
+			*dot = *semi = NULL;
+			break;
+		case '.':
+			*dot = ptr;
+			break;
+		case ';':
+			*semi = ptr;
+			break;
+		}
+	}
+
+	return ptr - *name;
+}
+
+/**
+ * nih_file_ignore_name:
+ * @name: name to check,
+ * @len: length of @name,
+ * @dot: last '.' in @name, or NULL,
+ * @semi: last ';' in @name, or NULL.
+ *
+ * Determines whether @name matches any of the patterns of the
+ * nih_file_is_*() functions, dispatching on its first and last characters
+ * and its extension rather than comparing it with each in turn.  Names of
+ * revision control directories beginning with '.' are already matched as
+ * hidden files.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+static int
+nih_file_ignore_name (const char *name,
+		      size_t      len,
+		      const char *dot,
+		      const char *semi)
+{
+	const char *end;
+
+	nih_assert (name != NULL);
+
+	if (! len)
+		return FALSE;
+
+	end = name + len;
+
+	/* Matches .*, and so .#* and the rcs directories beginning with
+	 * a dot; and matches #*# and the rcs directories by name.
+	 */
+	switch (name[0]) {
+	case '.':
+		return TRUE;
+	case '#':
+		if ((len >= 2) && (end[-1] == '#'))
+			return TRUE;
+		break;
+	case 'B':
+		if (! strcmp (name, "BitKeeper"))
+			return TRUE;
+		break;
+	case 'C':
+		if ((! strcmp (name, "CVS")) || (! strcmp (name, "CVS.adm")))
+			return TRUE;
+		break;
+	case 'R':
+		if (! strcmp (name, "RCS"))
+			return TRUE;
+		break;
+	case 'S':
+		if (! strcmp (name, "SCCS"))
+			return TRUE;
+		break;
+	case '_':
+		if (! strcmp (name, "_darcs"))
+			return TRUE;
+		break;
+	case '{':
+		if (! strcmp (name, "{arch}"))
+			return TRUE;
+		break;
+	}
+
+	/* Matches *~ and *,v */
+	switch (end[-1]) {
+	case '~':
+		return TRUE;
+	case 'v':
+		if ((len >= 2) && (end[-2] == ','))
+			return TRUE;
+		break;
+	}
+
+	/* Matches the backup, swap and packaging extensions */
+	if (dot) {
+		const char *ext = dot + 1;
+
+		switch (ext[0]) {
+		case 'b':
+			if (! strcmp (ext, "bak"))
+				return TRUE;
+			break;
+		case 'B':
+			if (! strcmp (ext, "BAK"))
+				return TRUE;
+			break;
+		case 's':
+			if ((end - ext == 3) && (ext[1] == 'w')
+			    && ((ext[2] == 'p') || (ext[2] == 'o')
+				|| (ext[2] == 'n')))
+				return TRUE;
+			break;
+		case 'd':
+			if (! strncmp (ext, "dpkg-", 5))
+				return TRUE;
+			break;
+		case 'r':
+			if ((! strcmp (ext, "rpmsave"))
+			    || (! strcmp (ext, "rpmorig"))
+			    || (! strcmp (ext, "rpmnew")))
+				return TRUE;
+			break;
+		}
+	}
+
+	/* Matches *;[a-fA-F0-9]{8} */
+	if (semi && (end - semi == 9)
+	    && (strspn (semi + 1, "abcdefABCDEF0123456789") == 8))
+		return TRUE;
+
+	return FALSE;
+}
+
+
+/**
+ * nih_file_matcher_new:
+ * @parent: parent object for new matcher,
+ * @builtin: whether to match the files nih_file_ignore() does.
+ *
+ * Allocates and returns a new file matcher, to which patterns are added
+ * with nih_file_matcher_add(); it is then passed as the data pointer of
+ * nih_file_matcher_match(), which may be given as the filter of a
+ * directory walk or a watch.  If @builtin is TRUE the matcher also
+ * matches everything nih_file_ignore() does.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned matcher.  When all parents
+ * of the returned matcher are freed, the returned matcher will also be
+ * freed.
+ *
+ * Returns: new file matcher or NULL on insufficient memory.
+ **/
+NihFileMatcher *
+nih_file_matcher_new (const void *parent,
+		      int         builtin)
+{
+	NihFileMatcher *matcher;
+
+	matcher = nih_new (parent, NihFileMatcher);
+	if (! matcher)
+		return NULL;
+
+	matcher->builtin = builtin;
+
+	matcher->names = nih_hash_string_new (matcher, 0);
+	if (! matcher->names) {
+		nih_free (matcher);
+		return NULL;
+	}
+
+	matcher->prefixes = NULL;
+	matcher->suffixes = NULL;
+
+	nih_list_init (&matcher->globs);
+
+	return matcher;
+}
+
+/**
+ * nih_file_matcher_add:
+ * @matcher: matcher to add to,
+ * @pattern: glob pattern to add.
+ *
+ * Adds @pattern to the patterns matched by @matcher.  Patterns are in the
+ * format of fnmatch(), and are matched against the last component of each
+ * path; a pattern that is a literal name, or a literal with a single *
+ * before or after it, is compiled into @matcher so that it costs nothing
+ * more to check for than any other of its kind.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+int
+nih_file_matcher_add (NihFileMatcher *matcher,
+		      const char     *pattern)
+{
+	const char   *special;
+	size_t        len;
+	NihListEntry *entry;
+
+	nih_assert (matcher != NULL);
+	nih_assert (pattern != NULL);
+
+	len = strlen (pattern);
+
+	special = strpbrk (pattern, "*?[\\");
+	if (! special) {
+		if (nih_hash_lookup (matcher->names, pattern))
+			return 0;
+
+		entry = nih_list_entry_new (matcher);
+		if (! entry)
+			return -1;
+
+		entry->str = nih_strdup (entry, pattern);
+		if (! entry->str) {
+			nih_free (entry);
+			return -1;
+		}
+
+		nih_hash_add (matcher->names, &entry->entry);
+		return 0;
+	}
+
+	/* Literal followed by a star is a prefix */
+	if ((special == pattern + len - 1) && (*special == '*'))
+		return nih_file_matcher_insert (matcher, &matcher->prefixes,
+						pattern, len - 1, FALSE);
+
+	/* Star followed by a literal is a suffix */
+	if ((special == pattern) && (*special == '*')
+	    && (! strpbrk (pattern + 1, "*?[\\")))
+		return nih_file_matcher_insert (matcher, &matcher->suffixes,
+						pattern + 1, len - 1, TRUE);
+
+	entry = nih_list_entry_new (matcher);
+	if (! entry)
+		return -1;
+
+	entry->str = nih_strdup (entry, pattern);
+	if (! entry->str) {
+		nih_free (entry);
+		return -1;
+	}
+
+	nih_list_add (&matcher->globs, &entry->entry);
+	return 0;
+}
+
+/**
+ * nih_file_matcher_insert:
+ * @matcher: matcher being added to,
+ * @root: root of trie,
+ * @str: literal to insert,
+ * @len: length of @str,
+ * @reverse: insert @str from its end.
+ *
+ * Inserts the @len characters of @str into the trie rooted at @root,
+ * creating nodes as necessary and marking the last as the end of a
+ * pattern.  The root itself matches the empty string.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+static int
+nih_file_matcher_insert (NihFileMatcher      *matcher,
+			 NihFileMatcherNode **root,
+			 const char          *str,
+			 size_t               len,
+			 int                  reverse)
+{
+	NihFileMatcherNode *node;
+	size_t              i;
+
+	nih_assert (matcher != NULL);
+	nih_assert (root != NULL);
+	nih_assert (str != NULL);
+
+	if (! *root) {
+		*root = nih_new (matcher, NihFileMatcherNode);
+		if (! *root)
+			return -1;
+
+		(*root)->children = NULL;
+		(*root)->next = NULL;
+		(*root)->c = '\0';
+		(*root)->terminal = FALSE;
+	}
+
+	node = *root;
+	for (i = 0; i < len; i++) {
+		NihFileMatcherNode *child;
+		char                c;
+
+		c = reverse ? str[len - i - 1] : str[i];
+
+		for (child = node->children; child; child = child->next)
+			if (child->c == c)
+				break;
+
+		if (! child) {
+			child = nih_new (node, NihFileMatcherNode);
+			if (! child)
+				return -1;
+
+			child->children = NULL;
+			child->next = node->children;
+			child->c = c;
+			child->terminal = FALSE;
+
+			node->children = child;
+		}
+
+		node = child;
+	}
+
+	node->terminal = TRUE;
+	return 0;
+}
+
+/**
+ * nih_file_matcher_match:
+ * @data: NihFileMatcher to match with,
+ * @path: path to check,
+ * @is_dir: TRUE if @path is a directory.
+ *
+ * Determines whether the last component of @path matches any of the
+ * patterns of the matcher given as @data, and so may be used as an
+ * NihFileFilter.  The built-in patterns, names, prefixes and suffixes
+ * are all checked without comparing @path with each pattern in turn.
+ *
+ * Returns: TRUE if it matches, FALSE otherwise.
+ **/
+int
+nih_file_matcher_match (void       *data,
+			const char *path,
+			int         is_dir)
+{
+	NihFileMatcher     *matcher = data;
+	NihFileMatcherNode *node;
+	const char         *name, *dot, *semi, *ptr;
+	size_t              len;
+
+	nih_assert (matcher != NULL);
+	nih_assert (path != NULL);
+
+	len = nih_file_split (path, &name, &dot, &semi);
+
+	if (matcher->builtin && nih_file_ignore_name (name, len, dot, semi))
+		return TRUE;
+
+	if (nih_hash_lookup (matcher->names, name))
+		return TRUE;
+
+	node = matcher->prefixes;
+	for (ptr = name; node; ptr++) {
+		if (node->terminal)
+			return TRUE;
+		if (ptr == name + len)
+			break;
+
+		for (node = node->children; node; node = node->next)
+			if (node->c == *ptr)
+				break;
+	}
+
+	node = matcher->suffixes;
+	for (ptr = name + len; node; ptr--) {
+		if (node->terminal)
+			return TRUE;
+		if (ptr == name)
+			break;
+
+		for (node = node->children; node; node = node->next)
+			if (node->c == ptr[-1])
+				break;
+	}
+
+	NIH_LIST_FOREACH (&matcher->globs, iter) {
+		NihListEntry *entry = (NihListEntry *)iter;
+
+		if (! fnmatch (entry->str, name, 0))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * nih_dir_walk:
+ * @path: path to walk,
+ * @filter: path filter,
+ * @visitor: function to call for each path,
+ * @error: function to call on error,
+ * @data: data to pass to @visitor.
+ *
+ * Iterates the directory tree starting at @path, calling @visitor for
+ * each file, directory or other object found.  Sub-directories are
+ * descended into, and the same @visitor called for those.
+ *
+ * @visitor is not called for @path itself.
+ *
+ * @filter can be used to restrict both the sub-directories iterated and
+ * the objects that @visitor is called for.  It is passed the full path
+ * of the object, and if it returns TRUE, the object is ignored.
+ *
+ * If @visitor returns a negative value, or there's an error obtaining
+ * the listing for a particular sub-directory, then the @error function
+ * will be called.  This function should handle the error and return zero,
+ * or raise an error again and return a negative value which causes the
+ * entire walk to be aborted.  If @error is NULL, then a warning is emitted
+ * instead.
+ *
+ * This is a wrapper around nih_dir_walk_at(), which should be used
+ * instead by visitors that do not need the stat of every object.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_dir_walk (const char          *path,
+	      NihFileFilter        filter,
+	      NihFileVisitor       visitor,
+	      NihFileErrorHandler  error,
+	      void                *data)
+{
+	NihDirWalkPath     walk_path;
+	NihDirErrorHandler path_error = NULL;
+
+	nih_assert (path != NULL);
+	nih_assert (visitor != NULL);
+
+	walk_path.dirname = path;
+	walk_path.visitor = visitor;
+	walk_path.error = error;
+	walk_path.data = data;
+
+	if (error)
+		path_error = (NihDirErrorHandler)nih_dir_walk_path_error;
+
+	return nih_dir_walk_at (AT_FDCWD, path, NIH_DIR_WALK_STAT, filter,
+				(NihDirVisitor)nih_dir_walk_path_visitor,
+				path_error, &walk_path);
+}
+
+/**
+ * nih_dir_walk_path_visitor:
+ * @walk_path: state of nih_dir_walk(),
+ * @dirfd: descriptor of directory containing object,
+ * @name: name of object within @dirfd,
+ * @path: path to object,
+ * @is_dir: TRUE if the object is a directory,
+ * @statbuf: stat of object.
+ *
+ * Calls the path-based visitor given to nih_dir_walk().
+ *
+ * Returns: value returned by visitor.
+ **/
+static int
+nih_dir_walk_path_visitor (NihDirWalkPath *walk_path,
+			   int             dirfd,
+			   const char     *name,
+			   const char     *path,
+			   int             is_dir,
+			   struct stat    *statbuf)
+{
+	nih_assert (walk_path != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	return walk_path->visitor (walk_path->data, walk_path->dirname,
+				   path, statbuf);
+}
+
+/**
+ * nih_dir_walk_path_error:
+ * @walk_path: state of nih_dir_walk(),
+ * @dirfd: descriptor of directory containing object,
+ * @name: name of object within @dirfd,
+ * @path: path to object,
+ * @statbuf: stat of object, or NULL.
+ *
+ * Calls the path-based error handler given to nih_dir_walk(), which
+ * is always given a stat buffer even if it could not be filled.
+ *
+ * Returns: value returned by error handler.
+ **/
+static int
+nih_dir_walk_path_error (NihDirWalkPath *walk_path,
+			 int             dirfd,
+			 const char     *name,
+			 const char     *path,
+			 struct stat    *statbuf)
+{
+	struct stat invalid;
+
+	nih_assert (walk_path != NULL);
+	nih_assert (path != NULL);
+
+	if (! statbuf) {
+		memset (&invalid, 0, sizeof (invalid));
+		statbuf = &invalid;
+	}
+
+	return walk_path->error (walk_path->data, walk_path->dirname,
+				 path, statbuf);
+}
+
+
+/**
+ * nih_dir_walk_at:
+ * @dirfd: directory descriptor, or AT_FDCWD,
+ * @path: path to walk relative to @dirfd,
+ * @flags: flags changing behaviour,
+ * @filter: path filter,
+ * @visitor: function to call for each object,
+ * @error: function to call on error,
+ * @data: data to pass to @filter, @visitor and @error.
+ *
+ * Iterates the directory tree starting at @path, calling @visitor for
+ * each file, directory or other object found.  Sub-directories,
+ * including those reached through symbolic links, are descended into
+ * and the same @visitor called for those in the order of their names.
+ *
+ * @visitor is not called for @path itself.
+ *
+ * Each directory is opened relative to the descriptor of its parent,
+ * and @visitor is passed the descriptor of the directory and the name
+ * of the object within it, so that neither we nor @visitor need resolve
+ * the full path of each object; a descriptor for each directory between
+ * @path and the one being visited is held open meanwhile.  The type of
+ * an object is obtained from the directory listing where the filesystem
+ * provides it, so that objects are only stat()ed when NIH_DIR_WALK_STAT
+ * is given in @flags.
+ *
+ * @filter can be used to restrict both the sub-directories iterated and
+ * the objects that @visitor is called for.  It is passed the full path
+ * of the object, and if it returns TRUE, the object is ignored.
+ *
+ * If @visitor returns a negative value, or there's an error obtaining
+ * the listing for a particular sub-directory, then the @error function
+ * will be called.  This function should handle the error and return zero,
+ * or raise an error again and return a negative value which causes the
+ * entire walk to be aborted.  If @error is NULL, then a warning is emitted
+ * instead.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_dir_walk_at (int                 dirfd,
+		 const char         *path,
+		 NihDirWalkFlags     flags,
+		 NihFileFilter       filter,
+		 NihDirVisitor       visitor,
+		 NihDirErrorHandler  error,
+		 void               *data)
+{
+	NihDirWalk  walk;
+	DIR        *dir;
+	struct stat statbuf;
+	size_t      len;
+	int         ret;
+
+	nih_assert (path != NULL);
+	nih_assert (visitor != NULL);
+
+	dir = nih_dir_walk_open (dirfd, path, &statbuf);
+	if (! dir)
+		return -1;
+
+	walk.flags = flags;
+	walk.filter = filter;
+	walk.visitor = visitor;
+	walk.error = error;
+	walk.data = data;
+
+	len = strlen (path);
+	walk.path_size = len + 1;
+	walk.path = NIH_MUST (nih_alloc (NULL, walk.path_size));
+	memcpy (walk.path, path, walk.path_size);
+
+	walk.dirs.entries = NULL;
+	walk.dirs.size = 0;
+	walk.dirs.used = 0;
+	nih_dir_set_add (&walk.dirs, &statbuf);
+
+	walk.pool = NULL;
+
+	ret = nih_dir_walk_dir (&walk, dir, len);
+
+	nih_free (walk.dirs.entries);
+	nih_free (walk.path);
+
+	return ret;
+}
+
+/**
+ * nih_dir_walk_open:
+ * @dirfd: directory descriptor,
+ * @name: name of directory within @dirfd,
+ * @statbuf: pointer to store stat of directory in.
+ *
+ * Opens the directory @name relative to @dirfd for reading, following
+ * symbolic links, and stores its stat in @statbuf.
+ *
+ * Returns: open directory or NULL on raised error.
+ **/
+static DIR *
+nih_dir_walk_open (int          dirfd,
+		   const char  *name,
+		   struct stat *statbuf)
+{
+	DIR *dir;
+	int  fd;
+
+	nih_assert (name != NULL);
+	nih_assert (statbuf != NULL);
+
+	fd = openat (dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (NULL);
+
+	if (fstat (fd, statbuf) < 0)
+		goto error;
+
+	dir = fdopendir (fd);
+	if (! dir)
+		goto error;
+
+	return dir;
+
+error:
+	nih_error_raise_system ();
+	close (fd);
+	return NULL;
+}
+
+/**
+ * nih_dir_walk_mode:
+ * @dirfd: directory descriptor,
+ * @name: name of object within @dirfd,
+ * @follow: TRUE to follow symbolic links,
+ * @mode: pointer to store mode in.
+ *
+ * Obtains the type of the object @name relative to @dirfd, for objects
+ * whose type was not given by readdir().  Where we can, we ask the kernel
+ * for the type alone, without synchronising with a network filesystem.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+nih_dir_walk_mode (int         dirfd,
+		   const char *name,
+		   int         follow,
+		   mode_t     *mode)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	nih_assert (name != NULL);
+	nih_assert (mode != NULL);
+
+	if (statx (dirfd, name,
+		   (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_STATX_DONT_SYNC,
+		   STATX_TYPE, &stx) < 0)
+		return -1;
+
+	*mode = stx.stx_mode;
+#else /* STATX_TYPE */
+	struct stat statbuf;
+
+	nih_assert (name != NULL);
+	nih_assert (mode != NULL);
+
+	if (fstatat (dirfd, name, &statbuf,
+		     follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+
+	*mode = statbuf.st_mode;
+#endif /* STATX_TYPE */
+
+	return 0;
+}
+
+/**
+ * nih_dir_walk_path_set:
+ * @walk: state of walk,
+ * @len: length of path of directory,
+ * @name: name of object within directory.
+ *
+ * Appends @name to the path of its directory, the first @len characters
+ * of the path buffer of @walk, growing the buffer if necessary.
+ **/
+static void
+nih_dir_walk_path_set (NihDirWalk *walk,
+		       size_t      len,
+		       const char *name)
+{
+	size_t name_len;
+
+	nih_assert (walk != NULL);
+	nih_assert (name != NULL);
+
+	name_len = strlen (name);
+
+	if (walk->path_size < len + name_len + 2) {
+		size_t size;
+
+		size = nih_max (walk->path_size * 2, len + name_len + 2);
+		walk->path = NIH_MUST (nih_realloc (walk->path, NULL, size));
+		walk->path_size = size;
+	}
+
+	walk->path[len] = '/';
+	memcpy (walk->path + len + 1, name, name_len + 1);
+}
+
+/**
+ * nih_dir_walk_sort:
+ * @a: pointer to first entry,
+ * @b: pointer to second entry.
+ *
+ * This function wraps the strcoll() function allowing it to be called
+ * from qsort() to sort entries by name.
+ *
+ * Returns: zero if names are equal, otherwise integer less than zero
+ * if @a is less than @b or integer greater than zero if @a is greater
+ * than @b.
+ **/
+static int
+nih_dir_walk_sort (const void *a,
+		   const void *b)
+{
+	const NihDirWalkEnt *ent_a;
+	const NihDirWalkEnt *ent_b;
+
+	nih_assert (a != NULL);
+	nih_assert (b != NULL);
+
+	ent_a = a;
+	ent_b = b;
+
+	return strcoll (ent_a->name, ent_b->name);
+}
+
+/**
+ * nih_dir_walk_dir:
+ * @walk: state of walk,
+ * @dir: open directory,
+ * @len: length of path of @dir.
+ *
+ * Reads the list of objects in @dir, removing ".", ".." and any for which
+ * the filter returns TRUE, and visits each in turn.  The names are held in
+ * a single buffer rather than allocated one by one.  @dir is closed before
+ * returning.
+ *
+ * Returns: zero on success, negative value if the walk was aborted.
+ **/
+static int
+nih_dir_walk_dir (NihDirWalk *walk,
+		  DIR        *dir,
+		  size_t      len)
+{
+	struct dirent  *dent;
+	NihDirWalkEnt  *ents = NULL;
+	size_t          nents = 0, ents_size = 0;
+	char           *names = NULL;
+	size_t          names_len = 0, names_size = 0;
+	size_t          i;
+	int             ret = 0;
+
+	nih_assert (walk != NULL);
+	nih_assert (dir != NULL);
+
+	while ((dent = readdir (dir)) != NULL) {
+		unsigned char type = dent->d_type;
+		size_t        name_len;
+
+		/* Always ignore '.' and '..' */
+		if ((! strcmp (dent->d_name, "."))
+		    || (! strcmp (dent->d_name, "..")))
+			continue;
+
+		if (type == DT_UNKNOWN) {
+			mode_t mode;
+
+			if ((nih_dir_walk_mode (dirfd (dir), dent->d_name,
+						FALSE, &mode) == 0)
+			    && S_ISDIR (mode))
+				type = DT_DIR;
+		}
+
+		if (walk->filter) {
+			nih_dir_walk_path_set (walk, len, dent->d_name);
+			if (walk->filter (walk->data, walk->path,
+					  type == DT_DIR))
+				continue;
+		}
+
+		name_len = strlen (dent->d_name) + 1;
+		if (names_len + name_len > names_size) {
+			names_size = nih_max (names_size * 2,
+					      names_len + name_len);
+			names = NIH_MUST (nih_realloc (names, NULL,
+						       names_size));
+		}
+
+		if (nents == ents_size) {
+			ents_size = nih_max (ents_size * 2, 16U);
+			ents = NIH_MUST (nih_realloc (
+				ents, NULL,
+				sizeof (NihDirWalkEnt) * ents_size));
+		}
+
+		memcpy (names + names_len, dent->d_name, name_len);
+
+		ents[nents].offset = names_len;
+		ents[nents].type = type;
+		nents++;
+
+		names_len += name_len;
+	}
+
+	if (nents) {
+		for (i = 0; i < nents; i++)
+			ents[i].name = names + ents[i].offset;
+
+		qsort (ents, nents, sizeof (NihDirWalkEnt),
+		       nih_dir_walk_sort);
+	}
+
+	/* Iterate the objects found.  If these calls return a negative
+	 * value, it means that an error handler decided to abort the
+	 * walk; so just abort right now.
+	 */
+	for (i = 0; i < nents; i++) {
+		ret = nih_dir_walk_visit (walk, dirfd (dir), &ents[i], len);
+		if (ret < 0)
+			break;
+	}
+
+	if (ents)
+		nih_free (ents);
+	if (names)
+		nih_free (names);
+
+	closedir (dir);
+
+	return ret;
+}
+
+/**
+ * nih_dir_walk_visit:
+ * @walk: state of walk,
+ * @dirfd: descriptor of directory containing object,
+ * @ent: object being visited,
+ * @len: length of path of directory.
+ *
+ * Visits an individual object @ent found while iterating the directory
+ * tree.  Ensures that the visitor is called for @ent, and if @ent is a
+ * directory, it is descended into and the same visitor called for each
+ * of those.
+ *
+ * If the visitor returns a negative value, or there's an error obtaining
+ * the listing for a particular sub-directory, then the error function
+ * will be called.  This function should handle the error and return zero,
+ * or raise an error again and return a negative value which causes the
+ * entire walk to be aborted.  If there is no error function, then a
+ * warning is emitted instead.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_dir_walk_visit (NihDirWalk    *walk,
+		    int            dirfd,
+		    NihDirWalkEnt *ent,
+		    size_t         len)
+{
+	struct stat  statbuf;
+	struct stat *statp = NULL;
+	int          is_dir;
+
+	nih_assert (walk != NULL);
+	nih_assert (ent != NULL);
+
+	nih_dir_walk_path_set (walk, len, ent->name);
+
+	/* Only stat the object when asked to, or when following a
+	 * symbolic link to find whether it's a directory; not much we can
+	 * do here if that fails.
+	 */
+	if (walk->flags & NIH_DIR_WALK_STAT) {
+		if (fstatat (dirfd, ent->name, &statbuf, 0) < 0) {
+			nih_error_raise_system ();
+			goto error;
+		}
+
+		statp = &statbuf;
+		is_dir = S_ISDIR (statbuf.st_mode);
+	} else if ((ent->type == DT_LNK) || (ent->type == DT_UNKNOWN)) {
+		mode_t mode;
+
+		if (nih_dir_walk_mode (dirfd, ent->name, TRUE, &mode) < 0) {
+			nih_error_raise_system ();
+			goto error;
+		}
+
+		is_dir = S_ISDIR (mode);
+	} else {
+		is_dir = (ent->type == DT_DIR);
+	}
+
+	/* Call the handler */
+	if (walk->visitor (walk->data, dirfd, ent->name, walk->path,
+			   is_dir, statp) < 0)
+		goto error;
+
+	/* Iterate into sub-directories; first checking for directory loops.
+	 */
+	if (is_dir && (! (walk->flags & NIH_DIR_WALK_NOSUBDIRS))) {
+		struct stat dirstat;
+		DIR *       dir;
+		int         ret;
+
+		dir = nih_dir_walk_open (dirfd, ent->name, &dirstat);
+		if (! dir)
+			goto error;
+
+		/* Record the device and inode numbers in the set of
+		 * directories we're in so that we can detect directory
+		 * loops.
+		 */
+		if (! nih_dir_set_add (&walk->dirs, &dirstat)) {
+			closedir (dir);
+			nih_error_raise (NIH_DIR_LOOP_DETECTED,
+					 _(NIH_DIR_LOOP_DETECTED_STR));
+			goto error;
+		}
+
+		ret = nih_dir_walk_dir (walk, dir,
+					len + strlen (ent->name) + 1);
+
+		nih_dir_set_remove (&walk->dirs, &dirstat);
+
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+
+error:
+	return nih_dir_walk_error (walk, dirfd, ent->name, statp);
+}
+
+/**
+ * nih_dir_walk_error:
+ * @walk: state of walk,
+ * @dirfd: descriptor of directory containing object,
+ * @name: name of object within @dirfd,
+ * @statbuf: stat of object, or NULL.
+ *
+ * Handles the error raised while visiting the object @name, whose path is
+ * in the path buffer of @walk, by calling the error function or emitting
+ * a warning if there is none.
+ *
+ * Returns: zero to continue the walk, negative value on raised error.
+ **/
+static int
+nih_dir_walk_error (NihDirWalk  *walk,
+		    int          dirfd,
+		    const char  *name,
+		    struct stat *statbuf)
+{
+	nih_assert (walk != NULL);
+	nih_assert (name != NULL);
+
+	if (walk->error) {
+		return walk->error (walk->data, dirfd, name, walk->path,
+				    statbuf);
+	} else {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", walk->path, err->message);
+		nih_free (err);
+
+		return 0;
+	}
+}
+
+
+/**
+ * nih_dir_set_hash:
+ * @set: set of directories,
+ * @statbuf: stat of directory.
+ *
+ * Returns: index of first slot of @set to probe for @statbuf.
+ **/
+static size_t
+nih_dir_set_hash (NihDirSet         *set,
+		  const struct stat *statbuf)
+{
+	uint64_t hash;
+
+	hash = ((uint64_t)statbuf->st_dev * 0x9e3779b97f4a7c15ULL)
+		^ (uint64_t)statbuf->st_ino;
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 32;
+
+	return hash & (set->size - 1);
+}
+
+/**
+ * nih_dir_set_add:
+ * @set: set of directories,
+ * @statbuf: stat of directory.
+ *
+ * Adds the directory with the device and inode numbers in @statbuf to
+ * @set, unless it is already there.  The table of @set is doubled in size
+ * whenever it becomes half full.
+ *
+ * Returns: TRUE if added, FALSE if already in @set.
+ **/
+static int
+nih_dir_set_add (NihDirSet         *set,
+		 const struct stat *statbuf)
+{
+	NihDirSetEntry *slot, *removed = NULL;
+	size_t          i;
+
+	nih_assert (set != NULL);
+	nih_assert (statbuf != NULL);
+
+	if ((set->used + 1) * 2 > set->size) {
+		NihDirSetEntry *entries = set->entries;
+		size_t          size = set->size;
+
+		set->size = nih_max (size * 2, 16U);
+		set->entries = NIH_MUST (nih_alloc (
+			NULL, sizeof (NihDirSetEntry) * set->size));
+		memset (set->entries, 0, sizeof (NihDirSetEntry) * set->size);
+		set->used = 0;
+
+		/* Moving the entries in use leaves behind those removed */
+		for (i = 0; i < size; i++) {
+			struct stat moved;
+
+			if (entries[i].state != NIH_DIR_SET_USED)
+				continue;
+
+			moved.st_dev = entries[i].dev;
+			moved.st_ino = entries[i].ino;
+			nih_dir_set_add (set, &moved);
+		}
+
+		if (entries)
+			nih_free (entries);
+	}
+
+	for (i = nih_dir_set_hash (set, statbuf); ;
+	     i = (i + 1) & (set->size - 1)) {
+		slot = &set->entries[i];
+
+		if (slot->state == NIH_DIR_SET_FREE)
+			break;
+
+		if ((slot->state == NIH_DIR_SET_REMOVED) && (! removed))
+			removed = slot;
+
+		if ((slot->state == NIH_DIR_SET_USED)
+		    && (slot->dev == statbuf->st_dev)
+		    && (slot->ino == statbuf->st_ino))
+			return FALSE;
+	}
+
+	if (removed) {
+		slot = removed;
+	} else {
+		set->used++;
+	}
+
+	slot->dev = statbuf->st_dev;
+	slot->ino = statbuf->st_ino;
+	slot->state = NIH_DIR_SET_USED;
+
+	return TRUE;
+}
+
+/**
+ * nih_dir_set_remove:
+ * @set: set of directories,
+ * @statbuf: stat of directory.
+ *
+ * Removes the directory with the device and inode numbers in @statbuf
+ * from @set; its slot is marked as removed rather than freed so that
+ * other directories probed past it can still be found.
+ **/
+static void
+nih_dir_set_remove (NihDirSet         *set,
+		    const struct stat *statbuf)
+{
+	NihDirSetEntry *slot;
+	size_t          i;
+
+	nih_assert (set != NULL);
+	nih_assert (statbuf != NULL);
+
+	if (! set->size)
+		return;
+
+	for (i = nih_dir_set_hash (set, statbuf); ;
+	     i = (i + 1) & (set->size - 1)) {
+		slot = &set->entries[i];
+
+		if (slot->state == NIH_DIR_SET_FREE)
+			return;
+
+		if ((slot->state == NIH_DIR_SET_USED)
+		    && (slot->dev == statbuf->st_dev)
+		    && (slot->ino == statbuf->st_ino)) {
+			slot->state = NIH_DIR_SET_REMOVED;
+			return;
+		}
+	}
+}
+
+
+/**
+ * nih_dir_walk_parallel:
+ * @dirfd: directory descriptor, or AT_FDCWD,
+ * @path: path to walk relative to @dirfd,
+ * @flags: flags changing behaviour,
+ * @nthreads: number of worker threads,
+ * @filter: path filter,
+ * @visitor: function to call for each object,
+ * @error: function to call on error,
+ * @data: data to pass to @filter, @visitor and @error.
+ *
+ * Iterates the directory tree starting at @path in the same way, and
+ * calling @visitor and @error in the same order and with the same
+ * arguments, as nih_dir_walk_at(); but with up to @nthreads worker
+ * threads reading the sub-directories of the tree, and stat()ing the
+ * objects within them, ahead of them being visited.  This is worthwhile
+ * for large trees on filesystems where each of those has a noticeable
+ * latency, such as those on network or rotating storage.
+ *
+ * @filter is called with the same arguments, and as with
+ * nih_dir_walk_at() for every object in a directory before any of them
+ * is visited; but in sorted order rather than in the order readdir()
+ * returns them.
+ *
+ * @filter, @visitor and @error are only ever called from the calling
+ * thread, so need not be thread-safe; however a sub-directory may well
+ * have been read before @visitor is called for it, so changes made to a
+ * directory by its visitor may not be seen by the walk.  At most twice
+ * @nthreads directories are read ahead at any time.
+ *
+ * The worker threads are started by this function and stopped before it
+ * returns; if @nthreads is zero, none could be started or there are no
+ * sub-directories to read because NIH_DIR_WALK_NOSUBDIRS is given in
+ * @flags, the walk is made by the calling thread alone.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_dir_walk_parallel (int                 dirfd,
+		       const char         *path,
+		       NihDirWalkFlags     flags,
+		       size_t              nthreads,
+		       NihFileFilter       filter,
+		       NihDirVisitor       visitor,
+		       NihDirErrorHandler  error,
+		       void               *data)
+{
+	NihDirWalkPool  pool;
+	NihDirWalk      walk;
+	NihDirScan     *scan;
+	size_t          len;
+	int             ret;
+
+	nih_assert (path != NULL);
+	nih_assert (visitor != NULL);
+
+	if ((! nthreads) || (flags & NIH_DIR_WALK_NOSUBDIRS))
+		return nih_dir_walk_at (dirfd, path, flags, filter,
+					visitor, error, data);
+
+	nih_dir_pool_start (&pool, flags, nthreads);
+
+	/* Read the top-level directory ourselves, since there's nothing
+	 * else we can do meanwhile.
+	 */
+	scan = NIH_MUST (nih_dir_scan_new (&pool, dirfd, path));
+	nih_dir_scan_wait (scan);
+	if (scan->error) {
+		errno = scan->error;
+		nih_error_raise_system ();
+		nih_free (scan);
+		nih_dir_pool_stop (&pool);
+		return -1;
+	}
+
+	walk.flags = flags;
+	walk.filter = filter;
+	walk.visitor = visitor;
+	walk.error = error;
+	walk.data = data;
+
+	len = strlen (path);
+	walk.path_size = len + 1;
+	walk.path = NIH_MUST (nih_alloc (NULL, walk.path_size));
+	memcpy (walk.path, path, walk.path_size);
+
+	walk.dirs.entries = NULL;
+	walk.dirs.size = 0;
+	walk.dirs.used = 0;
+	nih_dir_set_add (&walk.dirs, &scan->statbuf);
+
+	walk.pool = &pool;
+
+	ret = nih_dir_scan_walk (&walk, scan, len);
+
+	nih_free (scan);
+	nih_dir_pool_stop (&pool);
+
+	nih_free (walk.dirs.entries);
+	nih_free (walk.path);
+
+	return ret;
+}
+
+/**
+ * nih_dir_scan_walk:
+ * @walk: state of walk,
+ * @scan: directory read by a worker,
+ * @len: length of path of directory.
+ *
+ * Filters the objects found in the directory read by @scan and visits
+ * each in turn, descending into sub-directories, in the same way as
+ * nih_dir_walk_dir() and nih_dir_walk_visit(); except that the objects
+ * have already been examined, and the sub-directories ahead of the one
+ * being visited are passed to the workers to be read meanwhile.
+ *
+ * Returns: zero on success, negative value if the walk was aborted.
+ **/
+static int
+nih_dir_scan_walk (NihDirWalk *walk,
+		   NihDirScan *scan,
+		   size_t      len)
+{
+	NihDirScan **children;
+	size_t       next = 0;
+	size_t       i;
+	int          ret = 0;
+
+	nih_assert (walk != NULL);
+	nih_assert (walk->pool != NULL);
+	nih_assert (scan != NULL);
+	nih_assert (scan->state == NIH_DIR_SCAN_DONE);
+
+	/* Call the filter for every object before reading ahead, so that
+	 * we don't read directories that will be ignored.
+	 */
+	if (walk->filter) {
+		for (i = 0; i < scan->nents; i++) {
+			NihDirScanEnt *ent = &scan->ents[i];
+
+			nih_dir_walk_path_set (walk, len, ent->ent.name);
+			ent->skip = walk->filter (walk->data, walk->path,
+						  ent->ent.type == DT_DIR);
+		}
+	}
+
+	children = NIH_MUST (nih_alloc (NULL, (sizeof (NihDirScan *)
+					       * nih_max (scan->nents, 1U))));
+	memset (children, 0, sizeof (NihDirScan *) * nih_max (scan->nents, 1U));
+
+	for (i = 0; i < scan->nents; i++) {
+		NihDirScanEnt *ent = &scan->ents[i];
+		struct stat   *statp = NULL;
+		NihDirScan    *child;
+
+		if (ent->skip)
+			continue;
+
+		if (next < i)
+			next = i;
+		nih_dir_scan_prefetch (walk, scan, children, &next);
+
+		nih_dir_walk_path_set (walk, len, ent->ent.name);
+
+		if (ent->error) {
+			errno = ent->error;
+			nih_error_raise_system ();
+			goto error;
+		}
+
+		if (walk->flags & NIH_DIR_WALK_STAT)
+			statp = &scan->stats[i];
+
+		/* Call the handler */
+		if (walk->visitor (walk->data, dirfd (scan->dir),
+				   ent->ent.name, walk->path,
+				   ent->is_dir, statp) < 0)
+			goto error;
+
+		if (! ent->is_dir)
+			continue;
+
+		/* Iterate into sub-directories, reading them now if the
+		 * workers haven't got to them; first checking for directory
+		 * loops.
+		 */
+		child = children[i];
+		if (! child)
+			child = children[i] = NIH_MUST (nih_dir_scan_new (
+				walk->pool, dirfd (scan->dir),
+				ent->ent.name));
+
+		nih_dir_scan_wait (child);
+		if (child->error) {
+			errno = child->error;
+			nih_error_raise_system ();
+			goto error;
+		}
+
+		if (! nih_dir_set_add (&walk->dirs, &child->statbuf)) {
+			nih_error_raise (NIH_DIR_LOOP_DETECTED,
+					 _(NIH_DIR_LOOP_DETECTED_STR));
+			goto error;
+		}
+
+		ret = nih_dir_scan_walk (walk, child,
+					 len + strlen (ent->ent.name) + 1);
+
+		nih_dir_set_remove (&walk->dirs, &child->statbuf);
+
+		nih_free (child);
+		children[i] = NULL;
 
-	/* .bzr; used by bzr */
-	if (! strcmp (path, ".bzr"))
-		return TRUE;
+		if (ret < 0)
+			break;
 
-	/* .bzr.log; used by bzr */
-	if (! strcmp (path, ".bzr.log"))
-		return TRUE;
+		continue;
+	error:
+		if (children[i]) {
+			nih_free (children[i]);
+			children[i] = NULL;
+		}
 
-	/* .hg; used by hg */
-	if (! strcmp (path, ".hg"))
-		return TRUE;
+		ret = nih_dir_walk_error (walk, dirfd (scan->dir),
+					  ent->ent.name, statp);
+		if (ret < 0)
+			break;
+	}
 
-	/* .git; used by git */
-	if (! strcmp (path, ".git"))
-		return TRUE;
+	/* Discard anything read ahead that we didn't get to */
+	for (i = 0; i < scan->nents; i++)
+		if (children[i])
+			nih_free (children[i]);
 
-	/* .svn; used by subversion */
-	if (! strcmp (path, ".svn"))
-		return TRUE;
+	nih_free (children);
 
-	/* BitKeeper; used by BitKeeper */
-	if (! strcmp (path, "BitKeeper"))
-		return TRUE;
+	return ret;
+}
 
-	/* .arch-ids; used by tla */
-	if (! strcmp (path, ".arch-ids"))
-		return TRUE;
+/**
+ * nih_dir_scan_prefetch:
+ * @walk: state of walk,
+ * @scan: directory being visited,
+ * @children: reads of sub-directories of @scan, indexed as its objects,
+ * @next: index of next object of @scan to consider.
+ *
+ * Passes sub-directories of @scan, from the object at @next onwards, to
+ * the workers to be read until there are as many directories read ahead
+ * as the window allows; @next is updated to the first sub-directory not
+ * considered.
+ **/
+static void
+nih_dir_scan_prefetch (NihDirWalk  *walk,
+		       NihDirScan  *scan,
+		       NihDirScan **children,
+		       size_t      *next)
+{
+	NihDirWalkPool *pool;
 
-	/* .arch-inventory; used by tla */
-	if (! strcmp (path, ".arch-inventory"))
-		return TRUE;
+	nih_assert (walk != NULL);
+	nih_assert (scan != NULL);
+	nih_assert (children != NULL);
+	nih_assert (next != NULL);
 
-	/* {arch}; used by tla */
-	if (! strcmp (path, "{arch}"))
-		return TRUE;
+	pool = walk->pool;
 
-	/* _darcs; used by darcs */
-	if (! strcmp (path, "_darcs"))
-		return TRUE;
+	for (; *next < scan->nents; (*next)++) {
+		NihDirScanEnt *ent = &scan->ents[*next];
 
-	return FALSE;
+		if (pool->outstanding >= pool->window)
+			break;
+
+		if (ent->skip || ent->error || (! ent->is_dir)
+		    || children[*next])
+			continue;
+
+		children[*next] = NIH_MUST (nih_dir_scan_new (
+			pool, dirfd (scan->dir), ent->ent.name));
+		children[*next]->prefetched = TRUE;
+		pool->outstanding++;
+	}
 }
 
+
 /**
- * nih_file_is_packaging:
- * @path: path to check.
- *
- * Determines whether @path represents a file or directory used by a
- * common package manager, matching it against common patterns.
+ * nih_dir_pool_start:
+ * @pool: pool to initialise,
+ * @flags: flags given to nih_dir_walk_parallel(),
+ * @nthreads: number of worker threads.
  *
- * Returns: TRUE if it matches, FALSE otherwise.
+ * Initialises @pool and starts up to @nthreads worker threads; should any
+ * fail to start, the walk goes on with those that did, the walking thread
+ * reading any directory that no worker has got to when it's needed.
  **/
-int
-nih_file_is_packaging (const char *path)
+static void
+nih_dir_pool_start (NihDirWalkPool  *pool,
+		    NihDirWalkFlags  flags,
+		    size_t           nthreads)
 {
-	const char *ptr;
+	size_t i;
 
-	nih_assert (path != NULL);
+	nih_assert (pool != NULL);
+	nih_assert (nthreads > 0);
 
-	ptr = strrchr (path, '/');
-	if (ptr)
-		path = ptr + 1;
+	pthread_mutex_init (&pool->mutex, NULL);
+	pthread_cond_init (&pool->work_cond, NULL);
+	pthread_cond_init (&pool->done_cond, NULL);
+	nih_list_init (&pool->queue);
+	pool->flags = flags;
 
-	/* Matches *.dpkg-*; used by dpkg */
-	ptr = strrchr (path, '.');
-	if (ptr && (! strncmp (ptr, ".dpkg-", 6)))
-		return TRUE;
+	pool->threads = NIH_MUST (nih_alloc (NULL, (sizeof (pthread_t)
+						    * nthreads)));
+	pool->nthreads = 0;
+	pool->shutdown = FALSE;
 
-	/* Matches *.rpm{save,orig,new}; used by rpm */
-	if (ptr && (! strncmp (ptr, ".rpmsave", 9)))
-		return TRUE;
-	if (ptr && (! strncmp (ptr, ".rpmorig", 9)))
-		return TRUE;
-	if (ptr && (! strncmp (ptr, ".rpmnew", 8)))
-		return TRUE;
+	pool->window = nthreads * 2;
+	pool->outstanding = 0;
 
-	/* Matches *;[a-fA-F0-9]{8}; used by rpm */
-	ptr = strrchr (path, ';');
-	if (ptr && (strspn (ptr + 1, "abcdefABCDEF0123456789") == 8)
-	    && (! ptr[9]))
-		return TRUE;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create (&pool->threads[pool->nthreads], NULL,
+				    (void *(*)(void *))nih_dir_pool_thread,
+				    pool))
+			break;
 
-	return FALSE;
+		pool->nthreads++;
+	}
 }
 
 /**
- * nih_file_ignore:
- * @data: data pointer,
- * @path: path to check.
- *
- * Determines whether @path should normally be ignored when walking a
- * directory tree.  Files ignored are those that are hidden, represent
- * backup files, editor swap files and both files and directories used
- * by revision control systems.
+ * nih_dir_pool_stop:
+ * @pool: pool to stop.
  *
- * Returns: TRUE if it should be ignored, FALSE otherwise.
+ * Stops the worker threads of @pool, which must have no scans queued or
+ * running, and releases its resources.
  **/
-int
-nih_file_ignore (void       *data,
-		 const char *path)
+static void
+nih_dir_pool_stop (NihDirWalkPool *pool)
 {
-	if (nih_file_is_hidden (path))
-		return TRUE;
+	size_t i;
 
-	if (nih_file_is_backup (path))
-		return TRUE;
+	nih_assert (pool != NULL);
+	nih_assert (NIH_LIST_EMPTY (&pool->queue));
 
-	if (nih_file_is_swap (path))
-		return TRUE;
+	pthread_mutex_lock (&pool->mutex);
+	pool->shutdown = TRUE;
+	pthread_cond_broadcast (&pool->work_cond);
+	pthread_mutex_unlock (&pool->mutex);
 
-	if (nih_file_is_rcs (path))
-		return TRUE;
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join (pool->threads[i], NULL);
 
-	if (nih_file_is_packaging (path))
-		return TRUE;
+	nih_free (pool->threads);
 
-	return FALSE;
+	pthread_cond_destroy (&pool->done_cond);
+	pthread_cond_destroy (&pool->work_cond);
+	pthread_mutex_destroy (&pool->mutex);
 }
 
-
 /**
- * nih_dir_walk:
- * @path: path to walk,
- * @filter: path filter,
- * @visitor: function to call for each path,
- * @error: function to call on error,
- * @data: data to pass to @visitor.
- *
- * Iterates the directory tree starting at @path, calling @visitor for
- * each file, directory or other object found.  Sub-directories are
- * descended into, and the same @visitor called for those.
- *
- * @visitor is not called for @path itself.
- *
- * @filter can be used to restrict both the sub-directories iterated and
- * the objects that @visitor is called for.  It is passed the full path
- * of the object, and if it returns TRUE, the object is ignored.
+ * nih_dir_pool_thread:
+ * @pool: pool the thread belongs to.
  *
- * If @visitor returns a negative value, or there's an error obtaining
- * the listing for a particular sub-directory, then the @error function
- * will be called.  This function should handle the error and return zero,
- * or raise an error again and return a negative value which causes the
- * entire walk to be aborted.  If @error is NULL, then a warning is emitted
- * instead.
+ * Function run by each worker thread of @pool, reading queued directories
+ * until the pool is stopped.
  *
- * Returns: zero on success, negative value on raised error.
+ * Returns: NULL.
  **/
-int
-nih_dir_walk (const char          *path,
-	      NihFileFilter        filter,
-	      NihFileVisitor       visitor,
-	      NihFileErrorHandler  error,
-	      void                *data)
+static void *
+nih_dir_pool_thread (NihDirWalkPool *pool)
 {
-	nih_local NihList  *dirs = NULL;
-	struct stat         statbuf;
-	nih_local char    **paths = NULL;
-	char              **subpath;
-	int                 ret = 0;
+	nih_assert (pool != NULL);
 
-	nih_assert (path != NULL);
-	nih_assert (visitor != NULL);
+	pthread_mutex_lock (&pool->mutex);
 
-	paths = nih_dir_walk_scan (path, filter, data);
-	if (! paths)
-		return -1;
+	for (;;) {
+		NihDirScan *scan;
+
+		while ((! pool->shutdown) && NIH_LIST_EMPTY (&pool->queue))
+			pthread_cond_wait (&pool->work_cond, &pool->mutex);
 
+		if (pool->shutdown)
+			break;
 
-	dirs = NIH_MUST (nih_list_new (NULL));
+		scan = (NihDirScan *)pool->queue.next;
+		nih_list_remove (&scan->entry);
+		scan->state = NIH_DIR_SCAN_RUNNING;
 
-	if (stat (path, &statbuf) == 0) {
-		NihDirEntry *entry;
+		pthread_mutex_unlock (&pool->mutex);
 
-		entry = NIH_MUST (nih_new (dirs, NihDirEntry));
-		nih_list_init (&entry->entry);
-		nih_alloc_set_destructor (entry, nih_list_destroy);
-		entry->dev = statbuf.st_dev;
-		entry->ino = statbuf.st_ino;
-		nih_list_add (dirs, &entry->entry);
-	}
+		nih_dir_scan_run (scan, pool->flags);
 
-	for (subpath = paths; *subpath; subpath++) {
-		ret = nih_dir_walk_visit (path, dirs, *subpath, filter,
-					  visitor, error, data);
-		if (ret < 0)
-			break;
+		pthread_mutex_lock (&pool->mutex);
+
+		scan->state = NIH_DIR_SCAN_DONE;
+		pthread_cond_broadcast (&pool->done_cond);
 	}
 
-	return ret;
+	pthread_mutex_unlock (&pool->mutex);
+
+	return NULL;
 }
 
+
 /**
- * nih_dir_walk_sort:
- * @a: pointer to first path,
- * @b: pointer to second path.
+ * nih_dir_scan_new:
+ * @pool: pool to read directory,
+ * @at_fd: descriptor of parent directory,
+ * @at_name: name of directory within @at_fd.
  *
- * This function wraps the strcoll() function allowing it to be called
- * from qsort().
+ * Queues the directory @at_name relative to @at_fd to be read by a worker
+ * of @pool.  @at_fd must remain open, and @at_name valid, until the scan
+ * is freed.
  *
- * Returns: zero if strings are equal, otherwise integer less than zero
- * if @a is less than @b or integer greater than zero if @a is greater
- * than @b.
+ * Returns: newly allocated scan or NULL if insufficient memory.
  **/
-static int
-nih_dir_walk_sort (const void *a,
-		   const void *b)
+static NihDirScan *
+nih_dir_scan_new (NihDirWalkPool *pool,
+		  int             at_fd,
+		  const char     *at_name)
 {
-	const char * const *path_a;
-	const char * const *path_b;
+	NihDirScan *scan;
 
-	nih_assert (a != NULL);
-	nih_assert (b != NULL);
+	nih_assert (pool != NULL);
+	nih_assert (at_name != NULL);
+
+	scan = nih_new (NULL, NihDirScan);
+	if (! scan)
+		return NULL;
+
+	nih_list_init (&scan->entry);
+	scan->pool = pool;
+	scan->prefetched = FALSE;
+
+	scan->at_fd = at_fd;
+	scan->at_name = at_name;
+
+	scan->dir = NULL;
+	scan->error = 0;
+
+	scan->ents = NULL;
+	scan->nents = 0;
+	scan->names = NULL;
+	scan->stats = NULL;
+
+	nih_alloc_set_destructor (scan, nih_dir_scan_destroy);
 
-	path_a = a;
-	path_b = b;
+	pthread_mutex_lock (&pool->mutex);
+	scan->state = NIH_DIR_SCAN_QUEUED;
+	nih_list_add (&pool->queue, &scan->entry);
+	pthread_cond_signal (&pool->work_cond);
+	pthread_mutex_unlock (&pool->mutex);
 
-	return strcoll (*path_a, *path_b);
+	return scan;
 }
 
 /**
- * nih_dir_walk_scan:
- * @path: path to scan,
- * @filter: path filter,
- * @data: data to pass to @filter.
+ * nih_dir_scan_destroy:
+ * @scan: scan to be destroyed.
  *
- * Reads the list of files in @path, removing ".", ".." and any for which
- * @filter return TRUE.
+ * Removes @scan from the queue of its pool, or waits for the worker
+ * reading it to finish, and releases what it read.
  *
- * Returns: NULL-terminated array of full paths to sub-paths or NULL on
- * raised error.
+ * Returns: always zero.
  **/
-static char **
-nih_dir_walk_scan (const char    *path,
-		   NihFileFilter  filter,
-		   void          *data)
+static int
+nih_dir_scan_destroy (NihDirScan *scan)
 {
-	DIR            *dir;
-	struct dirent  *ent;
-	char          **paths;
-	size_t          npaths;
-	int             isdir;
-	struct stat     statbuf;
+	NihDirWalkPool *pool;
 
-	nih_assert (path != NULL);
+	nih_assert (scan != NULL);
 
-	dir = opendir (path);
-	if (! dir)
-		nih_return_system_error (NULL);
+	pool = scan->pool;
 
-	npaths = 0;
-	paths = NIH_MUST (nih_str_array_new (NULL));
+	pthread_mutex_lock (&pool->mutex);
+	if (scan->state == NIH_DIR_SCAN_QUEUED) {
+		nih_list_remove (&scan->entry);
+		scan->state = NIH_DIR_SCAN_DONE;
+	}
 
-	while ((ent = readdir (dir)) != NULL) {
-		nih_local char *subpath = NULL;
+	while (scan->state != NIH_DIR_SCAN_DONE)
+		pthread_cond_wait (&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock (&pool->mutex);
 
-		/* Always ignore '.' and '..' */
-		if ((! strcmp (ent->d_name, "."))
-		    || (! strcmp (ent->d_name, "..")))
-			continue;
+	if (scan->prefetched)
+		pool->outstanding--;
 
-		subpath = NIH_MUST (nih_sprintf (NULL, "%s/%s",
-						 path, ent->d_name));
+	if (scan->dir)
+		closedir (scan->dir);
 
-		if (ent->d_type == DT_UNKNOWN) {
-			if (lstat (subpath, &statbuf))
-				isdir = FALSE;
-			else
-				isdir = S_ISDIR(statbuf.st_mode);
-		} else {
-			isdir = ent->d_type == DT_DIR;
-		}
+	free (scan->ents);
+	free (scan->names);
+	free (scan->stats);
 
-		if (filter && filter (data, subpath, isdir))
-			continue;
+	return 0;
+}
+
+/**
+ * nih_dir_scan_wait:
+ * @scan: scan to wait for.
+ *
+ * Waits for a worker to finish reading the directory of @scan; if no
+ * worker has started to, it is read by the calling thread instead.
+ **/
+static void
+nih_dir_scan_wait (NihDirScan *scan)
+{
+	NihDirWalkPool *pool;
+
+	nih_assert (scan != NULL);
 
-		NIH_MUST (nih_str_array_addp (&paths, NULL, &npaths, subpath));
+	pool = scan->pool;
+
+	if (scan->prefetched) {
+		scan->prefetched = FALSE;
+		pool->outstanding--;
 	}
 
-	closedir (dir);
+	pthread_mutex_lock (&pool->mutex);
+	if (scan->state == NIH_DIR_SCAN_QUEUED) {
+		nih_list_remove (&scan->entry);
+		scan->state = NIH_DIR_SCAN_RUNNING;
+		pthread_mutex_unlock (&pool->mutex);
 
-	qsort (paths, npaths, sizeof (char *), nih_dir_walk_sort);
+		nih_dir_scan_run (scan, pool->flags);
 
-	return paths;
-}
+		pthread_mutex_lock (&pool->mutex);
+		scan->state = NIH_DIR_SCAN_DONE;
+	}
 
+	while (scan->state != NIH_DIR_SCAN_DONE)
+		pthread_cond_wait (&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock (&pool->mutex);
+}
 
 /**
- * nih_dir_walk_visit:
- * @dirname: top-level being walked,
- * @dirs: stack of visited directories,
- * @path: path being visited,
- * @filter: path filter,
- * @visitor: function to call for each path,
- * @error: function to call on error,
- * @data: data to pass to @visitor.
- *
- * Visits an individual @path found while iterating the directory tree
- * started at @dirname.  Ensures that @visitor is called for @path, and
- * if @path is a directory, it is descended into and the same @visitor
- * called for each of those.
- *
- * @filter can be used to restrict both the sub-directories iterated and
- * the objects that @visitor is called for.  It is passed the full path
- * of the object, and if it returns TRUE, the object is ignored.
- *
- * If @visitor returns a negative value, or there's an error obtaining
- * the listing for a particular sub-directory, then the @error function
- * will be called.  This function should handle the error and return zero,
- * or raise an error again and return a negative value which causes the
- * entire walk to be aborted.  If @error is NULL, then a warning is emitted
- * instead.
+ * nih_dir_scan_run:
+ * @scan: scan to run,
+ * @flags: flags given to nih_dir_walk_parallel().
  *
- * Returns: zero on success, negative value on raised error.
+ * Opens and reads the directory of @scan, sorting the objects found by
+ * name and examining each in the same way as nih_dir_walk_dir() and
+ * nih_dir_walk_visit() would.  This is called from worker threads, so
+ * may not raise errors or use nih_alloc(); errors are instead stored in
+ * @scan and its entries to be raised by the walking thread.
  **/
-static int
-nih_dir_walk_visit (const char          *dirname,
-		    NihList             *dirs,
-		    const char          *path,
-		    NihFileFilter        filter,
-		    NihFileVisitor       visitor,
-		    NihFileErrorHandler  error,
-		    void                *data)
+static void
+nih_dir_scan_run (NihDirScan      *scan,
+		  NihDirWalkFlags  flags)
 {
-	struct stat statbuf;
+	struct dirent *dent;
+	size_t         ents_size = 0;
+	size_t         names_len = 0, names_size = 0;
+	size_t         i;
+	int            fd;
 
-	nih_assert (dirname != NULL);
-	nih_assert (dirs != NULL);
-	nih_assert (path != NULL);
-	nih_assert (visitor != NULL);
+	nih_assert (scan != NULL);
 
-	/* Not much we can do here if we can't at least stat it */
-	if (stat (path, &statbuf) < 0) {
-		nih_error_raise_system ();
+	fd = openat (scan->at_fd, scan->at_name,
+		     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		goto error;
+
+	if (fstat (fd, &scan->statbuf) < 0) {
+		close (fd);
 		goto error;
 	}
 
-	/* Call the handler */
-	if (visitor (data, dirname, path, &statbuf) < 0)
+	scan->dir = fdopendir (fd);
+	if (! scan->dir) {
+		close (fd);
 		goto error;
+	}
 
-	/* Iterate into sub-directories; first checking for directory loops.
-	 */
-	if (S_ISDIR (statbuf.st_mode)) {
-		nih_local NihDirEntry  *entry = NULL;
-		nih_local char        **paths = NULL;
-		char                  **subpath;
-		int                     ret = 0;
-
-		NIH_LIST_FOREACH (dirs, iter) {
-			NihDirEntry *entry = (NihDirEntry *)iter;
-
-			if ((entry->dev == statbuf.st_dev)
-			    && (entry->ino == statbuf.st_ino)) {
-				nih_error_raise (NIH_DIR_LOOP_DETECTED,
-						 _(NIH_DIR_LOOP_DETECTED_STR));
+	while ((dent = readdir (scan->dir)) != NULL) {
+		unsigned char type = dent->d_type;
+		size_t        name_len;
+
+		/* Always ignore '.' and '..' */
+		if ((! strcmp (dent->d_name, "."))
+		    || (! strcmp (dent->d_name, "..")))
+			continue;
+
+		if (type == DT_UNKNOWN) {
+			mode_t mode;
+
+			if ((nih_dir_walk_mode (dirfd (scan->dir),
+						dent->d_name, FALSE,
+						&mode) == 0)
+			    && S_ISDIR (mode))
+				type = DT_DIR;
+		}
+
+		name_len = strlen (dent->d_name) + 1;
+		if (names_len + name_len > names_size) {
+			size_t  size;
+			char   *names;
+
+			size = nih_max (names_size * 2, names_len + name_len);
+			names = realloc (scan->names, size);
+			if (! names)
 				goto error;
-			}
+
+			scan->names = names;
+			names_size = size;
 		}
 
-		/* Grab the directory contents */
-		paths = nih_dir_walk_scan (path, filter, data);
-		if (! paths)
-			goto error;
+		if (scan->nents == ents_size) {
+			size_t         size;
+			NihDirScanEnt *ents;
 
-		/* Record the device and inode numbers in the stack so that
-		 * we can detect directory loops.
-		 */
-		entry = NIH_MUST (nih_new (NULL, NihDirEntry));
-		nih_list_init (&entry->entry);
-		nih_alloc_set_destructor (entry, nih_list_destroy);
-		entry->dev = statbuf.st_dev;
-		entry->ino = statbuf.st_ino;
-		nih_list_add (dirs, &entry->entry);
-
-		/* Iterate the paths found.  If these calls return a negative
-		 * value, it means that an error handler decided to abort the
-		 * walk; so just abort right now.
-		 */
-		for (subpath = paths; *subpath; subpath++) {
-			ret = nih_dir_walk_visit (dirname, dirs, *subpath,
-						  filter, visitor, error,
-						  data);
-			if (ret < 0)
-				break;
+			size = nih_max (ents_size * 2, 16U);
+			ents = realloc (scan->ents,
+					sizeof (NihDirScanEnt) * size);
+			if (! ents)
+				goto error;
+
+			scan->ents = ents;
+			ents_size = size;
 		}
 
-		if (ret < 0)
-			return ret;
+		memcpy (scan->names + names_len, dent->d_name, name_len);
+
+		scan->ents[scan->nents].ent.offset = names_len;
+		scan->ents[scan->nents].ent.type = type;
+		scan->nents++;
+
+		names_len += name_len;
 	}
 
-	return 0;
+	if (! scan->nents)
+		return;
 
-error:
-	if (error) {
-		return error (data, dirname, path, &statbuf);
-	} else {
-		NihError *err;
+	for (i = 0; i < scan->nents; i++)
+		scan->ents[i].ent.name = scan->names + scan->ents[i].ent.offset;
 
-		err = nih_error_get ();
-		nih_warn ("%s: %s", path, err->message);
-		nih_free (err);
+	qsort (scan->ents, scan->nents, sizeof (NihDirScanEnt),
+	       nih_dir_walk_sort);
 
-		return 0;
+	if (flags & NIH_DIR_WALK_STAT) {
+		scan->stats = malloc (sizeof (struct stat) * scan->nents);
+		if (! scan->stats)
+			goto error;
+	}
+
+	/* Examine each object as nih_dir_walk_visit() would, so that the
+	 * walking thread need only call the visitor.
+	 */
+	for (i = 0; i < scan->nents; i++) {
+		NihDirScanEnt *ent = &scan->ents[i];
+
+		ent->skip = FALSE;
+		ent->is_dir = FALSE;
+		ent->error = 0;
+
+		if (flags & NIH_DIR_WALK_STAT) {
+			if (fstatat (dirfd (scan->dir), ent->ent.name,
+				     &scan->stats[i], 0) < 0) {
+				ent->error = errno;
+				continue;
+			}
+
+			ent->is_dir = S_ISDIR (scan->stats[i].st_mode);
+		} else if ((ent->ent.type == DT_LNK)
+			   || (ent->ent.type == DT_UNKNOWN)) {
+			mode_t mode;
+
+			if (nih_dir_walk_mode (dirfd (scan->dir), ent->ent.name,
+					       TRUE, &mode) < 0) {
+				ent->error = errno;
+				continue;
+			}
+
+			ent->is_dir = S_ISDIR (mode);
+		} else {
+			ent->is_dir = (ent->ent.type == DT_DIR);
+		}
 	}
+
+	return;
+
+error:
+	scan->error = errno;
+	scan->nents = 0;
 }
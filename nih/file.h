@@ -26,6 +26,8 @@
 #include <fcntl.h>
 
 #include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 
 
 /**
@@ -78,6 +80,198 @@ typedef int (*NihFileErrorHandler) (void *data, const char *dirname,
 				    const char *path, struct stat *statbuf);
 
 
+/**
+ * NihDirWalkFlags:
+ *
+ * Flags changing the behaviour of nih_dir_walk_at() and
+ * nih_dir_walk_parallel(); NIH_DIR_WALK_STAT causes every object visited
+ * to be stat()ed, so that its visitor is passed the result, and
+ * NIH_DIR_WALK_NOSUBDIRS limits the walk to the objects directly within
+ * the directory given rather than descending into sub-directories.
+ **/
+typedef enum nih_dir_walk_flags {
+	NIH_DIR_WALK_STAT      = 0001,
+	NIH_DIR_WALK_NOSUBDIRS = 0002
+} NihDirWalkFlags;
+
+/**
+ * NihDirVisitor:
+ * @data: data pointer given to nih_dir_walk_at(),
+ * @dirfd: descriptor of directory containing object,
+ * @name: name of object within @dirfd,
+ * @path: path to object,
+ * @is_dir: TRUE if the object is a directory,
+ * @statbuf: stat of object, or NULL.
+ *
+ * A directory visitor is a function that can be called for a filesystem
+ * object visited by nih_dir_walk_at() that does not match the filter given
+ * to that function.  The object may be opened or examined relative to
+ * @dirfd rather than by resolving @path again; neither @dirfd nor @path
+ * remain valid after the visitor returns.
+ *
+ * @statbuf is only given when NIH_DIR_WALK_STAT is passed to
+ * nih_dir_walk_at(); @is_dir follows symbolic links either way.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+typedef int (*NihDirVisitor) (void *data, int dirfd, const char *name,
+			      const char *path, int is_dir,
+			      struct stat *statbuf);
+
+/**
+ * NihDirErrorHandler:
+ * @data: data pointer given to nih_dir_walk_at(),
+ * @dirfd: descriptor of directory containing object,
+ * @name: name of object within @dirfd,
+ * @path: path to object,
+ * @statbuf: stat of object, or NULL.
+ *
+ * A directory error handler is called in the same way as a file error
+ * handler, for objects visited by nih_dir_walk_at(); @statbuf is NULL
+ * unless NIH_DIR_WALK_STAT was passed and the object could be stat()ed.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+typedef int (*NihDirErrorHandler) (void *data, int dirfd, const char *name,
+				   const char *path, struct stat *statbuf);
+
+
+/**
+ * NIH_FILE_READER_SIZE:
+ *
+ * Default size of the buffer of an NihFileReader.
+ **/
+#define NIH_FILE_READER_SIZE 65536
+
+/**
+ * NihFileReaderFlags:
+ *
+ * Flags changing how nih_file_reader_new() opens and reads a file;
+ * NIH_FILE_READ_NOATIME avoids updating the access time of the file,
+ * where permitted, and NIH_FILE_READ_SEQUENTIAL advises the kernel that
+ * it will be read from start to end.
+ **/
+typedef enum nih_file_reader_flags {
+	NIH_FILE_READ_NOATIME    = 0001,
+	NIH_FILE_READ_SEQUENTIAL = 0002
+} NihFileReaderFlags;
+
+/**
+ * NihFileReader:
+ * @fd: file being read,
+ * @buf: buffer read into,
+ * @size: size of @buf,
+ * @start: offset of data in @buf not yet returned,
+ * @end: offset of end of data in @buf,
+ * @eof: TRUE once the end of the file has been read.
+ *
+ * A file reader reads a file in chunks into a buffer that is reused for
+ * each, so that files of any size may be processed in bounded memory.
+ **/
+typedef struct nih_file_reader {
+	int     fd;
+
+	char   *buf;
+	size_t  size;
+	size_t  start;
+	size_t  end;
+	int     eof;
+} NihFileReader;
+
+/**
+ * NihFileMapFlags:
+ *
+ * Advice given to the kernel by nih_file_mapping_new() and
+ * nih_file_window_new() about how the mapped file will be accessed;
+ * NIH_FILE_MAP_POPULATE reads it all in when mapped, and
+ * NIH_FILE_MAP_HUGEPAGE asks for huge pages where possible.
+ **/
+typedef enum nih_file_map_flags {
+	NIH_FILE_MAP_SEQUENTIAL = 0001,
+	NIH_FILE_MAP_RANDOM     = 0002,
+	NIH_FILE_MAP_WILLNEED   = 0004,
+	NIH_FILE_MAP_POPULATE   = 0010,
+	NIH_FILE_MAP_HUGEPAGE   = 0020
+} NihFileMapFlags;
+
+/**
+ * NihFileMapping:
+ * @data: mapped contents of file,
+ * @length: length of @data.
+ *
+ * A file mapping holds the contents of a file mapped into memory, and
+ * unmaps them when freed; references to it may be shared with nih_ref().
+ **/
+typedef struct nih_file_mapping {
+	char   *data;
+	size_t  length;
+} NihFileMapping;
+
+/**
+ * NihFileWindow:
+ * @fd: file being mapped,
+ * @size: size of window,
+ * @flags: advice for the kernel,
+ * @data: mapped part of file, or NULL,
+ * @offset: offset within file of @data,
+ * @length: length of @data.
+ *
+ * A file window maps part of a file at a time into memory, and is moved
+ * along it with nih_file_window_move(); the part mapped is unmapped when
+ * the window is moved or freed.
+ **/
+typedef struct nih_file_window {
+	int              fd;
+	size_t           size;
+	NihFileMapFlags  flags;
+
+	char            *data;
+	off_t            offset;
+	size_t           length;
+} NihFileWindow;
+
+/**
+ * NihFileMatcherNode:
+ * @children: first node for the next character,
+ * @next: next node for the same character position,
+ * @c: character matched by this node,
+ * @terminal: TRUE if a pattern ends at this node.
+ *
+ * A node of the tries of an NihFileMatcher, holding one character of the
+ * patterns that share the characters of its parents.
+ **/
+typedef struct nih_file_matcher_node {
+	struct nih_file_matcher_node *children;
+	struct nih_file_matcher_node *next;
+	char                          c;
+	int                           terminal;
+} NihFileMatcherNode;
+
+/**
+ * NihFileMatcher:
+ * @builtin: match the files nih_file_ignore() does,
+ * @names: hash table of names matched exactly,
+ * @prefixes: trie of prefixes of names matched,
+ * @suffixes: trie of suffixes of names matched, stored reversed,
+ * @globs: list of other patterns.
+ *
+ * A file matcher holds a set of glob patterns compiled so that a name
+ * can be checked against all of them at once, and is used as the data
+ * pointer of nih_file_matcher_match().  Patterns that are a literal
+ * name, or a literal with a single * before or after it, are matched by
+ * a lookup in @names or a walk of @prefixes or @suffixes; only those
+ * left in @globs are matched one at a time with fnmatch().
+ **/
+typedef struct nih_file_matcher {
+	int                 builtin;
+
+	NihHash            *names;
+	NihFileMatcherNode *prefixes;
+	NihFileMatcherNode *suffixes;
+	NihList             globs;
+} NihFileMatcher;
+
+
 NIH_BEGIN_EXTERN
 
 char *nih_file_read         (const void *parent, const char *path,
@@ -88,6 +282,26 @@ void *nih_file_map          (const char *path, int flags, size_t *length)
 	__attribute__ ((warn_unused_result));
 int   nih_file_unmap        (void *map, size_t length);
 
+NihFileReader * nih_file_reader_new    (const void *parent, const char *path,
+					size_t size, NihFileReaderFlags flags)
+	__attribute__ ((warn_unused_result, malloc));
+ssize_t         nih_file_reader_read   (NihFileReader *reader,
+					const char **data)
+	__attribute__ ((warn_unused_result));
+ssize_t         nih_file_reader_line   (NihFileReader *reader,
+					const char **line)
+	__attribute__ ((warn_unused_result));
+
+NihFileMapping *nih_file_mapping_new   (const void *parent, const char *path,
+					NihFileMapFlags flags)
+	__attribute__ ((warn_unused_result, malloc));
+
+NihFileWindow * nih_file_window_new    (const void *parent, const char *path,
+					size_t size, NihFileMapFlags flags)
+	__attribute__ ((warn_unused_result, malloc));
+int             nih_file_window_move   (NihFileWindow *window, off_t offset)
+	__attribute__ ((warn_unused_result));
+
 int   nih_file_is_hidden    (const char *path);
 int   nih_file_is_backup    (const char *path);
 int   nih_file_is_swap      (const char *path);
@@ -95,10 +309,28 @@ int   nih_file_is_rcs       (const char *path);
 int   nih_file_is_packaging (const char *path);
 int   nih_file_ignore       (void *data, const char *path);
 
+NihFileMatcher *nih_file_matcher_new   (const void *parent, int builtin)
+	__attribute__ ((warn_unused_result, malloc));
+int             nih_file_matcher_add   (NihFileMatcher *matcher,
+					const char *pattern)
+	__attribute__ ((warn_unused_result));
+int             nih_file_matcher_match (void *data, const char *path,
+					int is_dir);
+
 int   nih_dir_walk          (const char *path, NihFileFilter filter,
 			     NihFileVisitor visitor, NihFileErrorHandler error,
 			     void *data)
 	__attribute__ ((warn_unused_result));
+int   nih_dir_walk_at       (int dirfd, const char *path,
+			     NihDirWalkFlags flags, NihFileFilter filter,
+			     NihDirVisitor visitor, NihDirErrorHandler error,
+			     void *data)
+	__attribute__ ((warn_unused_result));
+int   nih_dir_walk_parallel (int dirfd, const char *path,
+			     NihDirWalkFlags flags, size_t nthreads,
+			     NihFileFilter filter, NihDirVisitor visitor,
+			     NihDirErrorHandler error, void *data)
+	__attribute__ ((warn_unused_result));
 
 NIH_END_EXTERN
 
@@ -32,6 +32,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
+#include <poll.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -39,6 +40,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_REGISTER_PBUF_RING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+
+# include <linux/io_uring.h>
+
+# define HAVE_IO_RING 1
+#endif /* HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_REGISTER_PBUF_RING */
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
@@ -47,11 +57,178 @@
 #include <nih/logging.h>
 #include <nih/error.h>
 #include <nih/errors.h>
+#include <nih/loop.h>
 
 #include "io.h"
 
 
+/**
+ * NIH_IO_RING_ENTRIES:
+ *
+ * Number of submission queue entries requested for the completion ring;
+ * the ring is flushed early if this fills up.
+ **/
+#define NIH_IO_RING_ENTRIES 256
+
+/**
+ * NIH_IO_RING_BUFFERS:
+ *
+ * Number of receive buffers provided to the kernel for reads submitted
+ * to the completion ring, this must be a power of two.
+ **/
+#define NIH_IO_RING_BUFFERS 64
+
+/**
+ * NIH_IO_RING_BUFSZ:
+ *
+ * Size of each receive buffer provided to the kernel.
+ **/
+#define NIH_IO_RING_BUFSZ BUFSIZ
+
+/**
+ * NIH_IO_RING_GROUP:
+ *
+ * Buffer group identifier of the receive buffers.
+ **/
+#define NIH_IO_RING_GROUP 0
+
+
+#if HAVE_IO_RING
+/**
+ * NihIoRingOpType:
+ *
+ * Kind of operation submitted to the completion ring on behalf of an
+ * NihIo structure.
+ **/
+typedef enum nih_io_ring_op_type {
+	NIH_IO_RING_READ,
+	NIH_IO_RING_WRITE,
+} NihIoRingOpType;
+
+/**
+ * NihIoRingOp:
+ * @type: kind of operation,
+ * @stream: stream the operation belongs to, NULL once orphaned,
+ * @queued: TRUE while the operation is submitted to the kernel,
+ * @poll: TRUE if readiness should be polled for before trying again,
+ * @complete: TRUE if a completion is waiting to be dispatched,
+ * @res: result of the completion,
+ * @buf: data being written (NIH_IO_RING_WRITE),
+ * @len: number of bytes in @buf,
+ * @off: number of bytes of @buf already written.
+ *
+ * Each ring-managed stream has one read and one write operation that are
+ * resubmitted as often as necessary; the address of this structure is
+ * used as the user data of the submission so that the completion can be
+ * matched back to it.
+ *
+ * Completions are reaped all at once, but dispatched in order of the
+ * priority of the stream's watch, so an operation is not resubmitted
+ * while @complete is set.
+ *
+ * Operations are allocated without a parent so that, when the stream is
+ * freed while an operation is still queued, it can be orphaned and
+ * freed once its cancellation completes, or with the ring, rather than
+ * leaving the kernel with a dangling pointer.
+ **/
+typedef struct nih_io_ring_op {
+	NihIoRingOpType  type;
+	NihIoRingStream *stream;
+	int              queued;
+	int              poll;
+	int              complete;
+	int              res;
+
+	char            *buf;
+	size_t           len;
+	size_t           off;
+} NihIoRingOp;
+
+/**
+ * NihIoRingStream:
+ * @entry: list header,
+ * @ring: ring managing the stream,
+ * @io: NihIo structure managed,
+ * @read: read operation,
+ * @write: write operation.
+ *
+ * Completion ring state of a stream mode NihIo structure, allocated as a
+ * child of it so that any queued operations are cancelled when it is
+ * freed.
+ **/
+struct nih_io_ring_stream {
+	NihList             entry;
+	struct nih_io_ring *ring;
+	NihIo              *io;
+
+	NihIoRingOp        *read;
+	NihIoRingOp        *write;
+};
+
+/**
+ * NihIoRing:
+ * @fd: io_uring file descriptor,
+ * @sq_ptr: mapping of the submission queue ring,
+ * @sq_size: size of @sq_ptr,
+ * @cq_ptr: mapping of the completion queue ring,
+ * @cq_size: size of @cq_ptr,
+ * @sqes: mapping of the submission queue entries,
+ * @sqes_size: size of @sqes,
+ * @sq_entries: number of entries in the submission queue,
+ * @sq_head: kernel submission queue head,
+ * @sq_tail: shared submission queue tail,
+ * @sq_mask: submission queue index mask,
+ * @sq_array: submission queue index array,
+ * @sq_local_tail: tail including entries not yet published to the kernel,
+ * @cq_head: shared completion queue head,
+ * @cq_tail: kernel completion queue tail,
+ * @cq_mask: completion queue index mask,
+ * @cqes: completion queue entries,
+ * @buf_ring: provided buffer ring shared with the kernel,
+ * @buf_ring_size: size of @buf_ring,
+ * @bufs: memory backing the provided buffers,
+ * @streams: list of NihIoRingStream structures,
+ * @pending: list of NihIoRingStream structures with completions waiting
+ * to be dispatched.
+ *
+ * Minimal io_uring instance used to submit reads and writes of stream mode
+ * NihIo structures; reads select their buffer from @buf_ring so that no
+ * memory is pinned to an idle stream.
+ **/
+typedef struct nih_io_ring {
+	int                       fd;
+
+	void                     *sq_ptr;
+	size_t                    sq_size;
+	void                     *cq_ptr;
+	size_t                    cq_size;
+	struct io_uring_sqe      *sqes;
+	size_t                    sqes_size;
+
+	unsigned                  sq_entries;
+	unsigned                 *sq_head;
+	unsigned                 *sq_tail;
+	unsigned                 *sq_mask;
+	unsigned                 *sq_array;
+	unsigned                  sq_local_tail;
+
+	unsigned                 *cq_head;
+	unsigned                 *cq_tail;
+	unsigned                 *cq_mask;
+	struct io_uring_cqe      *cqes;
+
+	struct io_uring_buf_ring *buf_ring;
+	size_t                    buf_ring_size;
+	char                     *bufs;
+
+	NihList                  *streams;
+	NihList                  *pending;
+} NihIoRing;
+#endif /* HAVE_IO_RING */
+
+
 /* Prototypes for static functions */
+static int            nih_io_watch_destroy  (NihIoWatch *watch);
 static void           nih_io_watcher        (NihIo *io, NihIoWatch *watch,
 					     NihIoEvents events);
 static inline ssize_t nih_io_watcher_read   (NihIo *io, NihIoWatch *watch)
@@ -62,14 +239,32 @@ static void           nih_io_closed         (NihIo *io);
 static void           nih_io_error          (NihIo *io);
 static void           nih_io_shutdown_check (NihIo *io);
 static NihIoMessage * nih_io_first_message  (NihIo *io);
+#if HAVE_IO_RING
+static int            nih_io_ring_destroy   (NihIoRing *ring);
+static int            nih_io_ring_submit    (NihIoRing *ring);
+static struct io_uring_sqe *nih_io_ring_get_sqe (NihIoRing *ring);
+static void           nih_io_ring_recycle   (NihIoRing *ring,
+					     unsigned short bid);
+static void           nih_io_ring_arm       (NihIoRing *ring,
+					     NihIoRingOp *op);
+static void           nih_io_ring_select    (NihIoRing *ring);
+static void           nih_io_ring_reap      (NihIoRing *ring);
+static int            nih_io_ring_dispatch  (NihIoRing *ring,
+					     NihLoopPriority priority);
+static void           nih_io_ring_complete  (NihIoRingStream *stream);
+static int            nih_io_ring_failed    (NihIoRingOp *op)
+	__attribute__ ((warn_unused_result));
+static NihIoRingStream *nih_io_ring_stream_new (NihIoRing *ring, NihIo *io);
+static int            nih_io_ring_stream_destroy (NihIoRingStream *stream);
+#endif /* HAVE_IO_RING */
 
 
 /**
  * nih_io_watches;
  *
- * This is the list of current watches on file descriptors and sockets,
- * not sorted into any particular order.  Each item is an NihIoWatch
- * structure.
+ * This is the list of current watches on file descriptors and sockets
+ * of the default loop, not sorted into any particular order.  Each item
+ * is an NihIoWatch structure.
  **/
 NihList *nih_io_watches = NULL;
 
@@ -77,13 +272,13 @@ NihList *nih_io_watches = NULL;
 /**
  * nih_io_init:
  *
- * Initialise the list of I/O watches.
+ * Initialise the list of I/O watches of the default loop.
  **/
 void
 nih_io_init (void)
 {
 	if (! nih_io_watches)
-		nih_io_watches = NIH_MUST (nih_list_new (NULL));
+		nih_loop_default ();
 }
 
 /**
@@ -94,12 +289,15 @@ nih_io_init (void)
  * @watcher: function to call when @events occur on @fd,
  * @data: pointer to pass to @watcher.
  *
- * Adds @fd to the list of file descriptors and sockets to watch, when any
- * of @events occur @watcher will be called.  @events is a bit mask
- * of the different events we care about.
+ * Adds @fd to the list of file descriptors and sockets to watch by the
+ * current loop, when any of @events occur @watcher will be called.
+ * @events is a bit mask of the different events we care about.
  *
  * This is the simplest form of watch and satisfies most basic purposes.
  *
+ * The watch has default priority, this may be changed by setting its
+ * priority member.
+ *
  * The watch structure is allocated using nih_alloc() and stored in a linked
  * list; there is no non-allocated version because of this.
  *
@@ -124,15 +322,13 @@ nih_io_add_watch (const void   *parent,
 	nih_assert (fd >= 0);
 	nih_assert (watcher != NULL);
 
-	nih_io_init ();
-
 	watch = nih_new (parent, NihIoWatch);
 	if (! watch)
 		return NULL;
 
 	nih_list_init (&watch->entry);
 
-	nih_alloc_set_destructor (watch, nih_list_destroy);
+	nih_alloc_set_destructor (watch, nih_io_watch_destroy);
 
 	watch->fd = fd;
 	watch->events = events;
@@ -140,11 +336,35 @@ nih_io_add_watch (const void   *parent,
 	watch->watcher = watcher;
 	watch->data = data;
 
-	nih_list_add (nih_io_watches, &watch->entry);
+	watch->priority = NIH_LOOP_PRIORITY_DEFAULT;
+
+	nih_list_add (nih_loop_current ()->io_watches, &watch->entry);
 
 	return watch;
 }
 
+/**
+ * nih_io_watch_destroy:
+ * @watch: watch to be destroyed.
+ *
+ * Removes @watch from the list of watches, and has the instrumentation of
+ * the current loop stop counting it individually.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_io_watch_destroy (NihIoWatch *watch)
+{
+	nih_assert (watch != NULL);
+
+	nih_loop_dispatch_forget (NIH_LOOP_IO_WATCH,
+				  (NihLoopCallback)watch->watcher, watch);
+
+	return nih_list_destroy (&watch->entry);
+}
+
 
 /**
  * nih_io_select_fds:
@@ -153,7 +373,8 @@ nih_io_add_watch (const void   *parent,
  * @writefds: pointer to set of descriptors to check for write,
  * @exceptfds: pointer to set of descriptors to check for exceptions.
  *
- * Fills the given fd_set arrays based on the list of I/O watches.
+ * Fills the given fd_set arrays based on the list of I/O watches of the
+ * current loop.
  **/
 void
 nih_io_select_fds (int    *nfds,
@@ -161,15 +382,17 @@ nih_io_select_fds (int    *nfds,
 		   fd_set *writefds,
 		   fd_set *exceptfds)
 {
+	NihLoop *loop;
+
 	nih_assert (nfds != NULL);
 	nih_assert (readfds != NULL);
 	nih_assert (writefds != NULL);
 	nih_assert (exceptfds != NULL);
 	nih_assert (*nfds <= FD_SETSIZE);
 
-	nih_io_init ();
+	loop = nih_loop_current ();
 
-	NIH_LIST_FOREACH (nih_io_watches, iter) {
+	NIH_LIST_FOREACH (loop->io_watches, iter) {
 		NihIoWatch    *watch = (NihIoWatch *)iter;
 
 		if (watch->events & NIH_IO_READ) {
@@ -188,6 +411,18 @@ nih_io_select_fds (int    *nfds,
 		}
 	}
 
+#if HAVE_IO_RING
+	/* Queue and submit any reads and writes on the completion ring,
+	 * the ring descriptor becomes readable once they complete.
+	 */
+	if (loop->io_ring) {
+		nih_io_ring_select (loop->io_ring);
+
+		FD_SET (loop->io_ring->fd, readfds);
+		*nfds = nih_max (*nfds, loop->io_ring->fd + 1);
+	}
+#endif /* HAVE_IO_RING */
+
 	/* Re-check in case we exceeded the limit in the loop */
 	nih_assert (*nfds <= FD_SETSIZE);
 }
@@ -199,8 +434,17 @@ nih_io_select_fds (int    *nfds,
  * @exceptfds: pointer to set of descriptors with exceptions.
  *
  * Receives arrays of fd_set structures which have been cleared of any
- * descriptors which haven't changed and iterates the watch list calling
- * the appropriate functions.
+ * descriptors which haven't changed and iterates the watch list of the
+ * current loop calling the appropriate functions.
+ *
+ * Watches are called in order of priority, with those of the same
+ * priority called in the order they were added; once nih_loop_defer()
+ * says that the rest should wait until the next iteration, no more are
+ * called.  Their descriptors remain ready, so they are seen again then.
+ *
+ * Completions of the completion ring are dispatched after the watches of
+ * the same priority as the stream's watch, and are kept until the next
+ * iteration in the same way.
  *
  * It is safe for watches to remove the watch during their call.
  **/
@@ -209,34 +453,873 @@ nih_io_handle_fds (fd_set *readfds,
 		   fd_set *writefds,
 		   fd_set *exceptfds)
 {
+	NihLoop         *loop;
+	NihLoopPriority  priority;
+	int              deferred = FALSE;
+
 	nih_assert (readfds != NULL);
 	nih_assert (writefds != NULL);
 	nih_assert (exceptfds != NULL);
 
-	nih_io_init ();
+	loop = nih_loop_current ();
+
+#if HAVE_IO_RING
+	/* Completions are read from shared memory, so there's no need to
+	 * check whether the ring descriptor was actually readable; they're
+	 * dispatched along with the watches of the same priority.
+	 */
+	if (loop->io_ring)
+		nih_io_ring_reap (loop->io_ring);
+#endif /* HAVE_IO_RING */
+
+	for (priority = NIH_LOOP_PRIORITY_HIGH;
+	     (priority < NIH_LOOP_PRIORITY_COUNT) && (! deferred);
+	     priority++) {
+		NIH_LIST_FOREACH_SAFE (loop->io_watches, iter) {
+			NihIoWatch  *watch = (NihIoWatch *)iter;
+			NihIoEvents  events;
+
+			if (watch->priority != priority)
+				continue;
+
+			events = NIH_IO_NONE;
+
+			if ((watch->events & NIH_IO_READ)
+			    && FD_ISSET (watch->fd, readfds))
+				events |= NIH_IO_READ;
+
+			if ((watch->events & NIH_IO_WRITE)
+			    && FD_ISSET (watch->fd, writefds))
+				events |= NIH_IO_WRITE;
+
+			if ((watch->events & NIH_IO_EXCEPT)
+			    && FD_ISSET (watch->fd, exceptfds))
+				events |= NIH_IO_EXCEPT;
+
+			if (events) {
+				NihIoWatcher    watcher = watch->watcher;
+				int             fd = watch->fd;
+				struct timespec start;
+
+				deferred = nih_loop_defer (loop, priority);
+				if (deferred)
+					break;
+
+				nih_loop_dispatch_begin (
+					&start, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)watcher,
+					watch, fd);
+				watch->watcher (watch->data, watch, events);
+				nih_loop_dispatch_end (
+					&start, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)watcher,
+					watch, fd);
+			}
+		}
+
+#if HAVE_IO_RING
+		if ((! deferred) && loop->io_ring)
+			deferred = nih_io_ring_dispatch (loop->io_ring,
+							 priority);
+#endif /* HAVE_IO_RING */
+	}
+
+#if HAVE_IO_RING
+	/* Deferred completions have already been reaped, so the ring
+	 * descriptor won't be readable again for them; interrupt the loop
+	 * so that it comes back here regardless.
+	 */
+	if (deferred && loop->io_ring
+	    && (! NIH_LIST_EMPTY (loop->io_ring->pending)))
+		nih_loop_interrupt (loop);
+#endif /* HAVE_IO_RING */
+}
+
+/**
+ * nih_io_ring_init:
+ *
+ * Sets up an io_uring completion ring for the current loop so that stream
+ * mode NihIo structures created on it from now on submit their reads and
+ * writes to the ring instead of waiting for their descriptor to become
+ * ready; reads are received into a ring of buffers provided to the
+ * kernel, and completions drive the reader, close and error handlers
+ * just as before.
+ *
+ * nih_io_select_fds() submits all queued operations to the kernel in a
+ * single call and adds the ring descriptor to the read set, and
+ * nih_io_handle_fds() dispatches any completions in order of the priority
+ * of each stream's watch, so the main loop needs no special handling.
+ *
+ * Descriptors managed by the ring are left blocking, so that the kernel
+ * waits for them to be ready rather than failing each read with EAGAIN.
+ *
+ * The ring is freed along with the loop; calling this function again once
+ * the ring is set up has no effect.
+ *
+ * Returns: zero on success, negative value on raised error; in which case
+ * stream mode structures continue to be readiness-based.
+ **/
+int
+nih_io_ring_init (void)
+{
+#if HAVE_IO_RING
+	NihLoop                 *loop;
+	NihIoRing               *ring;
+	struct io_uring_params   params;
+	struct io_uring_buf_reg  reg;
+	unsigned short           bid;
+	int                      saved_errno;
+
+	loop = nih_loop_current ();
+	if (loop->io_ring)
+		return 0;
+
+	ring = nih_new (loop, NihIoRing);
+	if (! ring)
+		nih_return_no_memory_error (-1);
+
+	memset (ring, 0, sizeof (NihIoRing));
+	ring->fd = -1;
+	ring->sq_ptr = ring->cq_ptr = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->buf_ring = MAP_FAILED;
+
+	nih_alloc_set_destructor (ring, nih_io_ring_destroy);
+
+	ring->streams = nih_list_new (ring);
+	if (! ring->streams)
+		goto error;
+
+	ring->pending = nih_list_new (ring);
+	if (! ring->pending)
+		goto error;
+
+	ring->bufs = nih_alloc (ring, NIH_IO_RING_BUFFERS * NIH_IO_RING_BUFSZ);
+	if (! ring->bufs)
+		goto error;
+
+	memset (&params, 0, sizeof (params));
+	ring->fd = syscall (__NR_io_uring_setup, NIH_IO_RING_ENTRIES, &params);
+	if (ring->fd < 0)
+		goto error;
+
+	/* We rely on reads at the current file position for streams */
+	if (! (params.features & IORING_FEAT_RW_CUR_POS)) {
+		errno = ENOSYS;
+		goto error;
+	}
+
+	nih_io_set_cloexec (ring->fd);
+
+	/* Map the submission and completion queue rings, which may share
+	 * a single mapping on newer kernels.
+	 */
+	ring->sq_size = (params.sq_off.array
+			 + params.sq_entries * sizeof (unsigned));
+	ring->cq_size = (params.cq_off.cqes
+			 + params.cq_entries * sizeof (struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_size = ring->cq_size = nih_max (ring->sq_size,
+							 ring->cq_size);
+
+	ring->sq_ptr = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto error;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap (NULL, ring->cq_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto error;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr
+				     + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr
+				      + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr
+				     + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr
+					     + params.cq_off.cqes);
+
+	/* Register the ring of receive buffers, this requires a
+	 * page-aligned allocation so take it directly from mmap().
+	 */
+	ring->buf_ring_size = (NIH_IO_RING_BUFFERS
+			       * sizeof (struct io_uring_buf));
+	ring->buf_ring = mmap (NULL, ring->buf_ring_size,
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED)
+		goto error;
+
+	memset (&reg, 0, sizeof (reg));
+	reg.ring_addr = (unsigned long)ring->buf_ring;
+	reg.ring_entries = NIH_IO_RING_BUFFERS;
+	reg.bgid = NIH_IO_RING_GROUP;
+
+	if (syscall (__NR_io_uring_register, ring->fd,
+		     IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto error;
+
+	for (bid = 0; bid < NIH_IO_RING_BUFFERS; bid++)
+		nih_io_ring_recycle (ring, bid);
+
+	loop->io_ring = ring;
+
+	return 0;
+
+error:
+	saved_errno = errno;
+	nih_free (ring);
+	errno = saved_errno;
+
+	nih_return_system_error (-1);
+#else /* HAVE_IO_RING */
+	errno = ENOSYS;
+	nih_return_system_error (-1);
+#endif /* HAVE_IO_RING */
+}
+
+#if HAVE_IO_RING
+/**
+ * nih_io_ring_destroy:
+ * @ring: ring to be destroyed.
+ *
+ * Unmaps the memory shared with the kernel and closes the ring descriptor,
+ * releasing any registered buffers with it; used when setting up the
+ * ring fails or the loop it belongs to is freed.
+ *
+ * Streams still managed by the ring are detached from it, since they
+ * may outlive the loop; closing the descriptor cancels their queued
+ * operations, which are freed along with the stream.  Operations orphaned
+ * by streams already freed are children of the ring, so are freed with it.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_io_ring_destroy (NihIoRing *ring)
+{
+	NihList *lists[2];
+	int      i;
+
+	nih_assert (ring != NULL);
+
+	lists[0] = ring->streams;
+	lists[1] = ring->pending;
+
+	for (i = 0; i < 2; i++) {
+		if (! lists[i])
+			continue;
+
+		NIH_LIST_FOREACH_SAFE (lists[i], iter) {
+			NihIoRingStream *stream = (NihIoRingStream *)iter;
+
+			nih_list_remove (&stream->entry);
+			stream->ring = NULL;
+		}
+	}
+
+	if (ring->buf_ring != MAP_FAILED)
+		munmap (ring->buf_ring, ring->buf_ring_size);
+	if (ring->sqes != MAP_FAILED)
+		munmap (ring->sqes, ring->sqes_size);
+	if ((ring->cq_ptr != MAP_FAILED) && (ring->cq_ptr != ring->sq_ptr))
+		munmap (ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr != MAP_FAILED)
+		munmap (ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0)
+		close (ring->fd);
+
+	return 0;
+}
+
+/**
+ * nih_io_ring_submit:
+ * @ring: ring to submit to.
+ *
+ * Publishes any submission queue entries filled since the last call to
+ * the kernel and submits them with a single io_uring_enter() call.
+ *
+ * Returns: zero on success, negative value if the kernel refused the
+ * entries, in which case they remain in the queue for the next call.
+ **/
+static int
+nih_io_ring_submit (NihIoRing *ring)
+{
+	unsigned to_submit;
+
+	nih_assert (ring != NULL);
+
+	__atomic_store_n (ring->sq_tail, ring->sq_local_tail,
+			  __ATOMIC_RELEASE);
+
+	to_submit = (ring->sq_local_tail
+		     - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE));
+	if (! to_submit)
+		return 0;
+
+	while (syscall (__NR_io_uring_enter, ring->fd, to_submit,
+			0, 0, NULL, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * nih_io_ring_get_sqe:
+ * @ring: ring to obtain entry from.
+ *
+ * Obtains the next free submission queue entry, cleared ready to be filled
+ * in; if the queue is full, the pending entries are submitted first.
+ *
+ * Returns: submission queue entry, or NULL if the queue is full.
+ **/
+static struct io_uring_sqe *
+nih_io_ring_get_sqe (NihIoRing *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned             head, idx;
+
+	nih_assert (ring != NULL);
+
+	head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		if (nih_io_ring_submit (ring) < 0)
+			return NULL;
+
+		head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries)
+			return NULL;
+	}
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	sqe = &ring->sqes[idx];
+	memset (sqe, 0, sizeof (struct io_uring_sqe));
+
+	return sqe;
+}
+
+/**
+ * nih_io_ring_recycle:
+ * @ring: ring buffer belongs to,
+ * @bid: buffer id.
+ *
+ * Returns the receive buffer @bid to the kernel so that it can be selected
+ * by a later read.
+ **/
+static void
+nih_io_ring_recycle (NihIoRing      *ring,
+		     unsigned short  bid)
+{
+	struct io_uring_buf *buf;
+	unsigned short       tail;
+
+	nih_assert (ring != NULL);
+	nih_assert (bid < NIH_IO_RING_BUFFERS);
+
+	tail = ring->buf_ring->tail;
+
+	buf = &ring->buf_ring->bufs[tail & (NIH_IO_RING_BUFFERS - 1)];
+	buf->addr = (unsigned long)(ring->bufs + bid * NIH_IO_RING_BUFSZ);
+	buf->len = NIH_IO_RING_BUFSZ;
+	buf->bid = bid;
+
+	__atomic_store_n (&ring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * nih_io_ring_stream_new:
+ * @ring: ring to manage stream with,
+ * @io: NihIo structure to manage.
+ *
+ * Allocates the completion ring state for the stream mode structure @io,
+ * as a child of it, and places it in the list of streams managed by @ring.
+ *
+ * Returns: new state, or NULL if insufficient memory.
+ **/
+static NihIoRingStream *
+nih_io_ring_stream_new (NihIoRing *ring,
+			NihIo     *io)
+{
+	NihIoRingStream *stream;
+
+	nih_assert (ring != NULL);
+	nih_assert (io != NULL);
+	nih_assert (io->type == NIH_IO_STREAM);
+
+	stream = nih_new (io, NihIoRingStream);
+	if (! stream)
+		return NULL;
+
+	nih_list_init (&stream->entry);
+
+	stream->ring = ring;
+	stream->io = io;
+	stream->read = NULL;
+	stream->write = NULL;
+
+	nih_alloc_set_destructor (stream, nih_io_ring_stream_destroy);
+
+	stream->read = nih_new (NULL, NihIoRingOp);
+	if (! stream->read)
+		goto error;
+
+	stream->write = nih_new (NULL, NihIoRingOp);
+	if (! stream->write)
+		goto error;
+
+	memset (stream->read, 0, sizeof (NihIoRingOp));
+	stream->read->type = NIH_IO_RING_READ;
+	stream->read->stream = stream;
+
+	memset (stream->write, 0, sizeof (NihIoRingOp));
+	stream->write->type = NIH_IO_RING_WRITE;
+	stream->write->stream = stream;
+
+	nih_list_add (ring->streams, &stream->entry);
+
+	return stream;
+
+error:
+	nih_free (stream);
+	return NULL;
+}
+
+/**
+ * nih_io_ring_stream_destroy:
+ * @stream: state to be destroyed.
+ *
+ * Removes @stream from the list of ring-managed streams; operations that
+ * are still queued are orphaned and cancelled, and freed once their
+ * completion arrives or with the ring, others are freed immediately.  If
+ * the ring has already been freed, no completion can arrive so all are
+ * freed.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_io_ring_stream_destroy (NihIoRingStream *stream)
+{
+	NihIoRingOp *ops[2];
+	int          i;
+
+	nih_assert (stream != NULL);
+
+	nih_list_destroy (&stream->entry);
+
+	ops[0] = stream->read;
+	ops[1] = stream->write;
+
+	for (i = 0; i < 2; i++) {
+		struct io_uring_sqe *sqe;
+
+		if (! ops[i])
+			continue;
+
+		if ((! ops[i]->queued) || (! stream->ring)) {
+			nih_free (ops[i]);
+			continue;
+		}
+
+		/* Hand it to the ring, so it's freed along with it should
+		 * the completion never be reaped.
+		 */
+		ops[i]->stream = NULL;
+		nih_ref (ops[i], stream->ring);
+		nih_unref (ops[i], NULL);
+
+		/* If we can't queue the cancellation, the operation will
+		 * still complete or fail when the descriptor is closed.
+		 */
+		sqe = nih_io_ring_get_sqe (stream->ring);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (unsigned long)ops[i];
+			sqe->user_data = 0;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * nih_io_ring_arm:
+ * @ring: ring to submit to,
+ * @op: operation to queue.
+ *
+ * Fills in a submission queue entry for @op; reads select a buffer from
+ * the provided buffer ring, writes send the remainder of the buffer
+ * taken from the stream.  When a previous attempt found the descriptor
+ * not ready, readiness is polled for instead.
+ *
+ * The operation remains unqueued if there is no room in the submission
+ * queue, and will be tried again next time.
+ **/
+static void
+nih_io_ring_arm (NihIoRing   *ring,
+		 NihIoRingOp *op)
+{
+	struct io_uring_sqe *sqe;
+	NihIo               *io;
+
+	nih_assert (ring != NULL);
+	nih_assert (op != NULL);
+	nih_assert (op->stream != NULL);
+	nih_assert (! op->queued);
+
+	io = op->stream->io;
+
+	sqe = nih_io_ring_get_sqe (ring);
+	if (! sqe)
+		return;
+
+	sqe->fd = io->watch->fd;
+	sqe->user_data = (unsigned long)op;
+
+	if (op->poll) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = (op->type == NIH_IO_RING_READ
+				      ? POLLIN : POLLOUT);
+	} else if (op->type == NIH_IO_RING_READ) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = NIH_IO_RING_GROUP;
+		sqe->len = NIH_IO_RING_BUFSZ;
+		sqe->off = (unsigned long long)-1;
+	} else {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr = (unsigned long)(op->buf + op->off);
+		sqe->len = op->len - op->off;
+		sqe->off = (unsigned long long)-1;
+	}
+
+	op->queued = TRUE;
+}
+
+/**
+ * nih_io_ring_select:
+ * @ring: ring to submit to.
+ *
+ * Queues a read for every ring-managed stream without one outstanding,
+ * and a write for any with data waiting in the send buffer; then submits
+ * them all to the kernel at once.
+ *
+ * The send buffer memory is handed to the write operation as-is, so
+ * further writes to the stream cannot move the data under the kernel.
+ **/
+static void
+nih_io_ring_select (NihIoRing *ring)
+{
+	nih_assert (ring != NULL);
+
+	NIH_LIST_FOREACH (ring->streams, iter) {
+		NihIoRingStream *stream = (NihIoRingStream *)iter;
+		NihIoRingOp     *write = stream->write;
+		NihIoBuffer     *send_buf = stream->io->send_buf;
+
+		if (! stream->read->queued)
+			nih_io_ring_arm (ring, stream->read);
+
+		if (write->queued)
+			continue;
+
+		if ((write->off == write->len) && send_buf->len) {
+			if (write->buf)
+				nih_unref (write->buf, write);
+
+			write->buf = send_buf->buf;
+			write->len = send_buf->len;
+			write->off = 0;
+
+			nih_ref (write->buf, write);
+			nih_unref (send_buf->buf, send_buf);
+
+			send_buf->buf = NULL;
+			send_buf->size = 0;
+			send_buf->len = 0;
+		}
+
+		if (write->off < write->len)
+			nih_io_ring_arm (ring, write);
+	}
+
+	nih_io_ring_submit (ring);
+}
+
+/**
+ * nih_io_ring_reap:
+ * @ring: ring to reap.
+ *
+ * Takes each completion from the completion queue in turn, copying any
+ * data received out of its selected buffer and returning that to the
+ * kernel at once; the completion itself is left on the operation and the
+ * stream moved to the list of those waiting to be dispatched, so that
+ * nih_io_ring_dispatch() can deal with them in order of priority.
+ *
+ * Completions of orphaned operations just free them, and those of polls
+ * just mean the operation can be tried again.
+ **/
+static void
+nih_io_ring_reap (NihIoRing *ring)
+{
+	unsigned head;
+
+	nih_assert (ring != NULL);
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe;
+		NihIoRingOp         *op;
+		int                  res;
+		unsigned             flags;
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		op = (NihIoRingOp *)(unsigned long)cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		__atomic_store_n (ring->cq_head, ++head, __ATOMIC_RELEASE);
 
-	NIH_LIST_FOREACH_SAFE (nih_io_watches, iter) {
-		NihIoWatch  *watch = (NihIoWatch *)iter;
-		NihIoEvents  events;
+		if (! op)
+			continue;
 
-		events = NIH_IO_NONE;
+		op->queued = FALSE;
 
-		if ((watch->events & NIH_IO_READ)
-		    && FD_ISSET (watch->fd, readfds))
-			events |= NIH_IO_READ;
+		if (flags & IORING_CQE_F_BUFFER) {
+			unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
 
-		if ((watch->events & NIH_IO_WRITE)
-		    && FD_ISSET (watch->fd, writefds))
-			events |= NIH_IO_WRITE;
+			/* The data has already left the kernel, so we have
+			 * no choice but to wait for the memory to store it.
+			 */
+			if (op->stream && (res > 0)) {
+				NihIoBuffer *recv_buf;
+
+				recv_buf = op->stream->io->recv_buf;
+				NIH_ZERO (nih_io_buffer_resize (recv_buf,
+								res));
+
+				memcpy (recv_buf->buf + recv_buf->len,
+					ring->bufs + bid * NIH_IO_RING_BUFSZ,
+					res);
+				recv_buf->len += res;
+			}
+
+			nih_io_ring_recycle (ring, bid);
+		}
+
+		if (! op->stream) {
+			nih_free (op);
+			continue;
+		}
+
+		/* Poll completions just mean we can try again */
+		if (op->poll) {
+			op->poll = FALSE;
+			continue;
+		}
+
+		op->complete = TRUE;
+		op->res = res;
+
+		nih_list_add (ring->pending, &op->stream->entry);
+	}
+}
+
+/**
+ * nih_io_ring_dispatch:
+ * @ring: ring to dispatch,
+ * @priority: priority to dispatch.
+ *
+ * Dispatches the completions waiting for each stream whose watch has
+ * @priority, exactly as nih_io_handle_fds() calls the watcher of a
+ * readiness-based stream; once nih_loop_defer() says that the rest should
+ * wait until the next iteration, no more are dispatched.
+ *
+ * Returns: TRUE if dispatch was deferred, FALSE otherwise.
+ **/
+static int
+nih_io_ring_dispatch (NihIoRing       *ring,
+		      NihLoopPriority  priority)
+{
+	NihLoop *loop;
+
+	nih_assert (ring != NULL);
+
+	loop = nih_loop_current ();
+
+	NIH_LIST_FOREACH_SAFE (ring->pending, iter) {
+		NihIoRingStream *stream = (NihIoRingStream *)iter;
+		NihIoWatch      *watch = stream->io->watch;
+		NihIoWatcher     watcher = watch->watcher;
+		int              fd = watch->fd;
+		struct timespec  start;
+
+		if (watch->priority != priority)
+			continue;
+
+		if (nih_loop_defer (loop, priority))
+			return TRUE;
+
+		/* Back with the streams to be submitted again, before
+		 * the handlers have a chance to free it.
+		 */
+		nih_list_add (ring->streams, &stream->entry);
+
+		nih_loop_dispatch_begin (&start, NIH_LOOP_IO_WATCH,
+					 (NihLoopCallback)watcher, watch, fd);
+		nih_io_ring_complete (stream);
+		nih_loop_dispatch_end (&start, NIH_LOOP_IO_WATCH,
+				       (NihLoopCallback)watcher, watch, fd);
+	}
+
+	return FALSE;
+}
+
+/**
+ * nih_io_ring_complete:
+ * @stream: stream with completions.
+ *
+ * Accounts for the data written by a completed write, so that the
+ * remainder of the buffer is written next time; then calls the reader,
+ * close handler or error handler for a completed read, the data of which
+ * is already in the receive buffer.  This is exactly what nih_io_watcher()
+ * does for a readiness-based stream.
+ **/
+static void
+nih_io_ring_complete (NihIoRingStream *stream)
+{
+	NihIo       *io;
+	NihIoRingOp *read;
+	NihIoRingOp *write;
+	int          caught_free;
+
+	nih_assert (stream != NULL);
+
+	io = stream->io;
+	read = stream->read;
+	write = stream->write;
+
+	caught_free = FALSE;
+	if (! io->free)
+		io->free = &caught_free;
+
+	if (write->complete) {
+		write->complete = FALSE;
+
+		if (write->res >= 0) {
+			write->off += write->res;
+		} else if (nih_io_ring_failed (write) < 0) {
+			nih_io_error (io);
+			if (caught_free)
+				return;
+			goto finish;
+		}
+
+		if (write->off == write->len) {
+			if (write->buf)
+				nih_unref (write->buf, write);
+
+			write->buf = NULL;
+			write->len = write->off = 0;
+		}
+	}
+
+	if (read->complete) {
+		read->complete = FALSE;
+
+		if (io->reader && io->recv_buf->len) {
+			nih_error_push_context ();
+			io->reader (io->data, io,
+				    io->recv_buf->buf, io->recv_buf->len);
+			nih_error_pop_context ();
+		}
+
+		if (caught_free)
+			return;
+
+		/* Deal with errors */
+		if ((read->res < 0) && (nih_io_ring_failed (read) < 0)) {
+			nih_io_error (io);
+			if (caught_free)
+				return;
+			goto finish;
+		}
+
+		/* Deal with the remote end being closed */
+		if (! read->res) {
+			nih_io_closed (io);
+			if (caught_free)
+				return;
+		}
+	}
+
+finish:
+	if (io->free == &caught_free)
+		io->free = NULL;
 
-		if ((watch->events & NIH_IO_EXCEPT)
-		    && FD_ISSET (watch->fd, exceptfds))
-			events |= NIH_IO_EXCEPT;
+	nih_io_shutdown_check (io);
+}
 
-		if (events)
-			watch->watcher (watch->data, watch, events);
+/**
+ * nih_io_ring_failed:
+ * @op: operation that failed.
+ *
+ * Deals with the errors that only mean @op should be tried again; when
+ * the descriptor had nothing to read or write, or there were no receive
+ * buffers left, readiness is polled for first so that we don't spin.
+ *
+ * Returns: zero if @op should be tried again, negative value on raised
+ * error.
+ **/
+static int
+nih_io_ring_failed (NihIoRingOp *op)
+{
+	nih_assert (op != NULL);
+	nih_assert (op->res < 0);
+
+	switch (-op->res) {
+	case EAGAIN:
+	case ENOBUFS:
+		op->poll = TRUE;
+		/* fall through */
+	case EINTR:
+	case ECANCELED:
+		return 0;
+	default:
+		errno = -op->res;
+		nih_return_system_error (-1);
 	}
 }
+#endif /* HAVE_IO_RING */
 
 
 /**
@@ -778,8 +1861,9 @@ nih_io_message_send (NihIoMessage *message,
  *
  * This allocates a new NihIo structure using nih_alloc(), used to manage an
  * already opened file descriptor.  The descriptor is set to be non-blocking
- * if it hasn't already been and the SIGPIPE signal is set to be ignored.
- * The file descriptor will be closed when the structure is freed.
+ * if it hasn't already been, unless it is managed by the completion ring,
+ * and the SIGPIPE signal is set to be ignored.  The file descriptor will
+ * be closed when the structure is freed.
  *
  * If @type is NIH_IO_STREAM, the descriptor is managed in stream mode; data
  * to be sent and data received are held in a single buffer that is expanded
@@ -787,6 +1871,9 @@ nih_io_message_send (NihIoMessage *message,
  * managed in message mode; individual messages are queued to be sent and
  * are received into a queue as discreet messages.
  *
+ * Stream mode descriptors are read and written using the completion ring
+ * if nih_io_ring_init() has been called successfully.
+ *
  * Data is automatically read from the file descriptor whenever it is
  * available, and stored in the receive buffer or queue.  If @reader is
  * given, this function is called whenever new data has been received.
@@ -838,6 +1925,7 @@ nih_io_reopen (const void        *parent,
 	io->data = data;
 	io->shutdown = FALSE;
 	io->free = NULL;
+	io->ring = NULL;
 
 	switch (io->type) {
 	case NIH_IO_STREAM:
@@ -870,6 +1958,20 @@ nih_io_reopen (const void        *parent,
 	if (! io->watch)
 		goto error;
 
+#if HAVE_IO_RING
+	/* Streams are read and written through the completion ring if
+	 * we have one, so the watch only serves to hold the descriptor.
+	 */
+	if ((io->type == NIH_IO_STREAM) && nih_loop_current ()->io_ring) {
+		io->ring = nih_io_ring_stream_new (nih_loop_current ()->io_ring,
+						   io);
+		if (! io->ring)
+			goto error;
+
+		nih_list_remove (&io->watch->entry);
+	}
+#endif /* HAVE_IO_RING */
+
 	/* Irritating signal, means we terminate if the remote end
 	 * disconnects between a read() and a write() ... far better to
 	 * just get an errno!
@@ -879,9 +1981,10 @@ nih_io_reopen (const void        *parent,
 	/* We want to be able to repeatedly call read and write on the
 	 * file descriptor so we always get maximum throughput, and we
 	 * don't want to end up blocking; so set the socket so that
-	 * doesn't happen.
+	 * doesn't happen.  The completion ring waits for the descriptor
+	 * itself, so there it's left as it is.
 	 */
-	if (nih_io_set_nonblock (fd) < 0)
+	if ((! io->ring) && (nih_io_set_nonblock (fd) < 0))
 		goto error;
 
 	nih_alloc_set_destructor (io, nih_io_destroy);
@@ -1276,6 +2379,12 @@ nih_io_shutdown_check (NihIo *io)
 
 	switch (io->type) {
 	case NIH_IO_STREAM:
+#if HAVE_IO_RING
+		/* Data handed to the completion ring is still to be sent */
+		if (io->ring && io->ring->write->len)
+			break;
+#endif /* HAVE_IO_RING */
+
 		if ((! io->send_buf->len) && (! io->recv_buf->len))
 			nih_io_closed (io);
 
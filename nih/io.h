@@ -25,6 +25,7 @@
 
 #include <nih/macros.h>
 #include <nih/list.h>
+#include <nih/loop.h>
 
 
 /**
@@ -53,8 +54,11 @@ typedef enum {
 
 
 /* Predefine the typedefs as we use them in the callbacks */
-typedef struct nih_io_watch NihIoWatch;
-typedef struct nih_io       NihIo;
+typedef struct nih_io_watch       NihIoWatch;
+typedef struct nih_io             NihIo;
+
+/* Opaque state used when an NihIo is managed by the completion ring */
+typedef struct nih_io_ring_stream NihIoRingStream;
 
 /**
  * NihIoWatcher:
@@ -135,22 +139,30 @@ typedef void (*NihIoErrorHandler) (void *data, NihIo *io);
  * @fd: file descriptor,
  * @events: events to watch for,
  * @watcher: function called when @events occur on @fd,
- * @data: pointer passed to @watcher.
+ * @data: pointer passed to @watcher,
+ * @priority: priority class of the watch.
  *
  * This structure represents the most basic kind of I/O handling, a watch
  * on a file descriptor or socket that causes a function to be called
  * when listed events occur.
  *
+ * Watches of higher @priority are called first, and those of less than
+ * high priority may be deferred to a later iteration when the loop has a
+ * time budget; @priority may be changed at any time, but must not be
+ * lowered by @watcher itself.
+ *
  * The watch can be cancelled by calling nih_list_remove() on the structure
  * as they are held in a list internally.
  **/
 struct nih_io_watch {
-	NihList       entry;
-	int           fd;
-	NihIoEvents   events;
+	NihList          entry;
+	int              fd;
+	NihIoEvents      events;
 
-	NihIoWatcher  watcher;
-	void         *data;
+	NihIoWatcher     watcher;
+	void            *data;
+
+	NihLoopPriority  priority;
 };
 
 /**
@@ -215,7 +227,8 @@ typedef struct nih_io_message {
  * @error_handler: function called when an error occurs,
  * @data: pointer passed to functions,
  * @shutdown: TRUE if the structure should be freed once the buffers are empty,
- * @free: pointer to variable to set to TRUE if freed during the watcher.
+ * @free: pointer to variable to set to TRUE if freed during the watcher,
+ * @ring: completion ring state, or NULL if readiness-based (NIH_IO_STREAM).
  *
  * This structure implements more featureful I/O handling than provided by
  * an NihIoWatch alone.
@@ -235,6 +248,11 @@ typedef struct nih_io_message {
  * When used in the message mode (@type is NIH_IO_MESSAGE), it combines the
  * NihIoWatch with an NihList of NihIoMessage structures to implement
  * asynchronous handling of datagram sockets.
+ *
+ * Stream mode structures created after a successful call to
+ * nih_io_ring_init() have @ring set; reads and writes are then submitted
+ * to the io_uring completion ring rather than performed when @watch
+ * becomes ready, and @watch is not placed in the list of watches.
  **/
 struct nih_io {
 	NihIoType            type;
@@ -256,6 +274,8 @@ struct nih_io {
 
 	int                  shutdown;
 	int                 *free;
+
+	NihIoRingStream     *ring;
 };
 
 
@@ -276,6 +296,9 @@ void          nih_io_select_fds          (int *nfds, fd_set *readfds,
 void          nih_io_handle_fds          (fd_set *readfds, fd_set *writewfds,
 					  fd_set *exceptfds);
 
+int           nih_io_ring_init           (void)
+	__attribute__ ((warn_unused_result));
+
 
 NihIoBuffer * nih_io_buffer_new          (const void *parent)
 	__attribute__ ((warn_unused_result, malloc));
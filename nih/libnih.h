@@ -30,6 +30,10 @@
 #include <nih/signal.h>
 #include <nih/child.h>
 #include <nih/io.h>
+#include <nih/loop.h>
+#include <nih/workpool.h>
+#include <nih/event.h>
+#include <nih/coro.h>
 #include <nih/file.h>
 #include <nih/watch.h>
 #include <nih/main.h>
@@ -0,0 +1,1968 @@
+/* libnih
+ *
+ * loop.c - main loop objects
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+
+#include <time.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/string.h>
+#include <nih/timer.h>
+#include <nih/signal.h>
+#include <nih/child.h>
+#include <nih/io.h>
+#include <nih/main.h>
+#include <nih/error.h>
+#include <nih/logging.h>
+
+#include "loop.h"
+
+
+/* Prototypes for static functions */
+static NihLoopPost *nih_loop_post_take      (NihLoop *loop);
+static void         nih_loop_post_push      (NihLoop *loop,
+					     NihLoopPost *post);
+static void         nih_loop_post_poll      (NihLoop *loop);
+static void         nih_loop_func_poll      (NihLoop *loop);
+static void         nih_loop_ready_poll     (NihLoop *loop);
+static int          nih_loop_select         (int nfds, fd_set *readfds,
+					     fd_set *writefds,
+					     fd_set *exceptfds,
+					     struct timeval *timeout,
+					     unsigned long slack);
+
+static const void * nih_loop_callback_key   (NihList *entry);
+static uint32_t     nih_loop_callback_hash  (const void *key);
+static int          nih_loop_callback_cmp   (const void *key1,
+					     const void *key2);
+static NihLoopCallbackStats *nih_loop_callback_stats (
+	NihLoopStats *stats, const NihLoopCallbackKey *key, int detail);
+
+static uint64_t     nih_loop_elapsed        (const struct timespec *start,
+					     const struct timespec *end);
+
+static void         nih_loop_histogram_add (NihLoopHistogram *histogram,
+					    uint64_t value);
+static void         nih_loop_histogram_merge (NihLoopHistogram *histogram,
+					      const NihLoopHistogram *other);
+static uint64_t     nih_loop_histogram_pct (const NihLoopHistogram *histogram,
+					    unsigned int percent);
+static char *       nih_loop_histogram_format (char **str,
+					       const void *parent,
+					       const NihLoopHistogram *histogram);
+
+static int          nih_loop_watchdog_destroy  (NihLoopWatchdog *watchdog);
+static void *       nih_loop_watchdog_thread   (NihLoopWatchdog *watchdog);
+static void         nih_loop_watchdog_describe (NihLoopWatchdog *watchdog,
+						char *buf, size_t len);
+static void         nih_loop_symbolize         (NihLoopCallback callback,
+						char *buf, size_t len);
+static void         nih_loop_watchdog_handler  (int signum);
+
+
+/**
+ * NIH_LOOP_WATCHDOG_SIGNAL:
+ *
+ * Signal sent to the thread running a slow callback to have it write a
+ * backtrace.
+ **/
+#define NIH_LOOP_WATCHDOG_SIGNAL (SIGRTMIN + 2)
+
+/**
+ * NIH_LOOP_WATCHDOG_FRAMES:
+ *
+ * Maximum number of stack frames written in a backtrace.
+ **/
+#define NIH_LOOP_WATCHDOG_FRAMES 64
+
+
+/**
+ * default_loop:
+ *
+ * The loop run by nih_main_loop(), which owns the lists exported as
+ * nih_io_watches, nih_timers and nih_main_loop_functions.
+ **/
+static NihLoop *default_loop = NULL;
+
+/**
+ * current_loop:
+ *
+ * Loop that watches, timers and functions are added to by this thread,
+ * NULL for the default loop.
+ **/
+static __thread NihLoop *current_loop = NULL;
+
+/**
+ * callback_type_names:
+ *
+ * Names of each NihLoopCallbackType, used when formatting statistics and
+ * watchdog reports.
+ **/
+static const char * const callback_type_names[] = {
+	"io-watch",
+	"timer",
+	"signal",
+	"child-watch",
+	"func",
+	"post",
+};
+
+/**
+ * watchdog_backtrace_fd:
+ *
+ * File descriptor the NIH_LOOP_WATCHDOG_SIGNAL handler writes the
+ * backtrace to, set by the watchdog thread before sending the signal.
+ **/
+static int watchdog_backtrace_fd = -1;
+
+
+/**
+ * nih_loop_new:
+ * @parent: parent object for new loop.
+ *
+ * Allocates a new main loop with no watches, timers or functions; these
+ * may be added to it by making it the current loop with
+ * nih_loop_set_current() or from within its own callbacks once it is
+ * running with nih_loop_run().
+ *
+ * The loop structure is allocated using nih_alloc(), the lists are
+ * allocated as children so will be freed along with it, and any
+ * structures still in the lists are removed.  The interrupt descriptor is
+ * closed by nih_loop_destroy(), which is set as the destructor.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned loop.  When all parents
+ * of the returned loop are freed, the returned loop will also be
+ * freed.
+ *
+ * Returns: new loop, or NULL on raised error.
+ **/
+NihLoop *
+nih_loop_new (const void *parent)
+{
+	NihLoop *loop;
+
+	loop = nih_new (parent, NihLoop);
+	if (! loop)
+		nih_return_no_memory_error (NULL);
+
+	loop->io_ring = NULL;
+	loop->interrupt_fd = -1;
+	loop->exit_loop = FALSE;
+	loop->exit_status = 0;
+
+	loop->post_stub.next = NULL;
+	loop->post_head = &loop->post_stub;
+	loop->post_tail = &loop->post_stub;
+	loop->post_pending = FALSE;
+
+	loop->stats = NULL;
+	loop->watchdog = NULL;
+
+	loop->budget = 0;
+	loop->budget_start.tv_sec = 0;
+	loop->budget_start.tv_nsec = 0;
+	loop->budget_exceeded = FALSE;
+	loop->budget_waived = FALSE;
+
+	nih_alloc_set_destructor (loop, nih_loop_destroy);
+
+	loop->io_watches = nih_list_new (loop);
+	if (! loop->io_watches)
+		goto nomem;
+
+	loop->timers = nih_list_new (loop);
+	if (! loop->timers)
+		goto nomem;
+
+	loop->functions = nih_list_new (loop);
+	if (! loop->functions)
+		goto nomem;
+
+	loop->ready_functions = nih_list_new (loop);
+	if (! loop->ready_functions)
+		goto nomem;
+
+	/* Set up the interrupt descriptor, an eventfd counter means that
+	 * any number of interrupts between iterations are cleared by a
+	 * single read; we need it to be non blocking so that we don't
+	 * accidentally block reading it when there were none.
+	 */
+	loop->interrupt_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->interrupt_fd < 0) {
+		nih_error_raise_system ();
+		nih_free (loop);
+		return NULL;
+	}
+
+	return loop;
+
+nomem:
+	nih_free (loop);
+	nih_return_no_memory_error (NULL);
+}
+
+/**
+ * nih_loop_destroy:
+ * @loop: loop to be destroyed.
+ *
+ * Closes the interrupt descriptor of @loop so that it can be freed,
+ * discarding any callbacks posted to it that have not yet been called;
+ * if the loop is the current loop of this thread, the default loop
+ * becomes current again.  The default loop may not be destroyed.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_loop_destroy (NihLoop *loop)
+{
+	NihLoopPost *post;
+
+	nih_assert (loop != NULL);
+	nih_assert (loop != default_loop);
+
+	if (current_loop == loop)
+		current_loop = NULL;
+
+	while ((post = nih_loop_post_take (loop)) != NULL)
+		free (post);
+
+	if (loop->interrupt_fd != -1)
+		close (loop->interrupt_fd);
+
+	return 0;
+}
+
+
+/**
+ * nih_loop_default:
+ *
+ * Returns the default loop, creating it if necessary; this is the loop
+ * run by nih_main_loop() and the one that handles signals and child
+ * processes.  Its lists are exported as nih_io_watches, nih_timers and
+ * nih_main_loop_functions for compatibility.
+ *
+ * Returns: default loop.
+ **/
+NihLoop *
+nih_loop_default (void)
+{
+	if (! default_loop) {
+		default_loop = NIH_MUST (nih_loop_new (NULL));
+
+		nih_io_watches = default_loop->io_watches;
+		nih_timers = default_loop->timers;
+		nih_main_loop_functions = default_loop->functions;
+	}
+
+	return default_loop;
+}
+
+/**
+ * nih_loop_current:
+ *
+ * Returns the current loop of this thread, that which watches, timers and
+ * loop functions are added to; this is the default loop unless changed
+ * with nih_loop_set_current() or while another loop is being run.
+ *
+ * Unless libnih is configured with --enable-threading, the current loop
+ * is shared by all threads.
+ *
+ * Returns: current loop.
+ **/
+NihLoop *
+nih_loop_current (void)
+{
+	if (current_loop)
+		return current_loop;
+
+	return nih_loop_default ();
+}
+
+/**
+ * nih_loop_set_current:
+ * @loop: loop to make current, or NULL.
+ *
+ * Makes @loop the current loop of this thread, to which watches, timers
+ * and loop functions will be added.  Passing NULL makes the default loop
+ * current again.
+ *
+ * Returns: previous current loop.
+ **/
+NihLoop *
+nih_loop_set_current (NihLoop *loop)
+{
+	NihLoop *previous;
+
+	previous = nih_loop_current ();
+	current_loop = (loop != default_loop ? loop : NULL);
+
+	return previous;
+}
+
+
+/**
+ * nih_loop_run:
+ * @loop: loop to run.
+ *
+ * Implements a fully functional main loop for @loop, handling I/O events,
+ * timers, posted callbacks and loop functions; when @loop is the default
+ * loop, signals and termination of child processes are also handled.
+ *
+ * @loop is the current loop of this thread for the duration.
+ *
+ * Returns: value given to nih_loop_exit().
+ **/
+int
+nih_loop_run (NihLoop *loop)
+{
+	NihLoop *previous;
+	int      is_default;
+
+	nih_assert (loop != NULL);
+
+	previous = nih_loop_set_current (loop);
+	is_default = (loop == nih_loop_default ());
+
+	/* Set a handler for SIGCHLD so that it can interrupt syscalls */
+	if (is_default)
+		nih_signal_set_handler (SIGCHLD, nih_signal_handler);
+
+	while (! loop->exit_loop) {
+		time_t          due, deadline;
+		struct timespec now;
+		struct timeval  timeout;
+		unsigned long   slack;
+		fd_set          readfds, writefds, exceptfds;
+		uint64_t        count;
+		int             nfds, ret;
+		int             timed_wait, timed, ready;
+		struct timespec wait_start, dispatch_start, dispatch_end;
+
+		/* Use the due times of the timers to calculate how long to
+		 * spend in select().  We sleep until the first is due, but
+		 * allow the kernel to let us sleep on until the earliest
+		 * deadline given by the timers' slack; it can then wake us
+		 * along with other timers on the system, and every timer due
+		 * by then is called at once.
+		 */
+		slack = 0;
+		timed_wait = nih_timer_next_wakeup (&due, &deadline);
+		if (timed_wait) {
+			nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+#ifdef PR_SET_TIMERSLACK
+			/* Saturate rather than overflow where unsigned long
+			 * is only 32 bits.
+			 */
+			slack = nih_min ((unsigned long)(deadline - due),
+					 ULONG_MAX / 1000000000UL);
+			slack *= 1000000000UL;
+#else /* PR_SET_TIMERSLACK */
+			due = deadline;
+#endif /* PR_SET_TIMERSLACK */
+
+			timeout.tv_sec = due - now.tv_sec;
+			timeout.tv_usec = 0;
+			if (timeout.tv_sec < 0)
+				timeout.tv_sec = 0;
+		}
+
+		/* Don't sleep at all if loop functions have been woken, or
+		 * if work was deferred in the last iteration.
+		 */
+		ready = ((! NIH_LIST_EMPTY (loop->ready_functions))
+			 || loop->budget_exceeded);
+		if (ready) {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 0;
+			slack = 0;
+		}
+
+		/* Start off with empty watch lists */
+		FD_ZERO (&readfds);
+		FD_ZERO (&writefds);
+		FD_ZERO (&exceptfds);
+
+		/* Always look for changes in the interrupt descriptor */
+		FD_SET (loop->interrupt_fd, &readfds);
+		nfds = loop->interrupt_fd + 1;
+
+		/* And look for changes in anything we're watching */
+		nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+
+		/* Now we hang around until either a signal comes in (and
+		 * calls nih_main_loop_interrupt), a file descriptor we're
+		 * watching changes in some way or it's time to run a timer.
+		 */
+		timed = (loop->stats != NULL);
+		if (timed)
+			nih_assert (clock_gettime (CLOCK_MONOTONIC,
+						   &wait_start) == 0);
+
+		ret = nih_loop_select (nfds, &readfds, &writefds, &exceptfds,
+				       (timed_wait || ready ? &timeout : NULL),
+				       slack);
+
+		if (timed) {
+			nih_assert (clock_gettime (CLOCK_MONOTONIC,
+						   &dispatch_start) == 0);
+			loop->stats->wait_time += nih_loop_elapsed (
+				&wait_start, &dispatch_start);
+		}
+
+		/* Start spending the time budget; if we deferred work last
+		 * time round, waive it this time so that the work is done.
+		 */
+		if (loop->budget) {
+			nih_assert (clock_gettime (CLOCK_MONOTONIC,
+						   &loop->budget_start) == 0);
+			loop->budget_waived = loop->budget_exceeded;
+		}
+		loop->budget_exceeded = FALSE;
+
+		/* Deal with events */
+		if (ret > 0)
+			nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+		/* Deal with signals.
+		 *
+		 * Clear the interrupt counter first so that if a signal occurs
+		 * while handling signals it'll ensure that the functions get
+		 * a chance to decide whether to do anything next time round
+		 * without having to wait.  A single read clears any number
+		 * of interrupts.
+		 */
+		if ((ret > 0) && FD_ISSET (loop->interrupt_fd, &readfds))
+			while ((read (loop->interrupt_fd, &count,
+				      sizeof (count)) < 0)
+			       && (errno == EINTR))
+				;
+
+		if (is_default) {
+			nih_signal_poll ();
+
+			/* Deal with terminated children */
+			nih_child_poll ();
+		}
+
+		/* Deal with callbacks posted from other threads */
+		nih_loop_post_poll (loop);
+
+		/* Deal with timers */
+		nih_timer_poll ();
+
+		/* Run the loop functions */
+		nih_loop_func_poll (loop);
+
+		/* Run the loop functions that have been woken */
+		nih_loop_ready_poll (loop);
+
+		if (timed && loop->stats) {
+			nih_assert (clock_gettime (CLOCK_MONOTONIC,
+						   &dispatch_end) == 0);
+			loop->stats->dispatch_time += nih_loop_elapsed (
+				&dispatch_start, &dispatch_end);
+			loop->stats->iterations++;
+		}
+	}
+
+	loop->exit_loop = FALSE;
+
+	nih_loop_set_current (previous);
+
+	return loop->exit_status;
+}
+
+/**
+ * nih_loop_select:
+ * @nfds: highest descriptor in sets plus one,
+ * @readfds: descriptors to check for reading,
+ * @writefds: descriptors to check for writing,
+ * @exceptfds: descriptors to check for exceptions,
+ * @timeout: maximum time to wait, or NULL,
+ * @slack: nanoseconds the kernel may extend @timeout by.
+ *
+ * Calls select() with the thread's timer slack temporarily set to @slack
+ * if that is non-zero, so that the kernel may delay waking us to share
+ * the wakeup with other timers; the slack is restored afterwards so that
+ * it doesn't apply to sleeps made by callbacks.
+ *
+ * Returns: return value of select().
+ **/
+static int
+nih_loop_select (int             nfds,
+		 fd_set         *readfds,
+		 fd_set         *writefds,
+		 fd_set         *exceptfds,
+		 struct timeval *timeout,
+		 unsigned long   slack)
+{
+#ifdef PR_SET_TIMERSLACK
+	int previous = -1;
+	int ret, saved_errno;
+
+	if (slack && timeout) {
+		previous = prctl (PR_GET_TIMERSLACK, 0, 0, 0, 0);
+		if (previous >= 0)
+			prctl (PR_SET_TIMERSLACK, slack, 0, 0, 0);
+	}
+
+	ret = select (nfds, readfds, writefds, exceptfds, timeout);
+
+	if (previous >= 0) {
+		saved_errno = errno;
+		prctl (PR_SET_TIMERSLACK, (unsigned long)previous, 0, 0, 0);
+		errno = saved_errno;
+	}
+
+	return ret;
+#else /* PR_SET_TIMERSLACK */
+	return select (nfds, readfds, writefds, exceptfds, timeout);
+#endif /* PR_SET_TIMERSLACK */
+}
+
+/**
+ * nih_loop_interrupt:
+ * @loop: loop to interrupt.
+ *
+ * Interrupts the current (or next) iteration of @loop because of an
+ * event that potentially needs immediate processing, or because some
+ * condition of the loop has been changed.
+ *
+ * This may be called from any thread, or from a signal handler.
+ **/
+void
+nih_loop_interrupt (NihLoop *loop)
+{
+	uint64_t count = 1;
+	int      saved_errno;
+
+	nih_assert (loop != NULL);
+
+	if (loop->interrupt_fd == -1)
+		return;
+
+	/* Adding to the counter only fails if it would overflow, in which
+	 * case the loop is already interrupted.
+	 */
+	saved_errno = errno;
+	while ((write (loop->interrupt_fd, &count, sizeof (count)) < 0)
+	       && (errno == EINTR))
+		;
+	errno = saved_errno;
+}
+
+/**
+ * nih_loop_exit:
+ * @loop: loop to exit,
+ * @status: exit status.
+ *
+ * Instructs @loop to exit with the given exit status the current (or
+ * next) time it is run; if the loop is in the middle of processing, it
+ * will exit once all that processing is complete.
+ *
+ * This may be safely called by functions called by the loop.
+ **/
+void
+nih_loop_exit (NihLoop *loop,
+	       int      status)
+{
+	nih_assert (loop != NULL);
+
+	loop->exit_status = status;
+	loop->exit_loop = TRUE;
+
+	nih_loop_interrupt (loop);
+}
+
+
+/**
+ * nih_loop_set_budget:
+ * @loop: loop to set budget of,
+ * @budget: time budget in nanoseconds, or zero.
+ *
+ * Sets the time @loop may spend dispatching I/O watches and loop functions
+ * in each iteration to @budget; once it has been spent, those not of high
+ * priority that remain are deferred to the next iteration.  A @budget of
+ * zero, the default, removes the limit.
+ *
+ * Signals, child processes, posted callbacks and timers are never
+ * deferred.
+ **/
+void
+nih_loop_set_budget (NihLoop  *loop,
+		     uint64_t  budget)
+{
+	nih_assert (loop != NULL);
+
+	loop->budget = budget;
+}
+
+/**
+ * nih_loop_defer:
+ * @loop: loop dispatching,
+ * @priority: priority of work to be done.
+ *
+ * Checks whether work of @priority should be deferred to the next
+ * iteration of @loop because the time budget for this iteration has been
+ * spent.  Work of high priority is never deferred, nor is any work when
+ * the loop has no budget or in an iteration following one in which work
+ * was deferred.
+ *
+ * This is used by the loop before calling each I/O watch and loop
+ * function, and may be used by those that process many items at once to
+ * leave the rest for later; the loop will not sleep before the next
+ * iteration when it returns TRUE.
+ *
+ * Returns: TRUE if the work should be deferred, FALSE otherwise.
+ **/
+int
+nih_loop_defer (NihLoop         *loop,
+		NihLoopPriority  priority)
+{
+	struct timespec now;
+
+	nih_assert (loop != NULL);
+
+	if ((priority == NIH_LOOP_PRIORITY_HIGH)
+	    || (! loop->budget) || loop->budget_waived)
+		return FALSE;
+
+	if (loop->budget_exceeded)
+		return TRUE;
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+	if (nih_loop_elapsed (&loop->budget_start, &now) < loop->budget)
+		return FALSE;
+
+	loop->budget_exceeded = TRUE;
+
+	return TRUE;
+}
+
+
+/**
+ * nih_loop_post:
+ * @loop: loop to post to,
+ * @callback: function to call,
+ * @data: pointer to pass to @callback.
+ *
+ * Arranges for @callback to be called once by @loop during its next
+ * iteration, interrupting it if necessary.  Callbacks posted from the same
+ * thread are called in the order they were posted.
+ *
+ * Unlike most libnih functions, this may be called from any thread; the
+ * queue is lock-free and the callback node is allocated with malloc()
+ * rather than nih_alloc(), so no error is raised on failure.
+ *
+ * Returns: zero on success, negative value with errno set to ENOMEM if
+ * insufficient memory.
+ **/
+int
+nih_loop_post (NihLoop       *loop,
+	       NihLoopPostCb  callback,
+	       void          *data)
+{
+	NihLoopPost *post;
+
+	nih_assert (loop != NULL);
+	nih_assert (callback != NULL);
+
+	post = malloc (sizeof (NihLoopPost));
+	if (! post) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	post->callback = callback;
+	post->data = data;
+
+	nih_loop_post_push (loop, post);
+
+	/* Only the first post since the loop last cleared the flag needs
+	 * to interrupt it, the loop takes everything in the queue at once.
+	 */
+	if (! __atomic_exchange_n (&loop->post_pending, TRUE,
+				   __ATOMIC_ACQ_REL))
+		nih_loop_interrupt (loop);
+
+	return 0;
+}
+
+/**
+ * nih_loop_post_push:
+ * @loop: loop to post to,
+ * @post: node to add.
+ *
+ * Adds @post to the head of the posted callback queue of @loop; this is
+ * a single atomic exchange, so may be called by any number of threads at
+ * once.  Until the previous head is linked to @post, the loop sees the
+ * queue as ending before it.
+ **/
+static void
+nih_loop_post_push (NihLoop     *loop,
+		    NihLoopPost *post)
+{
+	NihLoopPost *prev;
+
+	nih_assert (loop != NULL);
+	nih_assert (post != NULL);
+
+	post->next = NULL;
+
+	prev = __atomic_exchange_n (&loop->post_head, post, __ATOMIC_ACQ_REL);
+	__atomic_store_n (&prev->next, post, __ATOMIC_RELEASE);
+}
+
+/**
+ * nih_loop_post_take:
+ * @loop: loop to take from.
+ *
+ * Takes the oldest node from the tail of the posted callback queue of
+ * @loop; this must only be called by the thread running the loop.
+ *
+ * Returns: node taken, or NULL if the queue is empty or a post is still
+ * being added.
+ **/
+static NihLoopPost *
+nih_loop_post_take (NihLoop *loop)
+{
+	NihLoopPost *tail, *next;
+
+	nih_assert (loop != NULL);
+
+	tail = loop->post_tail;
+	next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+
+	/* Skip over the placeholder node */
+	if (tail == &loop->post_stub) {
+		if (! next)
+			return NULL;
+
+		loop->post_tail = next;
+		tail = next;
+		next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		loop->post_tail = next;
+		return tail;
+	}
+
+	/* tail is the last linked node; if it isn't also the head, then
+	 * another thread is part-way through adding one after it and we
+	 * have to leave it until that's done.
+	 */
+	if (tail != __atomic_load_n (&loop->post_head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* Put the placeholder back at the head so that we can take the
+	 * tail without leaving the queue empty of nodes.
+	 */
+	nih_loop_post_push (loop, &loop->post_stub);
+
+	next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		loop->post_tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+/**
+ * nih_loop_post_poll:
+ * @loop: loop to poll.
+ *
+ * Calls and frees all callbacks posted to @loop.  The pending flag is
+ * cleared first, so that a post which is still being added when we find
+ * the end of the queue will interrupt the loop again.
+ **/
+static void
+nih_loop_post_poll (NihLoop *loop)
+{
+	NihLoopPost *post;
+
+	nih_assert (loop != NULL);
+
+	if (! __atomic_load_n (&loop->post_pending, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n (&loop->post_pending, FALSE, __ATOMIC_SEQ_CST);
+
+	while ((post = nih_loop_post_take (loop)) != NULL) {
+		struct timespec start;
+
+		nih_loop_dispatch_begin (&start, NIH_LOOP_POST,
+					 (NihLoopCallback)post->callback,
+					 post, -1);
+		nih_error_push_context ();
+		post->callback (post->data);
+		nih_error_pop_context ();
+		nih_loop_dispatch_end (&start, NIH_LOOP_POST,
+				       (NihLoopCallback)post->callback,
+				       post, -1);
+
+		free (post);
+	}
+}
+
+
+/**
+ * nih_loop_func_poll:
+ * @loop: loop to poll.
+ *
+ * Calls each of the loop functions of @loop, those of high priority
+ * first, stopping once nih_loop_defer() says that the rest should wait
+ * until the next iteration.
+ **/
+static void
+nih_loop_func_poll (NihLoop *loop)
+{
+	NihLoopPriority priority;
+
+	nih_assert (loop != NULL);
+
+	for (priority = NIH_LOOP_PRIORITY_HIGH;
+	     priority < NIH_LOOP_PRIORITY_COUNT; priority++) {
+		NIH_LIST_FOREACH_SAFE (loop->functions, iter) {
+			NihMainLoopFunc *func = (NihMainLoopFunc *)iter;
+			NihMainLoopCb    callback = func->callback;
+			struct timespec  start;
+
+			if (func->priority != priority)
+				continue;
+			if (nih_loop_defer (loop, priority))
+				return;
+
+			nih_loop_dispatch_begin (&start, NIH_LOOP_FUNC,
+						 (NihLoopCallback)callback,
+						 func, -1);
+			func->callback (func->data, func);
+			nih_loop_dispatch_end (&start, NIH_LOOP_FUNC,
+					       (NihLoopCallback)callback,
+					       func, -1);
+		}
+	}
+}
+
+/**
+ * nih_loop_ready_poll:
+ * @loop: loop to poll.
+ *
+ * Calls each of the loop functions of @loop that have been woken, those
+ * of high priority first, taking each from the ready list first.  A
+ * marker is placed at the end of the list beforehand, so that functions
+ * woken by those being called wait until the next iteration rather than
+ * running here indefinitely.
+ *
+ * Functions deferred by nih_loop_defer() are left in the list, so are
+ * called in the next iteration.
+ **/
+static void
+nih_loop_ready_poll (NihLoop *loop)
+{
+	NihLoopPriority priority;
+	NihList         marker;
+
+	nih_assert (loop != NULL);
+
+	if (NIH_LIST_EMPTY (loop->ready_functions))
+		return;
+
+	nih_list_init (&marker);
+	nih_list_add (loop->ready_functions, &marker);
+
+	for (priority = NIH_LOOP_PRIORITY_HIGH;
+	     priority < NIH_LOOP_PRIORITY_COUNT; priority++) {
+		NIH_LIST_FOREACH_SAFE (loop->ready_functions, iter) {
+			NihMainLoopFunc *func = (NihMainLoopFunc *)iter;
+			NihMainLoopCb    callback;
+			struct timespec  start;
+
+			if (iter == &marker)
+				break;
+			if (func->priority != priority)
+				continue;
+			if (nih_loop_defer (loop, priority))
+				break;
+
+			callback = func->callback;
+			nih_list_remove (&func->entry);
+
+			nih_loop_dispatch_begin (&start, NIH_LOOP_FUNC,
+						 (NihLoopCallback)callback,
+						 func, -1);
+			func->callback (func->data, func);
+			nih_loop_dispatch_end (&start, NIH_LOOP_FUNC,
+					       (NihLoopCallback)callback,
+					       func, -1);
+		}
+	}
+
+	nih_list_remove (&marker);
+}
+
+
+/**
+ * nih_loop_stats_enable:
+ * @loop: loop to instrument.
+ *
+ * Enables instrumentation of @loop; from its next iteration, the number
+ * of iterations, the time spent waiting for events and dispatching them,
+ * how late timers are called and, for each callback, the number of calls
+ * and a histogram of the time spent in it are recorded.  These may be
+ * obtained with nih_loop_stats_format() or nih_loop_stats_dump().
+ *
+ * Callbacks are identified by the type of structure and the function
+ * called, so the statistics for all watches with the same watcher
+ * function are recorded together.
+ *
+ * Enabling instrumentation that is already enabled has no effect, to
+ * reset it call nih_loop_stats_disable() first.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_loop_stats_enable (NihLoop *loop)
+{
+	NihLoopStats *stats;
+
+	nih_assert (loop != NULL);
+
+	if (loop->stats)
+		return 0;
+
+	stats = nih_new (loop, NihLoopStats);
+	if (! stats)
+		nih_return_no_memory_error (-1);
+
+	stats->iterations = 0;
+	stats->wait_time = 0;
+	stats->dispatch_time = 0;
+
+	memset (&stats->timer_lateness, 0, sizeof (NihLoopHistogram));
+
+	stats->callbacks = nih_hash_new (stats, 0, nih_loop_callback_key,
+					 nih_loop_callback_hash,
+					 nih_loop_callback_cmp);
+	if (! stats->callbacks) {
+		nih_free (stats);
+		nih_return_no_memory_error (-1);
+	}
+
+	loop->stats = stats;
+
+	return 0;
+}
+
+/**
+ * nih_loop_stats_disable:
+ * @loop: loop to stop instrumenting.
+ *
+ * Disables instrumentation of @loop, discarding anything recorded.
+ **/
+void
+nih_loop_stats_disable (NihLoop *loop)
+{
+	nih_assert (loop != NULL);
+
+	if (loop->stats) {
+		nih_free (loop->stats);
+		loop->stats = NULL;
+	}
+}
+
+
+/**
+ * nih_loop_watchdog_enable:
+ * @loop: loop to watch,
+ * @threshold: milliseconds a callback may run for,
+ * @fd: file descriptor to write reports to,
+ * @with_backtrace: TRUE to include a backtrace in reports.
+ *
+ * Enables a watchdog for slow callbacks in @loop.  The loop records the
+ * time each callback it dispatches is called, and a helper thread checks
+ * this several times per @threshold; a callback still running after
+ * @threshold is reported by writing a line to @fd naming the function,
+ * found with dladdr(), the kind of structure and its file descriptor,
+ * signal, process id or timer.
+ *
+ * If @with_backtrace is TRUE, the helper thread also signals the thread
+ * running the loop with NIH_LOOP_WATCHDOG_SIGNAL, whose handler writes a
+ * backtrace of the slow callback to @fd; this is best effort, since the
+ * callback may return before the signal arrives.  Symbols are only
+ * available for functions exported from shared objects, unless the
+ * program is linked with -rdynamic.
+ *
+ * Once the callback returns, the loop also logs a warning with the total
+ * time it took.
+ *
+ * Only the outermost callback is watched when dispatches are nested, and
+ * @fd must remain open until the watchdog is disabled.  Enabling a
+ * watchdog that is already enabled changes its threshold, descriptor and
+ * backtrace setting.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_loop_watchdog_enable (NihLoop      *loop,
+			  unsigned int  threshold,
+			  int           fd,
+			  int           with_backtrace)
+{
+	NihLoopWatchdog     *watchdog;
+	pthread_condattr_t   attr;
+	int                  ret;
+
+	nih_assert (loop != NULL);
+	nih_assert (threshold > 0);
+	nih_assert (fd >= 0);
+
+	if (with_backtrace) {
+		struct sigaction  act;
+		void             *frame;
+
+		/* The first call to backtrace() may load libgcc, which is
+		 * not safe from a signal handler, so get it out of the way.
+		 */
+		backtrace (&frame, 1);
+
+		act.sa_handler = nih_loop_watchdog_handler;
+		act.sa_flags = SA_RESTART;
+		sigemptyset (&act.sa_mask);
+
+		if (sigaction (NIH_LOOP_WATCHDOG_SIGNAL, &act, NULL) < 0)
+			nih_return_system_error (-1);
+	}
+
+	if (loop->watchdog) {
+		pthread_mutex_lock (&loop->watchdog->lock);
+		loop->watchdog->threshold = threshold;
+		loop->watchdog->fd = fd;
+		loop->watchdog->backtrace = with_backtrace;
+		pthread_mutex_unlock (&loop->watchdog->lock);
+
+		return 0;
+	}
+
+	watchdog = nih_new (loop, NihLoopWatchdog);
+	if (! watchdog)
+		nih_return_no_memory_error (-1);
+
+	watchdog->threshold = threshold;
+	watchdog->fd = fd;
+	watchdog->backtrace = with_backtrace;
+	watchdog->shutdown = FALSE;
+
+	watchdog->active = FALSE;
+	watchdog->reported = FALSE;
+	watchdog->start.tv_sec = 0;
+	watchdog->start.tv_nsec = 0;
+	watchdog->type = NIH_LOOP_FUNC;
+	watchdog->callback = NULL;
+	watchdog->object = NULL;
+	watchdog->detail = -1;
+	watchdog->depth = 0;
+
+	/* The helper thread sleeps against the monotonic clock, like the
+	 * timestamps it compares.
+	 */
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init (&watchdog->lock, NULL);
+	pthread_cond_init (&watchdog->cond, &attr);
+
+	pthread_condattr_destroy (&attr);
+
+	ret = pthread_create (&watchdog->thread, NULL,
+			      (void *(*)(void *))nih_loop_watchdog_thread,
+			      watchdog);
+	if (ret) {
+		pthread_cond_destroy (&watchdog->cond);
+		pthread_mutex_destroy (&watchdog->lock);
+		nih_free (watchdog);
+
+		errno = ret;
+		nih_return_system_error (-1);
+	}
+
+	nih_alloc_set_destructor (watchdog, nih_loop_watchdog_destroy);
+
+	loop->watchdog = watchdog;
+
+	return 0;
+}
+
+/**
+ * nih_loop_watchdog_disable:
+ * @loop: loop to stop watching.
+ *
+ * Disables the slow callback watchdog of @loop, waiting for its helper
+ * thread to exit.  This may be called from within a callback.
+ **/
+void
+nih_loop_watchdog_disable (NihLoop *loop)
+{
+	nih_assert (loop != NULL);
+
+	if (loop->watchdog) {
+		nih_free (loop->watchdog);
+		loop->watchdog = NULL;
+	}
+}
+
+/**
+ * nih_loop_watchdog_destroy:
+ * @watchdog: watchdog to be destroyed.
+ *
+ * Stops the helper thread of @watchdog and waits for it to exit so that
+ * the watchdog can be freed.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_loop_watchdog_destroy (NihLoopWatchdog *watchdog)
+{
+	nih_assert (watchdog != NULL);
+
+	pthread_mutex_lock (&watchdog->lock);
+	watchdog->shutdown = TRUE;
+	pthread_cond_signal (&watchdog->cond);
+	pthread_mutex_unlock (&watchdog->lock);
+
+	pthread_join (watchdog->thread, NULL);
+
+	pthread_cond_destroy (&watchdog->cond);
+	pthread_mutex_destroy (&watchdog->lock);
+
+	return 0;
+}
+
+/**
+ * nih_loop_watchdog_thread:
+ * @watchdog: watchdog to run.
+ *
+ * Body of the watchdog helper thread; wakes four times per threshold to
+ * check whether the callback being dispatched has been running for too
+ * long, and if so, reports it once.  Reports are written without holding
+ * the lock, so a blocked @fd never stalls the loop.
+ *
+ * Returns: NULL.
+ **/
+static void *
+nih_loop_watchdog_thread (NihLoopWatchdog *watchdog)
+{
+	nih_assert (watchdog != NULL);
+
+	pthread_mutex_lock (&watchdog->lock);
+
+	while (! watchdog->shutdown) {
+		struct timespec now, wake;
+		uint64_t        elapsed, threshold, interval;
+
+		nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+		threshold = (uint64_t)watchdog->threshold * 1000000;
+		elapsed = nih_loop_elapsed (&watchdog->start, &now);
+
+		if (watchdog->active && (! watchdog->reported)
+		    && (elapsed >= threshold)) {
+			char      desc[256], line[384];
+			pthread_t loop_thread = watchdog->loop_thread;
+			int       fd = watchdog->fd;
+			int       with_backtrace = watchdog->backtrace;
+			int       len;
+
+			watchdog->reported = TRUE;
+			nih_loop_watchdog_describe (watchdog, desc,
+						    sizeof (desc));
+
+			pthread_mutex_unlock (&watchdog->lock);
+
+			len = snprintf (line, sizeof (line),
+					"%s%sslow %s callback running for "
+					"%llu ms\n",
+					program_name ? program_name : "",
+					program_name ? ": " : "", desc,
+					(unsigned long long)elapsed / 1000000);
+			if (len >= (int)sizeof (line))
+				len = sizeof (line) - 1;
+			if (len > 0)
+				while ((write (fd, line, len) < 0)
+				       && (errno == EINTR))
+					;
+
+			if (with_backtrace) {
+				__atomic_store_n (&watchdog_backtrace_fd, fd,
+						  __ATOMIC_RELEASE);
+				pthread_kill (loop_thread,
+					      NIH_LOOP_WATCHDOG_SIGNAL);
+			}
+
+			pthread_mutex_lock (&watchdog->lock);
+			continue;
+		}
+
+		interval = threshold / 4 + now.tv_nsec;
+
+		wake.tv_sec = now.tv_sec + interval / 1000000000;
+		wake.tv_nsec = interval % 1000000000;
+
+		pthread_cond_timedwait (&watchdog->cond, &watchdog->lock,
+					&wake);
+	}
+
+	pthread_mutex_unlock (&watchdog->lock);
+
+	return NULL;
+}
+
+/**
+ * nih_loop_watchdog_describe:
+ * @watchdog: watchdog,
+ * @buf: buffer to write to,
+ * @len: size of @buf.
+ *
+ * Writes a description of the callback being dispatched to @buf; the
+ * function is named by its symbol, or its object and offset, if dladdr()
+ * can find one.
+ **/
+static void
+nih_loop_watchdog_describe (NihLoopWatchdog *watchdog,
+			    char            *buf,
+			    size_t           len)
+{
+	char func[128];
+	char detail[64];
+
+	nih_assert (watchdog != NULL);
+	nih_assert (buf != NULL);
+
+	nih_loop_symbolize (watchdog->callback, func, sizeof (func));
+
+	switch (watchdog->type) {
+	case NIH_LOOP_IO_WATCH:
+		snprintf (detail, sizeof (detail), " (fd %d)",
+			  watchdog->detail);
+		break;
+	case NIH_LOOP_TIMER:
+		snprintf (detail, sizeof (detail), " (timer %p)",
+			  watchdog->object);
+		break;
+	case NIH_LOOP_SIGNAL:
+		snprintf (detail, sizeof (detail), " (signal %d)",
+			  watchdog->detail);
+		break;
+	case NIH_LOOP_CHILD_WATCH:
+		snprintf (detail, sizeof (detail), " (pid %d)",
+			  watchdog->detail);
+		break;
+	default:
+		detail[0] = '\0';
+		break;
+	}
+
+	snprintf (buf, len, "%s %s%s", callback_type_names[watchdog->type],
+		  func, detail);
+}
+
+/**
+ * nih_loop_symbolize:
+ * @callback: function to name,
+ * @buf: buffer to write to,
+ * @len: size of @buf.
+ *
+ * Writes the name of @callback to @buf; the function is named by its
+ * symbol, or its object and offset, if dladdr() can find one, otherwise
+ * by its address.
+ **/
+static void
+nih_loop_symbolize (NihLoopCallback  callback,
+		    char            *buf,
+		    size_t           len)
+{
+	Dl_info  info;
+	void    *addr;
+	int      found;
+
+	nih_assert (buf != NULL);
+
+	addr = (void *)callback;
+	found = dladdr (addr, &info);
+	if (found && info.dli_sname && (info.dli_saddr == addr)) {
+		snprintf (buf, len, "%s", info.dli_sname);
+	} else if (found && info.dli_sname) {
+		snprintf (buf, len, "%s+%#lx", info.dli_sname,
+			  (unsigned long)((char *)addr
+					  - (char *)info.dli_saddr));
+	} else if (found && info.dli_fname) {
+		snprintf (buf, len, "%s+%#lx", info.dli_fname,
+			  (unsigned long)((char *)addr
+					  - (char *)info.dli_fbase));
+	} else {
+		snprintf (buf, len, "%p", addr);
+	}
+}
+
+/**
+ * nih_loop_watchdog_handler:
+ * @signum: signal caught.
+ *
+ * Handler for NIH_LOOP_WATCHDOG_SIGNAL, called in the thread running a
+ * slow callback; writes a backtrace of that thread to the descriptor in
+ * watchdog_backtrace_fd.
+ **/
+static void
+nih_loop_watchdog_handler (int signum)
+{
+	void *frames[NIH_LOOP_WATCHDOG_FRAMES];
+	int   saved_errno;
+	int   fd, nframes;
+
+	saved_errno = errno;
+
+	fd = __atomic_load_n (&watchdog_backtrace_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0) {
+		nframes = backtrace (frames, NIH_LOOP_WATCHDOG_FRAMES);
+		backtrace_symbols_fd (frames, nframes, fd);
+	}
+
+	errno = saved_errno;
+}
+
+
+/**
+ * nih_loop_dispatch_begin:
+ * @start: time to fill in,
+ * @type: type of structure dispatched,
+ * @callback: function to be called,
+ * @object: structure dispatched,
+ * @detail: file descriptor, signal or process id, or -1.
+ *
+ * Called before a loop dispatches a callback; if the current loop is
+ * instrumented or watched, @start is set to the current time, otherwise
+ * it is marked so that nih_loop_dispatch_end() does nothing.  @callback,
+ * @object and @detail are only used to identify the callback in watchdog
+ * reports.
+ **/
+void
+nih_loop_dispatch_begin (struct timespec     *start,
+			 NihLoopCallbackType  type,
+			 NihLoopCallback      callback,
+			 const void          *object,
+			 int                  detail)
+{
+	NihLoop         *loop;
+	NihLoopWatchdog *watchdog;
+
+	nih_assert (start != NULL);
+
+	loop = nih_loop_current ();
+	if ((! loop->stats) && (! loop->watchdog)) {
+		start->tv_sec = 0;
+		start->tv_nsec = -1;
+		return;
+	}
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, start) == 0);
+
+	watchdog = loop->watchdog;
+	if (watchdog && (watchdog->depth++ == 0)) {
+		pthread_mutex_lock (&watchdog->lock);
+		watchdog->active = TRUE;
+		watchdog->reported = FALSE;
+		watchdog->loop_thread = pthread_self ();
+		watchdog->start = *start;
+		watchdog->type = type;
+		watchdog->callback = callback;
+		watchdog->object = object;
+		watchdog->detail = detail;
+		pthread_mutex_unlock (&watchdog->lock);
+	}
+}
+
+/**
+ * nih_loop_dispatch_end:
+ * @start: time filled in by nih_loop_dispatch_begin(),
+ * @type: type of structure dispatched,
+ * @callback: function called,
+ * @object: structure dispatched,
+ * @detail: file descriptor, signal or process id, or -1.
+ *
+ * Called once a loop has dispatched a callback; if the current loop is
+ * instrumented, the time since @start is added to the histogram of
+ * @callback, or of @object for an I/O watch.  @callback and @detail should
+ * be obtained before it is called, since the structure may be freed by
+ * it; @object is only compared, never dereferenced.
+ *
+ * If the current loop is watched and the callback took longer than the
+ * watchdog threshold, a warning is logged.
+ **/
+void
+nih_loop_dispatch_end (const struct timespec *start,
+		       NihLoopCallbackType    type,
+		       NihLoopCallback        callback,
+		       const void            *object,
+		       int                    detail)
+{
+	NihLoop              *loop;
+	NihLoopStats         *stats;
+	NihLoopWatchdog      *watchdog;
+	NihLoopCallbackKey    key;
+	NihLoopCallbackStats *cb_stats;
+	struct timespec       now;
+	uint64_t              elapsed;
+
+	nih_assert (start != NULL);
+
+	if (start->tv_nsec < 0)
+		return;
+
+	loop = nih_loop_current ();
+	stats = loop->stats;
+	watchdog = loop->watchdog;
+	if ((! stats) && (! watchdog))
+		return;
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+	elapsed = nih_loop_elapsed (start, &now);
+
+	/* The watchdog may have been enabled by the callback, in which case
+	 * it won't have seen the dispatch begin.
+	 */
+	if (watchdog && (watchdog->depth > 0) && (--watchdog->depth == 0)) {
+		pthread_mutex_lock (&watchdog->lock);
+		watchdog->active = FALSE;
+		pthread_mutex_unlock (&watchdog->lock);
+
+		if (elapsed >= (uint64_t)watchdog->threshold * 1000000) {
+			char desc[256];
+
+			nih_loop_watchdog_describe (watchdog, desc,
+						    sizeof (desc));
+			nih_warn (_("Slow %s callback took %llu ms"), desc,
+				  (unsigned long long)(elapsed / 1000000));
+		}
+	}
+
+	if (! stats)
+		return;
+
+	memset (&key, 0, sizeof (key));
+	key.type = type;
+	key.callback = callback;
+	if (type == NIH_LOOP_IO_WATCH)
+		key.object = object;
+
+	cb_stats = nih_loop_callback_stats (stats, &key,
+					    key.object ? detail : -1);
+	if (cb_stats)
+		nih_loop_histogram_add (&cb_stats->latency, elapsed);
+}
+
+/**
+ * nih_loop_dispatch_forget:
+ * @type: type of structure,
+ * @callback: function it called,
+ * @object: structure being freed.
+ *
+ * Called when a structure that a loop dispatches is freed; if it was
+ * counted individually by the instrumentation of the current loop, its
+ * counts are added to those of all freed structures with the same
+ * @callback, so that its address may be reused.
+ **/
+void
+nih_loop_dispatch_forget (NihLoopCallbackType  type,
+			  NihLoopCallback      callback,
+			  const void          *object)
+{
+	NihLoop              *loop;
+	NihLoopCallbackKey    key;
+	NihLoopCallbackStats *cb_stats, *freed;
+
+	nih_assert (object != NULL);
+
+	if (type != NIH_LOOP_IO_WATCH)
+		return;
+
+	/* Don't create the default loop just to find it has no stats */
+	loop = current_loop ? current_loop : default_loop;
+	if ((! loop) || (! loop->stats))
+		return;
+
+	memset (&key, 0, sizeof (key));
+	key.type = type;
+	key.callback = callback;
+	key.object = object;
+
+	cb_stats = (NihLoopCallbackStats *)nih_hash_lookup (
+		loop->stats->callbacks, &key);
+	if (! cb_stats)
+		return;
+
+	key.object = NULL;
+	freed = nih_loop_callback_stats (loop->stats, &key, -1);
+	if (freed)
+		nih_loop_histogram_merge (&freed->latency,
+					  &cb_stats->latency);
+
+	nih_free (cb_stats);
+}
+
+/**
+ * nih_loop_callback_stats:
+ * @stats: instrumentation of loop,
+ * @key: callback identity,
+ * @detail: file descriptor of I/O watch, or -1.
+ *
+ * Finds the statistics for @key in @stats, adding them if they don't
+ * exist.  Instrumentation is best effort, so when out of memory the
+ * caller simply loses what it would have recorded.
+ *
+ * Returns: statistics for @key, or NULL if insufficient memory.
+ **/
+static NihLoopCallbackStats *
+nih_loop_callback_stats (NihLoopStats             *stats,
+			 const NihLoopCallbackKey *key,
+			 int                       detail)
+{
+	NihLoopCallbackStats *cb_stats;
+
+	nih_assert (stats != NULL);
+	nih_assert (key != NULL);
+
+	cb_stats = (NihLoopCallbackStats *)nih_hash_lookup (stats->callbacks,
+							    key);
+	if (cb_stats)
+		return cb_stats;
+
+	cb_stats = nih_new (stats->callbacks, NihLoopCallbackStats);
+	if (! cb_stats)
+		return NULL;
+
+	nih_list_init (&cb_stats->entry);
+	nih_alloc_set_destructor (cb_stats, nih_list_destroy);
+
+	cb_stats->key = *key;
+	cb_stats->detail = detail;
+	memset (&cb_stats->latency, 0, sizeof (NihLoopHistogram));
+
+	nih_hash_add (stats->callbacks, &cb_stats->entry);
+
+	return cb_stats;
+}
+
+/**
+ * nih_loop_timer_lateness:
+ * @now: current time,
+ * @due: time timer was due.
+ *
+ * Called before a loop dispatches a timer; if the current loop is
+ * instrumented, adds the time since @due to the timer lateness histogram.
+ **/
+void
+nih_loop_timer_lateness (const struct timespec *now,
+			 time_t                 due)
+{
+	NihLoopStats    *stats;
+	struct timespec  due_ts;
+
+	nih_assert (now != NULL);
+
+	stats = nih_loop_current ()->stats;
+	if (! stats)
+		return;
+
+	due_ts.tv_sec = due;
+	due_ts.tv_nsec = 0;
+
+	nih_loop_histogram_add (&stats->timer_lateness,
+				nih_loop_elapsed (&due_ts, now));
+}
+
+
+/**
+ * nih_loop_stats_format:
+ * @parent: parent object for new string,
+ * @loop: instrumented loop.
+ *
+ * Formats the instrumentation of @loop as text, one line for the loop
+ * itself, one for the timer lateness histogram and one for each callback;
+ * times are in nanoseconds, and percentiles are accurate to 25%.
+ *
+ * The returned string is suitable for writing to a log or debug file, or
+ * for returning from a D-Bus method or property.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string or NULL if insufficient memory.
+ **/
+char *
+nih_loop_stats_format (const void *parent,
+		       NihLoop    *loop)
+{
+	NihLoopStats *stats;
+	char         *str;
+
+	nih_assert (loop != NULL);
+	nih_assert (loop->stats != NULL);
+
+	stats = loop->stats;
+
+	str = nih_sprintf (parent, "loop iterations %llu wait %llu "
+			   "dispatch %llu\n",
+			   (unsigned long long)stats->iterations,
+			   (unsigned long long)stats->wait_time,
+			   (unsigned long long)stats->dispatch_time);
+	if (! str)
+		return NULL;
+
+	if (! nih_strcat (&str, parent, "timer-lateness"))
+		goto error;
+	if (! nih_loop_histogram_format (&str, parent, &stats->timer_lateness))
+		goto error;
+
+	NIH_HASH_FOREACH (stats->callbacks, iter) {
+		NihLoopCallbackStats *cb_stats = (NihLoopCallbackStats *)iter;
+		const char           *name;
+		char                  func[128];
+
+		name = callback_type_names[cb_stats->key.type];
+		nih_loop_symbolize (cb_stats->key.callback,
+				    func, sizeof (func));
+
+		if (! nih_strcat_sprintf (&str, parent, "%s %s", name, func))
+			goto error;
+		if (cb_stats->key.object
+		    && (! nih_strcat_sprintf (&str, parent, " fd %d",
+					      cb_stats->detail)))
+			goto error;
+		if (! nih_loop_histogram_format (&str, parent,
+						 &cb_stats->latency))
+			goto error;
+	}
+
+	return str;
+
+error:
+	nih_free (str);
+	return NULL;
+}
+
+/**
+ * nih_loop_stats_dump:
+ * @loop: instrumented loop,
+ * @fd: file descriptor to write to.
+ *
+ * Writes the instrumentation of @loop, as formatted by
+ * nih_loop_stats_format(), to @fd.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_loop_stats_dump (NihLoop *loop,
+		     int      fd)
+{
+	nih_local char *str = NULL;
+	size_t          len, off;
+
+	nih_assert (loop != NULL);
+	nih_assert (fd >= 0);
+
+	str = nih_loop_stats_format (NULL, loop);
+	if (! str)
+		nih_return_no_memory_error (-1);
+
+	len = strlen (str);
+	off = 0;
+	while (off < len) {
+		ssize_t ret;
+
+		ret = write (fd, str + off, len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_return_system_error (-1);
+		}
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+
+/**
+ * nih_loop_callback_key:
+ * @entry: entry in callbacks hash.
+ *
+ * Returns: key of the callback statistics @entry.
+ **/
+static const void *
+nih_loop_callback_key (NihList *entry)
+{
+	nih_assert (entry != NULL);
+
+	return &((NihLoopCallbackStats *)entry)->key;
+}
+
+/**
+ * nih_loop_callback_hash:
+ * @key: NihLoopCallbackKey to hash.
+ *
+ * Returns: hash of the function pointer, object and type of @key.
+ **/
+static uint32_t
+nih_loop_callback_hash (const void *key)
+{
+	const NihLoopCallbackKey *cb_key = key;
+	uint64_t                  value;
+
+	nih_assert (key != NULL);
+
+	value = (uint64_t)(uintptr_t)cb_key->callback;
+	value ^= (uint64_t)(uintptr_t)cb_key->object * 31;
+	value ^= value >> 29;
+	value *= 0x9e3779b97f4a7c15ULL;
+
+	return (uint32_t)(value >> 32) ^ cb_key->type;
+}
+
+/**
+ * nih_loop_callback_cmp:
+ * @key1: NihLoopCallbackKey to compare,
+ * @key2: NihLoopCallbackKey to compare against.
+ *
+ * Returns: zero if @key1 and @key2 are the same, non-zero otherwise.
+ **/
+static int
+nih_loop_callback_cmp (const void *key1,
+		       const void *key2)
+{
+	const NihLoopCallbackKey *cb_key1 = key1;
+	const NihLoopCallbackKey *cb_key2 = key2;
+
+	nih_assert (key1 != NULL);
+	nih_assert (key2 != NULL);
+
+	if (cb_key1->type != cb_key2->type)
+		return (int)cb_key1->type - (int)cb_key2->type;
+
+	if (cb_key1->callback != cb_key2->callback)
+		return ((uintptr_t)cb_key1->callback
+			< (uintptr_t)cb_key2->callback) ? -1 : 1;
+
+	if (cb_key1->object != cb_key2->object)
+		return ((uintptr_t)cb_key1->object
+			< (uintptr_t)cb_key2->object) ? -1 : 1;
+
+	return 0;
+}
+
+
+/**
+ * nih_loop_elapsed:
+ * @start: start time,
+ * @end: end time.
+ *
+ * Returns: nanoseconds from @start to @end, or zero if @end is earlier.
+ **/
+static uint64_t
+nih_loop_elapsed (const struct timespec *start,
+		  const struct timespec *end)
+{
+	int64_t elapsed;
+
+	nih_assert (start != NULL);
+	nih_assert (end != NULL);
+
+	elapsed = ((int64_t)(end->tv_sec - start->tv_sec) * 1000000000LL
+		   + (end->tv_nsec - start->tv_nsec));
+
+	return elapsed > 0 ? (uint64_t)elapsed : 0;
+}
+
+/**
+ * nih_loop_histogram_add:
+ * @histogram: histogram to add to,
+ * @value: value in nanoseconds.
+ *
+ * Adds @value to the appropriate bucket of @histogram; see
+ * NIH_LOOP_STATS_BUCKETS for the bucket layout.
+ **/
+static void
+nih_loop_histogram_add (NihLoopHistogram *histogram,
+			uint64_t          value)
+{
+	size_t bucket;
+
+	nih_assert (histogram != NULL);
+
+	if (value < 4) {
+		bucket = value;
+	} else {
+		int exp;
+
+		exp = 63 - __builtin_clzll (value);
+		bucket = (exp - 1) * 4 + ((value >> (exp - 2)) & 3);
+		bucket = nih_min (bucket, NIH_LOOP_STATS_BUCKETS - 1U);
+	}
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total += value;
+	histogram->max = nih_max (histogram->max, value);
+}
+
+/**
+ * nih_loop_histogram_merge:
+ * @histogram: histogram to add to,
+ * @other: histogram to add.
+ *
+ * Adds the values recorded in @other to @histogram.
+ **/
+static void
+nih_loop_histogram_merge (NihLoopHistogram       *histogram,
+			  const NihLoopHistogram *other)
+{
+	size_t i;
+
+	nih_assert (histogram != NULL);
+	nih_assert (other != NULL);
+
+	for (i = 0; i < NIH_LOOP_STATS_BUCKETS; i++)
+		histogram->buckets[i] += other->buckets[i];
+
+	histogram->count += other->count;
+	histogram->total += other->total;
+	histogram->max = nih_max (histogram->max, other->max);
+}
+
+/**
+ * nih_loop_histogram_pct:
+ * @histogram: histogram to examine,
+ * @percent: percentile to find.
+ *
+ * Returns: smallest value of the bucket in which the @percent percentile
+ * of @histogram lies, no larger than the largest value recorded.
+ **/
+static uint64_t
+nih_loop_histogram_pct (const NihLoopHistogram *histogram,
+			       unsigned int            percent)
+{
+	uint64_t target, seen;
+	size_t   bucket;
+
+	nih_assert (histogram != NULL);
+	nih_assert (percent <= 100);
+
+	if (! histogram->count)
+		return 0;
+
+	target = (histogram->count * percent + 99) / 100;
+	if (! target)
+		target = 1;
+
+	seen = 0;
+	for (bucket = 0; bucket < NIH_LOOP_STATS_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen >= target)
+			break;
+	}
+
+	if (bucket >= 4) {
+		uint64_t value;
+
+		value = ((uint64_t)(4 + bucket % 4)) << (bucket / 4 - 1);
+
+		return nih_min (value, histogram->max);
+	}
+
+	return bucket;
+}
+
+/**
+ * nih_loop_histogram_format:
+ * @str: pointer to string to append to,
+ * @parent: parent object of new string,
+ * @histogram: histogram to format.
+ *
+ * Appends the count, mean, 50th, 90th and 99th percentiles and the
+ * maximum of @histogram to the string pointed to by @str, followed by a
+ * newline.
+ *
+ * Returns: new string pointer or NULL if insufficient memory.
+ **/
+static char *
+nih_loop_histogram_format (char                  **str,
+			   const void             *parent,
+			   const NihLoopHistogram *histogram)
+{
+	nih_assert (str != NULL);
+	nih_assert (histogram != NULL);
+
+	return nih_strcat_sprintf (
+		str, parent,
+		" count %llu mean %llu p50 %llu p90 %llu p99 %llu max %llu\n",
+		(unsigned long long)histogram->count,
+		(unsigned long long)(histogram->count
+				     ? histogram->total / histogram->count
+				     : 0),
+		(unsigned long long)nih_loop_histogram_pct (histogram,
+								   50),
+		(unsigned long long)nih_loop_histogram_pct (histogram,
+								   90),
+		(unsigned long long)nih_loop_histogram_pct (histogram,
+								   99),
+		(unsigned long long)histogram->max);
+}
@@ -0,0 +1,353 @@
+/* libnih
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NIH_LOOP_H
+#define NIH_LOOP_H
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+#include <time.h>
+#include <pthread.h>
+
+
+/**
+ * NIH_LOOP_STATS_BUCKETS:
+ *
+ * Number of buckets in a latency histogram; values under four nanoseconds
+ * each have their own bucket, above that each power of two is split into
+ * four buckets, so the error is bounded to 25%.  The last bucket holds all
+ * values of around 32 minutes or more.
+ **/
+#define NIH_LOOP_STATS_BUCKETS 160
+
+
+/**
+ * NihLoopPriority:
+ *
+ * Priority class of an I/O watch or loop function.  In each iteration
+ * the loop calls those of high priority before those of default priority,
+ * and those before those of low priority; when the loop has a time budget,
+ * work of less than high priority may be deferred to a later iteration
+ * once the budget has been spent.
+ **/
+typedef enum nih_loop_priority {
+	NIH_LOOP_PRIORITY_HIGH,
+	NIH_LOOP_PRIORITY_DEFAULT,
+	NIH_LOOP_PRIORITY_LOW,
+
+	NIH_LOOP_PRIORITY_COUNT
+} NihLoopPriority;
+
+
+/**
+ * NihLoopCallbackType:
+ *
+ * Identifies the kind of structure whose callback was dispatched by a
+ * loop, for instrumentation.
+ **/
+typedef enum nih_loop_callback_type {
+	NIH_LOOP_IO_WATCH,
+	NIH_LOOP_TIMER,
+	NIH_LOOP_SIGNAL,
+	NIH_LOOP_CHILD_WATCH,
+	NIH_LOOP_FUNC,
+	NIH_LOOP_POST
+} NihLoopCallbackType;
+
+/**
+ * NihLoopCallback:
+ *
+ * Generic function pointer type used to identify a dispatched callback,
+ * whatever its real type.
+ **/
+typedef void (*NihLoopCallback) (void);
+
+/**
+ * NihLoopHistogram:
+ * @count: number of values recorded,
+ * @total: sum of values recorded,
+ * @max: largest value recorded,
+ * @buckets: count of values recorded in each bucket.
+ *
+ * Log-linear histogram of nanosecond latencies, see
+ * NIH_LOOP_STATS_BUCKETS.
+ **/
+typedef struct nih_loop_histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[NIH_LOOP_STATS_BUCKETS];
+} NihLoopHistogram;
+
+/**
+ * NihLoopCallbackKey:
+ * @type: kind of structure dispatched,
+ * @callback: callback function called,
+ * @object: I/O watch dispatched, or NULL.
+ *
+ * Identifies a callback in the instrumentation of a loop.  I/O watches are
+ * counted individually, since most share a watcher function such as that
+ * of NihIo; once a watch is freed, its counts are added to those with
+ * NULL @object.  All other structures of the same type with the same
+ * callback function are counted together, with NULL @object.
+ **/
+typedef struct nih_loop_callback_key {
+	NihLoopCallbackType  type;
+	NihLoopCallback      callback;
+	const void          *object;
+} NihLoopCallbackKey;
+
+/**
+ * NihLoopCallbackStats:
+ * @entry: hash table entry,
+ * @key: callback identity,
+ * @detail: file descriptor of I/O watch, or -1,
+ * @latency: histogram of time spent in the callback.
+ *
+ * This structure holds the instrumentation for a single callback.
+ **/
+typedef struct nih_loop_callback_stats {
+	NihList            entry;
+	NihLoopCallbackKey key;
+	int                detail;
+
+	NihLoopHistogram   latency;
+} NihLoopCallbackStats;
+
+/**
+ * NihLoopStats:
+ * @iterations: number of loop iterations,
+ * @wait_time: nanoseconds spent waiting in select(),
+ * @dispatch_time: nanoseconds spent dispatching events,
+ * @timer_lateness: histogram of how late timers were called,
+ * @callbacks: hash table of NihLoopCallbackStats.
+ *
+ * This structure holds the instrumentation of a loop, enabled with
+ * nih_loop_stats_enable().
+ **/
+typedef struct nih_loop_stats {
+	uint64_t          iterations;
+	uint64_t          wait_time;
+	uint64_t          dispatch_time;
+
+	NihLoopHistogram  timer_lateness;
+
+	NihHash          *callbacks;
+} NihLoopStats;
+
+/**
+ * NihLoopWatchdog:
+ * @threshold: milliseconds a callback may run before being reported,
+ * @fd: file descriptor reports are written to,
+ * @backtrace: TRUE if reports should include a backtrace,
+ * @thread: helper thread,
+ * @lock: mutex protecting the following members,
+ * @cond: condition used to wake @thread,
+ * @shutdown: TRUE if @thread should exit,
+ * @active: TRUE while a callback is being dispatched,
+ * @reported: TRUE once the dispatched callback has been reported,
+ * @loop_thread: thread dispatching the callback,
+ * @start: time the callback was called,
+ * @type: kind of structure dispatched,
+ * @callback: callback function called,
+ * @object: structure dispatched,
+ * @detail: file descriptor, signal or process id, or -1,
+ * @depth: number of nested dispatches, only used by the loop thread.
+ *
+ * This structure holds the state of a slow callback watchdog, enabled
+ * with nih_loop_watchdog_enable().  The loop records each callback it
+ * dispatches here, and the helper thread reports any that are still
+ * running after @threshold.
+ **/
+typedef struct nih_loop_watchdog {
+	unsigned int         threshold;
+	int                  fd;
+	int                  backtrace;
+
+	pthread_t            thread;
+	pthread_mutex_t      lock;
+	pthread_cond_t       cond;
+	int                  shutdown;
+
+	int                  active;
+	int                  reported;
+	pthread_t            loop_thread;
+	struct timespec      start;
+	NihLoopCallbackType  type;
+	NihLoopCallback      callback;
+	const void          *object;
+	int                  detail;
+
+	int                  depth;
+} NihLoopWatchdog;
+
+
+/**
+ * NihLoopPostCb:
+ * @data: pointer given with callback.
+ *
+ * Posted callbacks are called once, from the loop they were posted to,
+ * during the iteration following the post.
+ **/
+typedef void (*NihLoopPostCb) (void *data);
+
+/**
+ * NihLoopPost:
+ * @next: next posted callback,
+ * @callback: function to call,
+ * @data: pointer to pass to @callback.
+ *
+ * This structure is a node in the queue of callbacks posted to a loop;
+ * it is allocated with malloc() by the posting thread and freed by the
+ * loop once @callback has been called.
+ **/
+typedef struct nih_loop_post {
+	struct nih_loop_post *next;
+
+	NihLoopPostCb         callback;
+	void                 *data;
+} NihLoopPost;
+
+/**
+ * NihLoop:
+ * @io_watches: list of NihIoWatch structures,
+ * @timers: list of NihTimer structures,
+ * @functions: list of NihMainLoopFunc structures,
+ * @ready_functions: list of NihMainLoopFunc structures woken since they
+ * were last called,
+ * @io_ring: io_uring completion ring, or NULL,
+ * @interrupt_fd: eventfd used to interrupt the loop,
+ * @exit_loop: TRUE if the loop should exit,
+ * @exit_status: status to exit the loop with,
+ * @post_head: most recently posted callback,
+ * @post_tail: next posted callback to be called,
+ * @post_stub: placeholder node for empty queue,
+ * @post_pending: TRUE if the loop has been interrupted for posts,
+ * @stats: instrumentation, or NULL if not enabled,
+ * @watchdog: slow callback watchdog, or NULL if not enabled,
+ * @budget: time budget for dispatching in each iteration in nanoseconds,
+ * or zero for no limit,
+ * @budget_start: time dispatching began in this iteration,
+ * @budget_exceeded: TRUE if work has been deferred in this iteration,
+ * @budget_waived: TRUE if the budget is not enforced in this iteration.
+ *
+ * This structure holds the state of a main loop; the watches, timers and
+ * functions registered with it and the means to interrupt and exit it.
+ *
+ * Each thread has a current loop, initially the default loop returned by
+ * nih_loop_default(), to which nih_io_add_watch(), nih_timer_add_timeout()
+ * and friends add their structures; nih_loop_run() makes the loop it runs
+ * the current loop for the duration, so anything added from within its
+ * callbacks is added to the same loop.
+ *
+ * Signals and child processes are process-wide, so are only handled by
+ * the default loop.
+ *
+ * Other threads may post callbacks to a loop with nih_loop_post(); these
+ * are held in a lock-free queue with many producers and the loop as its
+ * only consumer.  The loop is only interrupted by the first post after
+ * it last took callbacks from the queue, so a burst of posts costs a
+ * single wakeup.
+ *
+ * A loop may be given a time budget with nih_loop_set_budget(); once it
+ * has been spent in an iteration, any I/O watches and loop functions not
+ * of high priority that remain are deferred to the next iteration, which
+ * follows without sleeping.  The budget is not enforced in the iteration
+ * after one in which work was deferred, so low priority work is delayed
+ * but never starved.
+ **/
+typedef struct nih_loop {
+	NihList             *io_watches;
+	NihList             *timers;
+	NihList             *functions;
+	NihList             *ready_functions;
+
+	struct nih_io_ring  *io_ring;
+
+	int                  interrupt_fd;
+
+	int                  exit_loop;
+	int                  exit_status;
+
+	NihLoopPost         *post_head;
+	NihLoopPost         *post_tail;
+	NihLoopPost          post_stub;
+	int                  post_pending;
+
+	NihLoopStats        *stats;
+	NihLoopWatchdog     *watchdog;
+
+	uint64_t             budget;
+	struct timespec      budget_start;
+	int                  budget_exceeded;
+	int                  budget_waived;
+} NihLoop;
+
+
+NIH_BEGIN_EXTERN
+
+NihLoop *nih_loop_new              (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+int      nih_loop_destroy          (NihLoop *loop);
+
+NihLoop *nih_loop_default          (void);
+NihLoop *nih_loop_current          (void);
+NihLoop *nih_loop_set_current      (NihLoop *loop);
+
+int      nih_loop_run              (NihLoop *loop);
+void     nih_loop_interrupt        (NihLoop *loop);
+void     nih_loop_exit             (NihLoop *loop, int status);
+
+void     nih_loop_set_budget       (NihLoop *loop, uint64_t budget);
+int      nih_loop_defer            (NihLoop *loop, NihLoopPriority priority);
+
+int      nih_loop_post             (NihLoop *loop, NihLoopPostCb callback,
+				    void *data)
+	__attribute__ ((warn_unused_result));
+
+int      nih_loop_stats_enable     (NihLoop *loop)
+	__attribute__ ((warn_unused_result));
+void     nih_loop_stats_disable    (NihLoop *loop);
+char *   nih_loop_stats_format     (const void *parent, NihLoop *loop)
+	__attribute__ ((warn_unused_result, malloc));
+int      nih_loop_stats_dump       (NihLoop *loop, int fd)
+	__attribute__ ((warn_unused_result));
+
+int      nih_loop_watchdog_enable  (NihLoop *loop, unsigned int threshold,
+				    int fd, int with_backtrace)
+	__attribute__ ((warn_unused_result));
+void     nih_loop_watchdog_disable (NihLoop *loop);
+
+void     nih_loop_dispatch_begin   (struct timespec *start,
+				    NihLoopCallbackType type,
+				    NihLoopCallback callback,
+				    const void *object, int detail);
+void     nih_loop_dispatch_end     (const struct timespec *start,
+				    NihLoopCallbackType type,
+				    NihLoopCallback callback,
+				    const void *object, int detail);
+void     nih_loop_dispatch_forget  (NihLoopCallbackType type,
+				    NihLoopCallback callback,
+				    const void *object);
+void     nih_loop_timer_lateness   (const struct timespec *now, time_t due);
+
+NIH_END_EXTERN
+
+#endif /* NIH_LOOP_H */
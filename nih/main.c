@@ -26,7 +26,6 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 
 #include <time.h>
 #include <fcntl.h>
@@ -45,6 +44,7 @@
 #include <nih/io.h>
 #include <nih/error.h>
 #include <nih/logging.h>
+#include <nih/loop.h>
 
 #include "main.h"
 
@@ -127,35 +127,11 @@ const char *package_string = NULL;
 static char *pid_file = NULL;
 
 
-/**
- * interrupt_pipe:
- *
- * Pipe used for interrupting an active select() call in case a signal
- * comes in between the last time we handled the signal and the time we
- * ran the call.
- **/
-static int interrupt_pipe[2] = { -1, -1 };
-
-/**
- * exit_loop:
- *
- * Whether to exit the running main loop, set to TRUE by a call to
- * nih_main_loop_exit().
- **/
-static __thread int exit_loop = 0;
-
-/**
- * exit_status:
- *
- * Status to exit the running main loop with, set by nih_main_loop_exit().
- **/
-static __thread int exit_status = 0;
-
 /**
  * nih_main_loop_functions:
  *
- * List of functions to be called in each main loop iteration.  Each item
- * is an NihMainLoopFunc structure.
+ * List of functions to be called in each iteration of the default loop.
+ * Each item is an NihMainLoopFunc structure.
  **/
 NihList *nih_main_loop_functions = NULL;
 
@@ -503,27 +479,12 @@ nih_main_unlink_pidfile (void)
 /**
  * nih_main_loop_init:
  *
- * Initialise the loop functions list.
+ * Initialise the default loop, and thus the loop functions list.
  **/
 void
 nih_main_loop_init (void)
 {
-	if (! nih_main_loop_functions)
-		nih_main_loop_functions = NIH_MUST (nih_list_new (NULL));
-
-	/* Set up the interrupt pipe, we need it to be non blocking so that
-	 * we don't accidentally block if there's too many signals been
-	 * triggered or something
-	 */
-	if (interrupt_pipe[0] == -1) {
-		NIH_ZERO (pipe (interrupt_pipe));
-
-		nih_io_set_nonblock (interrupt_pipe[0]);
-		nih_io_set_nonblock (interrupt_pipe[1]);
-
-		nih_io_set_cloexec (interrupt_pipe[0]);
-		nih_io_set_cloexec (interrupt_pipe[1]);
-	}
+	nih_loop_default ();
 }
 
 /**
@@ -532,103 +493,27 @@ nih_main_loop_init (void)
  * Implements a fully functional main loop for a typical process, handling
  * I/O events, signals, termination of child processes, timers, etc.
  *
+ * This runs the default loop, see nih_loop_run().
+ *
  * Returns: value given to nih_main_loop_exit().
  **/
 int
 nih_main_loop (void)
 {
-	nih_main_loop_init ();
-
-	/* Set a handler for SIGCHLD so that it can interrupt syscalls */
-	nih_signal_set_handler (SIGCHLD, nih_signal_handler);
-
-	while (! exit_loop) {
-		NihTimer       *next_timer;
-		struct timespec now;
-		struct timeval  timeout;
-		fd_set          readfds, writefds, exceptfds;
-		char            buf[1];
-		int             nfds, ret;
-
-		/* Use the due time of the next timer to calculate how long
-		 * to spend in select().  That way we don't sleep for any
-		 * less or more time than we need to.
-		 */
-		next_timer = nih_timer_next_due ();
-		if (next_timer) {
-			nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
-
-			timeout.tv_sec = next_timer->due - now.tv_sec;
-			timeout.tv_usec = 0;
-		}
-
-		/* Start off with empty watch lists */
-		FD_ZERO (&readfds);
-		FD_ZERO (&writefds);
-		FD_ZERO (&exceptfds);
-
-		/* Always look for changes in the interrupt pipe */
-		FD_SET (interrupt_pipe[0], &readfds);
-		nfds = interrupt_pipe[0] + 1;
-
-		/* And look for changes in anything we're watching */
-		nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
-
-		/* Now we hang around until either a signal comes in (and
-		 * calls nih_main_loop_interrupt), a file descriptor we're
-		 * watching changes in some way or it's time to run a timer.
-		 */
-		ret = select (nfds, &readfds, &writefds, &exceptfds,
-			      (next_timer ? &timeout : NULL));
-
-		/* Deal with events */
-		if (ret > 0)
-			nih_io_handle_fds (&readfds, &writefds, &exceptfds);
-
-		/* Deal with signals.
-		 *
-		 * Clear the list first so that if a signal occurs while
-		 * handling signals it'll ensure that the functions get
-		 * a chance to decide whether to do anything next time round
-		 * without having to wait.
-		 */
-		while (read (interrupt_pipe[0], buf, sizeof (buf)) > 0)
-			;
-		nih_signal_poll ();
-
-		/* Deal with terminated children */
-		nih_child_poll ();
-
-		/* Deal with timers */
-		nih_timer_poll ();
-
-		/* Run the loop functions */
-		NIH_LIST_FOREACH_SAFE (nih_main_loop_functions, iter) {
-			NihMainLoopFunc *func = (NihMainLoopFunc *)iter;
-
-			func->callback (func->data, func);
-		}
-	}
-
-	exit_loop = 0;
-	return exit_status;
+	return nih_loop_run (nih_loop_default ());
 }
 
 /**
  * nih_main_loop_interrupt:
  *
- * Interrupts the current (or next) main loop iteration because of an
- * event that potentially needs immediate processing, or because some
+ * Interrupts the current (or next) iteration of the default loop because
+ * of an event that potentially needs immediate processing, or because some
  * condition of the main loop has been changed.
  **/
 void
 nih_main_loop_interrupt (void)
 {
-	nih_main_loop_init ();
-
-	if (interrupt_pipe[1] != -1)
-		while (write (interrupt_pipe[1], "", 1) < 0)
-			;
+	nih_loop_interrupt (nih_loop_default ());
 }
 
 /**
@@ -639,15 +524,15 @@ nih_main_loop_interrupt (void)
  * status; if the loop is in the middle of processing, it will exit once
  * all that processing is complete.
  *
+ * The loop exited is the current loop of this thread, which is the
+ * default loop unless another is being run; see nih_loop_exit().
+ *
  * This may be safely called by functions called by the main loop.
  **/
 void
 nih_main_loop_exit (int status)
 {
-	exit_status = status;
-	exit_loop = TRUE;
-
-	nih_main_loop_interrupt ();
+	nih_loop_exit (nih_loop_current (), status);
 }
 
 
@@ -658,7 +543,10 @@ nih_main_loop_exit (int status)
  * @data: pointer to pass to @callback.
  *
  * Adds @callback to the list of functions that should be called once
- * in each main loop iteration.
+ * in each iteration of the current loop, normally the default loop.
+ *
+ * The callback has default priority, this may be changed by setting its
+ * priority member.
  *
  * The callback structure is allocated using nih_alloc() and stored in a
  * linked list. Removal of the callback can be performed by freeing it.
@@ -679,8 +567,6 @@ nih_main_loop_add_func (const void    *parent,
 
 	nih_assert (callback != NULL);
 
-	nih_main_loop_init ();
-
 	func = nih_new (parent, NihMainLoopFunc);
 	if (! func)
 		return NULL;
@@ -691,12 +577,112 @@ nih_main_loop_add_func (const void    *parent,
 
 	func->callback = callback;
 	func->data = data;
+	func->ready_list = NULL;
+	func->priority = NIH_LOOP_PRIORITY_DEFAULT;
 
-	nih_list_add (nih_main_loop_functions, &func->entry);
+	nih_list_add (nih_loop_current ()->functions, &func->entry);
 
 	return func;
 }
 
+/**
+ * nih_main_loop_add_ready_func:
+ * @parent: parent object for new callback,
+ * @callback: function to call,
+ * @data: pointer to pass to @callback.
+ *
+ * Adds @callback to the current loop, normally the default loop, as a
+ * function that is only called in the iteration after it has been woken
+ * with nih_main_loop_func_wake().  Unlike functions added with
+ * nih_main_loop_add_func(), those waiting to be woken cost nothing, so
+ * this should be used when there may be many of them with little to do,
+ * such as one for each D-Bus connection.
+ *
+ * The callback is not woken initially, and has default priority.
+ *
+ * The callback structure is allocated using nih_alloc(). Removal of the
+ * callback can be performed by freeing it, which must be done before the
+ * loop is freed.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned callback.  When all parents
+ * of the returned callback are freed, the returned callback will also be
+ * freed.
+ *
+ * Returns: the function information, or NULL if insufficient memory.
+ **/
+NihMainLoopFunc *
+nih_main_loop_add_ready_func (const void    *parent,
+			      NihMainLoopCb  callback,
+			      void          *data)
+{
+	NihMainLoopFunc *func;
+
+	nih_assert (callback != NULL);
+
+	func = nih_new (parent, NihMainLoopFunc);
+	if (! func)
+		return NULL;
+
+	nih_list_init (&func->entry);
+
+	nih_alloc_set_destructor (func, nih_list_destroy);
+
+	func->callback = callback;
+	func->data = data;
+	func->ready_list = nih_loop_current ()->ready_functions;
+	func->priority = NIH_LOOP_PRIORITY_DEFAULT;
+
+	return func;
+}
+
+/**
+ * nih_main_loop_func_wake:
+ * @func: function to wake.
+ *
+ * Marks @func, added with nih_main_loop_add_ready_func(), as ready so
+ * that it is called once during the current or next iteration of its
+ * loop, which will not sleep until it has been.  Waking a function more
+ * than once before it is called has no further effect; waking it from
+ * within its own callback means it will be called again in the next
+ * iteration.
+ *
+ * Functions added with nih_main_loop_add_func() are called in every
+ * iteration anyway, so waking them has no effect.
+ *
+ * This must be called from the thread running the loop, other threads
+ * should use nih_loop_post().
+ **/
+void
+nih_main_loop_func_wake (NihMainLoopFunc *func)
+{
+	nih_assert (func != NULL);
+
+	if (func->ready_list && NIH_LIST_EMPTY (&func->entry))
+		nih_list_add (func->ready_list, &func->entry);
+}
+
+/**
+ * nih_main_loop_post:
+ * @callback: function to call,
+ * @data: pointer to pass to @callback.
+ *
+ * Arranges for @callback to be called once by the default loop during its
+ * next iteration; this may be called from any thread, so is the way for
+ * other threads to hand work to the main loop.  See nih_loop_post().
+ *
+ * Returns: zero on success, negative value with errno set to ENOMEM if
+ * insufficient memory.
+ **/
+int
+nih_main_loop_post (NihLoopPostCb  callback,
+		    void          *data)
+{
+	nih_assert (callback != NULL);
+
+	return nih_loop_post (nih_loop_default (), callback, data);
+}
+
 
 /**
  * nih_main_term_signal:
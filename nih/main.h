@@ -23,6 +23,7 @@
 #include <nih/macros.h>
 #include <nih/list.h>
 #include <nih/signal.h>
+#include <nih/loop.h>
 
 
 /**
@@ -43,19 +44,34 @@ typedef void (*NihMainLoopCb) (void *data, NihMainLoopFunc *loop);
  * NihMainLoopFunc:
  * @entry: list header,
  * @callback: function called,
- * @data: pointer passed to @callback.
+ * @data: pointer passed to @callback,
+ * @ready_list: list to add to when woken, or NULL,
+ * @priority: priority class of the function.
  *
  * This structure contains information about a function that should be
  * called once in each main loop iteration.
  *
+ * Functions added with nih_main_loop_add_ready_func() have @ready_list
+ * set, and are instead only called in the iteration after they have been
+ * woken with nih_main_loop_func_wake(); they are only held in the list
+ * while waiting to be called.
+ *
+ * Functions of higher @priority are called first, and those of less than
+ * high priority may be deferred to a later iteration when the loop has a
+ * time budget; @priority may be changed at any time, but must not be
+ * lowered by @callback itself.
+ *
  * The callback can be removed by using nih_list_remove() as they are
  * held in a list internally.
  **/
 struct nih_main_loop_func {
-	NihList        entry;
+	NihList          entry;
+
+	NihMainLoopCb    callback;
+	void            *data;
 
-	NihMainLoopCb  callback;
-	void          *data;
+	NihList         *ready_list;
+	NihLoopPriority  priority;
 };
 
 
@@ -139,6 +155,13 @@ void             nih_main_loop_exit      (int status);
 NihMainLoopFunc *nih_main_loop_add_func  (const void *parent,
 					  NihMainLoopCb callback, void *data)
 	__attribute__ ((warn_unused_result, malloc));
+NihMainLoopFunc *nih_main_loop_add_ready_func (const void *parent,
+					       NihMainLoopCb callback,
+					       void *data)
+	__attribute__ ((warn_unused_result, malloc));
+void             nih_main_loop_func_wake (NihMainLoopFunc *func);
+int              nih_main_loop_post      (NihLoopPostCb callback, void *data)
+	__attribute__ ((warn_unused_result));
 
 void             nih_main_term_signal    (void *data, NihSignal *signal);
 
@@ -31,6 +31,7 @@
 #include <nih/alloc.h>
 #include <nih/list.h>
 #include <nih/main.h>
+#include <nih/loop.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
@@ -338,12 +339,19 @@ nih_signal_poll (void)
 	nih_signal_init ();
 
 	NIH_LIST_FOREACH_SAFE (nih_signals, iter) {
-		NihSignal *signal = (NihSignal *)iter;
+		NihSignal *      signal = (NihSignal *)iter;
+		NihSignalHandler handler = signal->handler;
+		struct timespec  start;
 
 		if (! signals_caught[signal->signum])
 			continue;
 
+		nih_loop_dispatch_begin (&start, NIH_LOOP_SIGNAL,
+					 (NihLoopCallback)handler,
+					 signal, signal->signum);
 		signal->handler (signal->data, signal);
+		nih_loop_dispatch_end (&start, NIH_LOOP_SIGNAL,
+				       (NihLoopCallback)handler, signal, -1);
 	}
 
 	for (s = 0; s < NUM_SIGNALS; s++)
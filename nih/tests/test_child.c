@@ -27,16 +27,23 @@
 
 #include <sys/ptrace.h>
 
+#include <sys/resource.h>
+
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/list.h>
 #include <nih/string.h>
+#include <nih/io.h>
+#include <nih/loop.h>
 #include <nih/child.h>
+#include <nih/error.h>
 
 
 static int handler_called = 0;
@@ -58,6 +65,19 @@ my_handler (void           *data,
 	last_status = status;
 }
 
+static NihLoop *test_loop = NULL;
+
+static void
+my_exit_handler (void           *data,
+		 pid_t           pid,
+		 NihChildEvents  event,
+		 int             status)
+{
+	my_handler (data, pid, event, status);
+
+	nih_loop_exit (test_loop, 0);
+}
+
 void
 test_add_watch (void)
 {
@@ -65,6 +85,7 @@ test_add_watch (void)
 
 	TEST_FUNCTION ("nih_child_add_watch");
 	nih_child_poll ();
+	nih_io_init ();
 
 
 	/* Check that we can add a watch on a specific pid, and that the
@@ -87,6 +108,12 @@ test_add_watch (void)
 		TEST_EQ_P (watch->data, &watch);
 		TEST_LIST_NOT_EMPTY (&watch->entry);
 
+		TEST_GE (watch->pidfd, 0);
+		TEST_TRUE (fcntl (watch->pidfd, F_GETFD) & FD_CLOEXEC);
+		TEST_ALLOC_PARENT (watch->io_watch, watch);
+		TEST_EQ (watch->io_watch->fd, watch->pidfd);
+		TEST_EQ (watch->io_watch->events, NIH_IO_READ);
+
 		nih_free (watch);
 	}
 
@@ -111,11 +138,127 @@ test_add_watch (void)
 		TEST_EQ_P (watch->data, &watch);
 		TEST_LIST_NOT_EMPTY (&watch->entry);
 
+		TEST_EQ (watch->pidfd, -1);
+		TEST_EQ_P (watch->io_watch, NULL);
+
 		nih_free (watch);
 	}
 }
 
 
+void
+test_pidfd_watcher (void)
+{
+	NihChildWatch *watch;
+	fd_set         readfds, writefds, exceptfds;
+	pid_t          pid;
+	char          *argv[] = { "/bin/sh", "-c", "exit 5", NULL };
+
+	TEST_FUNCTION ("nih_child_pidfd_watcher");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+
+	/* Check that the termination of a child is delivered by the loop
+	 * current when its watch was added, even though that loop neither
+	 * handles SIGCHLD nor polls for children, and that the watch is
+	 * then freed along with the watch on its descriptor.
+	 */
+	TEST_FEATURE ("with terminated child");
+	TEST_CHILD (pid) {
+		exit (7);
+	}
+
+	watch = nih_child_add_watch (NULL, pid, NIH_CHILD_EXITED,
+				     my_exit_handler, &watch);
+	TEST_LIST_NOT_EMPTY (test_loop->io_watches);
+
+	TEST_FREE_TAG (watch);
+
+	handler_called = 0;
+	last_data = NULL;
+	last_pid = 0;
+	last_event = -1;
+	last_status = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (handler_called, 1);
+	TEST_EQ_P (last_data, &watch);
+	TEST_EQ (last_pid, pid);
+	TEST_EQ (last_event, NIH_CHILD_EXITED);
+	TEST_EQ (last_status, 7);
+	TEST_FREE (watch);
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+	TEST_LT (waitpid (-1, NULL, WNOHANG), 0);
+	TEST_EQ (errno, ECHILD);
+
+
+	/* Check that a spawned child is watched in the same way. */
+	TEST_FEATURE ("with spawned child");
+	watch = nih_child_spawn (NULL, "/bin/sh", argv, NULL,
+				 my_exit_handler, &watch);
+	TEST_NE_P (watch, NULL);
+	TEST_GE (watch->pidfd, 0);
+
+	pid = watch->pid;
+
+	TEST_FREE_TAG (watch);
+
+	handler_called = 0;
+	last_pid = 0;
+	last_event = -1;
+	last_status = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (handler_called, 1);
+	TEST_EQ (last_pid, pid);
+	TEST_EQ (last_event, NIH_CHILD_EXITED);
+	TEST_EQ (last_status, 5);
+	TEST_FREE (watch);
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+
+	/* Check that when the child has been reaped by someone else, the
+	 * handler is not called and the watch stops watching the
+	 * descriptor rather than finding it readable forever.
+	 */
+	TEST_FEATURE ("with child reaped elsewhere");
+	TEST_CHILD (pid) {
+		exit (0);
+	}
+
+	watch = nih_child_add_watch (NULL, pid, NIH_CHILD_EXITED,
+				     my_handler, &watch);
+
+	TEST_FREE_TAG (watch);
+
+	waitpid (pid, NULL, 0);
+
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+	FD_SET (watch->pidfd, &readfds);
+
+	handler_called = 0;
+
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_FALSE (handler_called);
+	TEST_NOT_FREE (watch);
+	TEST_EQ (watch->pidfd, -1);
+	TEST_EQ_P (watch->io_watch, NULL);
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+	nih_free (watch);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
 void
 test_poll (void)
 {
@@ -647,12 +790,294 @@ test_poll (void)
 }
 
 
+void
+test_spawn (void)
+{
+	NihChildWatch   *watch;
+	NihChildOptions  options;
+	NihChildFd       fds[2];
+	NihChildRlimit   rlimits[1];
+	NihError        *err;
+	siginfo_t        siginfo;
+	pid_t            pid;
+	char            *env[2];
+	char            *argv[4];
+	char             buf[80];
+	ssize_t          len;
+	int              out[2], in[2];
+
+	TEST_FUNCTION ("nih_child_spawn");
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[3] = NULL;
+
+
+	/* Check that we can spawn a child process, that a watch is
+	 * returned for it, and that the handler is called with its exit
+	 * status once it has exited, after which the watch is freed.
+	 */
+	TEST_FEATURE ("with simple child");
+	argv[2] = "exit 3";
+
+	TEST_ALLOC_FAIL {
+		watch = nih_child_spawn (NULL, "/bin/sh", argv, NULL,
+					 my_handler, &watch);
+
+		/* Failing to watch the descriptor referring to the child
+		 * only leaves it to nih_child_poll().
+		 */
+		if (test_alloc_failed && watch) {
+			TEST_EQ (watch->pidfd, -1);
+			TEST_EQ_P (watch->io_watch, NULL);
+		} else if (test_alloc_failed) {
+			TEST_EQ_P (watch, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			TEST_LT (waitpid (-1, NULL, WNOHANG), 0);
+			TEST_EQ (errno, ECHILD);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (watch, sizeof (NihChildWatch));
+		TEST_GT (watch->pid, 0);
+		TEST_EQ (watch->events, (NIH_CHILD_EXITED | NIH_CHILD_KILLED
+					 | NIH_CHILD_DUMPED));
+		TEST_EQ_P (watch->handler, my_handler);
+		TEST_EQ_P (watch->data, &watch);
+		TEST_LIST_NOT_EMPTY (&watch->entry);
+
+		pid = watch->pid;
+
+		TEST_FREE_TAG (watch);
+
+		handler_called = 0;
+		last_pid = 0;
+		last_event = -1;
+		last_status = 0;
+
+		waitid (P_PID, pid, &siginfo, WEXITED | WNOWAIT);
+
+		nih_child_poll ();
+
+		TEST_TRUE (handler_called);
+		TEST_EQ (last_pid, pid);
+		TEST_EQ (last_event, NIH_CHILD_EXITED);
+		TEST_EQ (last_status, 3);
+		TEST_FREE (watch);
+	}
+
+
+	/* Check that descriptors may be set up in the child, including
+	 * where the descriptor we give is the number of another we want
+	 * set up; and that the child may be given its own environment.
+	 * The shell reads from the descriptor numbered like our out[1],
+	 * which is our in[0], and writes to 3, which is our out[1].
+	 */
+	TEST_FEATURE ("with descriptors and environment");
+	assert0 (pipe2 (out, O_CLOEXEC));
+	assert0 (pipe2 (in, O_CLOEXEC));
+
+	fds[0].fd = in[0];
+	fds[0].child_fd = out[1];
+	fds[1].fd = out[1];
+	fds[1].child_fd = 3;
+
+	env[0] = "FOO=bar";
+	env[1] = NULL;
+
+	memset (&options, 0, sizeof (options));
+	options.env = env;
+	options.fds = fds;
+	options.nfds = 2;
+
+	argv[2] = nih_sprintf (NULL, "read x <&%d; echo $x $FOO >&3",
+			       out[1]);
+
+	watch = nih_child_spawn (NULL, "/bin/sh", argv, &options,
+				 my_handler, NULL);
+	TEST_NE_P (watch, NULL);
+	pid = watch->pid;
+
+	close (in[0]);
+	close (out[1]);
+
+	assert (write (in[1], "hello\n", 6) == 6);
+	close (in[1]);
+
+	len = read (out[0], buf, sizeof (buf) - 1);
+	TEST_GT (len, 0);
+	buf[len] = '\0';
+	TEST_EQ_STR (buf, "hello bar\n");
+	close (out[0]);
+
+	handler_called = 0;
+	waitid (P_PID, pid, &siginfo, WEXITED | WNOWAIT);
+	nih_child_poll ();
+
+	TEST_TRUE (handler_called);
+	TEST_EQ (last_event, NIH_CHILD_EXITED);
+	TEST_EQ (last_status, 0);
+
+	nih_free (argv[2]);
+
+
+	/* Check that the child may be made a session leader. */
+	TEST_FEATURE ("with new session");
+	assert0 (pipe2 (in, O_CLOEXEC));
+
+	argv[2] = "read x";
+
+	fds[0].fd = in[0];
+	fds[0].child_fd = STDIN_FILENO;
+
+	memset (&options, 0, sizeof (options));
+	options.fds = fds;
+	options.nfds = 1;
+	options.setsid = TRUE;
+
+	watch = nih_child_spawn (NULL, "/bin/sh", argv, &options,
+				 my_handler, NULL);
+	TEST_NE_P (watch, NULL);
+	pid = watch->pid;
+
+	close (in[0]);
+
+	TEST_EQ (getsid (pid), pid);
+	TEST_NE (getsid (0), pid);
+
+	close (in[1]);
+
+	handler_called = 0;
+	waitid (P_PID, pid, &siginfo, WEXITED | WNOWAIT);
+	nih_child_poll ();
+
+	TEST_TRUE (handler_called);
+
+
+	/* Check that resource limits may be set in the child. */
+	TEST_FEATURE ("with resource limits");
+	assert0 (pipe2 (out, O_CLOEXEC));
+
+	argv[2] = "ulimit -n";
+
+	fds[0].fd = out[1];
+	fds[0].child_fd = STDOUT_FILENO;
+
+	rlimits[0].resource = RLIMIT_NOFILE;
+	rlimits[0].limit.rlim_cur = 42;
+	rlimits[0].limit.rlim_max = 42;
+
+	memset (&options, 0, sizeof (options));
+	options.fds = fds;
+	options.nfds = 1;
+	options.rlimits = rlimits;
+	options.nrlimits = 1;
+
+	watch = nih_child_spawn (NULL, "/bin/sh", argv, &options,
+				 my_handler, NULL);
+	TEST_NE_P (watch, NULL);
+	pid = watch->pid;
+
+	close (out[1]);
+
+	len = read (out[0], buf, sizeof (buf) - 1);
+	TEST_GT (len, 0);
+	buf[len] = '\0';
+	TEST_EQ_STR (buf, "42\n");
+	close (out[0]);
+
+	handler_called = 0;
+	waitid (P_PID, pid, &siginfo, WEXITED | WNOWAIT);
+	nih_child_poll ();
+
+	TEST_TRUE (handler_called);
+
+
+	/* Check that when the program cannot be executed, the error is
+	 * raised, no watch returned and the child already reaped.
+	 */
+	TEST_FEATURE ("with missing program");
+	watch = nih_child_spawn (NULL, "/nonexistent", argv, NULL,
+				 my_handler, NULL);
+
+	TEST_EQ_P (watch, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+	TEST_LT (waitpid (-1, NULL, WNOHANG), 0);
+	TEST_EQ (errno, ECHILD);
+
+
+	/* Check that failure to set up the child is also raised. */
+	TEST_FEATURE ("with bad descriptor");
+	fds[0].fd = 1000;
+	fds[0].child_fd = STDIN_FILENO;
+
+	memset (&options, 0, sizeof (options));
+	options.fds = fds;
+	options.nfds = 1;
+
+	watch = nih_child_spawn (NULL, "/bin/sh", argv, &options,
+				 my_handler, NULL);
+
+	TEST_EQ_P (watch, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, EBADF);
+	nih_free (err);
+
+	TEST_LT (waitpid (-1, NULL, WNOHANG), 0);
+	TEST_EQ (errno, ECHILD);
+
+
+	/* Check that an error is still raised when one of the descriptors
+	 * set up in the child has the number of the pipe the error is
+	 * reported through; that is the next free descriptor after the
+	 * one for the pipe's read end.
+	 */
+	TEST_FEATURE ("with descriptor numbered like error pipe");
+	assert0 (pipe2 (in, O_CLOEXEC));
+	assert0 (pipe2 (out, O_CLOEXEC));
+	close (out[0]);
+	close (out[1]);
+
+	fds[0].fd = in[1];
+	fds[0].child_fd = out[1];
+
+	memset (&options, 0, sizeof (options));
+	options.fds = fds;
+	options.nfds = 1;
+
+	watch = nih_child_spawn (NULL, "/nonexistent", argv, &options,
+				 my_handler, NULL);
+
+	TEST_EQ_P (watch, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+	TEST_LT (waitpid (-1, NULL, WNOHANG), 0);
+	TEST_EQ (errno, ECHILD);
+
+	close (in[0]);
+	close (in[1]);
+}
+
+
 int
 main (int   argc,
       char *argv[])
 {
 	test_add_watch ();
 	test_poll ();
+	test_pidfd_watcher ();
+	test_spawn ();
 
 	return 0;
 }
@@ -770,6 +770,46 @@ test_next_token (void)
 	}
 
 
+	/* Check that a token longer than can be copied on the stack is
+	 * returned whole, dequoted and with the embedded newline collapsed.
+	 */
+	TEST_FEATURE ("with token longer than copy buffer");
+	TEST_ALLOC_FAIL {
+		buf[0] = '\"';
+		memset (buf + 1, 'a', 300);
+		memcpy (buf + 301, " \\\n ", 4);
+		memset (buf + 305, 'b', 300);
+		strcpy (buf + 605, "\" rest");
+		pos = 0;
+		lineno = 1;
+
+		str = nih_config_next_token (NULL, buf,
+					     strlen (buf), &pos, &lineno,
+					     NIH_CONFIG_CNLWS, TRUE);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (str, NULL);
+			TEST_EQ (pos, 0);
+			TEST_EQ (lineno, 2);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_EQ (pos, 607);
+		TEST_EQ (lineno, 2);
+		TEST_ALLOC_SIZE (str, 602);
+		TEST_EQ_MEM (str, buf + 1, 300);
+		TEST_EQ (str[300], ' ');
+		TEST_EQ_MEM (str + 301, buf + 305, 300);
+		TEST_EQ (str[601], '\0');
+
+		nih_free (str);
+	}
+
+
 	/* Check that an error is raised if there is no token at that
 	 * position.
 	 */
@@ -2399,13 +2439,86 @@ static NihConfigStanza any_stanzas[] = {
 	NIH_CONFIG_LAST
 };
 
+static NihConfigStanza dup_stanzas[] = {
+	{ "foo", my_handler },
+	{ "", my_handler },
+	{ "foo", my_handler },
+	{ "", my_handler },
+
+	NIH_CONFIG_LAST
+};
+
+
+void
+test_stanza_table_new (void)
+{
+	NihConfigStanzaTable *table;
+	NihConfigStanzaEntry *entry;
+
+	TEST_FUNCTION ("nih_config_stanza_table_new");
+
+	/* Check that a table is created with an entry for each stanza in
+	 * the array, and no catch-all when the array doesn't have one.
+	 */
+	TEST_FEATURE ("with stanzas");
+	TEST_ALLOC_FAIL {
+		table = nih_config_stanza_table_new (NULL, stanzas);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (table, NULL);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (table, sizeof (NihConfigStanzaTable));
+		TEST_ALLOC_PARENT (table->stanzas, table);
+		TEST_EQ_P (table->catch_all, NULL);
+
+		entry = (NihConfigStanzaEntry *)nih_hash_lookup (
+			table->stanzas, "frodo");
+		TEST_NE_P (entry, NULL);
+		TEST_EQ_P (entry->stanza, &stanzas[2]);
+
+		entry = (NihConfigStanzaEntry *)nih_hash_lookup (
+			table->stanzas, "wibble");
+		TEST_EQ_P (entry, NULL);
+
+		nih_free (table);
+	}
+
+
+	/* Check that where names are repeated, the first entry with the
+	 * name is used and the last entry with the name "" is the
+	 * catch-all, as when the array is searched.
+	 */
+	TEST_FEATURE ("with repeated names");
+	TEST_ALLOC_FAIL {
+		table = nih_config_stanza_table_new (NULL, dup_stanzas);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (table, NULL);
+			continue;
+		}
+
+		TEST_EQ_P (table->catch_all, &dup_stanzas[3]);
+
+		entry = (NihConfigStanzaEntry *)nih_hash_lookup (
+			table->stanzas, "foo");
+		TEST_NE_P (entry, NULL);
+		TEST_EQ_P (entry->stanza, &dup_stanzas[0]);
+
+		nih_free (table);
+	}
+}
+
+
 void
 test_parse_stanza (void)
 {
-	char      buf[1024];
-	size_t    pos, lineno;
-	int       ret;
-	NihError *err;
+	NihConfigStanzaTable *table;
+	char                  buf[1024];
+	size_t                pos, lineno;
+	int                   ret;
+	NihError             *err;
 
 	TEST_FUNCTION ("nih_config_stanza");
 	program_name = "test";
@@ -2546,6 +2659,87 @@ test_parse_stanza (void)
 	TEST_EQ (ret, 100);
 
 
+	/* Check that the handler is found in a compiled table, and is
+	 * called with the same arguments as when found in the array.
+	 */
+	TEST_FEATURE ("with stanza table");
+	table = nih_config_stanza_table_new (NULL, stanzas);
+	strcpy (buf, "bar this is a test\nwibble\n");
+	pos = 0;
+	lineno = 1;
+
+	handler_called = 0;
+	last_data = NULL;
+	last_stanza = NULL;
+	last_file = NULL;
+	last_len = 0;
+	last_pos = -1;
+	last_lineno = 0;
+
+	ret = nih_config_parse_stanza_table (buf, strlen (buf), &pos, &lineno,
+					     table, &ret);
+
+	TEST_TRUE (handler_called);
+	TEST_EQ_P (last_data, &ret);
+	TEST_EQ_P (last_stanza, &stanzas[1]);
+	TEST_EQ_P (last_file, buf);
+	TEST_EQ (last_len, strlen (buf));
+	TEST_EQ (last_pos, 4);
+	TEST_EQ (last_lineno, 1);
+
+	TEST_EQ (ret, 100);
+	TEST_EQ (pos, 19);
+	TEST_EQ (lineno, 2);
+
+
+	/* Check that an unknown stanza raises an error when the compiled
+	 * table has no catch-all.
+	 */
+	TEST_FEATURE ("with unknown stanza in stanza table");
+	strcpy (buf, "wibble this is a test\nwibble\n");
+	pos = 0;
+	lineno = 1;
+
+	handler_called = 0;
+
+	ret = nih_config_parse_stanza_table (buf, strlen (buf), &pos, &lineno,
+					     table, &ret);
+
+	TEST_FALSE (handler_called);
+	TEST_LT (ret, 0);
+	TEST_EQ (pos, 0);
+	TEST_EQ (lineno, 1);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNKNOWN_STANZA);
+	nih_free (err);
+
+	nih_free (table);
+
+
+	/* Check that an unknown stanza is handled by the catch-all of a
+	 * compiled table.
+	 */
+	TEST_FEATURE ("with unknown stanza and catch-all in stanza table");
+	table = nih_config_stanza_table_new (NULL, dup_stanzas);
+	pos = 0;
+
+	handler_called = 0;
+	last_stanza = NULL;
+	last_pos = -1;
+
+	ret = nih_config_parse_stanza_table (buf, strlen (buf), &pos, NULL,
+					     table, &ret);
+
+	TEST_TRUE (handler_called);
+	TEST_EQ_P (last_stanza, &dup_stanzas[3]);
+	TEST_EQ (last_pos, 7);
+
+	TEST_EQ (ret, 100);
+
+	nih_free (table);
+
+
 	/* Check that an error is raised if there is no stanza at this
 	 * position in the file.
 	 */
@@ -2573,10 +2767,11 @@ test_parse_stanza (void)
 void
 test_parse_file (void)
 {
-	char      buf[1024];
-	size_t    pos, lineno;
-	int       ret;
-	NihError *err;
+	NihConfigStanzaTable *table;
+	char                  buf[1024];
+	size_t                pos, lineno;
+	int                   ret;
+	NihError             *err;
 
 	TEST_FUNCTION ("nih_config_parse_file");
 
@@ -2611,6 +2806,40 @@ test_parse_file (void)
 	TEST_EQ (last_lineno, 2);
 
 
+	/* Check that the same sequence of stanzas is parsed when given a
+	 * compiled table rather than the array.
+	 */
+	TEST_FEATURE ("with stanza table");
+	table = nih_config_stanza_table_new (NULL, stanzas);
+	strcpy (buf, "frodo test\nbilbo test\n");
+	pos = 0;
+	lineno = 1;
+
+	handler_called = 0;
+	last_data = NULL;
+	last_stanza = NULL;
+	last_file = NULL;
+	last_len = 0;
+	last_pos = -1;
+	last_lineno = 0;
+
+	ret = nih_config_parse_file_table (buf, strlen (buf), &pos, &lineno,
+					   table, &buf);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (pos, 22);
+
+	TEST_EQ (handler_called, 2);
+	TEST_EQ_P (last_data, &buf);
+	TEST_EQ_P (last_stanza, &stanzas[3]);
+	TEST_EQ_P (last_file, buf);
+	TEST_EQ (last_len, strlen (buf));
+	TEST_EQ (last_pos, 17);
+	TEST_EQ (last_lineno, 2);
+
+	nih_free (table);
+
+
 	/* Check that a line ending in a comment can be parsed, with the
 	 * comment skipped.
 	 */
@@ -2815,11 +3044,12 @@ test_parse_file (void)
 void
 test_parse (void)
 {
-	FILE     *fd;
-	char      filename[PATH_MAX];
-	size_t    pos, lineno;
-	NihError *err;
-	int       ret;
+	NihConfigStanzaTable *table;
+	FILE                 *fd;
+	char                  filename[PATH_MAX];
+	size_t                pos, lineno;
+	NihError             *err;
+	int                   ret;
 
 	TEST_FUNCTION ("nih_config_parse");
 
@@ -2854,6 +3084,35 @@ test_parse (void)
 	TEST_EQ (last_pos, 17);
 	TEST_EQ (last_lineno, 2);
 
+
+	/* Check that the file is parsed the same way with a compiled
+	 * table of stanzas.
+	 */
+	TEST_FEATURE ("with existing file and stanza table");
+	table = nih_config_stanza_table_new (NULL, stanzas);
+
+	handler_called = 0;
+	last_data = NULL;
+	last_file = NULL;
+	last_len = 0;
+	last_pos = -1;
+	last_lineno = 0;
+
+	lineno = 1;
+
+	ret = nih_config_parse_table (filename, NULL, &lineno, table, &ret);
+
+	TEST_EQ (ret, 0);
+
+	TEST_EQ (handler_called, 2);
+	TEST_EQ_P (last_data, &ret);
+	TEST_NE_P (last_file, NULL);
+	TEST_EQ (last_len, 22);
+	TEST_EQ (last_pos, 17);
+	TEST_EQ (last_lineno, 2);
+
+	nih_free (table);
+
 	unlink (filename);
 
 
@@ -2930,6 +3189,7 @@ main (int   argc,
 	test_parse_command ();
 	test_parse_block ();
 	test_skip_block ();
+	test_stanza_table_new ();
 	test_parse_stanza ();
 	test_parse_file ();
 	test_parse ();
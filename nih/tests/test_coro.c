@@ -0,0 +1,665 @@
+/* libnih
+ *
+ * test_coro.c - test suite for nih/coro.c
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/timer.h>
+#include <nih/child.h>
+#include <nih/io.h>
+#include <nih/main.h>
+#include <nih/loop.h>
+#include <nih/coro.h>
+#include <nih/error.h>
+
+
+static NihLoop *test_loop = NULL;
+static NihCoro *last_coro = NULL;
+static int      coro_step = 0;
+static int      coro_woken = FALSE;
+
+static void
+my_func (void    *data,
+	 NihCoro *coro)
+{
+	last_coro = coro;
+
+	nih_loop_exit (test_loop, 0);
+}
+
+
+void
+test_new (void)
+{
+	NihCoro *coro;
+	size_t   page_size;
+
+	TEST_FUNCTION ("nih_coro_new");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	page_size = sysconf (_SC_PAGESIZE);
+
+
+	/* Check that we can create a new coroutine with the default stack
+	 * size, and that it is woken so that it is started by the loop.
+	 */
+	TEST_FEATURE ("with default stack size");
+	TEST_ALLOC_FAIL {
+		coro = nih_coro_new (NULL, 0, my_func, &coro);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_EQ_P (coro, NULL);
+			TEST_LIST_EMPTY (test_loop->ready_functions);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (coro, sizeof (NihCoro));
+		TEST_EQ_P (coro->func, my_func);
+		TEST_EQ_P (coro->data, &coro);
+		TEST_NE_P (coro->stack, NULL);
+		TEST_EQ (coro->stack_size, NIH_CORO_STACK_SIZE + page_size);
+		TEST_FALSE (coro->running);
+		TEST_FALSE (coro->finished);
+
+		TEST_ALLOC_PARENT (coro->waker, coro);
+		TEST_EQ_P (coro->waker->entry.next, test_loop->ready_functions);
+
+		nih_free (coro);
+
+		TEST_LIST_EMPTY (test_loop->ready_functions);
+	}
+
+
+	/* Check that the stack size is rounded up to a whole number of
+	 * pages, and has a guard page added.
+	 */
+	TEST_FEATURE ("with stack size");
+	coro = nih_coro_new (NULL, page_size + 1, my_func, NULL);
+
+	TEST_EQ (coro->stack_size, page_size * 3);
+
+	nih_free (coro);
+
+
+	/* Check that the coroutine function is called by the loop, and that
+	 * the coroutine is freed once it returns.
+	 */
+	TEST_FEATURE ("with function run by loop");
+	coro = nih_coro_new (NULL, 0, my_func, NULL);
+
+	TEST_FREE_TAG (coro);
+
+	last_coro = NULL;
+	nih_loop_run (test_loop);
+
+	TEST_EQ_P (last_coro, coro);
+	TEST_FREE (coro);
+	TEST_LIST_EMPTY (test_loop->ready_functions);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static void
+my_suspend_func (void    *data,
+		 NihCoro *coro)
+{
+	TEST_EQ_P (nih_coro_current (), coro);
+	TEST_TRUE (coro->running);
+
+	coro_step++;
+	nih_loop_exit (test_loop, 0);
+
+	while (! coro_woken)
+		nih_coro_suspend ();
+
+	TEST_EQ_P (nih_coro_current (), coro);
+
+	coro_step++;
+	nih_loop_exit (test_loop, 0);
+}
+
+void
+test_suspend (void)
+{
+	NihCoro *coro;
+
+	TEST_FUNCTION ("nih_coro_suspend");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+
+	/* Check that a coroutine may be suspended, returning to the loop,
+	 * and that it is resumed from where it left off once woken.
+	 */
+	TEST_FEATURE ("with wake");
+	coro = nih_coro_new (NULL, 0, my_suspend_func, NULL);
+
+	TEST_FREE_TAG (coro);
+
+	coro_step = 0;
+	coro_woken = FALSE;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (coro_step, 1);
+	TEST_EQ_P (nih_coro_current (), NULL);
+	TEST_NOT_FREE (coro);
+	TEST_FALSE (coro->running);
+	TEST_LIST_EMPTY (test_loop->ready_functions);
+
+	coro_woken = TRUE;
+	nih_coro_wake (coro);
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (coro_step, 2);
+	TEST_FREE (coro);
+
+
+	/* Check that freeing a suspended coroutine means it is never
+	 * resumed.
+	 */
+	TEST_FEATURE ("with coroutine freed");
+	coro = nih_coro_new (NULL, 0, my_suspend_func, NULL);
+
+	coro_step = 0;
+	coro_woken = FALSE;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (coro_step, 1);
+
+	nih_coro_wake (coro);
+	nih_free (coro);
+
+	TEST_LIST_EMPTY (test_loop->ready_functions);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static int yield_order[6];
+static int yield_count = 0;
+
+static void
+my_yield_func (void    *data,
+	       NihCoro *coro)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		yield_order[yield_count++] = *(int *)data;
+		nih_coro_yield ();
+	}
+
+	if (yield_count == 6)
+		nih_loop_exit (test_loop, 0);
+}
+
+void
+test_yield (void)
+{
+	NihCoro *coro1, *coro2;
+	int      id1 = 1, id2 = 2;
+
+	/* Check that two coroutines that yield to each other take turns
+	 * to run, one step in each iteration of the loop.
+	 */
+	TEST_FUNCTION ("nih_coro_yield");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	coro1 = nih_coro_new (NULL, 0, my_yield_func, &id1);
+	coro2 = nih_coro_new (NULL, 0, my_yield_func, &id2);
+
+	TEST_FREE_TAG (coro1);
+	TEST_FREE_TAG (coro2);
+
+	yield_count = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (yield_count, 6);
+	TEST_EQ (yield_order[0], 1);
+	TEST_EQ (yield_order[1], 2);
+	TEST_EQ (yield_order[2], 1);
+	TEST_EQ (yield_order[3], 2);
+	TEST_EQ (yield_order[4], 1);
+	TEST_EQ (yield_order[5], 2);
+
+	TEST_FREE (coro1);
+	TEST_FREE (coro2);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static int sleep_ret = 0;
+
+static void
+my_sleep_func (void    *data,
+	       NihCoro *coro)
+{
+	coro_step++;
+	sleep_ret = nih_coro_sleep (*(time_t *)data);
+	coro_step++;
+
+	nih_loop_exit (test_loop, 0);
+}
+
+static void
+my_exit_timer (void     *data,
+	       NihTimer *timer)
+{
+	nih_loop_exit (test_loop, 0);
+}
+
+void
+test_sleep (void)
+{
+	NihCoro  *coro;
+	NihTimer *timer;
+	time_t    seconds;
+
+	TEST_FUNCTION ("nih_coro_sleep");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+
+	/* Check that a coroutine may sleep, suspending it while a timer is
+	 * waited for, and that it is resumed once the timer is due.
+	 */
+	TEST_FEATURE ("with timer due");
+	seconds = 0;
+	coro = nih_coro_new (NULL, 0, my_sleep_func, &seconds);
+
+	TEST_FREE_TAG (coro);
+
+	coro_step = 0;
+	sleep_ret = -1;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (coro_step, 2);
+	TEST_EQ (sleep_ret, 0);
+	TEST_FREE (coro);
+	TEST_LIST_EMPTY (test_loop->timers);
+
+
+	/* Check that freeing a sleeping coroutine frees the timer it was
+	 * waiting for.
+	 */
+	TEST_FEATURE ("with coroutine freed");
+	seconds = 60;
+	coro = nih_coro_new (NULL, 0, my_sleep_func, &seconds);
+	timer = nih_timer_add_timeout (NULL, 0, my_exit_timer, NULL);
+
+	coro_step = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (coro_step, 1);
+	TEST_LIST_NOT_EMPTY (test_loop->timers);
+
+	timer = (NihTimer *)test_loop->timers->next;
+	TEST_ALLOC_PARENT (timer, coro);
+
+	nih_free (coro);
+
+	TEST_EQ (coro_step, 1);
+	TEST_LIST_EMPTY (test_loop->timers);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static int wait_ret = 0;
+
+static void
+my_wait_io_func (void    *data,
+		 NihCoro *coro)
+{
+	wait_ret = nih_coro_wait_io (*(int *)data, NIH_IO_READ);
+
+	nih_loop_exit (test_loop, 0);
+}
+
+static void
+my_write_timer (void     *data,
+		NihTimer *timer)
+{
+	assert (write (*(int *)data, "x", 1) == 1);
+}
+
+void
+test_wait_io (void)
+{
+	NihCoro  *coro;
+	NihTimer *timer;
+	int       fds[2];
+
+	/* Check that a coroutine may wait for a descriptor to become
+	 * readable, and that the events are returned once it is.
+	 */
+	TEST_FUNCTION ("nih_coro_wait_io");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	assert0 (pipe (fds));
+
+	coro = nih_coro_new (NULL, 0, my_wait_io_func, &fds[0]);
+	timer = nih_timer_add_timeout (NULL, 0, my_write_timer, &fds[1]);
+
+	TEST_FREE_TAG (coro);
+	TEST_FREE_TAG (timer);
+
+	wait_ret = -1;
+
+	nih_loop_run (test_loop);
+
+	TEST_FREE (timer);
+	TEST_FREE (coro);
+	TEST_EQ (wait_ret, NIH_IO_READ);
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+	close (fds[0]);
+	close (fds[1]);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+#define TRANSFER_SIZE 262144
+
+static char   *read_buf = NULL;
+static size_t  read_len = 0;
+static ssize_t read_ret = 0;
+static ssize_t write_ret = 0;
+static int     transfer_done = 0;
+
+static void
+my_read_func (void    *data,
+	      NihCoro *coro)
+{
+	int fd = *(int *)data;
+
+	read_len = 0;
+	while (read_len < TRANSFER_SIZE) {
+		read_ret = nih_coro_read (fd, read_buf + read_len,
+					  TRANSFER_SIZE - read_len);
+		if (read_ret <= 0)
+			break;
+
+		read_len += read_ret;
+	}
+
+	if (read_ret < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, EBADF);
+		nih_free (err);
+	}
+
+	if (++transfer_done == 2)
+		nih_loop_exit (test_loop, 0);
+}
+
+static void
+my_write_func (void    *data,
+	       NihCoro *coro)
+{
+	int   fd = *(int *)data;
+	char *buf;
+
+	buf = nih_alloc (coro, TRANSFER_SIZE);
+	memset (buf, 'x', TRANSFER_SIZE);
+
+	/* Give the reader a chance to be waiting first */
+	nih_coro_yield ();
+
+	write_ret = nih_coro_write (fd, buf, TRANSFER_SIZE);
+	if (write_ret < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, EBADF);
+		nih_free (err);
+	}
+
+	if (++transfer_done == 2)
+		nih_loop_exit (test_loop, 0);
+}
+
+void
+test_read (void)
+{
+	NihCoro *reader, *writer;
+	int      fds[2], bad_fd = 1000;
+
+	TEST_FUNCTION ("nih_coro_read");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	read_buf = nih_alloc (NULL, TRANSFER_SIZE);
+
+
+	/* Check that data written to a pipe by one coroutine, more than
+	 * the pipe can hold, is read by another, with each suspended
+	 * whenever the pipe is empty or full.
+	 */
+	TEST_FEATURE ("with data written by coroutine");
+	assert0 (pipe (fds));
+	nih_io_set_nonblock (fds[0]);
+	nih_io_set_nonblock (fds[1]);
+
+	reader = nih_coro_new (NULL, 0, my_read_func, &fds[0]);
+	writer = nih_coro_new (NULL, 0, my_write_func, &fds[1]);
+
+	TEST_FREE_TAG (reader);
+	TEST_FREE_TAG (writer);
+
+	memset (read_buf, 0, TRANSFER_SIZE);
+	transfer_done = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_FREE (reader);
+	TEST_FREE (writer);
+	TEST_EQ (read_len, TRANSFER_SIZE);
+	TEST_EQ (write_ret, TRANSFER_SIZE);
+	TEST_EQ (read_buf[0], 'x');
+	TEST_EQ (read_buf[TRANSFER_SIZE - 1], 'x');
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+
+	/* Check that end of file is returned as zero. */
+	TEST_FEATURE ("with end of file");
+	close (fds[1]);
+
+	reader = nih_coro_new (NULL, 0, my_read_func, &fds[0]);
+
+	transfer_done = 1;
+	read_ret = -1;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (read_ret, 0);
+	TEST_EQ (read_len, 0);
+
+	close (fds[0]);
+
+
+	/* Check that an error reading is raised. */
+	TEST_FEATURE ("with bad descriptor");
+	reader = nih_coro_new (NULL, 0, my_read_func, &bad_fd);
+
+	transfer_done = 1;
+	read_ret = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_LT (read_ret, 0);
+
+	nih_free (read_buf);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+void
+test_write (void)
+{
+	NihCoro *writer;
+	int      bad_fd = 1000;
+
+	/* Check that an error writing is raised; successful writes are
+	 * checked along with reads.
+	 */
+	TEST_FUNCTION ("nih_coro_write");
+	TEST_FEATURE ("with bad descriptor");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	writer = nih_coro_new (NULL, 0, my_write_func, &bad_fd);
+
+	TEST_FREE_TAG (writer);
+
+	transfer_done = 1;
+	write_ret = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_FREE (writer);
+	TEST_LT (write_ret, 0);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static NihChildEvents child_event = 0;
+static int            child_status = 0;
+
+static void
+my_child_func (void    *data,
+	       NihCoro *coro)
+{
+	pid_t pid;
+
+	TEST_CHILD (pid) {
+		if (*(int *)data)
+			pause ();
+
+		exit (42);
+	}
+
+	if (*(int *)data)
+		kill (pid, SIGTERM);
+
+	wait_ret = nih_coro_wait_child (pid, &child_event, &child_status);
+
+	nih_main_loop_exit (0);
+}
+
+void
+test_wait_child (void)
+{
+	NihCoro *coro;
+	int      killed;
+
+	TEST_FUNCTION ("nih_coro_wait_child");
+
+
+	/* Check that a coroutine may wait for a child process to exit,
+	 * and that the event and exit status are returned.
+	 */
+	TEST_FEATURE ("with exited child");
+	killed = FALSE;
+	coro = nih_coro_new (NULL, 0, my_child_func, &killed);
+
+	TEST_FREE_TAG (coro);
+
+	wait_ret = -1;
+	child_event = 0;
+	child_status = 0;
+
+	nih_main_loop ();
+
+	TEST_FREE (coro);
+	TEST_EQ (wait_ret, 0);
+	TEST_EQ (child_event, NIH_CHILD_EXITED);
+	TEST_EQ (child_status, 42);
+
+
+	/* Check that the signal is returned for a killed child. */
+	TEST_FEATURE ("with killed child");
+	killed = TRUE;
+	coro = nih_coro_new (NULL, 0, my_child_func, &killed);
+
+	TEST_FREE_TAG (coro);
+
+	wait_ret = -1;
+	child_event = 0;
+	child_status = 0;
+
+	nih_main_loop ();
+
+	TEST_FREE (coro);
+	TEST_EQ (wait_ret, 0);
+	TEST_EQ (child_event, NIH_CHILD_KILLED);
+	TEST_EQ (child_status, SIGTERM);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_new ();
+	test_suspend ();
+	test_yield ();
+	test_sleep ();
+	test_wait_io ();
+	test_read ();
+	test_write ();
+	test_wait_child ();
+
+	return 0;
+}
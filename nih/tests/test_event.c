@@ -0,0 +1,205 @@
+/* libnih
+ *
+ * test_event.c - test suite for nih/event.c
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/io.h>
+#include <nih/loop.h>
+#include <nih/event.h>
+#include <nih/error.h>
+
+
+static NihLoop *test_loop = NULL;
+static int      handler_called = 0;
+static void *   last_data = NULL;
+static NihEvent *last_event = NULL;
+
+static void
+my_handler (void     *data,
+	    NihEvent *event)
+{
+	handler_called++;
+	last_data = data;
+	last_event = event;
+
+	nih_loop_exit (test_loop, 0);
+}
+
+static void
+my_free_handler (void     *data,
+		 NihEvent *event)
+{
+	my_handler (data, event);
+
+	nih_free (event);
+}
+
+
+void
+test_new (void)
+{
+	NihEvent *event;
+
+	/* Check that we can create a new event, and that it has an
+	 * eventfd descriptor watched by the current loop.
+	 */
+	TEST_FUNCTION ("nih_event_new");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+	TEST_ALLOC_FAIL {
+		event = nih_event_new (NULL, my_handler, &event);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_EQ_P (event, NULL);
+			TEST_LIST_EMPTY (test_loop->io_watches);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (event, sizeof (NihEvent));
+		TEST_EQ_P (event->handler, my_handler);
+		TEST_EQ_P (event->data, &event);
+
+		TEST_GE (event->fd, 0);
+		TEST_TRUE (fcntl (event->fd, F_GETFL) & O_NONBLOCK);
+		TEST_TRUE (fcntl (event->fd, F_GETFD) & FD_CLOEXEC);
+
+		TEST_ALLOC_PARENT (event->watch, event);
+		TEST_EQ (event->watch->fd, event->fd);
+		TEST_EQ_P (event->watch->entry.next, test_loop->io_watches);
+
+		nih_free (event);
+
+		TEST_LIST_EMPTY (test_loop->io_watches);
+	}
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+static void *
+my_signal_thread (void *data)
+{
+	NihEvent *event = data;
+	int       i;
+
+	for (i = 0; i < 100; i++)
+		nih_event_signal (event);
+
+	return NULL;
+}
+
+void
+test_signal (void)
+{
+	NihEvent  *event;
+	pthread_t  thread;
+	uint64_t   value;
+	int        i;
+
+	TEST_FUNCTION ("nih_event_signal");
+	test_loop = nih_loop_new (NULL);
+	nih_loop_set_current (test_loop);
+
+
+	/* Check that signalling an event several times before the loop is
+	 * run results in its handler being called just once.
+	 */
+	TEST_FEATURE ("with several signals");
+	event = nih_event_new (NULL, my_handler, &value);
+
+	for (i = 0; i < 5; i++)
+		nih_event_signal (event);
+
+	handler_called = 0;
+	last_data = NULL;
+	last_event = NULL;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (handler_called, 1);
+	TEST_EQ_P (last_data, &value);
+	TEST_EQ_P (last_event, event);
+
+	TEST_LT (read (event->fd, &value, sizeof (value)), 0);
+	TEST_EQ (errno, EAGAIN);
+
+
+	/* Check that an event may be signalled from another thread to wake
+	 * the loop.
+	 */
+	TEST_FEATURE ("from another thread");
+	handler_called = 0;
+
+	assert0 (pthread_create (&thread, NULL, my_signal_thread, event));
+
+	nih_loop_run (test_loop);
+	pthread_join (thread, NULL);
+
+	TEST_GE (handler_called, 1);
+
+	nih_free (event);
+
+
+	/* Check that the handler may free the event. */
+	TEST_FEATURE ("with event freed by handler");
+	event = nih_event_new (NULL, my_free_handler, NULL);
+
+	TEST_FREE_TAG (event);
+
+	nih_event_signal (event);
+
+	handler_called = 0;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (handler_called, 1);
+	TEST_FREE (event);
+	TEST_LIST_EMPTY (test_loop->io_watches);
+
+	nih_loop_set_current (NULL);
+	nih_free (test_loop);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_new ();
+	test_signal ();
+
+	return 0;
+}
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <limits.h>
 #include <string.h>
@@ -35,6 +36,7 @@
 #include <nih/alloc.h>
 #include <nih/string.h>
 #include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/file.h>
 #include <nih/main.h>
 #include <nih/logging.h>
@@ -90,6 +92,33 @@ test_read (void)
 	unlink (filename);
 
 
+	/* Check that a file that reports no size, as those in /proc do,
+	 * is still read until the end.
+	 */
+	TEST_FEATURE ("with file of unknown size");
+	TEST_ALLOC_FAIL {
+		length = 0;
+		file = nih_file_read (NULL, "/proc/self/status", &length);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (file, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_NE_P (file, NULL);
+		TEST_GT (length, 5);
+		TEST_EQ_MEM (file, "Name:", 5);
+		TEST_EQ (file[length - 1], '\n');
+
+		nih_free (file);
+	}
+
+
 	/* Check that if we try and read a non-existant file, we get an
 	 * error raised.
 	 */
@@ -213,511 +242,1323 @@ test_unmap (void)
 
 
 void
-test_is_hidden (void)
+test_reader_new (void)
 {
-	int ret;
+	FILE          *fd;
+	NihFileReader *reader;
+	NihError      *err;
+	char           filename[PATH_MAX];
 
-	TEST_FUNCTION ("nih_file_is_hidden");
+	TEST_FUNCTION ("nih_file_reader_new");
+	nih_error_init ();
 
+	TEST_FILENAME (filename);
 
-	/* Check that a plain file beginning with a dot is hidden. */
-	TEST_FEATURE ("with plain dot file");
-	ret = nih_file_is_hidden (".foo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
 
-	TEST_TRUE (ret);
 
+	/* Check that a reader is allocated with the file open and a buffer
+	 * of the default size when none is given.
+	 */
+	TEST_FEATURE ("with default size");
+	TEST_ALLOC_FAIL {
+		reader = nih_file_reader_new (NULL, filename, 0,
+					      (NIH_FILE_READ_NOATIME
+					       | NIH_FILE_READ_SEQUENTIAL));
 
-	/* Check that a path with a file beginning with a dot is hidden. */
-	TEST_FEATURE ("with path to dot file");
-	ret = nih_file_is_hidden ("/path/to/.foo");
+		if (test_alloc_failed) {
+			TEST_EQ_P (reader, NULL);
 
-	TEST_TRUE (ret);
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
 
+			continue;
+		}
 
-	/* Check that a path containing a dot directory is not hidden,
-	 * since we're already walking it.
-	 */
-	TEST_FEATURE ("with hidden path to non-dot file");
-	ret = nih_file_is_hidden ("/path/.to/foo");
+		TEST_ALLOC_SIZE (reader, sizeof (NihFileReader));
+		TEST_GE (reader->fd, 0);
+		TEST_ALLOC_PARENT (reader->buf, reader);
+		TEST_ALLOC_SIZE (reader->buf, NIH_FILE_READER_SIZE);
+		TEST_EQ (reader->size, NIH_FILE_READER_SIZE);
+		TEST_EQ (reader->start, 0);
+		TEST_EQ (reader->end, 0);
+		TEST_FALSE (reader->eof);
 
-	TEST_FALSE (ret);
+		nih_free (reader);
+	}
 
 
-	/* Check that a plain non-dot file is not hidden. */
-	TEST_FEATURE ("with plain non-dot file");
-	ret = nih_file_is_hidden ("foo");
+	/* Check that the size of the buffer may be given. */
+	TEST_FEATURE ("with size");
+	reader = nih_file_reader_new (NULL, filename, 16, 0);
 
-	TEST_FALSE (ret);
+	TEST_NE_P (reader, NULL);
+	TEST_ALLOC_SIZE (reader->buf, 16);
+	TEST_EQ (reader->size, 16);
 
+	nih_free (reader);
 
-	/* Check that a file containing a dot is not hidden. */
-	TEST_FEATURE ("with ordinary file");
-	ret = nih_file_is_hidden ("foo.txt");
+	unlink (filename);
 
-	TEST_FALSE (ret);
+
+	/* Check that an error is raised for a file that doesn't exist. */
+	TEST_FEATURE ("with non-existant file");
+	reader = nih_file_reader_new (NULL, filename, 0,
+				      NIH_FILE_READ_NOATIME);
+
+	TEST_EQ_P (reader, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
 }
 
 void
-test_is_backup (void)
+test_reader_read (void)
 {
-	int ret;
-
-	TEST_FUNCTION ("nih_file_is_backup");
-
+	FILE          *fd;
+	NihFileReader *reader;
+	const char    *data;
+	char           filename[PATH_MAX];
+	ssize_t        len;
 
-	/* Check that a plain file ending with a tilde is a backup file. */
-	TEST_FEATURE ("with plain backup file");
-	ret = nih_file_is_backup ("foo~");
+	TEST_FUNCTION ("nih_file_reader_read");
+	TEST_FILENAME (filename);
 
-	TEST_TRUE (ret);
+	fd = fopen (filename, "w");
+	fprintf (fd, "this is a test\nof reading\n");
+	fclose (fd);
 
 
-	/* Check that a path with a file ending with a tilde is a
-	 * backup file.
+	/* Check that the file is returned in chunks the size of the buffer,
+	 * and then zero at the end of the file.
 	 */
-	TEST_FEATURE ("with path to backup file");
-	ret = nih_file_is_backup ("/path/to/foo~");
-
-	TEST_TRUE (ret);
+	TEST_FEATURE ("with file larger than buffer");
+	reader = nih_file_reader_new (NULL, filename, 16, 0);
+	TEST_NE_P (reader, NULL);
 
+	len = nih_file_reader_read (reader, &data);
 
-	/* Check that a path containing a tilde directory is not backup,
-	 * since we're already walking it.
-	 */
-	TEST_FEATURE ("with backup path to non-backup file");
-	ret = nih_file_is_backup ("/path/to~/foo");
+	TEST_EQ (len, 16);
+	TEST_EQ_MEM (data, "this is a test\no", 16);
 
-	TEST_FALSE (ret);
+	len = nih_file_reader_read (reader, &data);
 
+	TEST_EQ (len, 10);
+	TEST_EQ_MEM (data, "f reading\n", 10);
 
-	/* Check that a file containing a tilde is not backup. */
-	TEST_FEATURE ("with file containing tilde");
-	ret = nih_file_is_backup ("foo~txt");
+	len = nih_file_reader_read (reader, &data);
 
-	TEST_FALSE (ret);
+	TEST_EQ (len, 0);
 
+	len = nih_file_reader_read (reader, &data);
 
-	/* Check that a plain non-backup file is not matched. */
-	TEST_FEATURE ("with plain non-backup file");
-	ret = nih_file_is_backup ("foo");
+	TEST_EQ (len, 0);
 
-	TEST_FALSE (ret);
+	nih_free (reader);
 
+	unlink (filename);
 
-	/* Check that a file ending with .bak is a backup file. */
-	TEST_FEATURE ("with dos-style backup file");
-	ret = nih_file_is_backup ("foo.bak");
 
-	TEST_TRUE (ret);
+	/* Check that a file whose size isn't known in advance is read. */
+	TEST_FEATURE ("with file of unknown size");
+	reader = nih_file_reader_new (NULL, "/proc/self/status", 0, 0);
+	TEST_NE_P (reader, NULL);
 
+	len = nih_file_reader_read (reader, &data);
 
-	/* Check that a file ending with .BAK is a backup file. */
-	TEST_FEATURE ("with dos/fat-style backup file");
-	ret = nih_file_is_backup ("foo.BAK");
+	TEST_GT (len, 5);
+	TEST_EQ_MEM (data, "Name:", 5);
 
-	TEST_TRUE (ret);
+	nih_free (reader);
+}
 
+void
+test_reader_line (void)
+{
+	FILE          *fd;
+	NihFileReader *reader;
+	const char    *line;
+	char           filename[PATH_MAX];
+	ssize_t        len;
 
-	/* Check that an emacs-style backup file is matched. */
-	TEST_FEATURE ("with emacs-style backup file");
-	ret = nih_file_is_backup ("#foo#");
+	TEST_FUNCTION ("nih_file_reader_line");
+	TEST_FILENAME (filename);
 
-	TEST_TRUE (ret);
+	fd = fopen (filename, "w");
+	fprintf (fd, "short\nthis line is longer than the buffer\n\nend");
+	fclose (fd);
 
 
-	/* Check that a file beginning with a # is not matched. */
-	TEST_FEATURE ("with file beginning with hash");
-	ret = nih_file_is_backup ("#foo");
+	/* Check that each line is returned whole with its newline, the
+	 * buffer growing for one longer than it, and the last line without
+	 * one; then zero at the end of the file.
+	 */
+	TEST_FEATURE ("with lines");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			reader = nih_file_reader_new (NULL, filename, 8, 0);
+		}
 
-	TEST_FALSE (ret);
+		len = nih_file_reader_line (reader, &line);
 
+		TEST_EQ (len, 6);
+		TEST_EQ_MEM (line, "short\n", 6);
 
-	/* Check that a file ending with a # is not matched. */
-	TEST_FEATURE ("with file ending with hash");
-	ret = nih_file_is_backup ("foo#");
+		len = nih_file_reader_line (reader, &line);
 
-	TEST_FALSE (ret);
-}
+		if (test_alloc_failed) {
+			NihError *err;
 
-void
-test_is_swap (void)
-{
-	int ret;
+			TEST_LT (len, 0);
 
-	TEST_FUNCTION ("nih_file_is_swap");
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
 
+			nih_free (reader);
+			continue;
+		}
 
-	/* Check that a plain file beginning with .# is a swap file. */
-	TEST_FEATURE ("with emacs-style swap file");
-	ret = nih_file_is_swap (".#foo");
+		TEST_EQ (len, 36);
+		TEST_EQ_MEM (line, "this line is longer than the buffer\n", 36);
+		TEST_GE (reader->size, 36);
 
-	TEST_TRUE (ret);
+		len = nih_file_reader_line (reader, &line);
 
+		TEST_EQ (len, 1);
+		TEST_EQ_MEM (line, "\n", 1);
 
-	/* Check that a path with a file beginning with .# is a swap file. */
-	TEST_FEATURE ("with path to emacs-style swap file");
-	ret = nih_file_is_swap ("/path/to/.#foo");
+		len = nih_file_reader_line (reader, &line);
 
-	TEST_TRUE (ret);
+		TEST_EQ (len, 3);
+		TEST_EQ_MEM (line, "end", 3);
 
+		len = nih_file_reader_line (reader, &line);
 
-	/* Check that a path containing an emacs-style swap directory is
-	 * not swap, since we're already walking it.
-	 */
-	TEST_FEATURE ("with emacs-style swap path to non-swap file");
-	ret = nih_file_is_swap ("/path/.#to/foo");
+		TEST_EQ (len, 0);
 
-	TEST_FALSE (ret);
+		nih_free (reader);
+	}
 
+	unlink (filename);
+}
 
-	/* Check that a file containing the signature is not swap. */
-	TEST_FEATURE ("with file containing .#");
-	ret = nih_file_is_swap ("foo.#txt");
+void
+test_mapping_new (void)
+{
+	FILE           *fd;
+	NihFileMapping *mapping;
+	NihError       *err;
+	char            filename[PATH_MAX];
+	void           *parent;
 
-	TEST_FALSE (ret);
+	TEST_FUNCTION ("nih_file_mapping_new");
+	nih_error_init ();
 
+	TEST_FILENAME (filename);
 
-	/* Check that a plain non-swap file is not matched. */
-	TEST_FEATURE ("with plain non-swap file");
-	ret = nih_file_is_swap ("foo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
 
-	TEST_FALSE (ret);
 
+	/* Check that the file is mapped, and its contents and length are
+	 * in the object returned.
+	 */
+	TEST_FEATURE ("with file");
+	TEST_ALLOC_FAIL {
+		mapping = nih_file_mapping_new (NULL, filename,
+						(NIH_FILE_MAP_SEQUENTIAL
+						 | NIH_FILE_MAP_WILLNEED));
 
-	/* Check that a file ending with .swp is a swap file. */
-	TEST_FEATURE ("with vi-style .swp file");
-	ret = nih_file_is_swap ("foo.swp");
+		if (test_alloc_failed) {
+			TEST_EQ_P (mapping, NULL);
 
-	TEST_TRUE (ret);
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
 
+			continue;
+		}
 
-	/* Check that a file ending with .swo is a swap file. */
-	TEST_FEATURE ("with vi-style .swo file");
-	ret = nih_file_is_swap ("foo.swo");
+		TEST_ALLOC_SIZE (mapping, sizeof (NihFileMapping));
+		TEST_EQ (mapping->length, 5);
+		TEST_EQ_MEM (mapping->data, "test\n", 5);
 
-	TEST_TRUE (ret);
+		nih_free (mapping);
+	}
 
 
-	/* Check that a file ending with .swn is a swap file. */
-	TEST_FEATURE ("with vi-style .swn file");
-	ret = nih_file_is_swap ("foo.swn");
+	/* Check that the mapping remains while any reference to it does.
+	 */
+	TEST_FEATURE ("with reference");
+	parent = nih_alloc (NULL, 1);
 
-	TEST_TRUE (ret);
-}
+	mapping = nih_file_mapping_new (NULL, filename, NIH_FILE_MAP_RANDOM);
+	TEST_NE_P (mapping, NULL);
 
-void
-test_is_rcs (void)
-{
-	int ret;
+	nih_ref (mapping, parent);
+	nih_discard (mapping);
 
-	TEST_FUNCTION ("nih_file_is_rcs");
+	TEST_EQ_MEM (mapping->data, "test\n", 5);
 
+	TEST_FREE_TAG (mapping);
 
-	/* Check that a plain file ending with ,v is an RCS file. */
-	TEST_FEATURE ("with rcs-style file");
-	ret = nih_file_is_rcs ("foo,v");
+	nih_free (parent);
 
-	TEST_TRUE (ret);
+	TEST_FREE (mapping);
 
 
-	/* Check that a path with a file ending with ,v an RCS file. */
-	TEST_FEATURE ("with path to rcs-style file");
-	ret = nih_file_is_rcs ("/path/to/foo,v");
+	/* Check that the file may be populated when mapped, and backed by
+	 * huge pages.
+	 */
+	TEST_FEATURE ("with populate");
+	mapping = nih_file_mapping_new (NULL, filename,
+					(NIH_FILE_MAP_POPULATE
+					 | NIH_FILE_MAP_HUGEPAGE));
 
-	TEST_TRUE (ret);
+	TEST_NE_P (mapping, NULL);
+	TEST_EQ (mapping->length, 5);
+	TEST_EQ_MEM (mapping->data, "test\n", 5);
 
+	nih_free (mapping);
 
-	/* Check that a path containing an RCS-style directory is not matched,
-	 * since we're already walking it.
-	 */
-	TEST_FEATURE ("with rcs-style path to non-rcs file");
-	ret = nih_file_is_rcs ("/path/to,v/foo");
 
-	TEST_FALSE (ret);
+	/* Check that an empty file results in no data. */
+	TEST_FEATURE ("with empty file");
+	fd = fopen (filename, "w");
+	fclose (fd);
 
+	mapping = nih_file_mapping_new (NULL, filename, 0);
 
-	/* Check that a file containing the signature is not rcs. */
-	TEST_FEATURE ("with file containing ,v");
-	ret = nih_file_is_rcs ("foo,vtxt");
+	TEST_NE_P (mapping, NULL);
+	TEST_EQ_P (mapping->data, NULL);
+	TEST_EQ (mapping->length, 0);
 
-	TEST_FALSE (ret);
+	nih_free (mapping);
 
+	unlink (filename);
 
-	/* Check that a plain non-rcs file is not matched. */
-	TEST_FEATURE ("with plain non-rcs file");
-	ret = nih_file_is_rcs ("foo");
 
-	TEST_FALSE (ret);
+	/* Check that an error is raised for a file that doesn't exist. */
+	TEST_FEATURE ("with non-existant file");
+	mapping = nih_file_mapping_new (NULL, filename, 0);
 
+	TEST_EQ_P (mapping, NULL);
 
-	/* Check that an RCS directory is matched. */
-	TEST_FEATURE ("with rcs directory name");
-	ret = nih_file_is_rcs ("RCS");
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+}
 
-	TEST_TRUE (ret);
+void
+test_window_new (void)
+{
+	FILE          *fd;
+	NihFileWindow *window;
+	NihError      *err;
+	char           filename[PATH_MAX];
+	size_t         page_size;
 
+	TEST_FUNCTION ("nih_file_window_new");
+	nih_error_init ();
 
-	/* Check that a CVS directory is matched. */
-	TEST_FEATURE ("with cvs directory name");
-	ret = nih_file_is_rcs ("CVS");
+	page_size = sysconf (_SC_PAGESIZE);
 
-	TEST_TRUE (ret);
+	TEST_FILENAME (filename);
 
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
 
-	/* Check that a CVS admin directory is matched. */
-	TEST_FEATURE ("with cvs admin directory name");
-	ret = nih_file_is_rcs ("CVS.adm");
 
-	TEST_TRUE (ret);
+	/* Check that a window is allocated with the file open, its size
+	 * rounded up to whole pages, and nothing yet mapped.
+	 */
+	TEST_FEATURE ("with file");
+	TEST_ALLOC_FAIL {
+		window = nih_file_window_new (NULL, filename, 100,
+					      NIH_FILE_MAP_SEQUENTIAL);
 
+		if (test_alloc_failed) {
+			TEST_EQ_P (window, NULL);
 
-	/* Check that an SCCS directory is matched. */
-	TEST_FEATURE ("with sccs directory name");
-	ret = nih_file_is_rcs ("SCCS");
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
 
-	TEST_TRUE (ret);
+			continue;
+		}
 
+		TEST_ALLOC_SIZE (window, sizeof (NihFileWindow));
+		TEST_GE (window->fd, 0);
+		TEST_EQ (window->size, page_size);
+		TEST_EQ (window->flags, NIH_FILE_MAP_SEQUENTIAL);
+		TEST_EQ_P (window->data, NULL);
+		TEST_EQ (window->offset, 0);
+		TEST_EQ (window->length, 0);
 
-	/* Check that a bazaar directory is matched. */
-	TEST_FEATURE ("with bzr directory name");
-	ret = nih_file_is_rcs (".bzr");
+		nih_free (window);
+	}
 
-	TEST_TRUE (ret);
+	unlink (filename);
 
 
-	/* Check that a bazaar log file is matched. */
-	TEST_FEATURE ("with bzr log filename");
-	ret = nih_file_is_rcs (".bzr.log");
+	/* Check that an error is raised for a file that doesn't exist. */
+	TEST_FEATURE ("with non-existant file");
+	window = nih_file_window_new (NULL, filename, 100, 0);
 
-	TEST_TRUE (ret);
+	TEST_EQ_P (window, NULL);
 
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+}
 
-	/* Check that a mercurial directory is matched. */
-	TEST_FEATURE ("with mercurial directory name");
-	ret = nih_file_is_rcs (".hg");
+void
+test_window_move (void)
+{
+	FILE          *fd;
+	NihFileWindow *window;
+	char           filename[PATH_MAX], *data;
+	size_t         page_size, i;
+	off_t          offset;
+	int            ret;
 
-	TEST_TRUE (ret);
+	TEST_FUNCTION ("nih_file_window_move");
+	page_size = sysconf (_SC_PAGESIZE);
 
+	TEST_FILENAME (filename);
 
-	/* Check that a git directory is matched. */
-	TEST_FEATURE ("with git directory name");
-	ret = nih_file_is_rcs (".git");
+	/* Three and a half pages, each byte holding the number of the
+	 * page it's in.
+	 */
+	fd = fopen (filename, "w");
+	for (i = 0; i < page_size * 7 / 2; i++)
+		fputc ('0' + i / page_size, fd);
+	fclose (fd);
 
-	TEST_TRUE (ret);
+	window = nih_file_window_new (NULL, filename, page_size * 2,
+				      (NIH_FILE_MAP_SEQUENTIAL
+				       | NIH_FILE_MAP_POPULATE
+				       | NIH_FILE_MAP_HUGEPAGE));
+	TEST_NE_P (window, NULL);
 
 
-	/* Check that a subversion directory is matched. */
-	TEST_FEATURE ("with subversion directory name");
-	ret = nih_file_is_rcs (".svn");
+	/* Check that moving the window to the start of the file maps the
+	 * size of the window from there.
+	 */
+	TEST_FEATURE ("with start of file");
+	ret = nih_file_window_move (window, 0);
 
-	TEST_TRUE (ret);
+	TEST_EQ (ret, 0);
+	TEST_NE_P (window->data, NULL);
+	TEST_EQ (window->offset, 0);
+	TEST_EQ (window->length, page_size * 2);
+	TEST_EQ (window->data[0], '0');
+	TEST_EQ (window->data[page_size], '1');
 
 
-	/* Check that a BitKeeper directory is matched. */
-	TEST_FEATURE ("with BitKeeper directory name");
-	ret = nih_file_is_rcs ("BitKeeper");
+	/* Check that moving the window to an offset already within it
+	 * leaves it where it is.
+	 */
+	TEST_FEATURE ("with offset within window");
+	data = window->data;
 
-	TEST_TRUE (ret);
+	ret = nih_file_window_move (window, page_size + 10);
 
+	TEST_EQ (ret, 0);
+	TEST_EQ_P (window->data, data);
+	TEST_EQ (window->offset, 0);
 
-	/* Check that an arch ids file is matched. */
-	TEST_FEATURE ("with arch ids filename");
-	ret = nih_file_is_rcs (".arch-ids");
 
-	TEST_TRUE (ret);
+	/* Check that moving the window to an offset outside it maps from
+	 * the start of the page containing the offset.
+	 */
+	TEST_FEATURE ("with offset outside window");
+	ret = nih_file_window_move (window, page_size * 2 + 10);
 
+	TEST_EQ (ret, 0);
+	TEST_EQ (window->offset, (off_t)(page_size * 2));
+	TEST_EQ (window->length, page_size * 3 / 2);
+	TEST_EQ (window->data[0], '2');
+	TEST_EQ (window->data[page_size * 3 / 2 - 1], '3');
 
-	/* Check that an arch inventory file is matched. */
-	TEST_FEATURE ("with arch inventory filename");
-	ret = nih_file_is_rcs (".arch-inventory");
 
-	TEST_TRUE (ret);
+	/* Check that moving the window to the end of the file unmaps it.
+	 */
+	TEST_FEATURE ("with end of file");
+	ret = nih_file_window_move (window, page_size * 7 / 2);
 
+	TEST_EQ (ret, 0);
+	TEST_EQ_P (window->data, NULL);
+	TEST_EQ (window->offset, (off_t)(page_size * 7 / 2));
+	TEST_EQ (window->length, 0);
 
-	/* Check that an arch directory is matched. */
-	TEST_FEATURE ("with arch directory name");
-	ret = nih_file_is_rcs ("{arch}");
 
-	TEST_TRUE (ret);
+	/* Check that reading the file by moving the window along it each
+	 * time sees every byte once.
+	 */
+	TEST_FEATURE ("with whole file");
+	i = 0;
+	offset = 0;
+	for (;;) {
+		size_t j;
 
+		ret = nih_file_window_move (window, offset);
+		TEST_EQ (ret, 0);
 
-	/* Check that a darcs directory is matched. */
-	TEST_FEATURE ("with darcs directory name");
-	ret = nih_file_is_rcs ("_darcs");
+		if (! window->length)
+			break;
 
-	TEST_TRUE (ret);
+		for (j = offset - window->offset; j < window->length; j++) {
+			TEST_EQ (window->data[j], (char)('0' + i / page_size));
+			i++;
+		}
+
+		offset = window->offset + window->length;
+	}
+
+	TEST_EQ (i, page_size * 7 / 2);
+
+	nih_free (window);
+
+	unlink (filename);
 }
 
 void
-test_is_packaging (void)
+test_is_hidden (void)
 {
 	int ret;
 
-	TEST_FUNCTION ("nih_file_is_packaging");
+	TEST_FUNCTION ("nih_file_is_hidden");
 
 
-	/* Check that a plain file ending with a dpkg name is packaging. */
-	TEST_FEATURE ("with plain dpkg file");
-	ret = nih_file_is_packaging ("foo.dpkg-new");
+	/* Check that a plain file beginning with a dot is hidden. */
+	TEST_FEATURE ("with plain dot file");
+	ret = nih_file_is_hidden (".foo");
 
 	TEST_TRUE (ret);
 
 
-	/* Check that a path with a file ending with a dpkg name
-	 * is packaging
-	 */
-	TEST_FEATURE ("with path to dpkg file");
-	ret = nih_file_is_packaging ("/path/to/foo.dpkg-bak");
+	/* Check that a path with a file beginning with a dot is hidden. */
+	TEST_FEATURE ("with path to dot file");
+	ret = nih_file_is_hidden ("/path/to/.foo");
 
 	TEST_TRUE (ret);
 
 
-	/* Check that a path containing a dpkg directory is not packaging,
+	/* Check that a path containing a dot directory is not hidden,
 	 * since we're already walking it.
 	 */
-	TEST_FEATURE ("with dpkg path to non-packaging file");
-	ret = nih_file_is_packaging ("/path/to.dpkg-bak/foo");
+	TEST_FEATURE ("with hidden path to non-dot file");
+	ret = nih_file_is_hidden ("/path/.to/foo");
 
 	TEST_FALSE (ret);
 
 
-	/* Check that a plain file is not packaging. */
-	TEST_FEATURE ("with plain file");
-	ret = nih_file_is_packaging ("foo.txt");
+	/* Check that a plain non-dot file is not hidden. */
+	TEST_FEATURE ("with plain non-dot file");
+	ret = nih_file_is_hidden ("foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a file containing a dot is not hidden. */
+	TEST_FEATURE ("with ordinary file");
+	ret = nih_file_is_hidden ("foo.txt");
 
 	TEST_FALSE (ret);
 }
 
 void
-test_ignore (void)
+test_is_backup (void)
 {
 	int ret;
 
-	TEST_FUNCTION ("nih_test_ignore");
+	TEST_FUNCTION ("nih_file_is_backup");
 
 
-	/* Check that a hidden file is to be ignored. */
-	TEST_FEATURE ("with hidden file");
-	ret = nih_file_ignore (NULL, ".foo");
+	/* Check that a plain file ending with a tilde is a backup file. */
+	TEST_FEATURE ("with plain backup file");
+	ret = nih_file_is_backup ("foo~");
 
 	TEST_TRUE (ret);
 
 
-	/* Check that a backup file is to be ignored. */
-	TEST_FEATURE ("with backup file");
-	ret = nih_file_ignore (NULL, "foo~");
+	/* Check that a path with a file ending with a tilde is a
+	 * backup file.
+	 */
+	TEST_FEATURE ("with path to backup file");
+	ret = nih_file_is_backup ("/path/to/foo~");
 
 	TEST_TRUE (ret);
 
 
-	/* Check that a swap file is to be ignored. */
-	TEST_FEATURE ("with swap file");
-	ret = nih_file_ignore (NULL, "foo.swp");
+	/* Check that a path containing a tilde directory is not backup,
+	 * since we're already walking it.
+	 */
+	TEST_FEATURE ("with backup path to non-backup file");
+	ret = nih_file_is_backup ("/path/to~/foo");
 
-	TEST_TRUE (ret);
+	TEST_FALSE (ret);
 
 
-	/* Check that an RCS file is to be ignored. */
-	TEST_FEATURE ("with rcs file");
-	ret = nih_file_ignore (NULL, "CVS");
+	/* Check that a file containing a tilde is not backup. */
+	TEST_FEATURE ("with file containing tilde");
+	ret = nih_file_is_backup ("foo~txt");
 
-	TEST_TRUE (ret);
+	TEST_FALSE (ret);
 
 
-	/* Check that a packaging file is to be ignored. */
-	TEST_FEATURE ("with packaging file");
-	ret = nih_file_ignore (NULL, "foo.dpkg-new");
+	/* Check that a plain non-backup file is not matched. */
+	TEST_FEATURE ("with plain non-backup file");
+	ret = nih_file_is_backup ("foo");
 
-	TEST_TRUE (ret);
+	TEST_FALSE (ret);
 
 
-	/* Check that an ordinary file isn't ignored. */
-	TEST_FEATURE ("with ordinary file");
-	ret = nih_file_ignore (NULL, "foo.txt");
+	/* Check that a file ending with .bak is a backup file. */
+	TEST_FEATURE ("with dos-style backup file");
+	ret = nih_file_is_backup ("foo.bak");
 
-	TEST_FALSE (ret);
-}
+	TEST_TRUE (ret);
 
 
-typedef struct visited {
-	NihList  entry;
+	/* Check that a file ending with .BAK is a backup file. */
+	TEST_FEATURE ("with dos/fat-style backup file");
+	ret = nih_file_is_backup ("foo.BAK");
 
-	void    *data;
-	char    *dirname;
-	char    *path;
-} Visited;
+	TEST_TRUE (ret);
 
-static NihList *visited = NULL;
-static int visitor_called = 0;
 
-static int
-my_visitor (void        *data,
-	    const char  *dirname,
-	    const char  *path,
-	    struct stat *statbuf)
-{
-	Visited *v;
+	/* Check that an emacs-style backup file is matched. */
+	TEST_FEATURE ("with emacs-style backup file");
+	ret = nih_file_is_backup ("#foo#");
 
-	visitor_called++;
+	TEST_TRUE (ret);
 
-	TEST_ALLOC_SAFE {
-		v = nih_new (visited, Visited);
-		nih_list_init (&v->entry);
-		nih_alloc_set_destructor (v, nih_list_destroy);
 
-		v->data = data;
-		v->dirname = nih_strdup (v, dirname);
-		v->path = nih_strdup (v, path);
+	/* Check that a file beginning with a # is not matched. */
+	TEST_FEATURE ("with file beginning with hash");
+	ret = nih_file_is_backup ("#foo");
 
-		nih_list_add (visited, &v->entry);
-	}
+	TEST_FALSE (ret);
 
-	if (data == (void *)-1) {
-		errno = EINVAL;
-		nih_return_system_error (-1);
-	}
 
-	return 0;
-}
+	/* Check that a file ending with a # is not matched. */
+	TEST_FEATURE ("with file ending with hash");
+	ret = nih_file_is_backup ("foo#");
 
-static int error_called = 0;
-static char *last_error_path = NULL;
-static int last_error = -1;
+	TEST_FALSE (ret);
+}
 
-static int
-my_error_handler (void        *data,
-		  const char  *dirname,
-		  const char  *path,
-		  struct stat *statbuf)
+void
+test_is_swap (void)
 {
-	NihError *err;
+	int ret;
 
-	error_called++;
+	TEST_FUNCTION ("nih_file_is_swap");
 
-	err = nih_error_get ();
-	last_error = err->number;
-	if (last_error_path)
-		free (last_error_path);
-	last_error_path = strdup (path);
 
- 	if (data == (void *)-2) {
-		return -1;
-	}
+	/* Check that a plain file beginning with .# is a swap file. */
+	TEST_FEATURE ("with emacs-style swap file");
+	ret = nih_file_is_swap (".#foo");
 
-	nih_free (err);
+	TEST_TRUE (ret);
 
-	return 0;
-}
 
+	/* Check that a path with a file beginning with .# is a swap file. */
+	TEST_FEATURE ("with path to emacs-style swap file");
+	ret = nih_file_is_swap ("/path/to/.#foo");
 
-static int
-my_filter (void       *data,
-	   const char *path,
-	   int         is_dir)
-{
-	char *slash;
+	TEST_TRUE (ret);
 
-	slash = strrchr (path, '/');
+
+	/* Check that a path containing an emacs-style swap directory is
+	 * not swap, since we're already walking it.
+	 */
+	TEST_FEATURE ("with emacs-style swap path to non-swap file");
+	ret = nih_file_is_swap ("/path/.#to/foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a file containing the signature is not swap. */
+	TEST_FEATURE ("with file containing .#");
+	ret = nih_file_is_swap ("foo.#txt");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a plain non-swap file is not matched. */
+	TEST_FEATURE ("with plain non-swap file");
+	ret = nih_file_is_swap ("foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a file ending with .swp is a swap file. */
+	TEST_FEATURE ("with vi-style .swp file");
+	ret = nih_file_is_swap ("foo.swp");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a file ending with .swo is a swap file. */
+	TEST_FEATURE ("with vi-style .swo file");
+	ret = nih_file_is_swap ("foo.swo");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a file ending with .swn is a swap file. */
+	TEST_FEATURE ("with vi-style .swn file");
+	ret = nih_file_is_swap ("foo.swn");
+
+	TEST_TRUE (ret);
+}
+
+void
+test_is_rcs (void)
+{
+	int ret;
+
+	TEST_FUNCTION ("nih_file_is_rcs");
+
+
+	/* Check that a plain file ending with ,v is an RCS file. */
+	TEST_FEATURE ("with rcs-style file");
+	ret = nih_file_is_rcs ("foo,v");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a path with a file ending with ,v an RCS file. */
+	TEST_FEATURE ("with path to rcs-style file");
+	ret = nih_file_is_rcs ("/path/to/foo,v");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a path containing an RCS-style directory is not matched,
+	 * since we're already walking it.
+	 */
+	TEST_FEATURE ("with rcs-style path to non-rcs file");
+	ret = nih_file_is_rcs ("/path/to,v/foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a file containing the signature is not rcs. */
+	TEST_FEATURE ("with file containing ,v");
+	ret = nih_file_is_rcs ("foo,vtxt");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a plain non-rcs file is not matched. */
+	TEST_FEATURE ("with plain non-rcs file");
+	ret = nih_file_is_rcs ("foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that an RCS directory is matched. */
+	TEST_FEATURE ("with rcs directory name");
+	ret = nih_file_is_rcs ("RCS");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a CVS directory is matched. */
+	TEST_FEATURE ("with cvs directory name");
+	ret = nih_file_is_rcs ("CVS");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a CVS admin directory is matched. */
+	TEST_FEATURE ("with cvs admin directory name");
+	ret = nih_file_is_rcs ("CVS.adm");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an SCCS directory is matched. */
+	TEST_FEATURE ("with sccs directory name");
+	ret = nih_file_is_rcs ("SCCS");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a bazaar directory is matched. */
+	TEST_FEATURE ("with bzr directory name");
+	ret = nih_file_is_rcs (".bzr");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a bazaar log file is matched. */
+	TEST_FEATURE ("with bzr log filename");
+	ret = nih_file_is_rcs (".bzr.log");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a mercurial directory is matched. */
+	TEST_FEATURE ("with mercurial directory name");
+	ret = nih_file_is_rcs (".hg");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a git directory is matched. */
+	TEST_FEATURE ("with git directory name");
+	ret = nih_file_is_rcs (".git");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a subversion directory is matched. */
+	TEST_FEATURE ("with subversion directory name");
+	ret = nih_file_is_rcs (".svn");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a BitKeeper directory is matched. */
+	TEST_FEATURE ("with BitKeeper directory name");
+	ret = nih_file_is_rcs ("BitKeeper");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an arch ids file is matched. */
+	TEST_FEATURE ("with arch ids filename");
+	ret = nih_file_is_rcs (".arch-ids");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an arch inventory file is matched. */
+	TEST_FEATURE ("with arch inventory filename");
+	ret = nih_file_is_rcs (".arch-inventory");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an arch directory is matched. */
+	TEST_FEATURE ("with arch directory name");
+	ret = nih_file_is_rcs ("{arch}");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a darcs directory is matched. */
+	TEST_FEATURE ("with darcs directory name");
+	ret = nih_file_is_rcs ("_darcs");
+
+	TEST_TRUE (ret);
+}
+
+void
+test_is_packaging (void)
+{
+	int ret;
+
+	TEST_FUNCTION ("nih_file_is_packaging");
+
+
+	/* Check that a plain file ending with a dpkg name is packaging. */
+	TEST_FEATURE ("with plain dpkg file");
+	ret = nih_file_is_packaging ("foo.dpkg-new");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a path with a file ending with a dpkg name
+	 * is packaging
+	 */
+	TEST_FEATURE ("with path to dpkg file");
+	ret = nih_file_is_packaging ("/path/to/foo.dpkg-bak");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a path containing a dpkg directory is not packaging,
+	 * since we're already walking it.
+	 */
+	TEST_FEATURE ("with dpkg path to non-packaging file");
+	ret = nih_file_is_packaging ("/path/to.dpkg-bak/foo");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a plain file is not packaging. */
+	TEST_FEATURE ("with plain file");
+	ret = nih_file_is_packaging ("foo.txt");
+
+	TEST_FALSE (ret);
+}
+
+static const char *paths[] = {
+	"foo", "foo.txt", "/path/to/foo.c", "", "/", "/path/to/",
+	".foo", "/path/.to/foo", "foo~", "/path/to~/foo", "foo.bak",
+	"foo.BAK", "foo.bak.txt", ".bak", "#foo#", "#", "#foo", "foo#",
+	"foo.swp", "foo.swo", "foo.swn", "foo.swx", "foo.sw", ".#foo",
+	"foo,v", ",v", "v", "RCS", "RCSfoo", "CVS", "CVS.adm", "CVS.admx",
+	"SCCS", ".bzr", ".bzr.log", ".hg", ".git", ".svn", "BitKeeper",
+	".arch-ids", ".arch-inventory", "{arch}", "_darcs", "_darcsx",
+	"foo.dpkg-new", "foo.dpkg-", "foo.dpkg", "/path/to.dpkg-bak/foo",
+	"foo.dpkg-new.txt", "foo.rpmsave", "foo.rpmorig", "foo.rpmnew",
+	"foo.rpmnewer", "foo;0123abcd", "foo;0123ABCD", "foo;0123abc",
+	"foo;0123abcde", "foo;0123abcg", "foo;0123abcd;x", "foo;x;0123abcd",
+	"/path/to;0123abcd/foo", NULL
+};
+
+void
+test_ignore (void)
+{
+	int ret, i;
+
+	TEST_FUNCTION ("nih_test_ignore");
+
+
+	/* Check that a hidden file is to be ignored. */
+	TEST_FEATURE ("with hidden file");
+	ret = nih_file_ignore (NULL, ".foo");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a backup file is to be ignored. */
+	TEST_FEATURE ("with backup file");
+	ret = nih_file_ignore (NULL, "foo~");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a swap file is to be ignored. */
+	TEST_FEATURE ("with swap file");
+	ret = nih_file_ignore (NULL, "foo.swp");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an RCS file is to be ignored. */
+	TEST_FEATURE ("with rcs file");
+	ret = nih_file_ignore (NULL, "CVS");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a packaging file is to be ignored. */
+	TEST_FEATURE ("with packaging file");
+	ret = nih_file_ignore (NULL, "foo.dpkg-new");
+
+	TEST_TRUE (ret);
+
+
+	/* Check that an ordinary file isn't ignored. */
+	TEST_FEATURE ("with ordinary file");
+	ret = nih_file_ignore (NULL, "foo.txt");
+
+	TEST_FALSE (ret);
+
+
+	/* Check that the single pass over the path matches exactly what
+	 * the separate functions do, including for paths with directories
+	 * that would match.
+	 */
+	TEST_FEATURE ("with same results as separate functions");
+	for (i = 0; paths[i]; i++) {
+		int expected;
+
+		expected = (nih_file_is_hidden (paths[i])
+			    || nih_file_is_backup (paths[i])
+			    || nih_file_is_swap (paths[i])
+			    || nih_file_is_rcs (paths[i])
+			    || nih_file_is_packaging (paths[i]));
+
+		ret = nih_file_ignore (NULL, paths[i]);
+
+		TEST_EQ (ret, expected);
+	}
+}
+
+void
+test_matcher_new (void)
+{
+	NihFileMatcher *matcher;
+
+	TEST_FUNCTION ("nih_file_matcher_new");
+
+	/* Check that a new matcher is allocated with an empty hash table
+	 * of names, no tries and an empty list of other patterns.
+	 */
+	TEST_FEATURE ("with built-in patterns");
+	TEST_ALLOC_FAIL {
+		matcher = nih_file_matcher_new (NULL, TRUE);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (matcher, NULL);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (matcher, sizeof (NihFileMatcher));
+		TEST_TRUE (matcher->builtin);
+		TEST_ALLOC_PARENT (matcher->names, matcher);
+		TEST_EQ_P (matcher->prefixes, NULL);
+		TEST_EQ_P (matcher->suffixes, NULL);
+		TEST_LIST_EMPTY (&matcher->globs);
+
+		nih_free (matcher);
+	}
+}
+
+void
+test_matcher_add (void)
+{
+	NihFileMatcher *matcher;
+	NihListEntry   *entry;
+	int             ret;
+
+	TEST_FUNCTION ("nih_file_matcher_add");
+
+	/* Check that a literal name is added to the hash table of names. */
+	TEST_FEATURE ("with literal name");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			matcher = nih_file_matcher_new (NULL, FALSE);
+		}
+
+		ret = nih_file_matcher_add (matcher, "foo.conf");
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			nih_free (matcher);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		entry = (NihListEntry *)nih_hash_lookup (matcher->names,
+							 "foo.conf");
+		TEST_NE_P (entry, NULL);
+		TEST_ALLOC_PARENT (entry, matcher);
+		TEST_EQ_STR (entry->str, "foo.conf");
+
+		TEST_EQ_P (matcher->prefixes, NULL);
+		TEST_EQ_P (matcher->suffixes, NULL);
+		TEST_LIST_EMPTY (&matcher->globs);
+
+		nih_free (matcher);
+	}
+
+
+	/* Check that a literal followed by a star is added to the trie of
+	 * prefixes, one node for each character.
+	 */
+	TEST_FEATURE ("with prefix");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			matcher = nih_file_matcher_new (NULL, FALSE);
+		}
+
+		ret = nih_file_matcher_add (matcher, "ab*");
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			nih_free (matcher);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_NE_P (matcher->prefixes, NULL);
+		TEST_FALSE (matcher->prefixes->terminal);
+		TEST_NE_P (matcher->prefixes->children, NULL);
+		TEST_EQ (matcher->prefixes->children->c, 'a');
+		TEST_FALSE (matcher->prefixes->children->terminal);
+		TEST_NE_P (matcher->prefixes->children->children, NULL);
+		TEST_EQ (matcher->prefixes->children->children->c, 'b');
+		TEST_TRUE (matcher->prefixes->children->children->terminal);
+
+		TEST_EQ_P (matcher->suffixes, NULL);
+		TEST_LIST_EMPTY (&matcher->globs);
+
+		nih_free (matcher);
+	}
+
+
+	/* Check that a star followed by a literal is added to the trie of
+	 * suffixes, from the last character.
+	 */
+	TEST_FEATURE ("with suffix");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			matcher = nih_file_matcher_new (NULL, FALSE);
+		}
+
+		ret = nih_file_matcher_add (matcher, "*.o");
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			nih_free (matcher);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_NE_P (matcher->suffixes, NULL);
+		TEST_NE_P (matcher->suffixes->children, NULL);
+		TEST_EQ (matcher->suffixes->children->c, 'o');
+		TEST_NE_P (matcher->suffixes->children->children, NULL);
+		TEST_EQ (matcher->suffixes->children->children->c, '.');
+		TEST_TRUE (matcher->suffixes->children->children->terminal);
+
+		TEST_EQ_P (matcher->prefixes, NULL);
+		TEST_LIST_EMPTY (&matcher->globs);
+
+		nih_free (matcher);
+	}
+
+
+	/* Check that any other pattern is added to the list of patterns
+	 * matched with fnmatch().
+	 */
+	TEST_FEATURE ("with other pattern");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			matcher = nih_file_matcher_new (NULL, FALSE);
+		}
+
+		ret = nih_file_matcher_add (matcher, "*.[ch]");
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			nih_free (matcher);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (&matcher->globs);
+		entry = (NihListEntry *)matcher->globs.next;
+		TEST_ALLOC_PARENT (entry, matcher);
+		TEST_EQ_STR (entry->str, "*.[ch]");
+
+		TEST_EQ_P (matcher->prefixes, NULL);
+		TEST_EQ_P (matcher->suffixes, NULL);
+
+		nih_free (matcher);
+	}
+}
+
+void
+test_matcher_match (void)
+{
+	NihFileMatcher *matcher;
+	int             ret, i;
+
+	TEST_FUNCTION ("nih_file_matcher_match");
+	matcher = nih_file_matcher_new (NULL, FALSE);
+	TEST_NE_P (matcher, NULL);
+
+	TEST_EQ (nih_file_matcher_add (matcher, "Makefile"), 0);
+	TEST_EQ (nih_file_matcher_add (matcher, "tmp*"), 0);
+	TEST_EQ (nih_file_matcher_add (matcher, "*.o"), 0);
+	TEST_EQ (nih_file_matcher_add (matcher, "*.lo"), 0);
+	TEST_EQ (nih_file_matcher_add (matcher, "core.[0-9]*"), 0);
+
+
+	/* Check that a name added is matched, only as the last component
+	 * of the path.
+	 */
+	TEST_FEATURE ("with name");
+	ret = nih_file_matcher_match (matcher, "/path/to/Makefile", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/Makefile/foo", FALSE);
+
+	TEST_FALSE (ret);
+
+	ret = nih_file_matcher_match (matcher, "Makefile.am", FALSE);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a name beginning with a prefix added is matched. */
+	TEST_FEATURE ("with prefix");
+	ret = nih_file_matcher_match (matcher, "/path/to/tmp", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/tmpfile", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/tm", FALSE);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a name ending with a suffix added is matched, with
+	 * suffixes sharing characters.
+	 */
+	TEST_FEATURE ("with suffix");
+	ret = nih_file_matcher_match (matcher, "/path/to/foo.o", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/foo.lo", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/foo.so", FALSE);
+
+	TEST_FALSE (ret);
+
+	ret = nih_file_matcher_match (matcher, "o", FALSE);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that a name matching another pattern added is matched. */
+	TEST_FEATURE ("with other pattern");
+	ret = nih_file_matcher_match (matcher, "/path/to/core.1234", FALSE);
+
+	TEST_TRUE (ret);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/core.foo", FALSE);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that without the built-in patterns, files ignored by
+	 * nih_file_ignore() are not matched.
+	 */
+	TEST_FEATURE ("without built-in patterns");
+	ret = nih_file_matcher_match (matcher, "/path/to/foo~", FALSE);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that with the built-in patterns, everything ignored by
+	 * nih_file_ignore() is matched as well as the patterns added.
+	 */
+	TEST_FEATURE ("with built-in patterns");
+	matcher->builtin = TRUE;
+
+	for (i = 0; paths[i]; i++) {
+		ret = nih_file_matcher_match (matcher, paths[i], FALSE);
+
+		TEST_EQ (ret, nih_file_ignore (NULL, paths[i]));
+	}
+
+	ret = nih_file_matcher_match (matcher, "/path/to/foo.o", FALSE);
+
+	TEST_TRUE (ret);
+
+
+	/* Check that a star alone matches every name. */
+	TEST_FEATURE ("with star");
+	matcher->builtin = FALSE;
+	TEST_EQ (nih_file_matcher_add (matcher, "*"), 0);
+
+	ret = nih_file_matcher_match (matcher, "/path/to/foo", FALSE);
+
+	TEST_TRUE (ret);
+
+	nih_free (matcher);
+}
+
+
+typedef struct visited {
+	NihList  entry;
+
+	void    *data;
+	char    *dirname;
+	char    *path;
+} Visited;
+
+static NihList *visited = NULL;
+static int visitor_called = 0;
+
+static int
+my_visitor (void        *data,
+	    const char  *dirname,
+	    const char  *path,
+	    struct stat *statbuf)
+{
+	Visited *v;
+
+	visitor_called++;
+
+	TEST_ALLOC_SAFE {
+		v = nih_new (visited, Visited);
+		nih_list_init (&v->entry);
+		nih_alloc_set_destructor (v, nih_list_destroy);
+
+		v->data = data;
+		v->dirname = nih_strdup (v, dirname);
+		v->path = nih_strdup (v, path);
+
+		nih_list_add (visited, &v->entry);
+	}
+
+	if (data == (void *)-1) {
+		errno = EINVAL;
+		nih_return_system_error (-1);
+	}
+
+	return 0;
+}
+
+static int error_called = 0;
+static char *last_error_path = NULL;
+static int last_error = -1;
+
+static int
+my_error_handler (void        *data,
+		  const char  *dirname,
+		  const char  *path,
+		  struct stat *statbuf)
+{
+	NihError *err;
+
+	error_called++;
+
+	err = nih_error_get ();
+	last_error = err->number;
+	if (last_error_path)
+		free (last_error_path);
+	last_error_path = strdup (path);
+
+ 	if (data == (void *)-2) {
+		return -1;
+	}
+
+	nih_free (err);
+
+	return 0;
+}
+
+
+static int
+my_filter (void       *data,
+	   const char *path,
+	   int         is_dir)
+{
+	char *slash;
+
+	slash = strrchr (path, '/');
 	if (! strcmp (slash, "/frodo"))
 		return TRUE;
 
@@ -824,7 +1665,76 @@ test_dir_walk (void)
 		ret = nih_dir_walk (dirname, NULL, my_visitor, NULL, &ret);
 
 		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 7);
+		TEST_EQ (visitor_called, 7);
+
+		v = (Visited *)visited->next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar/bilbo");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar/frodo");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/baz");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/foo");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/frodo");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/frodo/baggins");
+		TEST_EQ_STR (v->path, filename);
+
+		nih_free (visited);
+	}
+
+
+	/* Check that a filter can be used to restrict the names of
+	 * objects visited and descended into.
+	 */
+	TEST_FEATURE ("with filter");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		ret = nih_dir_walk (dirname, my_filter,
+				    my_visitor, NULL, &ret);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 4);
 
 		v = (Visited *)visited->next;
 		TEST_EQ (v->data, &ret);
@@ -844,56 +1754,89 @@ test_dir_walk (void)
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/bar/frodo");
+		strcat (filename, "/baz");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/baz");
+		strcat (filename, "/foo");
+		TEST_EQ_STR (v->path, filename);
+
+		nih_free (visited);
+
+				/* Try also inverse filter */
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		ret = nih_dir_walk (dirname, my_filter_frodo_file,
+				    my_visitor, NULL, &ret);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 4);
+
+		v = (Visited *)visited->next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/foo");
+		strcat (filename, "/bar/frodo");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/frodo");
+		strcat (filename, "/baz");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/frodo/baggins");
+		strcat (filename, "/frodo");
 		TEST_EQ_STR (v->path, filename);
 
 		nih_free (visited);
 	}
 
 
-	/* Check that a filter can be used to restrict the names of
-	 * objects visited and descended into.
+	/* Check that failing to stat a file or directory in the tree with
+	 * no error handler set results in a warning being emitted and us
+	 * stepping over it.
 	 */
-	TEST_FEATURE ("with filter");
+	TEST_FEATURE ("with stat failure and no error handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0644);
+
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
+		logger_called = 0;
+		nih_log_set_logger (my_logger);
+
 		ret = nih_dir_walk (dirname, my_filter,
 				    my_visitor, NULL, &ret);
 
+		nih_log_set_logger (nih_logger_printf);
+
+		TEST_EQ (logger_called, 1);
+
 		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 4);
+		TEST_EQ (visitor_called, 3);
 
 		v = (Visited *)visited->next;
 		TEST_EQ (v->data, &ret);
@@ -905,8 +1848,62 @@ test_dir_walk (void)
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/baz");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/foo");
+		TEST_EQ_STR (v->path, filename);
+
+		nih_free (visited);
+	}
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0755);
+
+
+	/* Check that failing to stat a file or directory in the tree with
+	 * an error handler set results in the handler being called.
+	 */
+	TEST_FEATURE ("with stat failure and error handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0644);
+
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		error_called = 0;
+		last_error = -1;
+		last_error_path = NULL;
+
+		ret = nih_dir_walk (dirname, my_filter,
+				    my_visitor, my_error_handler, &ret);
+
+		TEST_EQ (error_called, 1);
+		TEST_EQ (last_error, EACCES);
+
 		strcpy (filename, dirname);
 		strcat (filename, "/bar/bilbo");
+		TEST_EQ_STR (last_error_path, filename);
+		free (last_error_path);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 3);
+
+		v = (Visited *)visited->next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
@@ -924,31 +1921,101 @@ test_dir_walk (void)
 		TEST_EQ_STR (v->path, filename);
 
 		nih_free (visited);
+	}
 
-				/* Try also inverse filter */
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0755);
+
+
+	/* Check that the error handler can return a negative value and
+	 * raised error to abort the directory walk.
+	 */
+	TEST_FEATURE ("with error from error handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0644);
+
+	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
-		ret = nih_dir_walk (dirname, my_filter_frodo_file,
-				    my_visitor, NULL, &ret);
+		error_called = 0;
+		last_error = -1;
+		last_error_path = NULL;
 
-		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 4);
+		ret = nih_dir_walk (dirname, my_filter,
+				    my_visitor, my_error_handler, (void *)-2);
+
+		TEST_EQ (error_called, 1);
+		TEST_EQ (last_error, EACCES);
+
+		strcpy (filename, dirname);
+		strcat (filename, "/bar/bilbo");
+		TEST_EQ_STR (last_error_path, filename);
+		free (last_error_path);
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, EACCES);
+		nih_free (err);
+
+		TEST_EQ (ret, -1);
+		TEST_EQ (visitor_called, 1);
 
 		v = (Visited *)visited->next;
-		TEST_EQ (v->data, &ret);
+		TEST_EQ (v->data, (void *)-2);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
 		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
-		v = (Visited *)v->entry.next;
+		nih_free (visited);
+	}
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0755);
+
+
+	/* Check that a complete failure to walk a sub-directory underneath
+	 * the tree also results in the error handler being called.
+	 */
+	TEST_FEATURE ("with inability to walk a sub-directory");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	chmod (filename, 0000);
+
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		error_called = 0;
+		last_error = -1;
+		last_error_path = NULL;
+
+		ret = nih_dir_walk (dirname, my_filter,
+				    my_visitor, my_error_handler, &ret);
+
+		TEST_EQ (error_called, 1);
+		TEST_EQ (last_error, EACCES);
+
+		strcpy (filename, dirname);
+		strcat (filename, "/bar");
+		TEST_EQ_STR (last_error_path, filename);
+		free (last_error_path);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 3);
+
+		v = (Visited *)visited->next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/bar/frodo");
+		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
@@ -962,22 +2029,21 @@ test_dir_walk (void)
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
-		strcat (filename, "/frodo");
+		strcat (filename, "/foo");
 		TEST_EQ_STR (v->path, filename);
 
 		nih_free (visited);
 	}
 
-
-	/* Check that failing to stat a file or directory in the tree with
-	 * no error handler set results in a warning being emitted and us
-	 * stepping over it.
-	 */
-	TEST_FEATURE ("with stat failure and no error handler");
 	strcpy (filename, dirname);
 	strcat (filename, "/bar");
-	chmod (filename, 0644);
+	chmod (filename, 0755);
+
 
+	/* Check that a warning is emitted if the visitor raises an error
+	 * when there is no error handler set.
+	 */
+	TEST_FEATURE ("with error in visitor");
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
@@ -988,31 +2054,79 @@ test_dir_walk (void)
 		nih_log_set_logger (my_logger);
 
 		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, NULL, &ret);
-
-		nih_log_set_logger (nih_logger_printf);
+				    my_visitor, NULL, (void *)-1);
+
+		nih_log_set_logger (nih_logger_printf);
+
+		TEST_EQ (logger_called, 3);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 3);
+
+		v = (Visited *)visited->next;
+		TEST_EQ (v->data, (void *)-1);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, (void *)-1);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/baz");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, (void *)-1);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/foo");
+		TEST_EQ_STR (v->path, filename);
+
+		nih_free (visited);
+	}
+
+
+	/* Check that the error handled is called if the visitor raises
+	 * an error.
+	 */
+	TEST_FEATURE ("with error in visitor and handler");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		error_called = 0;
+		last_error = -1;
+		last_error_path = NULL;
+
+		ret = nih_dir_walk (dirname, my_filter,
+				    my_visitor, my_error_handler, (void *)-1);
 
-		TEST_EQ (logger_called, 1);
+		TEST_EQ (error_called, 3);
+		free (last_error_path);
 
 		TEST_EQ (ret, 0);
 		TEST_EQ (visitor_called, 3);
 
 		v = (Visited *)visited->next;
-		TEST_EQ (v->data, &ret);
+		TEST_EQ (v->data, (void *)-1);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
 		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
+		TEST_EQ (v->data, (void *)-1);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
 		strcat (filename, "/baz");
 		TEST_EQ_STR (v->path, filename);
 
 		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
+		TEST_EQ (v->data, (void *)-1);
 		TEST_EQ_STR (v->dirname, dirname);
 		strcpy (filename, dirname);
 		strcat (filename, "/foo");
@@ -1021,18 +2135,60 @@ test_dir_walk (void)
 		nih_free (visited);
 	}
 
+
+	/* Check that we get a ENOTDIR error if we try and walk a file
+	 * and there's no error handler set.
+	 */
+	TEST_FEATURE ("with non-directory and no error handler");
 	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	chmod (filename, 0755);
+	strcat (filename, "/foo");
 
+	TEST_ALLOC_FAIL {
+		visitor_called = 0;
 
-	/* Check that failing to stat a file or directory in the tree with
-	 * an error handler set results in the handler being called.
+		ret = nih_dir_walk (filename, my_filter,
+				    my_visitor, NULL, &ret);
+
+		TEST_EQ (ret, -1);
+		TEST_EQ (visitor_called, 0);
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, ENOTDIR);
+		nih_free (err);
+	}
+
+
+	/* Check that we still get a ENOTDIR error if we try and walk a file
+	 * and there is an error handler set.
 	 */
-	TEST_FEATURE ("with stat failure and error handler");
+	TEST_FEATURE ("with non-directory and error handler");
 	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	chmod (filename, 0644);
+	strcat (filename, "/foo");
+
+	TEST_ALLOC_FAIL {
+		visitor_called = 0;
+		error_called = 0;
+
+		ret = nih_dir_walk (filename, my_filter,
+				    my_visitor, my_error_handler, &ret);
+
+		TEST_EQ (ret, -1);
+		TEST_EQ (visitor_called, 0);
+		TEST_EQ (error_called, 0);
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, ENOTDIR);
+		nih_free (err);
+	}
+
+
+	/* Check that we can detect the simplest kind of directory loop, and
+	 * have it treated as an ordinary error while visiting.
+	 */
+	TEST_FEATURE ("with simple directory loop");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/loop");
+	assert0 (symlink (dirname, filename));
 
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
@@ -1048,15 +2204,15 @@ test_dir_walk (void)
 				    my_visitor, my_error_handler, &ret);
 
 		TEST_EQ (error_called, 1);
-		TEST_EQ (last_error, EACCES);
+		TEST_EQ (last_error, NIH_DIR_LOOP_DETECTED);
 
 		strcpy (filename, dirname);
-		strcat (filename, "/bar/bilbo");
+		strcat (filename, "/bar/loop");
 		TEST_EQ_STR (last_error_path, filename);
 		free (last_error_path);
 
 		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 3);
+		TEST_EQ (visitor_called, 5);
 
 		v = (Visited *)visited->next;
 		TEST_EQ (v->data, &ret);
@@ -1065,6 +2221,20 @@ test_dir_walk (void)
 		strcat (filename, "/bar");
 		TEST_EQ_STR (v->path, filename);
 
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar/bilbo");
+		TEST_EQ_STR (v->path, filename);
+
+		v = (Visited *)v->entry.next;
+		TEST_EQ (v->data, &ret);
+		TEST_EQ_STR (v->dirname, dirname);
+		strcpy (filename, dirname);
+		strcat (filename, "/bar/loop");
+		TEST_EQ_STR (v->path, filename);
+
 		v = (Visited *)v->entry.next;
 		TEST_EQ (v->data, &ret);
 		TEST_EQ_STR (v->dirname, dirname);
@@ -1083,230 +2253,281 @@ test_dir_walk (void)
 	}
 
 	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	chmod (filename, 0755);
+	strcat (filename, "/bar/loop");
+	unlink (filename);
 
 
-	/* Check that the error handler can return a negative value and
-	 * raised error to abort the directory walk.
-	 */
-	TEST_FEATURE ("with error from error handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/frodo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/bilbo");
+	unlink (filename);
+
 	strcpy (filename, dirname);
 	strcat (filename, "/bar");
-	chmod (filename, 0644);
+	rmdir (filename);
 
-	TEST_ALLOC_FAIL {
-		TEST_ALLOC_SAFE {
-			visitor_called = 0;
-			visited = nih_list_new (NULL);
-		}
+	strcpy (filename, dirname);
+	strcat (filename, "/baz");
+	rmdir (filename);
 
-		error_called = 0;
-		last_error = -1;
-		last_error_path = NULL;
+	strcpy (filename, dirname);
+	strcat (filename, "/frodo/baggins");
+	unlink (filename);
 
-		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, my_error_handler, (void *)-2);
+	strcpy (filename, dirname);
+	strcat (filename, "/frodo");
+	rmdir (filename);
 
-		TEST_EQ (error_called, 1);
-		TEST_EQ (last_error, EACCES);
+	rmdir (dirname);
+}
 
-		strcpy (filename, dirname);
-		strcat (filename, "/bar/bilbo");
-		TEST_EQ_STR (last_error_path, filename);
-		free (last_error_path);
 
-		err = nih_error_get ();
-		TEST_EQ (err->number, EACCES);
-		nih_free (err);
+typedef struct visited_at {
+	NihList  entry;
 
-		TEST_EQ (ret, -1);
-		TEST_EQ (visitor_called, 1);
+	char    *name;
+	char    *path;
+	int      is_dir;
+	int      has_stat;
+} VisitedAt;
 
-		v = (Visited *)visited->next;
-		TEST_EQ (v->data, (void *)-2);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (v->path, filename);
+static int
+my_visitor_at (void        *data,
+	       int          dirfd,
+	       const char  *name,
+	       const char  *path,
+	       int          is_dir,
+	       struct stat *statbuf)
+{
+	VisitedAt   *v;
+	struct stat  namebuf;
 
-		nih_free (visited);
+	visitor_called++;
+
+	/* The object must be reachable through the directory descriptor */
+	TEST_EQ (fstatat (dirfd, name, &namebuf, AT_SYMLINK_NOFOLLOW), 0);
+
+	if (statbuf)
+		TEST_EQ (S_ISDIR (statbuf->st_mode), is_dir);
+
+	TEST_ALLOC_SAFE {
+		v = nih_new (visited, VisitedAt);
+		nih_list_init (&v->entry);
+		nih_alloc_set_destructor (v, nih_list_destroy);
+
+		v->name = nih_strdup (v, name);
+		v->path = nih_strdup (v, path);
+		v->is_dir = is_dir;
+		v->has_stat = (statbuf != NULL);
+
+		nih_list_add (visited, &v->entry);
 	}
 
+	return 0;
+}
+
+static void
+check_visited_at (VisitedAt  *v,
+		  const char *dirname,
+		  const char *name,
+		  const char *subpath,
+		  int         is_dir,
+		  int         has_stat)
+{
+	char filename[PATH_MAX];
+
+	TEST_EQ_STR (v->name, name);
+
 	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	chmod (filename, 0755);
+	strcat (filename, subpath);
+	TEST_EQ_STR (v->path, filename);
 
+	TEST_EQ (v->is_dir, is_dir);
+	TEST_EQ (v->has_stat, has_stat);
+}
+
+void
+test_dir_walk_at (void)
+{
+	FILE      *fd;
+	char       dirname[PATH_MAX], filename[PATH_MAX];
+	char      *basename;
+	int        ret, parentfd;
+	VisitedAt *v;
+	NihError  *err;
+
+	TEST_FUNCTION ("nih_dir_walk_at");
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
 
-	/* Check that a complete failure to walk a sub-directory underneath
-	 * the tree also results in the error handler being called.
-	 */
-	TEST_FEATURE ("with inability to walk a sub-directory");
 	strcpy (filename, dirname);
 	strcat (filename, "/bar");
-	chmod (filename, 0000);
 
+	mkdir (filename, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/bilbo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/link");
+	assert0 (symlink ("bar", filename));
+
+
+	/* Check that without flags, the visitor is called for each object
+	 * with the descriptor of its directory and its name, that objects
+	 * are not stat()ed, and that symbolic links to directories are
+	 * descended into.
+	 */
+	TEST_FEATURE ("without flags");
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
-		error_called = 0;
-		last_error = -1;
-		last_error_path = NULL;
+		ret = nih_dir_walk_at (AT_FDCWD, dirname, 0, NULL,
+				       my_visitor_at, NULL, NULL);
 
-		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, my_error_handler, &ret);
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 5);
 
-		TEST_EQ (error_called, 1);
-		TEST_EQ (last_error, EACCES);
+		v = (VisitedAt *)visited->next;
+		check_visited_at (v, dirname, "bar", "/bar", TRUE, FALSE);
 
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (last_error_path, filename);
-		free (last_error_path);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "bilbo", "/bar/bilbo",
+				  FALSE, FALSE);
 
-		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 3);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "foo", "/foo", FALSE, FALSE);
 
-		v = (Visited *)visited->next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "link", "/link", TRUE, FALSE);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/baz");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "bilbo", "/link/bilbo",
+				  FALSE, FALSE);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/foo");
-		TEST_EQ_STR (v->path, filename);
+		nih_free (visited);
+	}
+
+
+	/* Check that with NIH_DIR_WALK_STAT, the visitor is passed the
+	 * stat of each object.
+	 */
+	TEST_FEATURE ("with stat");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			visitor_called = 0;
+			visited = nih_list_new (NULL);
+		}
+
+		ret = nih_dir_walk_at (AT_FDCWD, dirname, NIH_DIR_WALK_STAT,
+				       NULL, my_visitor_at, NULL, NULL);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, 5);
+
+		NIH_LIST_FOREACH (visited, iter) {
+			v = (VisitedAt *)iter;
+
+			TEST_TRUE (v->has_stat);
+		}
 
 		nih_free (visited);
 	}
 
-	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	chmod (filename, 0755);
-
 
-	/* Check that a warning is emitted if the visitor raises an error
-	 * when there is no error handler set.
+	/* Check that with NIH_DIR_WALK_NOSUBDIRS, the visitor is called
+	 * for the objects directly within the directory, including the
+	 * sub-directories, but not for those within them.
 	 */
-	TEST_FEATURE ("with error in visitor");
+	TEST_FEATURE ("without sub-directories");
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
-		logger_called = 0;
-		nih_log_set_logger (my_logger);
-
-		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, NULL, (void *)-1);
-
-		nih_log_set_logger (nih_logger_printf);
-
-		TEST_EQ (logger_called, 3);
+		ret = nih_dir_walk_at (AT_FDCWD, dirname,
+				       NIH_DIR_WALK_NOSUBDIRS, NULL,
+				       my_visitor_at, NULL, NULL);
 
 		TEST_EQ (ret, 0);
 		TEST_EQ (visitor_called, 3);
 
-		v = (Visited *)visited->next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)visited->next;
+		check_visited_at (v, dirname, "bar", "/bar", TRUE, FALSE);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/baz");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "foo", "/foo", FALSE, FALSE);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/foo");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)v->entry.next;
+		check_visited_at (v, dirname, "link", "/link", TRUE, FALSE);
 
 		nih_free (visited);
 	}
 
 
-	/* Check that the error handled is called if the visitor raises
-	 * an error.
+	/* Check that the path walked may be relative to a directory
+	 * descriptor, in which case the paths given to the visitor are
+	 * too.
 	 */
-	TEST_FEATURE ("with error in visitor and handler");
+	TEST_FEATURE ("with directory descriptor");
+	basename = strrchr (dirname, '/');
+	*basename = '\0';
+	parentfd = open (dirname, O_RDONLY | O_DIRECTORY);
+	*basename++ = '/';
+
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
-		error_called = 0;
-		last_error = -1;
-		last_error_path = NULL;
-
-		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, my_error_handler, (void *)-1);
-
-		TEST_EQ (error_called, 3);
-		free (last_error_path);
+		ret = nih_dir_walk_at (parentfd, basename, 0, my_filter,
+				       my_visitor_at, NULL, NULL);
 
 		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 3);
-
-		v = (Visited *)visited->next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (v->path, filename);
-
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/baz");
-		TEST_EQ_STR (v->path, filename);
+		TEST_EQ (visitor_called, 5);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, (void *)-1);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/foo");
-		TEST_EQ_STR (v->path, filename);
+		v = (VisitedAt *)visited->next;
+		check_visited_at (v, basename, "bar", "/bar", TRUE, FALSE);
 
 		nih_free (visited);
 	}
 
+	close (parentfd);
 
-	/* Check that we get a ENOTDIR error if we try and walk a file
-	 * and there's no error handler set.
-	 */
-	TEST_FEATURE ("with non-directory and no error handler");
+
+	/* Check that we get a ENOTDIR error if we try and walk a file. */
+	TEST_FEATURE ("with non-directory");
 	strcpy (filename, dirname);
 	strcat (filename, "/foo");
 
 	TEST_ALLOC_FAIL {
 		visitor_called = 0;
 
-		ret = nih_dir_walk (filename, my_filter,
-				    my_visitor, NULL, &ret);
+		ret = nih_dir_walk_at (AT_FDCWD, filename, 0, NULL,
+				       my_visitor_at, NULL, NULL);
 
 		TEST_EQ (ret, -1);
 		TEST_EQ (visitor_called, 0);
@@ -1317,137 +2538,307 @@ test_dir_walk (void)
 	}
 
 
-	/* Check that we still get a ENOTDIR error if we try and walk a file
-	 * and there is an error handler set.
-	 */
-	TEST_FEATURE ("with non-directory and error handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/link");
+	unlink (filename);
+
 	strcpy (filename, dirname);
 	strcat (filename, "/foo");
+	unlink (filename);
 
-	TEST_ALLOC_FAIL {
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/bilbo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	rmdir (filename);
+
+	rmdir (dirname);
+}
+
+static int
+my_error_handler_at (void        *data,
+		     int          dirfd,
+		     const char  *name,
+		     const char  *path,
+		     struct stat *statbuf)
+{
+	NihError *err;
+
+	error_called++;
+
+	err = nih_error_get ();
+	last_error = err->number;
+
+	if (data == (void *)-2)
+		return -1;
+
+	nih_free (err);
+
+	return 0;
+}
+
+static void
+check_visited_same (NihList *expected,
+		    NihList *visited)
+{
+	NihList *iter, *viter;
+
+	for (iter = expected->next, viter = visited->next;
+	     (iter != expected) && (viter != visited);
+	     iter = iter->next, viter = viter->next) {
+		VisitedAt *e = (VisitedAt *)iter;
+		VisitedAt *v = (VisitedAt *)viter;
+
+		TEST_EQ_STR (v->name, e->name);
+		TEST_EQ_STR (v->path, e->path);
+		TEST_EQ (v->is_dir, e->is_dir);
+		TEST_EQ (v->has_stat, e->has_stat);
+	}
+
+	TEST_EQ_P (iter, expected);
+	TEST_EQ_P (viter, visited);
+}
+
+void
+test_dir_walk_parallel (void)
+{
+	FILE      *fd;
+	char       dirname[PATH_MAX], filename[PATH_MAX + 32];
+	NihList   *expected;
+	NihError  *err;
+	int        ret, i, j, expected_called;
+
+	TEST_FUNCTION ("nih_dir_walk_parallel");
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	for (i = 0; i < 8; i++) {
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d", dirname, i);
+		mkdir (filename, 0755);
+
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d/sub", dirname, i);
+		mkdir (filename, 0755);
+
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d/frodo", dirname, i);
+		mkdir (filename, 0755);
+
+		for (j = 0; j < 3; j++) {
+			snprintf (filename, sizeof (filename),
+				  "%s/dir%d/file%d", dirname, i, j);
+			fd = fopen (filename, "w");
+			fprintf (fd, "test\n");
+			fclose (fd);
+
+			snprintf (filename, sizeof (filename),
+				  "%s/dir%d/sub/file%d", dirname, i, j);
+			fd = fopen (filename, "w");
+			fprintf (fd, "test\n");
+			fclose (fd);
+		}
+	}
+
+	snprintf (filename, sizeof (filename),
+		  "%s/dir3/loop", dirname);
+	assert0 (symlink ("..", filename));
+
+	snprintf (filename, sizeof (filename),
+		  "%s/link", dirname);
+	assert0 (symlink ("dir5", filename));
+
+
+	/* Make the same walk with nih_dir_walk_at() to know what to
+	 * expect.
+	 */
+	visitor_called = 0;
+	error_called = 0;
+	visited = nih_list_new (NULL);
+
+	ret = nih_dir_walk_at (AT_FDCWD, dirname, 0, my_filter,
+			       my_visitor_at, my_error_handler_at, NULL);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (error_called, 1);
+	TEST_EQ (last_error, NIH_DIR_LOOP_DETECTED);
+
+	expected = visited;
+	expected_called = visitor_called;
+
+
+	/* Check that with worker threads, the filter, visitor and error
+	 * handler are called in exactly the same order and with the same
+	 * arguments as a walk without them; repeated so that the workers
+	 * race the walk differently each time.
+	 */
+	TEST_FEATURE ("with worker threads");
+	for (i = 0; i < 20; i++) {
 		visitor_called = 0;
 		error_called = 0;
+		visited = nih_list_new (NULL);
 
-		ret = nih_dir_walk (filename, my_filter,
-				    my_visitor, my_error_handler, &ret);
+		ret = nih_dir_walk_parallel (AT_FDCWD, dirname, 0, 4,
+					     my_filter, my_visitor_at,
+					     my_error_handler_at, NULL);
 
-		TEST_EQ (ret, -1);
-		TEST_EQ (visitor_called, 0);
-		TEST_EQ (error_called, 0);
+		TEST_EQ (ret, 0);
+		TEST_EQ (visitor_called, expected_called);
+		TEST_EQ (error_called, 1);
+		TEST_EQ (last_error, NIH_DIR_LOOP_DETECTED);
 
-		err = nih_error_get ();
-		TEST_EQ (err->number, ENOTDIR);
-		nih_free (err);
+		check_visited_same (expected, visited);
+
+		nih_free (visited);
 	}
 
 
-	/* Check that we can detect the simplest kind of directory loop, and
-	 * have it treated as an ordinary error while visiting.
-	 */
-	TEST_FEATURE ("with simple directory loop");
-	strcpy (filename, dirname);
-	strcat (filename, "/bar/loop");
-	assert0 (symlink (dirname, filename));
+	/* Check that a single worker thread is enough. */
+	TEST_FEATURE ("with single worker thread");
+	visitor_called = 0;
+	error_called = 0;
+	visited = nih_list_new (NULL);
+
+	ret = nih_dir_walk_parallel (AT_FDCWD, dirname, 0, 1,
+				     my_filter, my_visitor_at,
+				     my_error_handler_at, NULL);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (error_called, 1);
+
+	check_visited_same (expected, visited);
+
+	nih_free (visited);
+
 
+	/* Check that without worker threads, the walk is made by the
+	 * calling thread alone.
+	 */
+	TEST_FEATURE ("without worker threads");
 	TEST_ALLOC_FAIL {
 		TEST_ALLOC_SAFE {
 			visitor_called = 0;
+			error_called = 0;
 			visited = nih_list_new (NULL);
 		}
 
-		error_called = 0;
-		last_error = -1;
-		last_error_path = NULL;
-
-		ret = nih_dir_walk (dirname, my_filter,
-				    my_visitor, my_error_handler, &ret);
+		ret = nih_dir_walk_parallel (AT_FDCWD, dirname, 0, 0,
+					     my_filter, my_visitor_at,
+					     my_error_handler_at, NULL);
 
+		TEST_EQ (ret, 0);
 		TEST_EQ (error_called, 1);
-		TEST_EQ (last_error, NIH_DIR_LOOP_DETECTED);
 
-		strcpy (filename, dirname);
-		strcat (filename, "/bar/loop");
-		TEST_EQ_STR (last_error_path, filename);
-		free (last_error_path);
+		check_visited_same (expected, visited);
 
-		TEST_EQ (ret, 0);
-		TEST_EQ (visitor_called, 5);
+		nih_free (visited);
+	}
 
-		v = (Visited *)visited->next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar");
-		TEST_EQ_STR (v->path, filename);
+	nih_free (expected);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar/bilbo");
-		TEST_EQ_STR (v->path, filename);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/bar/loop");
-		TEST_EQ_STR (v->path, filename);
+	/* Check that with NIH_DIR_WALK_STAT, the visitor is passed the
+	 * stat of each object as read by the worker threads.
+	 */
+	TEST_FEATURE ("with stat");
+	visitor_called = 0;
+	error_called = 0;
+	visited = nih_list_new (NULL);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/baz");
-		TEST_EQ_STR (v->path, filename);
+	ret = nih_dir_walk_parallel (AT_FDCWD, dirname, NIH_DIR_WALK_STAT, 4,
+				     my_filter, my_visitor_at,
+				     my_error_handler_at, NULL);
 
-		v = (Visited *)v->entry.next;
-		TEST_EQ (v->data, &ret);
-		TEST_EQ_STR (v->dirname, dirname);
-		strcpy (filename, dirname);
-		strcat (filename, "/foo");
-		TEST_EQ_STR (v->path, filename);
+	TEST_EQ (ret, 0);
+	TEST_EQ (visitor_called, expected_called);
+	TEST_EQ (error_called, 1);
 
-		nih_free (visited);
+	NIH_LIST_FOREACH (visited, iter) {
+		VisitedAt *v = (VisitedAt *)iter;
+
+		TEST_TRUE (v->has_stat);
 	}
 
-	strcpy (filename, dirname);
-	strcat (filename, "/bar/loop");
-	unlink (filename);
+	nih_free (visited);
 
 
-	strcpy (filename, dirname);
-	strcat (filename, "/foo");
-	unlink (filename);
+	/* Check that the walk is aborted if the error handler returns a
+	 * negative value, with the directories read ahead discarded.
+	 */
+	TEST_FEATURE ("with error handler aborting walk");
+	visitor_called = 0;
+	error_called = 0;
+	visited = nih_list_new (NULL);
 
-	strcpy (filename, dirname);
-	strcat (filename, "/bar/frodo");
+	ret = nih_dir_walk_parallel (AT_FDCWD, dirname, 0, 4,
+				     my_filter, my_visitor_at,
+				     my_error_handler_at, (void *)-2);
+
+	TEST_EQ (ret, -1);
+	TEST_EQ (error_called, 1);
+	TEST_LT (visitor_called, expected_called);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_DIR_LOOP_DETECTED);
+	nih_free (err);
+
+	nih_free (visited);
+
+
+	/* Check that we get a ENOTDIR error if we try and walk a file. */
+	TEST_FEATURE ("with non-directory");
+	snprintf (filename, sizeof (filename),
+		  "%s/dir0/file0", dirname);
+	visitor_called = 0;
+
+	ret = nih_dir_walk_parallel (AT_FDCWD, filename, 0, 4, NULL,
+				     my_visitor_at, NULL, NULL);
+
+	TEST_EQ (ret, -1);
+	TEST_EQ (visitor_called, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOTDIR);
+	nih_free (err);
+
+
+	snprintf (filename, sizeof (filename),
+		  "%s/link", dirname);
 	unlink (filename);
 
-	strcpy (filename, dirname);
-	strcat (filename, "/bar/bilbo");
+	snprintf (filename, sizeof (filename),
+		  "%s/dir3/loop", dirname);
 	unlink (filename);
 
-	strcpy (filename, dirname);
-	strcat (filename, "/bar");
-	rmdir (filename);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 3; j++) {
+			snprintf (filename, sizeof (filename),
+				  "%s/dir%d/file%d", dirname, i, j);
+			unlink (filename);
 
-	strcpy (filename, dirname);
-	strcat (filename, "/baz");
-	rmdir (filename);
+			snprintf (filename, sizeof (filename),
+				  "%s/dir%d/sub/file%d", dirname, i, j);
+			unlink (filename);
+		}
 
-	strcpy (filename, dirname);
-	strcat (filename, "/frodo/baggins");
-	unlink (filename);
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d/sub", dirname, i);
+		rmdir (filename);
 
-	strcpy (filename, dirname);
-	strcat (filename, "/frodo");
-	rmdir (filename);
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d/frodo", dirname, i);
+		rmdir (filename);
+
+		snprintf (filename, sizeof (filename),
+			  "%s/dir%d", dirname, i);
+		rmdir (filename);
+	}
 
 	rmdir (dirname);
 }
 
-
 int
 main (int   argc,
       char *argv[])
@@ -1455,13 +2846,24 @@ main (int   argc,
 	test_read ();
 	test_map ();
 	test_unmap ();
+	test_reader_new ();
+	test_reader_read ();
+	test_reader_line ();
+	test_mapping_new ();
+	test_window_new ();
+	test_window_move ();
 	test_is_hidden ();
 	test_is_backup ();
 	test_is_swap ();
 	test_is_rcs ();
 	test_is_packaging ();
 	test_ignore ();
+	test_matcher_new ();
+	test_matcher_add ();
+	test_matcher_match ();
 	test_dir_walk ();
+	test_dir_walk_at ();
+	test_dir_walk_parallel ();
 
 	return 0;
 }
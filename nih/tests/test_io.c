@@ -33,6 +33,7 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
@@ -42,6 +43,7 @@
 #include <nih/alloc.h>
 #include <nih/list.h>
 #include <nih/io.h>
+#include <nih/loop.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 #include <nih/errors.h>
@@ -61,6 +63,15 @@ my_watcher (void *data, NihIoWatch *watch, NihIoEvents events)
 	last_events = events;
 }
 
+static NihIoWatch *order_watch[3];
+static int         order_called = 0;
+
+static void
+my_order_watcher (void *data, NihIoWatch *watch, NihIoEvents events)
+{
+	order_watch[order_called++] = watch;
+}
+
 void
 test_add_watch (void)
 {
@@ -93,6 +104,7 @@ test_add_watch (void)
 		TEST_EQ (watch->events, NIH_IO_READ);
 		TEST_EQ_P (watch->watcher, my_watcher);
 		TEST_EQ_P (watch->data, &watch);
+		TEST_EQ (watch->priority, NIH_LOOP_PRIORITY_DEFAULT);
 
 		nih_free (watch);
 
@@ -147,6 +159,7 @@ void
 test_handle_fds (void)
 {
 	NihIoWatch    *watch1, *watch2, *watch3;
+	NihLoop       *loop;
 	fd_set         readfds, writefds, exceptfds;
 	int            fds[2];
 
@@ -213,6 +226,75 @@ test_handle_fds (void)
 	TEST_EQ (watcher_called, 0);
 
 
+	nih_free (watch1);
+	nih_free (watch2);
+	nih_free (watch3);
+
+
+	/* Check that watches are called in order of priority, and in the
+	 * order they were added within the same priority.
+	 */
+	TEST_FEATURE ("with priorities");
+	watch1 = nih_io_add_watch (NULL, fds[0], NIH_IO_READ,
+				   my_order_watcher, NULL);
+	watch2 = nih_io_add_watch (NULL, fds[0], NIH_IO_READ,
+				   my_order_watcher, NULL);
+	watch3 = nih_io_add_watch (NULL, fds[0], NIH_IO_READ,
+				   my_order_watcher, NULL);
+
+	watch1->priority = NIH_LOOP_PRIORITY_LOW;
+	watch3->priority = NIH_LOOP_PRIORITY_HIGH;
+
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+	FD_SET (fds[0], &readfds);
+
+	order_called = 0;
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_EQ (order_called, 3);
+	TEST_EQ_P (order_watch[0], watch3);
+	TEST_EQ_P (order_watch[1], watch2);
+	TEST_EQ_P (order_watch[2], watch1);
+
+
+	/* Check that once the time budget of the loop has been spent,
+	 * watches of high priority are still called but the rest are
+	 * deferred.
+	 */
+	TEST_FEATURE ("with time budget spent");
+	loop = nih_loop_current ();
+	nih_loop_set_budget (loop, 1);
+	loop->budget_start.tv_sec = 0;
+	loop->budget_start.tv_nsec = 0;
+	loop->budget_exceeded = FALSE;
+	loop->budget_waived = FALSE;
+
+	order_called = 0;
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_EQ (order_called, 1);
+	TEST_EQ_P (order_watch[0], watch3);
+	TEST_TRUE (loop->budget_exceeded);
+
+
+	/* Check that when the budget is waived, all of the watches are
+	 * called.
+	 */
+	TEST_FEATURE ("with time budget waived");
+	loop->budget_exceeded = FALSE;
+	loop->budget_waived = TRUE;
+
+	order_called = 0;
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_EQ (order_called, 3);
+	TEST_FALSE (loop->budget_exceeded);
+
+	nih_loop_set_budget (loop, 0);
+	loop->budget_waived = FALSE;
+
 	nih_free (watch1);
 	nih_free (watch2);
 	nih_free (watch3);
@@ -3160,6 +3242,258 @@ test_get_family (void)
 }
 
 
+static void
+ring_iterate (void)
+{
+	fd_set         readfds, writefds, exceptfds;
+	struct timeval timeout;
+	int            nfds;
+
+	nfds = 0;
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+
+	nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	select (nfds, &readfds, &writefds, &exceptfds, &timeout);
+
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+}
+
+void
+test_ring (void)
+{
+	NihLoop  *loop, *previous;
+	NihIo    *io;
+	int       fds[2], ret, i;
+	char      buf[80];
+	ssize_t   len;
+	uint64_t  count;
+
+	/* Check that we can set up the completion ring; if the kernel
+	 * doesn't support it, an error should be raised and stream mode
+	 * structures remain readiness-based, so we skip the other tests.
+	 */
+	TEST_FUNCTION ("nih_io_ring_init");
+	ret = nih_io_ring_init ();
+	if (ret < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		printf ("SKIP: io_uring unavailable: %s\n", err->message);
+		nih_free (err);
+		return;
+	}
+
+	TEST_EQ (ret, 0);
+
+	/* Check that calling it again has no effect. */
+	TEST_EQ (nih_io_ring_init (), 0);
+
+
+	/* Check that a stream mode structure created once the ring has
+	 * been set up is managed by it, and that its watch is not placed
+	 * in the list of watches.
+	 */
+	TEST_FEATURE ("with stream mode");
+	assert0 (socketpair (PF_UNIX, SOCK_STREAM, 0, fds));
+	io = nih_io_reopen (NULL, fds[0], NIH_IO_STREAM,
+			    my_reader, my_close_handler, my_error_handler,
+			    &io);
+
+	TEST_NE_P (io->ring, NULL);
+	TEST_ALLOC_PARENT (io->ring, io);
+	TEST_LIST_EMPTY (&io->watch->entry);
+
+	/* The descriptor should be left blocking, since the kernel waits
+	 * for it to be ready.
+	 */
+	TEST_FALSE (fcntl (fds[0], F_GETFL) & O_NONBLOCK);
+
+
+	/* Check that data arriving on the descriptor is received through
+	 * the ring into the receive buffer and the reader called.
+	 */
+	TEST_FEATURE ("with data to read");
+	read_called = 0;
+	last_data = NULL;
+	last_str = NULL;
+	last_len = 0;
+
+	assert (write (fds[1], "this is a test", 14) == 14);
+
+	for (i = 0; (i < 10) && (! read_called); i++)
+		ring_iterate ();
+
+	TEST_TRUE (read_called);
+	TEST_EQ_P (last_data, &io);
+	TEST_EQ_P (last_str, io->recv_buf->buf);
+	TEST_EQ (last_len, 14);
+	TEST_EQ_MEM (io->recv_buf->buf, "this is a test", 14);
+
+	nih_io_buffer_shrink (io->recv_buf, io->recv_buf->len);
+
+
+	/* Check that data written to the structure is handed to the ring
+	 * and arrives at the other end.
+	 */
+	TEST_FEATURE ("with data to write");
+	assert0 (nih_io_write (io, "hello, world", 12));
+
+	ring_iterate ();
+
+	TEST_EQ (io->send_buf->len, 0);
+
+	len = read (fds[1], buf, sizeof (buf));
+	TEST_EQ (len, 12);
+	TEST_EQ_MEM (buf, "hello, world", 12);
+
+
+	/* Check that completions are dispatched along with the watches of
+	 * the same priority as the stream's watch, so once the time budget
+	 * of the loop has been spent they are deferred; the data should
+	 * already have been received, and the loop interrupted so that it
+	 * doesn't wait for the ring before dispatching them.
+	 */
+	TEST_FEATURE ("with time budget spent");
+	loop = nih_loop_current ();
+	nih_loop_set_budget (loop, 1);
+	io->watch->priority = NIH_LOOP_PRIORITY_LOW;
+
+	while (read (loop->interrupt_fd, &count, sizeof (count)) > 0)
+		;
+
+	read_called = 0;
+	assert (write (fds[1], "more", 4) == 4);
+
+	for (i = 0; (i < 10) && (! loop->budget_exceeded); i++) {
+		loop->budget_start.tv_sec = 0;
+		loop->budget_start.tv_nsec = 0;
+		loop->budget_waived = FALSE;
+
+		ring_iterate ();
+	}
+
+	TEST_TRUE (loop->budget_exceeded);
+	TEST_FALSE (read_called);
+	TEST_EQ (io->recv_buf->len, 4);
+	TEST_EQ (read (loop->interrupt_fd, &count, sizeof (count)),
+		 (ssize_t)sizeof (count));
+
+
+	/* Check that deferred completions are dispatched in the next
+	 * iteration, when the budget is waived.
+	 */
+	TEST_FEATURE ("with time budget waived");
+	loop->budget_exceeded = FALSE;
+	loop->budget_waived = TRUE;
+
+	ring_iterate ();
+
+	TEST_TRUE (read_called);
+	TEST_EQ (last_len, 4);
+	TEST_EQ_MEM (last_str, "more", 4);
+	TEST_FALSE (loop->budget_exceeded);
+
+	nih_loop_set_budget (loop, 0);
+	loop->budget_waived = FALSE;
+	io->watch->priority = NIH_LOOP_PRIORITY_DEFAULT;
+
+	nih_io_buffer_shrink (io->recv_buf, io->recv_buf->len);
+
+
+	/* Check that the close handler is called when the remote end is
+	 * closed.
+	 */
+	TEST_FEATURE ("with remote end closed");
+	close_called = 0;
+	last_data = NULL;
+
+	close (fds[1]);
+
+	for (i = 0; (i < 10) && (! close_called); i++)
+		ring_iterate ();
+
+	TEST_TRUE (close_called);
+	TEST_EQ_P (last_data, &io);
+
+
+	/* Check that the structure can be freed while its read is still
+	 * outstanding, and that the cancelled read is dealt with.
+	 */
+	TEST_FEATURE ("with free while read outstanding");
+	assert0 (socketpair (PF_UNIX, SOCK_STREAM, 0, fds));
+	io = nih_io_reopen (NULL, fds[0], NIH_IO_STREAM,
+			    my_reader, my_close_handler, my_error_handler,
+			    &io);
+
+	ring_iterate ();
+	nih_free (io);
+
+	read_called = 0;
+	ring_iterate ();
+
+	TEST_FALSE (read_called);
+
+	close (fds[1]);
+
+
+	/* Check that the loop, and the ring with it, can be freed while a
+	 * stream it manages still has a read outstanding; the stream must
+	 * be detached from the ring so that freeing it afterwards does not
+	 * touch the ring.
+	 */
+	TEST_FEATURE ("with loop freed before structure");
+	loop = nih_loop_new (NULL);
+	previous = nih_loop_set_current (loop);
+
+	assert0 (nih_io_ring_init ());
+
+	assert0 (socketpair (PF_UNIX, SOCK_STREAM, 0, fds));
+	io = nih_io_reopen (NULL, fds[0], NIH_IO_STREAM,
+			    my_reader, my_close_handler, my_error_handler,
+			    &io);
+
+	TEST_NE_P (io->ring, NULL);
+
+	ring_iterate ();
+
+	nih_loop_set_current (previous);
+	nih_free (loop);
+
+	nih_free (io);
+
+	close (fds[1]);
+
+
+	/* Check that the loop can be freed while the cancellation of the
+	 * read of a freed structure is still outstanding; the orphaned
+	 * read must be freed along with the ring.
+	 */
+	TEST_FEATURE ("with loop freed before cancellation");
+	loop = nih_loop_new (NULL);
+	previous = nih_loop_set_current (loop);
+
+	assert0 (nih_io_ring_init ());
+
+	assert0 (socketpair (PF_UNIX, SOCK_STREAM, 0, fds));
+	io = nih_io_reopen (NULL, fds[0], NIH_IO_STREAM,
+			    my_reader, my_close_handler, my_error_handler,
+			    &io);
+
+	ring_iterate ();
+	nih_free (io);
+
+	nih_loop_set_current (previous);
+	nih_free (loop);
+
+	close (fds[1]);
+}
+
+
 int
 main (int   argc,
       char *argv[])
@@ -3189,6 +3523,7 @@ main (int   argc,
 	test_set_nonblock ();
 	test_set_cloexec ();
 	test_get_family ();
+	test_ring ();
 
 	return 0;
 }
@@ -0,0 +1,1021 @@
+/* libnih
+ *
+ * test_loop.c - test suite for nih/loop.c
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <sys/prctl.h>
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/string.h>
+#include <nih/timer.h>
+#include <nih/io.h>
+#include <nih/main.h>
+#include <nih/loop.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+
+void
+test_new (void)
+{
+	NihLoop *loop;
+
+	/* Check that we can create a new loop, and that it has empty lists
+	 * allocated as children and an interrupt descriptor that's set to
+	 * be non-blocking and closed on exec.
+	 */
+	TEST_FUNCTION ("nih_loop_new");
+	TEST_ALLOC_FAIL {
+		loop = nih_loop_new (NULL);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_EQ_P (loop, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (loop, sizeof (NihLoop));
+		TEST_ALLOC_PARENT (loop->io_watches, loop);
+		TEST_LIST_EMPTY (loop->io_watches);
+		TEST_ALLOC_PARENT (loop->timers, loop);
+		TEST_LIST_EMPTY (loop->timers);
+		TEST_ALLOC_PARENT (loop->functions, loop);
+		TEST_LIST_EMPTY (loop->functions);
+		TEST_ALLOC_PARENT (loop->ready_functions, loop);
+		TEST_LIST_EMPTY (loop->ready_functions);
+		TEST_EQ_P (loop->io_ring, NULL);
+		TEST_FALSE (loop->exit_loop);
+		TEST_EQ (loop->budget, 0);
+		TEST_FALSE (loop->budget_exceeded);
+		TEST_FALSE (loop->budget_waived);
+
+		TEST_TRUE (fcntl (loop->interrupt_fd, F_GETFL) & O_NONBLOCK);
+		TEST_TRUE (fcntl (loop->interrupt_fd, F_GETFD) & FD_CLOEXEC);
+
+		nih_free (loop);
+	}
+}
+
+void
+test_default (void)
+{
+	NihLoop *loop;
+
+	/* Check that the default loop owns the lists that are exported
+	 * for compatibility, and that it's the current loop unless we
+	 * change it.
+	 */
+	TEST_FUNCTION ("nih_loop_default");
+	loop = nih_loop_default ();
+
+	TEST_NE_P (loop, NULL);
+	TEST_EQ_P (nih_loop_default (), loop);
+	TEST_EQ_P (loop->io_watches, nih_io_watches);
+	TEST_EQ_P (loop->timers, nih_timers);
+	TEST_EQ_P (loop->functions, nih_main_loop_functions);
+	TEST_EQ_P (nih_loop_current (), loop);
+}
+
+
+static void
+my_watcher (void *data, NihIoWatch *watch, NihIoEvents events)
+{
+}
+
+static void
+my_timer (void *data, NihTimer *timer)
+{
+}
+
+void
+test_set_current (void)
+{
+	NihLoop    *loop, *previous;
+	NihIoWatch *watch;
+	NihTimer   *timer;
+
+	/* Check that setting a new loop as current means that watches and
+	 * timers are added to its lists rather than those of the default
+	 * loop, and that setting NULL makes the default loop current
+	 * again.
+	 */
+	TEST_FUNCTION ("nih_loop_set_current");
+	loop = nih_loop_new (NULL);
+
+	previous = nih_loop_set_current (loop);
+
+	TEST_EQ_P (previous, nih_loop_default ());
+	TEST_EQ_P (nih_loop_current (), loop);
+
+	watch = nih_io_add_watch (NULL, 0, NIH_IO_READ, my_watcher, NULL);
+	timer = nih_timer_add_timeout (NULL, 10, my_timer, NULL);
+
+	TEST_EQ_P (watch->entry.next, loop->io_watches);
+	TEST_EQ_P (timer->entry.next, loop->timers);
+
+	previous = nih_loop_set_current (NULL);
+
+	TEST_EQ_P (previous, loop);
+	TEST_EQ_P (nih_loop_current (), nih_loop_default ());
+
+	nih_free (watch);
+	nih_free (timer);
+
+
+	/* Check that freeing the current loop makes the default loop
+	 * current again.
+	 */
+	TEST_FEATURE ("with current loop freed");
+	nih_loop_set_current (loop);
+	nih_free (loop);
+
+	TEST_EQ_P (nih_loop_current (), nih_loop_default ());
+}
+
+
+static int      callback_called = 0;
+static NihLoop *callback_loop = NULL;
+
+static void
+my_callback (void            *data,
+	     NihMainLoopFunc *func)
+{
+	NihLoop *loop = data;
+
+	callback_called++;
+	callback_loop = nih_loop_current ();
+
+	if (callback_called == 2) {
+		nih_loop_exit (loop, 42);
+	} else {
+		nih_loop_interrupt (loop);
+	}
+}
+
+static void
+my_default_callback (void            *data,
+		     NihMainLoopFunc *func)
+{
+	callback_called += 100;
+}
+
+void
+test_run (void)
+{
+	NihLoop         *loop, *previous;
+	NihMainLoopFunc *func, *default_func;
+	int              ret;
+
+	/* Check that running a loop calls only its own loop functions,
+	 * that the loop is current while they are called, and that the
+	 * value given to nih_loop_exit() is returned.  The default loop
+	 * should be current again afterwards.  We interrupt the loop first
+	 * so that it doesn't wait for an event that never comes.
+	 */
+	TEST_FUNCTION ("nih_loop_run");
+	default_func = nih_main_loop_add_func (NULL, my_default_callback,
+					       NULL);
+
+	loop = nih_loop_new (NULL);
+
+	previous = nih_loop_set_current (loop);
+	func = nih_main_loop_add_func (NULL, my_callback, loop);
+	nih_loop_set_current (previous);
+
+	TEST_EQ_P (func->entry.next, loop->functions);
+
+	callback_called = 0;
+	callback_loop = NULL;
+
+	nih_loop_interrupt (loop);
+	ret = nih_loop_run (loop);
+
+	TEST_EQ (ret, 42);
+	TEST_EQ (callback_called, 2);
+	TEST_EQ_P (callback_loop, loop);
+	TEST_EQ_P (nih_loop_current (), nih_loop_default ());
+	TEST_FALSE (loop->exit_loop);
+
+	nih_free (func);
+	nih_free (default_func);
+	nih_free (loop);
+}
+
+
+void
+test_interrupt (void)
+{
+	NihLoop  *loop;
+	uint64_t  count;
+	int       i;
+
+	/* Check that interrupting a loop several times makes its interrupt
+	 * descriptor readable, and that all of the interrupts are cleared
+	 * by a single read.
+	 */
+	TEST_FUNCTION ("nih_loop_interrupt");
+	loop = nih_loop_new (NULL);
+
+	for (i = 0; i < 5; i++)
+		nih_loop_interrupt (loop);
+
+	TEST_EQ (read (loop->interrupt_fd, &count, sizeof (count)),
+		 sizeof (count));
+	TEST_EQ (count, 5);
+
+	TEST_LT (read (loop->interrupt_fd, &count, sizeof (count)), 0);
+	TEST_EQ (errno, EAGAIN);
+
+	nih_free (loop);
+}
+
+
+static int  post_called = 0;
+static int  post_expected = 0;
+static int  post_order[3];
+static int  post_thread_values[4];
+
+static void
+my_post (void *data)
+{
+	NihLoop *loop = nih_loop_current ();
+
+	if (post_called < 3)
+		post_order[post_called] = *(int *)data;
+
+	if (++post_called == post_expected)
+		nih_loop_exit (loop, 0);
+}
+
+static void *
+my_post_thread (void *data)
+{
+	NihLoop *loop = data;
+	int      i;
+
+	for (i = 0; i < 1000; i++)
+		assert0 (nih_loop_post (loop, my_post,
+					&post_thread_values[i % 4]));
+
+	return NULL;
+}
+
+void
+test_post (void)
+{
+	NihLoop   *loop;
+	pthread_t  threads[4];
+	int        values[3] = { 1, 2, 3 };
+	uint64_t   count;
+	int        ret, i;
+
+	TEST_FUNCTION ("nih_loop_post");
+	loop = nih_loop_new (NULL);
+
+
+	/* Check that several callbacks posted before the loop is run only
+	 * interrupt the loop once, and that they're all called, in the
+	 * order they were posted, during the next iteration.
+	 */
+	TEST_FEATURE ("with several posts");
+	post_called = 0;
+	post_expected = 3;
+
+	for (i = 0; i < 3; i++) {
+		ret = nih_loop_post (loop, my_post, &values[i]);
+
+		TEST_EQ (ret, 0);
+	}
+
+	TEST_TRUE (loop->post_pending);
+	TEST_EQ (read (loop->interrupt_fd, &count, sizeof (count)),
+		 sizeof (count));
+	TEST_EQ (count, 1);
+
+	nih_loop_interrupt (loop);
+	nih_loop_run (loop);
+
+	TEST_EQ (post_called, 3);
+	TEST_EQ (post_order[0], 1);
+	TEST_EQ (post_order[1], 2);
+	TEST_EQ (post_order[2], 3);
+	TEST_FALSE (loop->post_pending);
+
+
+	/* Check that callbacks posted from several threads at once, while
+	 * the loop is running, are all called.
+	 */
+	TEST_FEATURE ("with posts from other threads");
+	post_called = 0;
+	post_expected = 4000;
+
+	for (i = 0; i < 4; i++)
+		assert0 (pthread_create (&threads[i], NULL,
+					 my_post_thread, loop));
+
+	nih_loop_run (loop);
+
+	for (i = 0; i < 4; i++)
+		pthread_join (threads[i], NULL);
+
+	TEST_EQ (post_called, 4000);
+
+
+	/* Check that callbacks still queued when the loop is freed are
+	 * discarded without being called.
+	 */
+	TEST_FEATURE ("with loop freed");
+	post_called = 0;
+
+	ret = nih_loop_post (loop, my_post, &values[0]);
+
+	TEST_EQ (ret, 0);
+
+	nih_free (loop);
+
+	TEST_EQ (post_called, 0);
+}
+
+
+static int stats_called = 0;
+
+static void
+my_stats_func (void            *data,
+	       NihMainLoopFunc *func)
+{
+	NihLoop *loop = data;
+
+	/* Take a couple of milliseconds so we can check the histogram */
+	usleep (2000);
+
+	if (++stats_called == 3)
+		nih_loop_exit (loop, 0);
+	else
+		nih_loop_interrupt (loop);
+}
+
+static void
+my_stats_timer (void     *data,
+		NihTimer *timer)
+{
+}
+
+static void
+my_stats_watcher (void        *data,
+		  NihIoWatch  *watch,
+		  NihIoEvents  events)
+{
+	NihLoop *loop = data;
+	char     buf[1];
+
+	assert (read (watch->fd, buf, 1) == 1);
+
+	if (++stats_called == 2)
+		nih_loop_exit (loop, 0);
+}
+
+static NihLoopCallbackStats *
+find_callback_stats (NihLoop             *loop,
+		     NihLoopCallbackType  type,
+		     NihLoopCallback      callback,
+		     const void          *object)
+{
+	NihLoopCallbackKey key;
+
+	memset (&key, 0, sizeof (key));
+	key.type = type;
+	key.callback = callback;
+	key.object = object;
+
+	return (NihLoopCallbackStats *)nih_hash_lookup (
+		loop->stats->callbacks, &key);
+}
+
+void
+test_stats (void)
+{
+	NihLoop              *loop, *previous;
+	NihMainLoopFunc      *func;
+	NihTimer             *timer;
+	NihLoopCallbackStats *cb_stats;
+	NihIoWatch           *watch1, *watch2;
+	FILE                 *output;
+	char                 *str;
+	char                  buf[4096], line[64];
+	int                   ret, fds1[2], fds2[2];
+
+	/* Check that enabling instrumentation allocates the statistics
+	 * structure for the loop, with everything zero.
+	 */
+	TEST_FUNCTION ("nih_loop_stats_enable");
+	loop = nih_loop_new (NULL);
+
+	TEST_ALLOC_FAIL {
+		ret = nih_loop_stats_enable (loop);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_LT (ret, 0);
+			TEST_EQ_P (loop->stats, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+		TEST_ALLOC_PARENT (loop->stats, loop);
+		TEST_EQ (loop->stats->iterations, 0);
+		TEST_EQ (loop->stats->wait_time, 0);
+		TEST_EQ (loop->stats->dispatch_time, 0);
+		TEST_EQ (loop->stats->timer_lateness.count, 0);
+		TEST_HASH_EMPTY (loop->stats->callbacks);
+
+		nih_loop_stats_disable (loop);
+
+		TEST_EQ_P (loop->stats, NULL);
+	}
+
+
+	/* Check that running an instrumented loop records the number of
+	 * iterations and, for each callback, the number of calls and how
+	 * long they took.
+	 */
+	TEST_FUNCTION ("nih_loop_run");
+	TEST_FEATURE ("with instrumentation");
+	assert0 (nih_loop_stats_enable (loop));
+
+	previous = nih_loop_set_current (loop);
+	func = nih_main_loop_add_func (NULL, my_stats_func, loop);
+	timer = nih_timer_add_timeout (NULL, 0, my_stats_timer, NULL);
+	nih_loop_set_current (previous);
+
+	TEST_NE_P (timer, NULL);
+
+	stats_called = 0;
+
+	nih_loop_interrupt (loop);
+	nih_loop_run (loop);
+
+	TEST_EQ (loop->stats->iterations, 3);
+	TEST_GE (loop->stats->dispatch_time, 6000000);
+	TEST_EQ (loop->stats->timer_lateness.count, 1);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_FUNC,
+					(NihLoopCallback)my_stats_func, NULL);
+	TEST_NE_P (cb_stats, NULL);
+	TEST_EQ (cb_stats->latency.count, 3);
+	TEST_GE (cb_stats->latency.max, 2000000);
+	TEST_GE (cb_stats->latency.total, 6000000);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_TIMER,
+					(NihLoopCallback)my_stats_timer, NULL);
+	TEST_NE_P (cb_stats, NULL);
+	TEST_EQ (cb_stats->latency.count, 1);
+
+	nih_free (func);
+
+
+	/* Check that the statistics can be formatted as text, with a line
+	 * for the loop, the timer lateness and each callback; the median
+	 * of the loop function should be within 25% of its latency.
+	 */
+	TEST_FUNCTION ("nih_loop_stats_format");
+	TEST_ALLOC_FAIL {
+		unsigned long long count, mean, p50;
+		char *line;
+
+		str = nih_loop_stats_format (NULL, loop);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (str, NULL);
+			continue;
+		}
+
+		TEST_EQ_STRN (str, "loop iterations 3 wait ");
+		TEST_NE_P (strstr (str, "\ntimer-lateness count 1 "), NULL);
+
+		line = strstr (str, "\nfunc ");
+		TEST_NE_P (line, NULL);
+		TEST_EQ (sscanf (line, "\nfunc %*s count %llu mean %llu "
+				 "p50 %llu", &count, &mean, &p50), 3);
+		TEST_EQ (count, 3);
+		TEST_GE (mean, 2000000);
+		TEST_GE (p50, 1500000);
+
+		TEST_NE_P (strstr (str, "\ntimer "), NULL);
+
+		nih_free (str);
+	}
+
+
+	/* Check that the statistics can be written to a file descriptor. */
+	TEST_FUNCTION ("nih_loop_stats_dump");
+	str = nih_loop_stats_format (NULL, loop);
+
+	output = tmpfile ();
+	ret = nih_loop_stats_dump (loop, fileno (output));
+	rewind (output);
+
+	TEST_EQ (ret, 0);
+
+	memset (buf, 0, sizeof (buf));
+	TEST_EQ (fread (buf, 1, sizeof (buf) - 1, output), strlen (str));
+	TEST_EQ_STR (buf, str);
+
+	fclose (output);
+	nih_free (str);
+
+
+	/* Check that I/O watches sharing a watcher function are counted
+	 * individually, identified by their descriptor, and that once a
+	 * watch is freed its counts are added to those of freed watches.
+	 */
+	TEST_FUNCTION ("nih_loop_dispatch_end");
+	TEST_FEATURE ("with I/O watches");
+	assert0 (pipe (fds1));
+	assert0 (pipe (fds2));
+
+	previous = nih_loop_set_current (loop);
+	watch1 = nih_io_add_watch (NULL, fds1[0], NIH_IO_READ,
+				   my_stats_watcher, loop);
+	watch2 = nih_io_add_watch (NULL, fds2[0], NIH_IO_READ,
+				   my_stats_watcher, loop);
+	nih_loop_set_current (previous);
+
+	TEST_NE_P (watch1, NULL);
+	TEST_NE_P (watch2, NULL);
+
+	assert (write (fds1[1], "x", 1) == 1);
+	assert (write (fds2[1], "x", 1) == 1);
+
+	stats_called = 0;
+	nih_loop_run (loop);
+
+	TEST_EQ (stats_called, 2);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)my_stats_watcher,
+					watch1);
+	TEST_NE_P (cb_stats, NULL);
+	TEST_EQ (cb_stats->detail, fds1[0]);
+	TEST_EQ (cb_stats->latency.count, 1);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)my_stats_watcher,
+					watch2);
+	TEST_NE_P (cb_stats, NULL);
+	TEST_EQ (cb_stats->detail, fds2[0]);
+	TEST_EQ (cb_stats->latency.count, 1);
+
+	str = nih_loop_stats_format (NULL, loop);
+	TEST_NE_P (str, NULL);
+	sprintf (line, " fd %d count 1 ", fds1[0]);
+	TEST_NE_P (strstr (str, line), NULL);
+	sprintf (line, " fd %d count 1 ", fds2[0]);
+	TEST_NE_P (strstr (str, line), NULL);
+	nih_free (str);
+
+	previous = nih_loop_set_current (loop);
+	nih_free (watch1);
+	nih_loop_set_current (previous);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)my_stats_watcher,
+					watch1);
+	TEST_EQ_P (cb_stats, NULL);
+
+	cb_stats = find_callback_stats (loop, NIH_LOOP_IO_WATCH,
+					(NihLoopCallback)my_stats_watcher,
+					NULL);
+	TEST_NE_P (cb_stats, NULL);
+	TEST_EQ (cb_stats->detail, -1);
+	TEST_EQ (cb_stats->latency.count, 1);
+
+	previous = nih_loop_set_current (loop);
+	nih_free (watch2);
+	nih_loop_set_current (previous);
+
+	TEST_EQ (cb_stats->latency.count, 2);
+
+	close (fds1[0]);
+	close (fds1[1]);
+	close (fds2[0]);
+	close (fds2[1]);
+
+	nih_free (loop);
+}
+
+
+static int   watchdog_called = 0;
+static char *watchdog_warning = NULL;
+
+static int
+my_watchdog_logger (NihLogLevel  priority,
+		    const char  *message)
+{
+	if (priority == NIH_LOG_WARN) {
+		if (watchdog_warning)
+			nih_free (watchdog_warning);
+
+		watchdog_warning = nih_strdup (NULL, message);
+	}
+
+	return 0;
+}
+
+static void
+my_watchdog_func (void            *data,
+		  NihMainLoopFunc *func)
+{
+	NihLoop         *loop = data;
+	struct timespec  delay;
+
+	watchdog_called++;
+
+	/* Stall for a tenth of a second, the watchdog signal interrupts
+	 * the sleep so carry on with what's left.
+	 */
+	delay.tv_sec = 0;
+	delay.tv_nsec = 100000000;
+	while ((nanosleep (&delay, &delay) < 0) && (errno == EINTR))
+		;
+
+	nih_loop_exit (loop, 0);
+}
+
+static void
+my_fast_func (void            *data,
+	      NihMainLoopFunc *func)
+{
+	NihLoop *loop = data;
+
+	watchdog_called++;
+
+	nih_loop_exit (loop, 0);
+}
+
+void
+test_watchdog (void)
+{
+	NihLoop         *loop, *previous;
+	NihMainLoopFunc *func;
+	FILE            *output;
+	char             buf[8192];
+	size_t           len;
+	int              ret;
+
+	/* Check that enabling the watchdog allocates the structure for the
+	 * loop and starts its helper thread, with nothing being watched.
+	 */
+	TEST_FUNCTION ("nih_loop_watchdog_enable");
+	loop = nih_loop_new (NULL);
+	output = tmpfile ();
+
+	TEST_ALLOC_FAIL {
+		ret = nih_loop_watchdog_enable (loop, 20, fileno (output),
+						FALSE);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_LT (ret, 0);
+			TEST_EQ_P (loop->watchdog, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+		TEST_ALLOC_PARENT (loop->watchdog, loop);
+		TEST_EQ (loop->watchdog->threshold, 20);
+		TEST_EQ (loop->watchdog->fd, fileno (output));
+		TEST_FALSE (loop->watchdog->backtrace);
+		TEST_FALSE (loop->watchdog->active);
+		TEST_EQ (loop->watchdog->depth, 0);
+
+		nih_loop_watchdog_disable (loop);
+
+		TEST_EQ_P (loop->watchdog, NULL);
+	}
+
+
+	/* Check that a callback that runs for longer than the threshold is
+	 * reported by the helper thread while it's still running, along
+	 * with a backtrace, and that a warning is logged once it returns.
+	 */
+	TEST_FUNCTION ("nih_loop_run");
+	TEST_FEATURE ("with slow callback");
+	assert0 (nih_loop_watchdog_enable (loop, 20, fileno (output), TRUE));
+
+	previous = nih_loop_set_current (loop);
+	func = nih_main_loop_add_func (NULL, my_watchdog_func, loop);
+	nih_loop_set_current (previous);
+
+	nih_log_set_logger (my_watchdog_logger);
+	watchdog_called = 0;
+	watchdog_warning = NULL;
+
+	nih_loop_interrupt (loop);
+	nih_loop_run (loop);
+
+	nih_log_set_logger (nih_logger_printf);
+
+	TEST_EQ (watchdog_called, 1);
+	TEST_FALSE (loop->watchdog->active);
+	TEST_EQ (loop->watchdog->depth, 0);
+
+	rewind (output);
+	memset (buf, 0, sizeof (buf));
+	len = fread (buf, 1, sizeof (buf) - 1, output);
+
+	TEST_GT (len, 0);
+	TEST_NE_P (strstr (buf, "slow func "), NULL);
+	TEST_NE_P (strstr (buf, " callback running for "), NULL);
+
+	/* The backtrace follows the report, one line per frame */
+	TEST_GT (strchr (buf, '\n')[1], '\0');
+
+	TEST_NE_P (watchdog_warning, NULL);
+	TEST_EQ_STRN (watchdog_warning, "Slow func ");
+	TEST_NE_P (strstr (watchdog_warning, " callback took "), NULL);
+
+	nih_free (watchdog_warning);
+	watchdog_warning = NULL;
+	nih_free (func);
+
+
+	/* Check that a callback that returns within the threshold is not
+	 * reported.
+	 */
+	TEST_FEATURE ("with fast callback");
+	fclose (output);
+	output = tmpfile ();
+
+	assert0 (nih_loop_watchdog_enable (loop, 1000, fileno (output),
+					   FALSE));
+	TEST_EQ (loop->watchdog->threshold, 1000);
+
+	previous = nih_loop_set_current (loop);
+	func = nih_main_loop_add_func (NULL, my_fast_func, loop);
+	nih_loop_set_current (previous);
+
+	nih_log_set_logger (my_watchdog_logger);
+	watchdog_called = 0;
+
+	nih_loop_interrupt (loop);
+	nih_loop_run (loop);
+
+	nih_log_set_logger (nih_logger_printf);
+
+	TEST_EQ (watchdog_called, 1);
+	TEST_EQ_P (watchdog_warning, NULL);
+
+	rewind (output);
+	TEST_EQ (fread (buf, 1, sizeof (buf) - 1, output), 0);
+
+	nih_free (func);
+
+
+	/* Check that disabling the watchdog stops its helper thread. */
+	TEST_FUNCTION ("nih_loop_watchdog_disable");
+	nih_loop_watchdog_disable (loop);
+
+	TEST_EQ_P (loop->watchdog, NULL);
+
+	fclose (output);
+	nih_free (loop);
+}
+
+
+static uint64_t slack_iterations[2];
+static int      slack_called = 0;
+
+static void
+my_slack_timer (void     *data,
+		NihTimer *timer)
+{
+	NihLoop *loop = data;
+
+	slack_iterations[slack_called] = loop->stats->iterations;
+
+	if (++slack_called == 2)
+		nih_loop_exit (loop, 0);
+}
+
+void
+test_timer_slack (void)
+{
+	NihLoop  *loop, *previous;
+	NihTimer *timer1, *timer2;
+	int       timer_slack;
+
+	/* Check that a timer with slack is still called, no later than a
+	 * timer due at its deadline, and that the timer slack of the thread
+	 * is restored once the loop has finished waiting.  The kernel may
+	 * wake us anywhere within the slack, so whether the two are called
+	 * in the same iteration is up to it.
+	 */
+	TEST_FUNCTION ("nih_loop_run");
+	TEST_FEATURE ("with timer slack");
+	loop = nih_loop_new (NULL);
+	assert0 (nih_loop_stats_enable (loop));
+
+	previous = nih_loop_set_current (loop);
+	timer1 = nih_timer_add_timeout (NULL, 1, my_slack_timer, loop);
+	timer2 = nih_timer_add_timeout (NULL, 2, my_slack_timer, loop);
+	nih_loop_set_current (previous);
+
+	nih_timer_set_slack (timer1, 1);
+
+	TEST_FREE_TAG (timer1);
+	TEST_FREE_TAG (timer2);
+
+	timer_slack = prctl (PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	slack_called = 0;
+
+	nih_loop_run (loop);
+
+	TEST_EQ (slack_called, 2);
+	TEST_FREE (timer1);
+	TEST_FREE (timer2);
+	TEST_LE (slack_iterations[0], slack_iterations[1]);
+	TEST_EQ (prctl (PR_GET_TIMERSLACK, 0, 0, 0, 0), timer_slack);
+
+	nih_free (loop);
+}
+
+
+static int budget_high_called = 0;
+static int budget_low_called = 0;
+
+static void
+my_budget_high_func (void            *data,
+		     NihMainLoopFunc *func)
+{
+	struct timespec delay = { 0, 1000000 };
+	NihLoop        *loop = data;
+
+	while ((nanosleep (&delay, &delay) < 0) && (errno == EINTR))
+		;
+
+	if (++budget_high_called == 4) {
+		nih_loop_exit (loop, 0);
+	} else {
+		nih_loop_interrupt (loop);
+	}
+}
+
+static void
+my_budget_low_func (void            *data,
+		    NihMainLoopFunc *func)
+{
+	budget_low_called++;
+}
+
+void
+test_defer (void)
+{
+	NihLoop *loop;
+
+	TEST_FUNCTION ("nih_loop_defer");
+	loop = nih_loop_new (NULL);
+
+
+	/* Check that nothing is deferred when the loop has no budget. */
+	TEST_FEATURE ("without budget");
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_DEFAULT));
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_LOW));
+	TEST_FALSE (loop->budget_exceeded);
+
+
+	/* Check that work is not deferred while the budget has not yet
+	 * been spent.
+	 */
+	TEST_FEATURE ("with budget not spent");
+	nih_loop_set_budget (loop, 3600000000000ULL);
+	TEST_EQ (loop->budget, 3600000000000ULL);
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &loop->budget_start));
+
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_DEFAULT));
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_LOW));
+	TEST_FALSE (loop->budget_exceeded);
+
+
+	/* Check that once the budget has been spent, work of default and
+	 * low priority is deferred but work of high priority is not.
+	 */
+	TEST_FEATURE ("with budget spent");
+	nih_loop_set_budget (loop, 1000);
+	loop->budget_start.tv_sec -= 1;
+
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_HIGH));
+	TEST_FALSE (loop->budget_exceeded);
+	TEST_TRUE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_LOW));
+	TEST_TRUE (loop->budget_exceeded);
+	TEST_TRUE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_DEFAULT));
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_HIGH));
+
+
+	/* Check that nothing is deferred when the budget is waived. */
+	TEST_FEATURE ("with budget waived");
+	loop->budget_exceeded = FALSE;
+	loop->budget_waived = TRUE;
+
+	TEST_FALSE (nih_loop_defer (loop, NIH_LOOP_PRIORITY_LOW));
+	TEST_FALSE (loop->budget_exceeded);
+
+	nih_free (loop);
+
+
+	/* Check that when the loop has a budget, a low priority function
+	 * is deferred in iterations where a high priority function spends
+	 * it, but is still called in every other iteration.
+	 */
+	TEST_FUNCTION ("nih_loop_run");
+	TEST_FEATURE ("with time budget");
+	loop = nih_loop_new (NULL);
+	nih_loop_set_budget (loop, 1);
+
+	TEST_ALLOC_SAFE {
+		NihLoop         *previous;
+		NihMainLoopFunc *low, *high;
+
+		previous = nih_loop_set_current (loop);
+		low = nih_main_loop_add_func (loop, my_budget_low_func, NULL);
+		high = nih_main_loop_add_func (loop, my_budget_high_func,
+					       loop);
+		nih_loop_set_current (previous);
+
+		low->priority = NIH_LOOP_PRIORITY_LOW;
+		high->priority = NIH_LOOP_PRIORITY_HIGH;
+	}
+
+	budget_high_called = 0;
+	budget_low_called = 0;
+
+	nih_loop_interrupt (loop);
+	nih_loop_run (loop);
+
+	TEST_EQ (budget_high_called, 4);
+	TEST_EQ (budget_low_called, 2);
+
+	nih_free (loop);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_new ();
+	test_default ();
+	test_set_current ();
+	test_run ();
+	test_interrupt ();
+	test_post ();
+	test_stats ();
+	test_timer_slack ();
+	test_watchdog ();
+	test_defer ();
+
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <nih/macros.h>
 #include <nih/list.h>
 #include <nih/main.h>
+#include <nih/loop.h>
 #include <nih/timer.h>
 #include <nih/error.h>
 
@@ -501,12 +502,184 @@ test_main_loop_add_func (void)
 		TEST_LIST_NOT_EMPTY (&func->entry);
 		TEST_EQ_P (func->callback, my_callback);
 		TEST_EQ_P (func->data, &func);
+		TEST_EQ (func->priority, NIH_LOOP_PRIORITY_DEFAULT);
 
 		nih_free (func);
 	}
 }
 
 
+void
+test_main_loop_add_ready_func (void)
+{
+	NihMainLoopFunc *func;
+
+	/* Check that we can add a callback function to the main loop that
+	 * is only called when woken, and that the structure returned is
+	 * correctly populated but not placed in any list.
+	 */
+	TEST_FUNCTION ("nih_main_loop_add_ready_func");
+	TEST_ALLOC_FAIL {
+		func = nih_main_loop_add_ready_func (NULL, my_callback, &func);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (func, NULL);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (func, sizeof (NihMainLoopFunc));
+		TEST_LIST_EMPTY (&func->entry);
+		TEST_EQ_P (func->callback, my_callback);
+		TEST_EQ_P (func->data, &func);
+		TEST_EQ (func->priority, NIH_LOOP_PRIORITY_DEFAULT);
+		TEST_EQ_P (func->ready_list, nih_loop_default ()->ready_functions);
+
+		nih_free (func);
+	}
+}
+
+
+static int ready_called = 0;
+
+static void
+my_ready_callback (void            *data,
+		   NihMainLoopFunc *func)
+{
+	int *wakes = data;
+
+	ready_called++;
+
+	TEST_LIST_EMPTY (&func->entry);
+
+	if (*wakes > 0) {
+		(*wakes)--;
+		nih_main_loop_func_wake (func);
+	} else {
+		nih_main_loop_exit (0);
+	}
+}
+
+void
+test_main_loop_func_wake (void)
+{
+	NihMainLoopFunc *func, *idle_func;
+	NihList         *ready_functions;
+	int              wakes;
+
+	TEST_FUNCTION ("nih_main_loop_func_wake");
+	ready_functions = nih_loop_default ()->ready_functions;
+
+
+	/* Check that waking a function places it in the ready list of the
+	 * loop, and that waking it again doesn't add it twice.
+	 */
+	TEST_FEATURE ("with ready function");
+	wakes = 0;
+	func = nih_main_loop_add_ready_func (NULL, my_ready_callback, &wakes);
+
+	nih_main_loop_func_wake (func);
+
+	TEST_EQ_P (ready_functions->next, &func->entry);
+	TEST_EQ_P (func->entry.next, ready_functions);
+
+	nih_main_loop_func_wake (func);
+
+	TEST_EQ_P (ready_functions->next, &func->entry);
+	TEST_EQ_P (func->entry.next, ready_functions);
+
+
+	/* Check that a woken function is called by the main loop without
+	 * it having to be interrupted, and is taken out of the ready list,
+	 * while a function that wasn't woken is never called.
+	 */
+	TEST_FEATURE ("with main loop");
+	idle_func = nih_main_loop_add_ready_func (NULL, my_callback, NULL);
+
+	ready_called = 0;
+	callback_called = 0;
+
+	TEST_EQ (nih_main_loop (), 0);
+
+	TEST_EQ (ready_called, 1);
+	TEST_EQ (callback_called, 0);
+	TEST_LIST_EMPTY (&func->entry);
+	TEST_LIST_EMPTY (ready_functions);
+
+
+	/* Check that a function which wakes itself is called again in each
+	 * following iteration, rather than repeatedly in the same one.
+	 */
+	TEST_FEATURE ("with function waking itself");
+	wakes = 2;
+	nih_main_loop_func_wake (func);
+
+	ready_called = 0;
+
+	TEST_EQ (nih_main_loop (), 0);
+
+	TEST_EQ (ready_called, 3);
+	TEST_EQ (wakes, 0);
+	TEST_LIST_EMPTY (ready_functions);
+
+	nih_free (idle_func);
+
+
+	/* Check that a freed function is taken out of the ready list. */
+	TEST_FEATURE ("with function freed");
+	nih_main_loop_func_wake (func);
+	nih_free (func);
+
+	TEST_LIST_EMPTY (ready_functions);
+
+
+	/* Check that waking a function called in every iteration has no
+	 * effect.
+	 */
+	TEST_FEATURE ("with ordinary function");
+	func = nih_main_loop_add_func (NULL, my_callback, NULL);
+
+	nih_main_loop_func_wake (func);
+
+	TEST_EQ_P (func->entry.next, nih_main_loop_functions);
+	TEST_LIST_EMPTY (ready_functions);
+
+	nih_free (func);
+}
+
+
+static void
+my_post (void *data)
+{
+	callback_called++;
+	last_data = data;
+
+	nih_main_loop_exit (0);
+}
+
+void
+test_main_loop_post (void)
+{
+	int ret;
+
+	/* Check that a callback posted to the main loop is called during
+	 * the next iteration of the loop.
+	 */
+	TEST_FUNCTION ("nih_main_loop_post");
+	callback_called = 0;
+	last_data = NULL;
+
+	ret = nih_main_loop_post (my_post, &ret);
+
+	TEST_EQ (ret, 0);
+
+	ret = nih_main_loop ();
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (callback_called, 1);
+	TEST_EQ_P (last_data, &ret);
+}
+
+
 int
 main (int   argc,
       char *argv[])
@@ -521,6 +694,9 @@ main (int   argc,
 	test_write_pidfile ();
 	test_main_loop ();
 	test_main_loop_add_func ();
+	test_main_loop_add_ready_func ();
+	test_main_loop_func_wake ();
+	test_main_loop_post ();
 
 	return 0;
 }
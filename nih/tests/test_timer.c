@@ -69,6 +69,8 @@ test_add_timeout (void)
 		TEST_GE (timer->due, t1.tv_sec + 10);
 		TEST_LE (timer->due, t2.tv_sec + 10);
 		TEST_EQ (timer->timeout, 10);
+		TEST_EQ (timer->slack, 0);
+		TEST_EQ (timer->align, 0);
 		TEST_EQ_P (timer->callback, my_callback);
 		TEST_EQ_P (timer->data, &timer);
 
@@ -107,6 +109,8 @@ test_add_periodic (void)
 		TEST_GE (timer->due, t1.tv_sec + 25);
 		TEST_LE (timer->due, t2.tv_sec + 25);
 		TEST_EQ (timer->timeout, 25);
+		TEST_EQ (timer->slack, 0);
+		TEST_EQ (timer->align, 0);
 		TEST_EQ_P (timer->callback, my_callback);
 		TEST_EQ_P (timer->data, &timer);
 
@@ -152,6 +156,8 @@ test_add_scheduled (void)
 		TEST_EQ (timer->schedule.mdays, schedule.mdays);
 		TEST_EQ (timer->schedule.months, schedule.months);
 		TEST_EQ (timer->schedule.wdays, schedule.wdays);
+		TEST_EQ (timer->slack, 0);
+		TEST_EQ (timer->align, 0);
 		TEST_EQ_P (timer->callback, my_callback);
 		TEST_EQ_P (timer->data, &timer);
 
@@ -163,6 +169,90 @@ test_add_scheduled (void)
 }
 
 
+void
+test_set_slack (void)
+{
+	NihTimer *timer;
+
+	/* Check that setting the slack of a timer stores it in the
+	 * structure without changing when it is due.
+	 */
+	TEST_FUNCTION ("nih_timer_set_slack");
+	timer = nih_timer_add_timeout (NULL, 10, my_callback, &timer);
+	timer->due = 1000;
+
+	nih_timer_set_slack (timer, 5);
+
+	TEST_EQ (timer->slack, 5);
+	TEST_EQ (timer->due, 1000);
+
+	nih_free (timer);
+}
+
+void
+test_align (void)
+{
+	NihTimer *      timer;
+	struct timespec now;
+
+	TEST_FUNCTION ("nih_timer_align");
+	timer = nih_timer_add_periodic (NULL, 60, my_callback, &timer);
+
+
+	/* Check that aligning a timer rounds its due time up to the next
+	 * multiple of the grid.
+	 */
+	TEST_FEATURE ("with unaligned timer");
+	timer->due = 1001;
+
+	nih_timer_align (timer, 60);
+
+	TEST_EQ (timer->align, 60);
+	TEST_EQ (timer->due, 1020);
+
+
+	/* Check that a timer already on the grid is left alone. */
+	TEST_FEATURE ("with aligned timer");
+	nih_timer_align (timer, 20);
+
+	TEST_EQ (timer->align, 20);
+	TEST_EQ (timer->due, 1020);
+
+
+	/* Check that an aligned periodic timer is rescheduled on the
+	 * grid.
+	 */
+	TEST_FEATURE ("with periodic timer");
+	nih_timer_align (timer, 60);
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+	timer->due = now.tv_sec - 5;
+
+	callback_called = 0;
+	nih_timer_poll ();
+
+	TEST_EQ (callback_called, 1);
+	TEST_EQ (timer->due % 60, 0);
+	TEST_GE (timer->due, now.tv_sec + 60);
+	TEST_LT (timer->due, now.tv_sec + 121);
+
+
+	/* Check that a zero grid stops aligning the timer. */
+	TEST_FEATURE ("with zero grid");
+	nih_timer_align (timer, 0);
+
+	TEST_EQ (timer->align, 0);
+
+	timer->due = now.tv_sec - 5;
+	nih_timer_poll ();
+
+	TEST_GE (timer->due, now.tv_sec + 60);
+	TEST_LE (timer->due, now.tv_sec + 61);
+
+	nih_free (timer);
+}
+
+
 void
 test_next_due (void)
 {
@@ -190,6 +280,62 @@ test_next_due (void)
 }
 
 
+void
+test_next_wakeup (void)
+{
+	NihTimer *timer1, *timer2;
+	time_t    due, deadline;
+	int       ret;
+
+	TEST_FUNCTION ("nih_timer_next_wakeup");
+
+	/* Check that FALSE is returned when there are no timers. */
+	TEST_FEATURE ("with no timers");
+	ret = nih_timer_next_wakeup (&due, &deadline);
+
+	TEST_FALSE (ret);
+
+
+	/* Check that without slack, the deadline is the same as the due
+	 * time of the next timer.
+	 */
+	TEST_FEATURE ("without slack");
+	timer1 = nih_timer_add_timeout (NULL, 10, my_callback, &timer1);
+	timer1->due = 1010;
+
+	ret = nih_timer_next_wakeup (&due, &deadline);
+
+	TEST_TRUE (ret);
+	TEST_EQ (due, 1010);
+	TEST_EQ (deadline, 1010);
+
+
+	/* Check that slack allows the wakeup to be deferred, but not past
+	 * the time another timer without slack is due.
+	 */
+	TEST_FEATURE ("with slack");
+	nih_timer_set_slack (timer1, 5);
+
+	ret = nih_timer_next_wakeup (&due, &deadline);
+
+	TEST_TRUE (ret);
+	TEST_EQ (due, 1010);
+	TEST_EQ (deadline, 1015);
+
+	timer2 = nih_timer_add_timeout (NULL, 10, my_callback, &timer2);
+	timer2->due = 1012;
+
+	ret = nih_timer_next_wakeup (&due, &deadline);
+
+	TEST_TRUE (ret);
+	TEST_EQ (due, 1010);
+	TEST_EQ (deadline, 1012);
+
+	nih_free (timer1);
+	nih_free (timer2);
+}
+
+
 void
 test_poll (void)
 {
@@ -259,7 +405,10 @@ main (int   argc,
 	test_add_timeout ();
 	test_add_periodic ();
 	test_add_scheduled ();
+	test_set_slack ();
+	test_align ();
 	test_next_due ();
+	test_next_wakeup ();
 	test_poll ();
 
 	return 0;
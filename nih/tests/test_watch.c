@@ -34,10 +34,12 @@
 #include <nih/alloc.h>
 #include <nih/string.h>
 #include <nih/io.h>
+#include <nih/timer.h>
 #include <nih/file.h>
 #include <nih/watch.h>
 #include <nih/error.h>
 #include <nih/logging.h>
+#include <nih/errors.h>
 
 
 static int
@@ -119,6 +121,36 @@ my_delete_handler (void       *data,
 	}
 }
 
+static int   batch_called = 0;
+static char *last_batch = NULL;
+
+static void
+my_batch_handler (void         *data,
+		  NihWatch     *watch,
+		  char * const *paths)
+{
+	batch_called++;
+	last_data = data;
+	last_watch = watch;
+
+	if (last_batch)
+		nih_free (last_batch);
+
+	last_batch = NIH_MUST (nih_strdup (NULL, ""));
+	for (; *paths; paths++)
+		NIH_MUST (nih_strcat_sprintf (&last_batch, NULL, "%s%s",
+					      *last_batch ? "::" : "",
+					      *paths));
+}
+
+static void
+my_free_handler (void       *data,
+		 NihWatch   *watch,
+		 const char *path)
+{
+	nih_free (watch);
+}
+
 static int logger_called = 0;
 
 static int
@@ -217,10 +249,10 @@ test_new (void)
 
 		TEST_GE (fcntl (watch->fd, F_GETFD), 0);
 
-		TEST_ALLOC_SIZE (watch->io, sizeof (NihIo));
-		TEST_ALLOC_PARENT (watch->io, watch);
-		TEST_EQ (watch->io->type, NIH_IO_STREAM);
-		TEST_EQ (watch->io->watch->fd, watch->fd);
+		TEST_ALLOC_SIZE (watch->io_watch, sizeof (NihIoWatch));
+		TEST_ALLOC_PARENT (watch->io_watch, watch);
+		TEST_EQ (watch->io_watch->fd, watch->fd);
+		TEST_EQ (watch->io_watch->events, NIH_IO_READ);
 
 		TEST_LIST_NOT_EMPTY (&watch->watches);
 
@@ -268,10 +300,10 @@ test_new (void)
 
 		TEST_GE (fcntl (watch->fd, F_GETFD), 0);
 
-		TEST_ALLOC_SIZE (watch->io, sizeof (NihIo));
-		TEST_ALLOC_PARENT (watch->io, watch);
-		TEST_EQ (watch->io->type, NIH_IO_STREAM);
-		TEST_EQ (watch->io->watch->fd, watch->fd);
+		TEST_ALLOC_SIZE (watch->io_watch, sizeof (NihIoWatch));
+		TEST_ALLOC_PARENT (watch->io_watch, watch);
+		TEST_EQ (watch->io_watch->fd, watch->fd);
+		TEST_EQ (watch->io_watch->events, NIH_IO_READ);
 
 		TEST_LIST_NOT_EMPTY (&watch->watches);
 
@@ -316,10 +348,10 @@ test_new (void)
 
 		TEST_GE (fcntl (watch->fd, F_GETFD), 0);
 
-		TEST_ALLOC_SIZE (watch->io, sizeof (NihIo));
-		TEST_ALLOC_PARENT (watch->io, watch);
-		TEST_EQ (watch->io->type, NIH_IO_STREAM);
-		TEST_EQ (watch->io->watch->fd, watch->fd);
+		TEST_ALLOC_SIZE (watch->io_watch, sizeof (NihIoWatch));
+		TEST_ALLOC_PARENT (watch->io_watch, watch);
+		TEST_EQ (watch->io_watch->fd, watch->fd);
+		TEST_EQ (watch->io_watch->events, NIH_IO_READ);
 
 		TEST_LIST_NOT_EMPTY (&watch->watches);
 
@@ -394,10 +426,10 @@ test_new (void)
 
 		TEST_GE (fcntl (watch->fd, F_GETFD), 0);
 
-		TEST_ALLOC_SIZE (watch->io, sizeof (NihIo));
-		TEST_ALLOC_PARENT (watch->io, watch);
-		TEST_EQ (watch->io->type, NIH_IO_STREAM);
-		TEST_EQ (watch->io->watch->fd, watch->fd);
+		TEST_ALLOC_SIZE (watch->io_watch, sizeof (NihIoWatch));
+		TEST_ALLOC_PARENT (watch->io_watch, watch);
+		TEST_EQ (watch->io_watch->fd, watch->fd);
+		TEST_EQ (watch->io_watch->events, NIH_IO_READ);
 
 		TEST_LIST_NOT_EMPTY (&watch->watches);
 
@@ -598,7 +630,8 @@ test_add (void)
 	NihWatch       *watch;
 	NihWatchHandle *handle;
 	NihError       *err;
-	int             ret;
+	size_t          count;
+	int             ret, i;
 
 	TEST_FUNCTION ("nih_watch_add");
 	nih_error_init ();
@@ -868,6 +901,99 @@ test_add (void)
 	chmod (filename, 0755);
 
 
+	/* Check that a path whose handle was removed from the list is no
+	 * longer considered to be watched, so adding it again results in
+	 * a new handle in the list.
+	 */
+	TEST_FEATURE ("with path removed from list");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar/bilbo");
+
+	assert0 (nih_watch_add (watch, filename, FALSE));
+
+	handle = (NihWatchHandle *)watch->watches.next;
+	nih_list_remove (&handle->entry);
+
+	ret = nih_watch_add (watch, filename, FALSE);
+
+	TEST_EQ (ret, 0);
+	TEST_LIST_NOT_EMPTY (&watch->watches);
+	TEST_NE_P (watch->watches.next, &handle->entry);
+	TEST_EQ_STR (((NihWatchHandle *)watch->watches.next)->path,
+		     filename);
+	TEST_LIST_EMPTY (&handle->wd_entry);
+	TEST_LIST_EMPTY (&handle->path_entry);
+
+	nih_free (handle);
+	nih_free (watch->watches.next);
+
+	nih_free (watch);
+
+
+	/* Check that when we add a directory with many sub-directories,
+	 * the handle for each can be found in the indexes by its watch
+	 * descriptor and path, which are grown to keep up; and that the
+	 * handles are removed from the indexes when freed.
+	 */
+	TEST_FEATURE ("with many sub-directories");
+	watch = nih_watch_new (NULL, dirname, FALSE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/many");
+	mkdir (filename, 0755);
+
+	for (i = 0; i < 100; i++) {
+		sprintf (filename, "%s/many/%d", dirname, i);
+		mkdir (filename, 0755);
+	}
+
+	TEST_ALLOC_FAIL {
+		strcpy (filename, dirname);
+		strcat (filename, "/many");
+
+		count = watch->nhandles;
+
+		ret = nih_watch_add (watch, filename, TRUE);
+
+		TEST_EQ (ret, 0);
+		TEST_EQ (watch->nhandles, count + 101);
+		TEST_GT (watch->wd_index->size, 101 / 2);
+		TEST_GT (watch->path_index->size, 101 / 2);
+
+		NIH_LIST_FOREACH (&watch->watches, iter) {
+			handle = (NihWatchHandle *)iter;
+
+			TEST_EQ_P (nih_hash_lookup (watch->wd_index,
+						    &handle->wd),
+				   &handle->wd_entry);
+			TEST_EQ_P (nih_hash_lookup (watch->path_index,
+						    handle->path),
+				   &handle->path_entry);
+		}
+
+		NIH_LIST_FOREACH_SAFE (&watch->watches, iter)
+			nih_free (iter);
+
+		TEST_EQ (watch->nhandles, 0);
+
+		NIH_HASH_FOREACH (watch->wd_index, iter)
+			TEST_FAILED ("wd index not empty");
+		NIH_HASH_FOREACH (watch->path_index, iter)
+			TEST_FAILED ("path index not empty");
+	}
+
+	for (i = 0; i < 100; i++) {
+		sprintf (filename, "%s/many/%d", dirname, i);
+		rmdir (filename);
+	}
+
+	strcpy (filename, dirname);
+	strcat (filename, "/many");
+	rmdir (filename);
+
+
 	nih_free (watch);
 
 
@@ -1571,6 +1697,1463 @@ test_reader (void)
 }
 
 
+static void
+wait_for_events (int *called,
+		 int  count)
+{
+	int i;
+
+	for (i = 0; (*called < count) && (i < 50); i++) {
+		fd_set         readfds, writefds, exceptfds;
+		struct timeval timeout;
+		int            nfds = 0;
+
+		FD_ZERO (&readfds);
+		FD_ZERO (&writefds);
+		FD_ZERO (&exceptfds);
+
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+
+		nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+		if (select (nfds, &readfds, &writefds, &exceptfds,
+			    &timeout) > 0)
+			nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+	}
+}
+
+void
+test_fanotify (void)
+{
+	FILE               *fd;
+	NihWatch           *watch;
+	struct file_handle *fh, *other_fh;
+	NihWatchDir        *dir;
+	char                dirname[PATH_MAX], filename[PATH_MAX];
+	char                othername[PATH_MAX], expected[PATH_MAX * 2];
+	int                 mount_id;
+
+	TEST_FUNCTION ("nih_watch_fanotify_reader");
+	nih_error_init ();
+
+	/* The whole filesystem can only be watched with CAP_SYS_ADMIN, so
+	 * the watch falls back to inotify without it.
+	 */
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/deeper");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	TEST_FILENAME (othername);
+	TEST_EQ (mkdir (othername, 0755), 0);
+
+	nih_watch_use_fanotify = TRUE;
+
+	create_called = 0;
+	modify_called = 0;
+	delete_called = 0;
+	last_path  = NULL;
+	last_watch = NULL;
+	last_data  = NULL;
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	if (! watch->fanotify) {
+		printf ("SKIP: fanotify not available, needs CAP_SYS_ADMIN\n");
+		nih_free (watch);
+		goto cleanup;
+	}
+
+
+	/* Check that the watch was set up without a watch for each
+	 * sub-directory, and that only the top-level is in the list.
+	 */
+	TEST_FEATURE ("with sub-directories");
+	TEST_EQ (watch->nhandles, 1);
+	TEST_NE_P (watch->io_watch, NULL);
+
+
+	/* Check that a file created deep within the tree results in the
+	 * create handler being called once it has been closed, with the
+	 * path under the one given.
+	 */
+	TEST_FEATURE ("with new file in sub-directory");
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/deeper/foo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	wait_for_events (&create_called, 1);
+
+	TEST_EQ (create_called, 1);
+	TEST_EQ_P (last_watch, watch);
+	TEST_EQ_STR (last_path, filename);
+	TEST_EQ_P (last_data, &watch);
+
+	nih_free (last_path);
+	last_path = NULL;
+
+
+	/* Check that a file created immediately within a new directory is
+	 * not missed, since there's no watch to be added first.
+	 */
+	TEST_FEATURE ("with file in new sub-directory");
+	create_called = 0;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	strcat (filename, "/bar");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	wait_for_events (&create_called, 2);
+
+	sprintf (expected, "%s/new::%s", dirname, filename);
+
+	TEST_EQ (create_called, 2);
+	TEST_EQ_STR (last_path, expected);
+
+	nih_free (last_path);
+	last_path = NULL;
+
+
+	/* Check that modifying an existing file results in the modify
+	 * handler being called.
+	 */
+	TEST_FEATURE ("with modified file");
+	modify_called = 0;
+
+	fd = fopen (filename, "a");
+	fprintf (fd, "more\n");
+	fclose (fd);
+
+	wait_for_events (&modify_called, 1);
+
+	TEST_EQ (modify_called, 1);
+	TEST_EQ_STR (last_path, filename);
+
+	nih_free (last_path);
+	last_path = NULL;
+
+
+	/* Check that changes elsewhere on the filesystem, and to filtered
+	 * files, are ignored.
+	 */
+	TEST_FEATURE ("with files outside tree or filtered");
+	create_called = 0;
+	modify_called = 0;
+	delete_called = 0;
+
+	strcpy (filename, othername);
+	strcat (filename, "/foo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/frodo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	unlink (filename);
+
+	wait_for_events (&create_called, 1);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+	TEST_EQ_P (last_path, NULL);
+
+
+	/* Check that a directory outside the tree is remembered as such by
+	 * its file handle, and that once it has been moved into the tree
+	 * the events within it are no longer ignored.
+	 */
+	TEST_FEATURE ("with directory moved into tree");
+	strcpy (filename, othername);
+	strcat (filename, "/moved");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	strcat (filename, "/foo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	wait_for_events (&create_called, 1);
+
+	TEST_EQ (create_called, 0);
+	TEST_GT (watch->ndirs, 0);
+
+	strcpy (filename, othername);
+	strcat (filename, "/moved");
+
+	fh = nih_alloc (NULL, sizeof (struct file_handle) + MAX_HANDLE_SZ);
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	TEST_EQ (name_to_handle_at (AT_FDCWD, filename, fh, &mount_id, 0), 0);
+
+	dir = (NihWatchDir *)nih_hash_lookup (watch->dirs, fh);
+	TEST_NE_P (dir, NULL);
+	TEST_FALSE (dir->watched);
+	TEST_EQ_STR (dir->path, filename);
+
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	TEST_EQ (name_to_handle_at (AT_FDCWD, othername, fh, &mount_id, 0),
+		 0);
+	other_fh = fh;
+
+	fh = nih_alloc (NULL, sizeof (struct file_handle) + MAX_HANDLE_SZ);
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	TEST_EQ (name_to_handle_at (AT_FDCWD, filename, fh, &mount_id, 0), 0);
+
+	strcpy (expected, dirname);
+	strcat (expected, "/moved");
+	TEST_EQ (rename (filename, expected), 0);
+
+	wait_for_events (&create_called, 1);
+
+	TEST_EQ (create_called, 1);
+
+	/* Only the directory moved was forgotten, not the one it was
+	 * moved from.
+	 */
+	dir = (NihWatchDir *)nih_hash_lookup (watch->dirs, fh);
+	TEST_TRUE ((dir == NULL) || dir->watched);
+
+	dir = (NihWatchDir *)nih_hash_lookup (watch->dirs, other_fh);
+	TEST_NE_P (dir, NULL);
+	TEST_FALSE (dir->watched);
+
+	nih_free (fh);
+	nih_free (other_fh);
+
+	create_called = 0;
+	nih_free (last_path);
+	last_path = NULL;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/moved/bar");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	wait_for_events (&create_called, 1);
+
+	TEST_EQ (create_called, 1);
+	TEST_EQ_STR (last_path, filename);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/moved/foo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/moved");
+	rmdir (filename);
+
+	wait_for_events (&delete_called, 3);
+
+	create_called = 0;
+	modify_called = 0;
+	delete_called = 0;
+	nih_free (last_path);
+	last_path = NULL;
+
+
+	/* Check that deleting a file results in the delete handler being
+	 * called.
+	 */
+	TEST_FEATURE ("with deleted file");
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/deeper/foo");
+	unlink (filename);
+
+	wait_for_events (&delete_called, 1);
+
+	TEST_EQ (delete_called, 1);
+	TEST_EQ_STR (last_path, filename);
+
+	nih_free (last_path);
+	last_path = NULL;
+
+
+	/* Check that removing sub-directories results in the delete
+	 * handler being called for each, and that the top-level directory
+	 * being removed results in it being called for that, which frees
+	 * the watch.  Events are handled as each is removed, since those
+	 * within a directory can't be resolved once it has gone.
+	 */
+	TEST_FEATURE ("with removal of directory");
+	delete_called = 0;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new/bar");
+	unlink (filename);
+	wait_for_events (&delete_called, 1);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	rmdir (filename);
+	wait_for_events (&delete_called, 2);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/deeper");
+	rmdir (filename);
+	wait_for_events (&delete_called, 3);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+	wait_for_events (&delete_called, 4);
+
+	TEST_EQ (delete_called, 4);
+	TEST_EQ_STR (last_path, filename);
+
+	TEST_FREE_TAG (watch);
+
+	rmdir (dirname);
+	wait_for_events (&delete_called, 5);
+
+	TEST_EQ (delete_called, 5);
+	TEST_EQ_STR (last_path, dirname);
+	TEST_FREE (watch);
+
+	nih_free (last_path);
+	last_path = NULL;
+
+cleanup:
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/deeper");
+	rmdir (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+
+	rmdir (dirname);
+	rmdir (othername);
+
+	nih_watch_use_fanotify = FALSE;
+}
+
+
+static void
+handle_events (void)
+{
+	for (;;) {
+		fd_set         readfds, writefds, exceptfds;
+		struct timeval timeout;
+		int            nfds = 0;
+
+		FD_ZERO (&readfds);
+		FD_ZERO (&writefds);
+		FD_ZERO (&exceptfds);
+
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+
+		nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+		if (select (nfds, &readfds, &writefds, &exceptfds,
+			    &timeout) <= 0)
+			break;
+
+		nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+	}
+}
+
+static void
+reset_called (void)
+{
+	create_called = 0;
+	modify_called = 0;
+	delete_called = 0;
+	batch_called = 0;
+
+	if (last_path)
+		nih_free (last_path);
+	if (last_batch)
+		nih_free (last_batch);
+
+	last_path = NULL;
+	last_batch = NULL;
+	last_watch = NULL;
+	last_data = NULL;
+}
+
+void
+test_coalesce (void)
+{
+	FILE     *fd;
+	NihWatch *watch;
+	char      dirname[PATH_MAX], filename[PATH_MAX];
+	char      expected[PATH_MAX * 4];
+	time_t    due;
+
+	TEST_FUNCTION ("nih_watch_coalesce");
+	nih_error_init ();
+	nih_timer_init ();
+
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	reset_called ();
+
+	watch = nih_watch_new (NULL, dirname, TRUE, TRUE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+
+	/* Check that coalescing can be enabled, allocating the hash table
+	 * of changes but not the timer until there are some.
+	 */
+	TEST_FEATURE ("with coalescing enabled");
+	nih_watch_coalesce (watch, 0, my_batch_handler);
+
+	TEST_NE_P (watch->changes, NULL);
+	TEST_ALLOC_PARENT (watch->changes, watch);
+	TEST_EQ (watch->quiet, 0);
+	TEST_EQ_P (watch->batch_handler, my_batch_handler);
+	TEST_EQ_P (watch->timer, NULL);
+
+
+	/* Check that a file created and then written several times results
+	 * in nothing being called until the timer, and then the create
+	 * handler once followed by the batch handler with its path.
+	 */
+	TEST_FEATURE ("with file created and modified");
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	fd = fopen (filename, "a");
+	fprintf (fd, "more\n");
+	fclose (fd);
+
+	handle_events ();
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (batch_called, 0);
+	TEST_NE_P (watch->timer, NULL);
+	TEST_ALLOC_PARENT (watch->timer, watch);
+
+	nih_timer_poll ();
+
+	TEST_EQ (create_called, 1);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+	TEST_EQ_STR (last_path, filename);
+	TEST_EQ (batch_called, 1);
+	TEST_EQ_STR (last_batch, filename);
+	TEST_EQ_P (last_watch, watch);
+	TEST_EQ_P (last_data, &watch);
+	TEST_EQ_P (watch->timer, NULL);
+	TEST_LIST_EMPTY (&watch->change_order);
+
+	reset_called ();
+
+
+	/* Check that an existing file being replaced results in the modify
+	 * handler being called, rather than delete and create.
+	 */
+	TEST_FEATURE ("with file replaced");
+	unlink (filename);
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "new\n");
+	fclose (fd);
+
+	handle_events ();
+	nih_timer_poll ();
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 1);
+	TEST_EQ (delete_called, 0);
+	TEST_EQ_STR (last_path, filename);
+	TEST_EQ (batch_called, 1);
+	TEST_EQ_STR (last_batch, filename);
+
+	reset_called ();
+
+
+	/* Check that a file created and removed again within the period
+	 * results in nothing being called at all, while other files changed
+	 * are all given to the batch handler in the order changed.
+	 */
+	TEST_FEATURE ("with several files");
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/baz");
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	unlink (filename);
+
+	handle_events ();
+	nih_timer_poll ();
+
+	TEST_EQ (create_called, 1);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 1);
+	TEST_EQ_STR (last_path, filename);
+	TEST_EQ (batch_called, 1);
+
+	sprintf (expected, "%s/baz::%s/foo", dirname, dirname);
+	TEST_EQ_STR (last_batch, expected);
+
+	reset_called ();
+
+
+	/* Check that files in a new sub-directory are found, and that
+	 * changes within it are also coalesced.
+	 */
+	TEST_FEATURE ("with new sub-directory");
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	mkdir (filename, 0755);
+
+	strcat (filename, "/frodo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/bilbo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	handle_events ();
+
+	fd = fopen (filename, "a");
+	fprintf (fd, "more\n");
+	fclose (fd);
+
+	handle_events ();
+	nih_timer_poll ();
+
+	sprintf (expected, "%s/sub::%s", dirname, filename);
+
+	TEST_EQ (create_called, 2);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (batch_called, 1);
+	TEST_EQ_STR (last_batch, expected);
+
+	reset_called ();
+
+
+	/* Check that the timer is put back by further changes, until the
+	 * watch has been quiet for long enough.
+	 */
+	TEST_FEATURE ("with quiet period");
+	nih_watch_coalesce (watch, 10, my_batch_handler);
+
+	unlink (filename);
+	handle_events ();
+
+	TEST_NE_P (watch->timer, NULL);
+	due = watch->timer->due;
+	TEST_EQ (due, watch->changes_since + 10);
+
+	nih_timer_poll ();
+
+	TEST_EQ (delete_called, 0);
+	TEST_EQ (batch_called, 0);
+
+	watch->changes_since -= 5;
+	watch->timer->due -= 5;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/frodo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+	handle_events ();
+
+	TEST_GE (watch->timer->due, due);
+
+	watch->timer->due = 0;
+	nih_timer_poll ();
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+
+	TEST_EQ (delete_called, 2);
+	TEST_EQ_STR (last_path, filename);
+	TEST_EQ (batch_called, 1);
+
+	reset_called ();
+
+
+	/* Check that the watch may be freed from a handler, with changes
+	 * still outstanding.
+	 */
+	TEST_FEATURE ("with watch freed by handler");
+	strcpy (filename, dirname);
+	strcat (filename, "/baz");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/qux");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	handle_events ();
+
+	TEST_FREE_TAG (watch);
+
+	watch->delete_handler = my_free_handler;
+	watch->timer->due = 0;
+
+	nih_timer_poll ();
+
+	TEST_FREE (watch);
+	TEST_EQ (create_called, 0);
+	TEST_EQ (batch_called, 0);
+
+	unlink (filename);
+	rmdir (dirname);
+
+	reset_called ();
+}
+
+
+static int final_created = 0;
+
+static void
+my_count_create_handler (void        *data,
+			 NihWatch    *watch,
+			 const char  *path,
+			 struct stat *statbuf)
+{
+	create_called++;
+
+	if (! strcmp (strrchr (path, '/'), "/final"))
+		final_created++;
+}
+
+static void
+my_count_delete_handler (void       *data,
+			 NihWatch   *watch,
+			 const char *path)
+{
+	delete_called++;
+}
+
+static void
+drain_events (NihWatch *watch)
+{
+	char buf[4096];
+
+	while (read (watch->fd, buf, sizeof (buf)) > 0)
+		;
+}
+
+void
+test_record (void)
+{
+	FILE          *fd;
+	NihWatch      *watch;
+	NihWatchEntry *entry, *child;
+	char           dirname[PATH_MAX], filename[PATH_MAX];
+	char           subname[PATH_MAX];
+
+	TEST_FUNCTION ("nih_watch_record");
+	nih_error_init ();
+
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	strcpy (subname, dirname);
+	strcat (subname, "/sub");
+	TEST_EQ (mkdir (subname, 0755), 0);
+
+	strcpy (filename, subname);
+	strcat (filename, "/foo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, NULL,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+
+	/* Check that nothing is recorded until recording is started.
+	 */
+	TEST_FEATURE ("without recording");
+	TEST_EQ_P (watch->entries, NULL);
+	TEST_EQ (watch->nentries, 0);
+
+
+	/* Check that starting recording records every object in the tree,
+	 * each linked to the entry of the directory containing it.
+	 */
+	TEST_FEATURE ("with recording started");
+	nih_watch_record (watch);
+
+	TEST_NE_P (watch->entries, NULL);
+	TEST_ALLOC_PARENT (watch->entries, watch);
+	TEST_EQ (watch->nentries, 3);
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, subname);
+	TEST_NE_P (entry, NULL);
+	TEST_TRUE (entry->is_dir);
+
+	child = (NihWatchEntry *)nih_hash_lookup (watch->entries, filename);
+	TEST_NE_P (child, NULL);
+	TEST_FALSE (child->is_dir);
+
+	TEST_EQ_P (entry->children.next, &child->child_entry);
+	TEST_EQ_P (child->child_entry.next, &entry->children);
+
+
+	/* Check that starting recording again changes nothing.
+	 */
+	TEST_FEATURE ("with recording already started");
+	nih_watch_record (watch);
+
+	TEST_EQ (watch->nentries, 3);
+	TEST_EQ_P ((NihWatchEntry *)nih_hash_lookup (watch->entries, subname),
+		   entry);
+
+
+	/* Check that when a directory is moved away, the objects recorded
+	 * within it are removed along with it.
+	 */
+	TEST_FEATURE ("with directory moved away");
+	strcpy (filename, dirname);
+	strcat (filename, ".moved");
+	TEST_EQ (rename (subname, filename), 0);
+
+	handle_events ();
+
+	TEST_EQ (watch->nentries, 1);
+	TEST_EQ_P (nih_hash_lookup (watch->entries, subname), NULL);
+
+	nih_free (watch);
+
+	strcat (filename, "/foo");
+	unlink (filename);
+	filename[strlen (filename) - 4] = '\0';
+	rmdir (filename);
+
+	rmdir (dirname);
+
+	reset_called ();
+}
+
+void
+test_rescan (void)
+{
+	FILE          *fd;
+	FILE          *proc;
+	NihWatch      *watch, *flat;
+	NihWatchEntry *entry;
+	char           dirname[PATH_MAX], filename[PATH_MAX + 16];
+	char           expected[PATH_MAX + 16];
+	struct stat    statbuf;
+	struct timespec times[2];
+	int            max_events, i;
+
+	TEST_FUNCTION ("nih_watch_rescan");
+	nih_error_init ();
+
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	strcat (filename, "/baz");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	reset_called ();
+
+
+	/* Check that every object in the tree is recorded once recording
+	 * is started, along with its inode.
+	 */
+	TEST_FEATURE ("with objects recorded");
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	nih_watch_record (watch);
+
+	TEST_EQ (watch->nentries, 5);
+	TEST_EQ (watch->overflows, 0);
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, filename);
+	TEST_NE_P (entry, NULL);
+	TEST_ALLOC_PARENT (entry, watch);
+	TEST_EQ_STR (entry->path, filename);
+	TEST_FALSE (entry->is_dir);
+
+	TEST_EQ (stat (filename, &statbuf), 0);
+	TEST_EQ (entry->ino, statbuf.st_ino);
+	TEST_EQ (entry->mtime.tv_sec, statbuf.st_mtim.tv_sec);
+	TEST_EQ (entry->mtime.tv_nsec, statbuf.st_mtim.tv_nsec);
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, dirname);
+	TEST_NE_P (entry, NULL);
+	TEST_TRUE (entry->is_dir);
+
+
+	/* Check that when the events for changes have been lost, a rescan
+	 * finds them and calls the handlers as if they had been received.
+	 */
+	TEST_FEATURE ("with events lost");
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	times[0].tv_sec = times[1].tv_sec = 1000000000;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	strcat (filename, "/qux");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	drain_events (watch);
+
+	nih_watch_rescan (watch);
+
+	TEST_EQ (create_called, 2);
+	TEST_EQ (modify_called, 1);
+	TEST_EQ (delete_called, 1);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	if (! watch->fanotify)
+		TEST_NE_P (nih_hash_lookup (watch->path_index, filename), NULL);
+
+	strcat (filename, "/qux");
+	TEST_NE_P (nih_hash_lookup (watch->entries, filename), NULL);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	TEST_EQ_P (nih_hash_lookup (watch->entries, filename), NULL);
+
+	TEST_EQ (watch->nentries, 6);
+
+	reset_called ();
+
+
+	/* Check that a rescan without changes calls no handlers at all.
+	 */
+	TEST_FEATURE ("without changes");
+	nih_watch_rescan (watch);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+
+	/* Check that a directory moved away is delivered as deleted along
+	 * with everything recorded within it.
+	 */
+	TEST_FEATURE ("with directory moved away");
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	strcpy (expected, dirname);
+	strcat (expected, ".moved");
+	TEST_EQ (rename (filename, expected), 0);
+
+	drain_events (watch);
+
+	nih_watch_rescan (watch);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (delete_called, 2);
+	TEST_EQ (watch->nentries, 4);
+
+	strcat (expected, "/qux");
+	unlink (expected);
+	expected[strlen (expected) - 4] = '\0';
+	rmdir (expected);
+
+	reset_called ();
+
+
+	/* Check that the direct contents of a directory watched without
+	 * sub-directories are recorded too, so that a rescan only calls
+	 * the handlers for those that have changed.
+	 */
+	TEST_FEATURE ("without sub-directories");
+	flat = nih_watch_new (NULL, dirname, FALSE, FALSE, my_filter,
+			      my_create_handler, my_modify_handler,
+			      my_delete_handler, &flat);
+	TEST_NE_P (flat, NULL);
+
+	nih_watch_record (flat);
+
+	TEST_EQ (flat->nentries, 3);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/baz");
+	TEST_EQ_P (nih_hash_lookup (flat->entries, filename), NULL);
+
+	nih_watch_rescan (flat);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	times[0].tv_sec = times[1].tv_sec = 1100000000;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	drain_events (flat);
+	drain_events (watch);
+
+	nih_watch_rescan (flat);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 1);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (flat);
+	nih_watch_rescan (watch);
+
+	reset_called ();
+
+
+	/* Check that when the event queue overflows, it is counted and the
+	 * tree rescanned to find the changes made after it did.
+	 */
+	TEST_FEATURE ("with queue overflow");
+	max_events = 0;
+	proc = fopen ("/proc/sys/fs/inotify/max_queued_events", "r");
+	if (proc) {
+		if (fscanf (proc, "%d", &max_events) != 1)
+			max_events = 0;
+		fclose (proc);
+	}
+
+	if ((max_events <= 0) || (max_events > 65536)) {
+		printf ("SKIP: inotify queue too large\n");
+		goto finish;
+	}
+
+	watch->create_handler = my_count_create_handler;
+	watch->delete_handler = my_count_delete_handler;
+	final_created = 0;
+
+	for (i = 0; i < max_events / 2; i++) {
+		sprintf (filename, "%s/tmp%d", dirname, i);
+		fd = fopen (filename, "w");
+		fclose (fd);
+		unlink (filename);
+	}
+
+	strcpy (filename, dirname);
+	strcat (filename, "/final");
+	fd = fopen (filename, "w");
+	fprintf (fd, "test\n");
+	fclose (fd);
+
+	logger_called = 0;
+	nih_log_set_logger (my_logger);
+
+	handle_events ();
+
+	nih_log_set_logger (nih_logger_printf);
+
+	TEST_TRUE (logger_called);
+	TEST_EQ (watch->overflows, 1);
+	TEST_EQ (final_created, 1);
+	TEST_NE_P (nih_hash_lookup (watch->entries, filename), NULL);
+	TEST_EQ (watch->nentries, 5);
+
+	unlink (filename);
+
+finish:
+	nih_free (watch);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/final");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/baz");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+
+	rmdir (dirname);
+
+	reset_called ();
+}
+
+
+static void
+make_file (const char *dirname,
+	   const char *name,
+	   const char *contents)
+{
+	char  filename[PATH_MAX];
+	FILE *fd;
+
+	strcpy (filename, dirname);
+	strcat (filename, name);
+
+	fd = fopen (filename, "w");
+	fputs (contents, fd);
+	fclose (fd);
+}
+
+void
+test_save (void)
+{
+	NihWatch      *watch;
+	NihWatchEntry *entry;
+	NihError      *err;
+	char           dirname[PATH_MAX], filename[PATH_MAX];
+	char           snapname[PATH_MAX];
+	struct stat    statbuf;
+	int            ret;
+
+	TEST_FUNCTION ("nih_watch_save");
+	nih_error_init ();
+
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	make_file (dirname, "/foo", "test\n");
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	make_file (dirname, "/sub/bar", "");
+
+	TEST_FILENAME (snapname);
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+
+	/* Check that the objects recorded by the watch are saved to the
+	 * file, and that the contents of each file are hashed doing so.
+	 */
+	TEST_FEATURE ("with objects recorded");
+	ret = nih_watch_save (watch, snapname);
+
+	TEST_EQ (ret, 0);
+
+	TEST_EQ (stat (snapname, &statbuf), 0);
+	TEST_EQ (statbuf.st_size, (off_t)(16 + 4 * 48 + strlen (dirname) * 4
+					  + strlen ("/foo/sub/sub/bar") + 4));
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, filename);
+	TEST_NE_P (entry, NULL);
+	TEST_TRUE (entry->hashed);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/bar");
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, filename);
+	TEST_NE_P (entry, NULL);
+	TEST_TRUE (entry->hashed);
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, dirname);
+	TEST_NE_P (entry, NULL);
+	TEST_FALSE (entry->hashed);
+
+	TEST_EQ (create_called, 0);
+
+
+	/* Check that the hash of a file is forgotten once it's modified.
+	 */
+	TEST_FEATURE ("with file modified");
+	make_file (dirname, "/foo", "modified\n");
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, filename);
+
+	nih_watch_rescan (watch);
+
+	TEST_EQ (modify_called, 1);
+	TEST_FALSE (entry->hashed);
+
+	reset_called ();
+
+
+	/* Check that an error is raised when the file can't be written,
+	 * and that no temporary file is left behind.
+	 */
+	TEST_FEATURE ("with unwritable location");
+	strcpy (filename, dirname);
+	strcat (filename, "/nonexistant/snapshot");
+
+	ret = nih_watch_save (watch, filename);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+
+	nih_free (watch);
+
+	unlink (snapname);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/bar");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	unlink (filename);
+
+	rmdir (dirname);
+}
+
+void
+test_restore (void)
+{
+	FILE          *fd;
+	NihWatch      *watch;
+	NihError      *err;
+	char           dirname[PATH_MAX], filename[PATH_MAX];
+	char           snapname[PATH_MAX];
+	struct timespec times[2];
+	struct stat    statbuf;
+	int            ret;
+
+	TEST_FUNCTION ("nih_watch_restore");
+	nih_error_init ();
+
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	make_file (dirname, "/foo", "test\n");
+	make_file (dirname, "/bar", "test\n");
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	TEST_EQ (mkdir (filename, 0755), 0);
+
+	make_file (dirname, "/sub/baz", "test\n");
+
+	TEST_FILENAME (snapname);
+
+	reset_called ();
+
+
+	/* Check that when there is no saved file, the create handler is
+	 * called for every object in the tree.
+	 */
+	TEST_FEATURE ("without saved file");
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 5);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	TEST_EQ (nih_watch_save (watch, snapname), 0);
+
+	nih_free (watch);
+	reset_called ();
+
+
+	/* Check that when nothing has changed since the file was saved,
+	 * no handlers are called.
+	 */
+	TEST_FEATURE ("without changes");
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (watch);
+
+
+	/* Check that the handlers are called for the changes made since
+	 * the file was saved, but not for a file that was only touched or
+	 * rewritten with the same contents.
+	 */
+	TEST_FEATURE ("with changes");
+	strcpy (filename, dirname);
+	strcat (filename, "/foo");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	times[0].tv_sec = times[1].tv_sec = 1000000000;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	make_file (dirname, "/sub/baz", "TEST\n");
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	make_file (dirname, "/new", "test\n");
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	TEST_EQ (create_called, 0);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 1);
+	TEST_EQ (modify_called, 1);
+	TEST_EQ (delete_called, 1);
+
+	TEST_EQ (nih_watch_save (watch, snapname), 0);
+
+	nih_free (watch);
+	reset_called ();
+
+
+	/* Check that objects saved from outside the tree watched are not
+	 * delivered as deleted.
+	 */
+	TEST_FEATURE ("with objects outside tree");
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+
+	watch = nih_watch_new (NULL, filename, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (watch);
+
+
+	/* Check that a sub-directory removed since the file was saved is
+	 * delivered as deleted along with its contents.
+	 */
+	TEST_FEATURE ("with sub-directory removed");
+	strcpy (filename, dirname);
+	strcat (filename, "/sub/baz");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/sub");
+	rmdir (filename);
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 2);
+
+	nih_free (watch);
+	reset_called ();
+
+
+	/* Check that the direct contents of a directory watched without
+	 * sub-directories are saved and compared when restored, so that
+	 * only those changed are delivered.
+	 */
+	TEST_FEATURE ("without sub-directories");
+	watch = nih_watch_new (NULL, dirname, FALSE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	TEST_EQ (nih_watch_save (watch, snapname), 0);
+
+	nih_free (watch);
+
+	make_file (dirname, "/bar", "changed\n");
+
+	watch = nih_watch_new (NULL, dirname, FALSE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 1);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (watch);
+	reset_called ();
+
+
+	/* Check that a saved file that has been truncated is rejected with
+	 * an error, rather than read beyond its end.
+	 */
+	TEST_FEATURE ("with truncated file");
+	TEST_EQ (stat (snapname, &statbuf), 0);
+	TEST_EQ (truncate (snapname, statbuf.st_size - 1), 0);
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_WATCH_INVALID_SNAPSHOT);
+	nih_free (err);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (watch);
+
+
+	/* Check that a file that isn't a saved watch is rejected with an
+	 * error, without calling any handlers.
+	 */
+	TEST_FEATURE ("with invalid file");
+	fd = fopen (snapname, "w");
+	fprintf (fd, "this is not a snapshot of a watch\n");
+	fclose (fd);
+
+	watch = nih_watch_new (NULL, dirname, TRUE, FALSE, my_filter,
+			       my_create_handler, my_modify_handler,
+			       my_delete_handler, &watch);
+	TEST_NE_P (watch, NULL);
+
+	ret = nih_watch_restore (watch, snapname);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_WATCH_INVALID_SNAPSHOT);
+	nih_free (err);
+
+	TEST_EQ (create_called, 0);
+	TEST_EQ (modify_called, 0);
+	TEST_EQ (delete_called, 0);
+
+	nih_free (watch);
+
+
+	unlink (snapname);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar");
+	unlink (filename);
+
+	rmdir (dirname);
+
+	reset_called ();
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -1588,6 +3171,12 @@ main (int   argc,
 	test_add ();
 	test_destroy ();
 	test_reader ();
+	test_fanotify ();
+	test_coalesce ();
+	test_record ();
+	test_rescan ();
+	test_save ();
+	test_restore ();
 
 	return 0;
 }
@@ -0,0 +1,479 @@
+/* libnih
+ *
+ * test_workpool.c - test suite for nih/workpool.c
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/io.h>
+#include <nih/loop.h>
+#include <nih/workpool.h>
+#include <nih/config.h>
+#include <nih/error.h>
+#include <nih/errors.h>
+
+
+void
+test_pool_new (void)
+{
+	NihWorkPool *pool;
+	NihLoop     *loop, *previous;
+
+	/* Check that we can create a new pool, and that it has the number
+	 * of workers we asked for and an event descriptor watched by the
+	 * current loop.
+	 */
+	TEST_FUNCTION ("nih_work_pool_new");
+	loop = nih_loop_new (NULL);
+	previous = nih_loop_set_current (loop);
+
+	TEST_ALLOC_FAIL {
+		pool = nih_work_pool_new (NULL, 4);
+
+		if (test_alloc_failed) {
+			NihError *err;
+
+			TEST_EQ_P (pool, NULL);
+			TEST_LIST_EMPTY (loop->io_watches);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (pool, sizeof (NihWorkPool));
+		TEST_EQ (pool->nthreads, 4);
+		TEST_ALLOC_PARENT (pool->workers, pool);
+		TEST_EQ (pool->queued, 0);
+		TEST_EQ_P (pool->done_head, NULL);
+		TEST_FALSE (pool->shutdown);
+
+		TEST_GE (pool->event_fd, 0);
+		TEST_TRUE (fcntl (pool->event_fd, F_GETFD) & FD_CLOEXEC);
+
+		TEST_ALLOC_PARENT (pool->watch, pool);
+		TEST_EQ (pool->watch->fd, pool->event_fd);
+		TEST_EQ_P (pool->watch->entry.next, loop->io_watches);
+
+		nih_free (pool);
+
+		TEST_LIST_EMPTY (loop->io_watches);
+	}
+
+	nih_loop_set_current (previous);
+	nih_free (loop);
+}
+
+
+typedef struct test_job {
+	int    value;
+	int    result;
+	int    fd;
+	int    started_fd;
+	int    work_called;
+	int    done_called;
+} TestJob;
+
+static NihLoop *test_loop = NULL;
+static int      done_count = 0;
+static int      done_expected = 0;
+
+static int
+my_work (void *data)
+{
+	TestJob *tj = data;
+	char     buf[1];
+
+	tj->work_called++;
+
+	/* Tell the test that we're running, and wait for it to tell us
+	 * to continue if asked to.
+	 */
+	if (tj->started_fd >= 0)
+		assert (write (tj->started_fd, "", 1) == 1);
+	if (tj->fd >= 0)
+		assert (read (tj->fd, buf, 1) == 1);
+
+	tj->result = tj->value * tj->value;
+
+	return 0;
+}
+
+static void
+my_done (void       *data,
+	 NihWorkJob *job)
+{
+	TestJob *tj = data;
+
+	TEST_EQ_P (job->data, tj);
+	TEST_EQ_P (job->item, NULL);
+	TEST_EQ_P (job->error, NULL);
+	TEST_EQ_P (nih_loop_current (), test_loop);
+
+	tj->done_called++;
+
+	if (++done_count == done_expected)
+		nih_loop_exit (test_loop, 0);
+}
+
+typedef struct test_parse {
+	const char *filename;
+	size_t      lineno;
+	pthread_t   thread;
+	int         ret;
+	int         number;
+	int         done_called;
+} TestParse;
+
+static NihConfigStanza no_stanzas[] = {
+	NIH_CONFIG_LAST
+};
+
+static int
+my_parse_work (void *data)
+{
+	TestParse *tp = data;
+
+	tp->thread = pthread_self ();
+	tp->lineno = 1;
+
+	tp->ret = nih_config_parse (tp->filename, NULL, &tp->lineno,
+				    no_stanzas, NULL);
+
+	return tp->ret;
+}
+
+static void
+my_parse_done (void       *data,
+	       NihWorkJob *job)
+{
+	TestParse *tp = data;
+	NihError  *err;
+
+	TEST_EQ_P (job->data, tp);
+	TEST_NE_P (job->error, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ_P (err, job->error);
+	TEST_NE_P (strstr (err->filename, "config.c"), NULL);
+	tp->number = err->number;
+	nih_free (err);
+
+	tp->done_called++;
+
+	nih_loop_exit (test_loop, 0);
+}
+
+void
+test_submit (void)
+{
+	NihWorkPool *pool;
+	NihWorkJob  *job[100];
+	TestJob      tj[100];
+	TestParse    tp;
+	NihLoop     *previous;
+	FILE        *fd;
+	char         filename[PATH_MAX];
+	int          i;
+
+	/* Check that jobs submitted to the pool are run by the worker
+	 * threads, and that their done handlers are called from the loop
+	 * the pool was created in afterwards.
+	 */
+	TEST_FUNCTION ("nih_work_pool_submit");
+	test_loop = nih_loop_new (NULL);
+	previous = nih_loop_set_current (test_loop);
+
+	pool = nih_work_pool_new (NULL, 4);
+
+	TEST_ALLOC_FAIL {
+		tj[0].value = 7;
+		tj[0].result = 0;
+		tj[0].fd = -1;
+		tj[0].started_fd = -1;
+		tj[0].work_called = 0;
+		tj[0].done_called = 0;
+
+		job[0] = nih_work_pool_submit (pool, NULL, my_work, my_done,
+					       &tj[0]);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job[0], NULL);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (job[0], sizeof (NihWorkJob));
+		TEST_EQ_P (job[0]->pool, pool);
+		TEST_NE_P (job[0]->item, NULL);
+		TEST_EQ_P (job[0]->done, my_done);
+		TEST_EQ_P (job[0]->data, &tj[0]);
+
+		done_count = 0;
+		done_expected = 1;
+
+		TEST_FREE_TAG (job[0]);
+
+		TEST_ALLOC_SAFE {
+			nih_loop_run (test_loop);
+		}
+
+		TEST_FREE (job[0]);
+		TEST_EQ (tj[0].work_called, 1);
+		TEST_EQ (tj[0].done_called, 1);
+		TEST_EQ (tj[0].result, 49);
+	}
+
+
+	/* Check that many jobs submitted at once are all run exactly
+	 * once, by some worker, and that each has its done handler called.
+	 */
+	TEST_FEATURE ("with many jobs");
+	for (i = 0; i < 100; i++) {
+		tj[i].value = i;
+		tj[i].result = 0;
+		tj[i].fd = -1;
+		tj[i].started_fd = -1;
+		tj[i].work_called = 0;
+		tj[i].done_called = 0;
+
+		job[i] = nih_work_pool_submit (pool, NULL, my_work, my_done,
+					       &tj[i]);
+	}
+
+	done_count = 0;
+	done_expected = 100;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (done_count, 100);
+	for (i = 0; i < 100; i++) {
+		TEST_EQ (tj[i].work_called, 1);
+		TEST_EQ (tj[i].done_called, 1);
+		TEST_EQ (tj[i].result, i * i);
+	}
+
+
+	/* Check that a work function may parse a configuration file with
+	 * a syntax error; the error should be raised in the worker's own
+	 * context, and handed back to be raised again while the done
+	 * handler is called.
+	 */
+	TEST_FEATURE ("with error raised by work function");
+	TEST_FILENAME (filename);
+
+	fd = fopen (filename, "w");
+	fprintf (fd, "# comment\n");
+	fprintf (fd, "wibble\n");
+	fclose (fd);
+
+	tp.filename = filename;
+	tp.lineno = 0;
+	tp.ret = 0;
+	tp.number = 0;
+	tp.done_called = 0;
+
+	job[0] = nih_work_pool_submit (pool, NULL, my_parse_work,
+				       my_parse_done, &tp);
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (tp.done_called, 1);
+	TEST_FALSE (pthread_equal (tp.thread, pthread_self ()));
+	TEST_LT (tp.ret, 0);
+	TEST_EQ (tp.lineno, 2);
+	TEST_EQ (tp.number, NIH_CONFIG_UNKNOWN_STANZA);
+
+	unlink (filename);
+
+	nih_free (pool);
+
+	nih_loop_set_current (previous);
+	nih_free (test_loop);
+}
+
+
+void
+test_job_destroy (void)
+{
+	NihWorkPool *pool;
+	NihWorkJob  *job1, *job2;
+	TestJob      tj1, tj2;
+	NihLoop     *previous;
+	int          fds[2], started[2];
+	char         buf[1];
+
+	TEST_FUNCTION ("nih_work_job_destroy");
+	test_loop = nih_loop_new (NULL);
+	previous = nih_loop_set_current (test_loop);
+
+	assert0 (pipe (fds));
+	assert0 (pipe (started));
+
+	pool = nih_work_pool_new (NULL, 1);
+
+
+	/* Check that freeing the handle of a job that is queued behind a
+	 * running job on the only worker means that the job is never
+	 * run, and its done handler never called.
+	 */
+	TEST_FEATURE ("with queued job");
+	tj1.value = 3;
+	tj1.result = 0;
+	tj1.fd = fds[0];
+	tj1.started_fd = started[1];
+	tj1.work_called = 0;
+	tj1.done_called = 0;
+
+	job1 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj1);
+
+	assert (read (started[0], buf, 1) == 1);
+
+	tj2.value = 5;
+	tj2.result = 0;
+	tj2.fd = -1;
+	tj2.started_fd = -1;
+	tj2.work_called = 0;
+	tj2.done_called = 0;
+
+	job2 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj2);
+
+	nih_free (job2);
+
+	assert (write (fds[1], "", 1) == 1);
+
+	done_count = 0;
+	done_expected = 1;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (tj1.work_called, 1);
+	TEST_EQ (tj1.done_called, 1);
+	TEST_EQ (tj1.result, 9);
+
+	TEST_EQ (tj2.work_called, 0);
+	TEST_EQ (tj2.done_called, 0);
+
+
+	/* Check that freeing the handle of a job that is running waits
+	 * for the work function to return, but doesn't call the done
+	 * handler.
+	 */
+	TEST_FEATURE ("with running job");
+	tj1.value = 4;
+	tj1.result = 0;
+	tj1.work_called = 0;
+	tj1.done_called = 0;
+
+	job1 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj1);
+
+	assert (read (started[0], buf, 1) == 1);
+	assert (write (fds[1], "", 1) == 1);
+
+	nih_free (job1);
+
+	TEST_EQ (tj1.work_called, 1);
+	TEST_EQ (tj1.result, 16);
+
+	/* Run a second job so that we know the loop has dealt with the
+	 * completion of the first.
+	 */
+	tj2.value = 6;
+	tj2.result = 0;
+	tj2.work_called = 0;
+	tj2.done_called = 0;
+
+	job2 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj2);
+
+	done_count = 0;
+	done_expected = 1;
+
+	nih_loop_run (test_loop);
+
+	TEST_EQ (tj1.done_called, 0);
+	TEST_EQ (tj2.work_called, 1);
+	TEST_EQ (tj2.done_called, 1);
+	TEST_EQ (tj2.result, 36);
+
+
+	/* Check that freeing the pool cancels any outstanding jobs,
+	 * leaving their handles allocated but no longer referring to the
+	 * pool.  The worker may or may not have started the second job
+	 * by the time we free the pool, but no done handler is called.
+	 */
+	TEST_FEATURE ("with pool freed");
+	tj1.value = 8;
+	tj1.result = 0;
+	tj1.work_called = 0;
+	tj1.done_called = 0;
+
+	job1 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj1);
+
+	assert (read (started[0], buf, 1) == 1);
+
+	tj2.work_called = 0;
+	tj2.done_called = 0;
+
+	job2 = nih_work_pool_submit (pool, NULL, my_work, my_done, &tj2);
+
+	assert (write (fds[1], "", 1) == 1);
+
+	nih_free (pool);
+
+	TEST_EQ (tj1.work_called, 1);
+	TEST_EQ (tj1.done_called, 0);
+	TEST_EQ (tj2.done_called, 0);
+
+	TEST_EQ_P (job1->pool, NULL);
+	TEST_EQ_P (job1->item, NULL);
+	TEST_EQ_P (job2->pool, NULL);
+	TEST_EQ_P (job2->item, NULL);
+
+	nih_free (job1);
+	nih_free (job2);
+
+	close (fds[0]);
+	close (fds[1]);
+	close (started[0]);
+	close (started[1]);
+
+	nih_loop_set_current (previous);
+	nih_free (test_loop);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_pool_new ();
+	test_submit ();
+	test_job_destroy ();
+
+	return 0;
+}
@@ -32,16 +32,22 @@
 #include <nih/list.h>
 #include <nih/logging.h>
 #include <nih/error.h>
+#include <nih/loop.h>
 
 #include "timer.h"
 
 
+/* Prototypes for static functions */
+static time_t nih_timer_aligned (NihTimer *timer, time_t due);
+
+
 /**
  * nih_timers:
  *
- * This is the list of all registered timers, it is not sorted into any
- * particular order.  The due time of timers should be set when the timer
- * is added to this list, or rescheduled; it is not calculated on the fly.
+ * This is the list of all timers registered with the default loop, it is
+ * not sorted into any particular order.  The due time of timers should be
+ * set when the timer is added to this list, or rescheduled; it is not
+ * calculated on the fly.
  *
  * Each item is an NihTimer structure.
  **/
@@ -51,13 +57,13 @@ NihList *nih_timers = NULL;
 /**
  * nih_timer_init:
  *
- * Initialise the timer list.
+ * Initialise the timer list of the default loop.
  **/
 void
 nih_timer_init (void)
 {
 	if (! nih_timers)
-		nih_timers = NIH_MUST (nih_list_new (NULL));
+		nih_loop_default ();
 }
 
 
@@ -68,9 +74,10 @@ nih_timer_init (void)
  * @callback: function to be called,
  * @data: pointer to pass to function as first argument.
  *
- * Arranges for the @callback function to be called in @timeout seconds
- * time, or the soonest period thereafter.  A timer may be called
- * immediately by passing zero or a non-negative number as @timeout.
+ * Arranges for the @callback function to be called by the current loop
+ * in @timeout seconds time, or the soonest period thereafter.  A timer
+ * may be called immediately by passing zero or a non-negative number as
+ * @timeout.
  *
  * The timer structure is allocated using nih_alloc() and stored in
  * a linked list; there is no non-allocated version of this function
@@ -96,8 +103,6 @@ nih_timer_add_timeout (const void *parent,
 
 	nih_assert (callback != NULL);
 
-	nih_timer_init ();
-
 	timer = nih_new (parent, NihTimer);
 	if (! timer)
 		return NULL;
@@ -109,13 +114,16 @@ nih_timer_add_timeout (const void *parent,
 	timer->type = NIH_TIMER_TIMEOUT;
 	timer->timeout = timeout;
 
+	timer->slack = 0;
+	timer->align = 0;
+
 	timer->callback = callback;
 	timer->data = data;
 
 	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
 	timer->due = now.tv_sec + timeout;
 
-	nih_list_add (nih_timers, &timer->entry);
+	nih_list_add (nih_loop_current ()->timers, &timer->entry);
 
 	return timer;
 }
@@ -127,8 +135,8 @@ nih_timer_add_timeout (const void *parent,
  * @callback: function to be called,
  * @data: pointer to pass to function as first argument.
  *
- * Arranges for the @callback function to be called every @period seconds,
- * or the soonest time thereafter.
+ * Arranges for the @callback function to be called by the current loop
+ * every @period seconds, or the soonest time thereafter.
  *
  * The timer structure is allocated using nih_alloc() and stored in
  * a linked list; there is no non-allocated version of this function
@@ -155,8 +163,6 @@ nih_timer_add_periodic (const void *parent,
 	nih_assert (callback != NULL);
 	nih_assert (period > 0);
 
-	nih_timer_init ();
-
 	timer = nih_new (parent, NihTimer);
 	if (! timer)
 		return NULL;
@@ -168,13 +174,16 @@ nih_timer_add_periodic (const void *parent,
 	timer->type = NIH_TIMER_PERIODIC;
 	timer->period = period;
 
+	timer->slack = 0;
+	timer->align = 0;
+
 	timer->callback = callback;
 	timer->data = data;
 
 	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
 	timer->due = now.tv_sec + period;
 
-	nih_list_add (nih_timers, &timer->entry);
+	nih_list_add (nih_loop_current ()->timers, &timer->entry);
 
 	return timer;
 }
@@ -186,8 +195,8 @@ nih_timer_add_periodic (const void *parent,
  * @callback: function to be called,
  * @data: pointer to pass to function as first argument.
  *
- * Arranges for the @callback function to be called based on the @schedule
- * given.
+ * Arranges for the @callback function to be called by the current loop
+ * based on the @schedule given.
  *
  * The timer structure is allocated using nih_alloc() and stored in
  * a linked list; there is no non-allocated version of this function
@@ -213,8 +222,6 @@ nih_timer_add_scheduled (const void       *parent,
 	nih_assert (callback != NULL);
 	nih_assert (schedule != NULL);
 
-	nih_timer_init ();
-
 	timer = nih_new (parent, NihTimer);
 	if (! timer)
 		return NULL;
@@ -226,24 +233,71 @@ nih_timer_add_scheduled (const void       *parent,
 	timer->type = NIH_TIMER_SCHEDULED;
 	memcpy (&timer->schedule, schedule, sizeof (NihTimerSchedule));
 
+	timer->slack = 0;
+	timer->align = 0;
+
 	timer->callback = callback;
 	timer->data = data;
 
 	/* FIXME Not implemented */
 	timer->due = 0;
 
-	nih_list_add (nih_timers, &timer->entry);
+	nih_list_add (nih_loop_current ()->timers, &timer->entry);
 
 	return timer;
 }
 
 
+/**
+ * nih_timer_set_slack:
+ * @timer: timer to change,
+ * @slack: seconds the timer may be delayed by.
+ *
+ * Allows the loop to call @timer up to @slack seconds after it is due,
+ * so that it may be called in the same wakeup as other timers rather
+ * than waking the process separately.  Timers are never called early.
+ **/
+void
+nih_timer_set_slack (NihTimer *timer,
+		     time_t    slack)
+{
+	nih_assert (timer != NULL);
+	nih_assert (slack >= 0);
+
+	timer->slack = slack;
+}
+
+/**
+ * nih_timer_align:
+ * @timer: timer to align,
+ * @grid: seconds between grid points, or zero.
+ *
+ * Rounds the due time of @timer up to a multiple of @grid seconds of the
+ * monotonic clock and, for periodic timers, each time it is rescheduled.
+ * The monotonic clock is shared by every process on the system, so all
+ * timers aligned to the same grid are due at the same moment and can be
+ * handled with a single wakeup.
+ *
+ * Passing zero for @grid stops aligning the timer.
+ **/
+void
+nih_timer_align (NihTimer *timer,
+		 time_t    grid)
+{
+	nih_assert (timer != NULL);
+	nih_assert (grid >= 0);
+
+	timer->align = grid;
+	timer->due = nih_timer_aligned (timer, timer->due);
+}
+
+
 /**
  * nih_timer_next_due:
  *
- * Iterates the complete list of timers looking for the one with the
- * lowest due time, so that the timer returned is either due to be triggered
- * now or in some period's time.
+ * Iterates the complete list of timers of the current loop looking for
+ * the one with the lowest due time, so that the timer returned is either
+ * due to be triggered now or in some period's time.
  *
  * Normally used to determine how long we can sleep for by subtracting the
  * current time from the due time of the next timer.
@@ -255,10 +309,8 @@ nih_timer_next_due (void)
 {
 	NihTimer *next;
 
-	nih_timer_init ();
-
 	next = NULL;
-	NIH_LIST_FOREACH (nih_timers, iter) {
+	NIH_LIST_FOREACH (nih_loop_current ()->timers, iter) {
 		NihTimer *timer = (NihTimer *)iter;
 
 		if ((next == NULL) || (timer->due < next->due))
@@ -268,13 +320,49 @@ nih_timer_next_due (void)
 	return next;
 }
 
+/**
+ * nih_timer_next_wakeup:
+ * @due: pointer to store earliest due time in,
+ * @deadline: pointer to store latest time to wake up in.
+ *
+ * Iterates the complete list of timers of the current loop to find when
+ * the loop next needs to wake up; this may be any time between @due, when
+ * the first timer becomes due, and @deadline, the earliest time that any
+ * timer may be delayed until with its slack.  Waking at @deadline calls
+ * all of the timers due by then at once.
+ *
+ * Returns: TRUE if there are timers, FALSE if not.
+ **/
+int
+nih_timer_next_wakeup (time_t *due,
+		       time_t *deadline)
+{
+	int found = FALSE;
+
+	nih_assert (due != NULL);
+	nih_assert (deadline != NULL);
+
+	NIH_LIST_FOREACH (nih_loop_current ()->timers, iter) {
+		NihTimer *timer = (NihTimer *)iter;
+
+		if ((! found) || (timer->due < *due))
+			*due = timer->due;
+		if ((! found) || (timer->due + timer->slack < *deadline))
+			*deadline = timer->due + timer->slack;
+
+		found = TRUE;
+	}
+
+	return found;
+}
+
 
 /**
  * nih_timer_poll:
  *
- * Iterates the complete list of timers and triggers any for which the
- * due time is less than or equal to the current time by calling their
- * callback functions.
+ * Iterates the complete list of timers of the current loop and triggers
+ * any for which the due time is less than or equal to the current time by
+ * calling their callback functions.
  *
  * Arranges for the timer to be rescheuled, unless it is a timeout in which
  * case it is removed from the timer list.
@@ -282,26 +370,32 @@ nih_timer_next_due (void)
 void
 nih_timer_poll (void)
 {
+	NihList *       timers;
 	struct timespec now;
 
-	nih_timer_init ();
+	timers = nih_loop_current ()->timers;
 
 	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
 
-	NIH_LIST_FOREACH_SAFE (nih_timers, iter) {
-		NihTimer *timer = (NihTimer *)iter;
-		int       free_when_done = FALSE;
+	NIH_LIST_FOREACH_SAFE (timers, iter) {
+		NihTimer *      timer = (NihTimer *)iter;
+		NihTimerCb      callback = timer->callback;
+		int             free_when_done = FALSE;
+		struct timespec start;
 
 		if (timer->due > now.tv_sec)
 			continue;
 
+		nih_loop_timer_lateness (&now, timer->due);
+
 		switch (timer->type) {
 		case NIH_TIMER_TIMEOUT:
-			nih_ref (timer, nih_timers);
+			nih_ref (timer, timers);
 			free_when_done = TRUE;
 			break;
 		case NIH_TIMER_PERIODIC:
-			timer->due = now.tv_sec + timer->period;
+			timer->due = nih_timer_aligned (
+				timer, now.tv_sec + timer->period);
 			break;
 		case NIH_TIMER_SCHEDULED:
 			/* FIXME Not implemented */
@@ -309,11 +403,35 @@ nih_timer_poll (void)
 			break;
 		}
 
+		nih_loop_dispatch_begin (&start, NIH_LOOP_TIMER,
+					 (NihLoopCallback)callback, timer, -1);
 		nih_error_push_context ();
 		timer->callback (timer->data, timer);
 		nih_error_pop_context ();
+		nih_loop_dispatch_end (&start, NIH_LOOP_TIMER,
+				       (NihLoopCallback)callback, timer, -1);
 
 		if (free_when_done)
 			nih_free (timer);
 	}
 }
+
+
+/**
+ * nih_timer_aligned:
+ * @timer: timer,
+ * @due: due time.
+ *
+ * Returns: @due rounded up to the alignment grid of @timer.
+ **/
+static time_t
+nih_timer_aligned (NihTimer *timer,
+		   time_t    due)
+{
+	nih_assert (timer != NULL);
+
+	if (timer->align <= 0)
+		return due;
+
+	return ((due + timer->align - 1) / timer->align) * timer->align;
+}
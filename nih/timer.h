@@ -79,6 +79,8 @@ typedef struct nih_timer_schedule {
  * @timeout: seconds after registration timer should be triggered (timeout),
  * @period: seconds between triggerings of timer (periodic),
  * @schedule: detail of when to call the timer (scheduled),
+ * @slack: seconds the timer may be delayed by,
+ * @align: seconds that due times are rounded up to a multiple of,
  * @callback: function called when timer triggered,
  * @data: pointer passed to callback.
  *
@@ -89,6 +91,12 @@ typedef struct nih_timer_schedule {
  * Periodic timers are called every @period seconds after they were registered.
  * Scheduled timers are called based on the information in @schedule.
  *
+ * To reduce the number of wakeups, a timer may be given @slack with
+ * nih_timer_set_slack(); the loop may then delay calling it by up to that
+ * many seconds so that it is called along with other timers.  Periodic
+ * timers may also be aligned to a grid with nih_timer_align(), so that
+ * all those with the same grid, in any process, are due at the same time.
+ *
  * In all cases, a timer may be cancelled by calling nih_list_remove() on
  * it as they are held in a list internally.
  **/
@@ -103,6 +111,9 @@ struct nih_timer {
 		NihTimerSchedule schedule;
 	};
 
+	time_t        slack;
+	time_t        align;
+
 	NihTimerCb    callback;
 	void         *data;
 };
@@ -126,7 +137,11 @@ NihTimer *nih_timer_add_scheduled (const void *parent,
 				   NihTimerCb callback, void *data)
 	__attribute__ ((warn_unused_result, malloc));
 
+void      nih_timer_set_slack     (NihTimer *timer, time_t slack);
+void      nih_timer_align         (NihTimer *timer, time_t grid);
+
 NihTimer *nih_timer_next_due       (void);
+int       nih_timer_next_wakeup    (time_t *due, time_t *deadline);
 void      nih_timer_poll           (void);
 
 NIH_END_EXTERN
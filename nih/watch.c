@@ -27,10 +27,19 @@
 #include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+# include <sys/fanotify.h>
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <dirent.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <nih/macros.h>
@@ -39,10 +48,12 @@
 #include <nih/list.h>
 #include <nih/hash.h>
 #include <nih/io.h>
+#include <nih/timer.h>
 #include <nih/file.h>
 #include <nih/watch.h>
 #include <nih/logging.h>
 #include <nih/error.h>
+#include <nih/errors.h>
 
 
 /**
@@ -54,23 +65,258 @@
 #define INOTIFY_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE \
 			| IN_MOVE | IN_MOVE_SELF)
 
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+/**
+ * FANOTIFY_EVENTS:
+ *
+ * The fanotify events equivalent to INOTIFY_EVENTS, which we mark the
+ * whole filesystem for.
+ **/
+#define FANOTIFY_EVENTS (FAN_CREATE | FAN_DELETE | FAN_CLOSE_WRITE \
+			 | FAN_MOVE | FAN_DELETE_SELF | FAN_MOVE_SELF \
+			 | FAN_ONDIR)
+
+/**
+ * WATCH_DIRS_MAX:
+ *
+ * Number of directories that fanotify events have been received from
+ * that are remembered; once reached, the least recently used is
+ * forgotten for each new one.
+ **/
+#define WATCH_DIRS_MAX 4096
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+
+/**
+ * WATCH_BUFSIZ:
+ *
+ * Size of the buffer events are read into; large enough that a burst of
+ * events is read in a few system calls.
+ **/
+#define WATCH_BUFSIZ 65536
+
+/**
+ * SNAPSHOT_MAGIC, SNAPSHOT_VERSION:
+ *
+ * Identify a file written by nih_watch_save(); the version is changed
+ * whenever the format is.
+ **/
+#define SNAPSHOT_MAGIC   0x5748494eU
+#define SNAPSHOT_VERSION 1
+
+/**
+ * SNAPSHOT_DIR, SNAPSHOT_HASHED:
+ *
+ * Flags of a record in a snapshot, set when the object is a directory
+ * and when the hash of its contents is known.
+ **/
+#define SNAPSHOT_DIR     0x01
+#define SNAPSHOT_HASHED  0x02
+
+
+/**
+ * NihWatchRescan:
+ * @watch: watch being rescanned,
+ * @handle: handle for tree being walked,
+ * @changes: list of changes found, when not coalescing.
+ *
+ * Passed as the data pointer to the walk of each tree when rescanning.
+ **/
+typedef struct nih_watch_rescan {
+	NihWatch       *watch;
+	NihWatchHandle *handle;
+	NihList        *changes;
+} NihWatchRescan;
+
+
+/**
+ * NihWatchSnapshot:
+ * @magic: SNAPSHOT_MAGIC,
+ * @version: SNAPSHOT_VERSION,
+ * @nrecords: number of records following,
+ * @strings_len: length of the paths following the records.
+ *
+ * Header of a file written by nih_watch_save(), which is followed by
+ * @nrecords records and then the nul-terminated paths they refer to.
+ * Everything is in the byte order of the machine that wrote it, since the
+ * file is only meant to be read again by the same process; one written
+ * elsewhere has the wrong magic number and is rejected.
+ **/
+typedef struct nih_watch_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrecords;
+	uint32_t strings_len;
+} NihWatchSnapshot;
+
+/**
+ * NihWatchSnapshotRecord:
+ * @ino: inode number of object,
+ * @mtime_sec: seconds part of modification time,
+ * @mtime_nsec: nanoseconds part of modification time,
+ * @flags: SNAPSHOT_DIR and SNAPSHOT_HASHED,
+ * @size: size of object,
+ * @hash: hash of contents of object,
+ * @path_offset: offset of path within the paths,
+ * @path_len: length of path.
+ *
+ * A record of an object in a file written by nih_watch_save(), as it was
+ * recorded in an NihWatchEntry.
+ **/
+typedef struct nih_watch_snapshot_record {
+	uint64_t ino;
+	int64_t  mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t flags;
+	uint64_t size;
+	uint64_t hash;
+	uint32_t path_offset;
+	uint32_t path_len;
+} NihWatchSnapshotRecord;
+
 
 /* Prototypes for static functions */
-static NihWatchHandle *nih_watch_handle_by_wd   (NihWatch *watch, int wd);
-static NihWatchHandle *nih_watch_handle_by_path (NihWatch *watch,
-						 const char *path);
-static int             nih_watch_add_visitor    (NihWatch *watch,
-						 const char *dirname,
-					         const char *path,
-						 struct stat *statbuf)
+static const int *     nih_watch_handle_wd_key   (NihList *entry);
+static uint32_t        nih_watch_handle_wd_hash  (const int *wd);
+static int             nih_watch_handle_wd_cmp   (const int *wd1,
+						  const int *wd2);
+static const char *    nih_watch_handle_path_key (NihList *entry);
+static NihWatchHandle *nih_watch_handle_listed   (NihWatchHandle *handle);
+static NihWatchHandle *nih_watch_handle_by_wd    (NihWatch *watch, int wd);
+static NihWatchHandle *nih_watch_handle_by_path  (NihWatch *watch,
+						  const char *path);
+static void            nih_watch_handle_untrack  (NihWatchHandle *handle);
+static int             nih_watch_handle_destroy  (NihWatchHandle *handle);
+static NihHash *       nih_watch_index_grow      (NihWatch *watch,
+						  NihHash *index,
+						  size_t count);
+static int             nih_watch_add_visitor     (NihWatch *watch,
+						  int dirfd, const char *name,
+						  const char *path, int is_dir,
+						  struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static void            nih_watch_reader          (NihWatch *watch,
+						  NihIoWatch *io_watch,
+						  NihIoEvents events);
+static void            nih_watch_handle          (NihWatch *watch,
+						  NihWatchHandle *handle,
+						  uint32_t events,
+						  uint32_t cookie,
+						  const char *name,
+						  int *caught_free);
+static void            nih_watch_handle_path     (NihWatch *watch,
+						  char *path,
+						  uint32_t events,
+						  int *caught_free);
+static void            nih_watch_record_tree     (NihWatch *watch,
+						  const char *path,
+						  int subdirs);
+static int             nih_watch_record_visitor  (NihWatch *watch,
+						  int dirfd, const char *name,
+						  const char *path, int is_dir,
+						  struct stat *statbuf);
+static int             nih_watch_record_error    (NihWatch *watch,
+						  int dirfd, const char *name,
+						  const char *path,
+						  struct stat *statbuf);
+static int             nih_watch_walk            (NihWatch *watch,
+						  const char *path)
+	__attribute__ ((warn_unused_result));
+static void            nih_watch_subdir          (NihWatch *watch,
+						  const char *path);
+static void            nih_watch_change_add      (NihWatch *watch,
+						  const char *path,
+						  uint32_t events,
+						  int delayed);
+static NihWatchChange *nih_watch_change_new      (NihWatch *watch,
+						  const char *path,
+						  int existed);
+static int             nih_watch_change_destroy  (NihWatchChange *change);
+static void            nih_watch_flush           (NihWatch *watch,
+						  NihTimer *timer);
+static void            nih_watch_deliver         (NihWatch *watch,
+						  NihList *changes,
+						  int *caught_free);
+static void            nih_watch_entry_set       (NihWatch *watch,
+						  const char *path,
+						  const struct stat *statbuf);
+static void            nih_watch_entry_remove    (NihWatch *watch,
+						  const char *path,
+						  int tree);
+static void            nih_watch_entry_remove_children (NihWatch *watch,
+							NihWatchEntry *entry);
+static int             nih_watch_entry_destroy   (NihWatchEntry *entry);
+static void            nih_watch_overflow        (NihWatch *watch,
+						  int *caught_free);
+static void            nih_watch_do_rescan       (NihWatch *watch,
+						  int *caught_free);
+static int             nih_watch_rescan_filter   (NihWatchRescan *rescan,
+						  const char *path,
+						  int is_dir);
+static int             nih_watch_rescan_visitor  (NihWatchRescan *rescan,
+						  int dirfd, const char *name,
+						  const char *path, int is_dir,
+						  struct stat *statbuf);
+static void            nih_watch_rescan_change   (NihWatchRescan *rescan,
+						  const char *path,
+						  int existed);
+static int             nih_watch_handle_is_root  (NihWatch *watch,
+						  NihWatchHandle *handle);
+static int             nih_watch_entry_hash      (NihWatchEntry *entry)
+	__attribute__ ((warn_unused_result));
+static int             nih_watch_path_is_watched (NihWatch *watch,
+						  const char *path);
+static int             nih_watch_snapshot_check  (const void *data,
+						  size_t length);
+static int             nih_watch_do_restore      (NihWatch *watch,
+						  const char *filename,
+						  int *caught_free)
+	__attribute__ ((warn_unused_result));
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+static void            nih_watch_fanotify_init   (NihWatch *watch,
+						  const char *path);
+static int             nih_watch_fanotify_root   (NihWatch *watch,
+						  NihWatchHandle *handle)
 	__attribute__ ((warn_unused_result));
-static void            nih_watch_reader      (NihWatch *watch, NihIo *io,
-					      const char *buf, size_t len);
-static void            nih_watch_handle      (NihWatch *watch,
-					      NihWatchHandle *handle,
-					      uint32_t events, uint32_t cookie,
-					      const char *name,
-					      int *caught_free);
+static void            nih_watch_fanotify_reader (NihWatch *watch,
+						  NihIoWatch *io_watch,
+						  NihIoEvents events);
+static void            nih_watch_fanotify_event  (NihWatch *watch,
+						  uint64_t mask,
+						  struct file_handle *fh,
+						  const char *name,
+						  int *caught_free);
+static int             nih_watch_fanotify_watched (NihWatch *watch,
+						   const char *dir_path);
+static const struct file_handle *nih_watch_dir_key (NihList *entry);
+static uint32_t nih_watch_dir_hash (const struct file_handle *fh);
+static int             nih_watch_dir_cmp         (const struct file_handle *fh1,
+						  const struct file_handle *fh2);
+static NihWatchDir *   nih_watch_dir_new         (NihWatch *watch,
+						  const struct file_handle *fh,
+						  const char *path,
+						  int watched);
+static int             nih_watch_dir_destroy     (NihWatchDir *dir);
+static void            nih_watch_dirs_forget     (NihWatch *watch,
+						  const char *path,
+						  int ancestors);
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+
+
+/**
+ * nih_watch_use_fanotify:
+ *
+ * Whether nih_watch_new() may watch directory trees with fanotify; this
+ * is FALSE by default, so inotify is always used unless it is set to TRUE.
+ *
+ * fanotify delivers events for the whole filesystem, not only the tree
+ * watched, and the directory of each has to be opened from its file
+ * handle to find whether it is within the tree.  The answer is remembered
+ * for each directory, so that later events from one outside the tree
+ * cost only a hash table lookup; but a process watching a small tree on a
+ * busy filesystem still reads every event on it, so should only set this
+ * when watching large trees.
+ **/
+int nih_watch_use_fanotify = FALSE;
 
 
 /**
@@ -104,14 +350,30 @@ static void            nih_watch_handle      (NihWatch *watch,
  * files that exist under @path when the watch is first added.  This only
  * occurs if the watch can be added.
  *
+ * Watching a large directory tree with inotify needs a watch for every
+ * directory in it, which takes time to set up, kernel memory to hold and
+ * leaves a window in which files created in a new directory are missed.
+ * So where nih_watch_use_fanotify has been set to TRUE, @subdirs is TRUE,
+ * @path is a directory and the process may watch the whole filesystem it
+ * is on with fanotify (which needs CAP_SYS_ADMIN), that is done instead;
+ * events are then matched against @path by resolving the file handle of
+ * the directory each occurred in.  Otherwise inotify is used.
+ * Directories within @path that are on other filesystems are not watched
+ * when fanotify is used.
+ *
  * This is a very high level wrapper around the inotify API; lower levels
  * can be obtained using the inotify API itself and some of the helper
  * functions used by this one.
  *
+ * Objects within @path are only stat()ed when @create is TRUE, and are
+ * not recorded unless nih_watch_record() is called; that is needed for
+ * events lost when the event queue overflows to be recovered, and is done
+ * by nih_watch_save() and nih_watch_restore() if it hasn't been.
+ *
  * The returned watch structure is allocated with nih_alloc(), and contains
- * open inotify descriptors and child structures including NihIo, which are
- * children of the returned structure; there is no non-allocated version
- * because of this.
+ * open inotify or fanotify descriptors and child structures including
+ * NihIoWatch, which are children of the returned structure; there is no
+ * non-allocated version because of this.
  *
  * If @parent is not NULL, it should be a pointer to another object which
  * will be used as a parent for the returned watch.  When all parents
@@ -140,6 +402,16 @@ nih_watch_new (const void       *parent,
 	watch->path = NIH_MUST (nih_strdup (watch, path));
 	watch->created = NIH_MUST (nih_hash_string_new (watch, 0));
 
+	watch->wd_index = NIH_MUST (nih_hash_new (
+		watch, 0, (NihKeyFunction)nih_watch_handle_wd_key,
+		(NihHashFunction)nih_watch_handle_wd_hash,
+		(NihCmpFunction)nih_watch_handle_wd_cmp));
+	watch->path_index = NIH_MUST (nih_hash_new (
+		watch, 0, (NihKeyFunction)nih_watch_handle_path_key,
+		(NihHashFunction)nih_hash_string_hash,
+		(NihCmpFunction)nih_hash_string_cmp));
+	watch->nhandles = 0;
+
 	watch->subdirs = subdirs;
 	watch->create = create;
 	watch->filter = filter;
@@ -149,48 +421,189 @@ nih_watch_new (const void       *parent,
 	watch->delete_handler = delete_handler;
 	watch->data = data;
 
+	watch->quiet = 0;
+	watch->batch_handler = NULL;
+	watch->changes = NULL;
+	nih_list_init (&watch->change_order);
+	watch->changes_since = 0;
+	watch->timer = NULL;
+
+	watch->entries = NULL;
+	watch->nentries = 0;
+	watch->generation = 0;
+	watch->overflows = 0;
+
 	watch->free = NULL;
 
+	watch->fanotify = FALSE;
+	watch->io_watch = NULL;
+	watch->mount_fd = -1;
+	watch->dirs = NULL;
+	watch->ndirs = 0;
+	nih_list_init (&watch->dir_order);
 
-	/* Open an inotify instance file descriptor */
-	watch->fd = inotify_init ();
-	if (watch->fd < 0) {
-		nih_error_raise_system ();
-		nih_free (watch);
-		return NULL;
+
+	/* Watch the whole filesystem with fanotify where we can, otherwise
+	 * open an inotify instance file descriptor.
+	 */
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+	if (subdirs && nih_watch_use_fanotify)
+		nih_watch_fanotify_init (watch, path);
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+
+	if (! watch->fanotify) {
+		watch->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+		if (watch->fd < 0) {
+			nih_error_raise_system ();
+			nih_free (watch);
+			return NULL;
+		}
 	}
 
 	/* Add the path (and subdirs) to the list of watches */
 	nih_list_init (&watch->watches);
 
-	if (nih_watch_add (watch, path, subdirs) < 0) {
-		close (watch->fd);
-		nih_free (watch);
-		return NULL;
-	}
+	if (nih_watch_add (watch, path, subdirs) < 0)
+		goto error;
 
-	/* Create an NihIo to handle incoming events. */
-	watch->io = NIH_SHOULD (nih_io_reopen (watch, watch->fd, NIH_IO_STREAM,
-					       (NihIoReader)nih_watch_reader,
-					       NULL, NULL, watch));
-	if (! watch->io) {
-		close (watch->fd);
-		nih_free (watch);
-		return NULL;
+	/* Watch the descriptor for incoming events; they're read directly
+	 * into a large buffer rather than through an NihIo, since each is
+	 * handled as soon as it's read.
+	 */
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+	if (watch->fanotify) {
+		watch->io_watch = NIH_MUST (nih_io_add_watch (
+			watch, watch->fd, NIH_IO_READ,
+			(NihIoWatcher)nih_watch_fanotify_reader, watch));
+	} else
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+	{
+		watch->io_watch = NIH_MUST (nih_io_add_watch (
+			watch, watch->fd, NIH_IO_READ,
+			(NihIoWatcher)nih_watch_reader, watch));
 	}
 
 	nih_alloc_set_destructor (watch, nih_watch_destroy);
 
 	return watch;
+
+error:
+	close (watch->fd);
+	if (watch->mount_fd >= 0)
+		close (watch->mount_fd);
+	nih_free (watch);
+	return NULL;
+}
+
+
+/**
+ * nih_watch_handle_wd_key:
+ * @entry: wd_entry of handle.
+ *
+ * Key function for the wd_index hash table of a watch.
+ *
+ * Returns: pointer to watch descriptor of handle.
+ **/
+static const int *
+nih_watch_handle_wd_key (NihList *entry)
+{
+	NihWatchHandle *handle;
+
+	nih_assert (entry != NULL);
+
+	handle = NIH_LIST_ITER (entry, NihWatchHandle, wd_entry);
+
+	return &handle->wd;
+}
+
+/**
+ * nih_watch_handle_wd_hash:
+ * @wd: pointer to watch descriptor.
+ *
+ * Hash function for the wd_index hash table of a watch; the kernel hands
+ * out watch descriptors in sequence, so they are spread evenly across the
+ * bins as they are.
+ *
+ * Returns: hash of @wd.
+ **/
+static uint32_t
+nih_watch_handle_wd_hash (const int *wd)
+{
+	nih_assert (wd != NULL);
+
+	return (uint32_t)*wd;
+}
+
+/**
+ * nih_watch_handle_wd_cmp:
+ * @wd1: pointer to watch descriptor,
+ * @wd2: pointer to watch descriptor to compare against.
+ *
+ * Comparison function for the wd_index hash table of a watch.
+ *
+ * Returns: integer less than, equal to or greater than zero if @wd1 is
+ * respectively less then, equal to or greater than @wd2.
+ **/
+static int
+nih_watch_handle_wd_cmp (const int *wd1,
+			 const int *wd2)
+{
+	nih_assert (wd1 != NULL);
+	nih_assert (wd2 != NULL);
+
+	return (*wd1 > *wd2) - (*wd1 < *wd2);
+}
+
+/**
+ * nih_watch_handle_path_key:
+ * @entry: path_entry of handle.
+ *
+ * Key function for the path_index hash table of a watch.
+ *
+ * Returns: path of handle.
+ **/
+static const char *
+nih_watch_handle_path_key (NihList *entry)
+{
+	NihWatchHandle *handle;
+
+	nih_assert (entry != NULL);
+
+	handle = NIH_LIST_ITER (entry, NihWatchHandle, path_entry);
+
+	return handle->path;
 }
 
+/**
+ * nih_watch_handle_listed:
+ * @handle: handle found in an index.
+ *
+ * Handles may be removed from the watches list of their watch with
+ * nih_list_remove() rather than being freed, after which they are no
+ * longer watched; such a handle found in the indexes is removed from
+ * them at this point.
+ *
+ * Returns: @handle, or NULL if it is no longer in the list.
+ **/
+static NihWatchHandle *
+nih_watch_handle_listed (NihWatchHandle *handle)
+{
+	nih_assert (handle != NULL);
+
+	if (NIH_LIST_EMPTY (&handle->entry)) {
+		nih_watch_handle_untrack (handle);
+		return NULL;
+	}
+
+	return handle;
+}
 
 /**
  * nih_watch_handle_by_wd:
  * @watch: watch to search,
  * @wd: inotify watch descriptor.
  *
- * Searches @watch for the path that @wd is handling.
+ * Looks up the path that @wd is handling in the index of @watch.
  *
  * Returns: NihWatchHandle for @wd, or NULL if none known.
  **/
@@ -198,17 +611,17 @@ static NihWatchHandle *
 nih_watch_handle_by_wd (NihWatch *watch,
 			int       wd)
 {
+	NihList *entry;
+
 	nih_assert (watch != NULL);
 	nih_assert (wd >= 0);
 
-	NIH_LIST_FOREACH (&watch->watches, iter) {
-		NihWatchHandle *handle = (NihWatchHandle *)iter;
-
-		if (handle->wd == wd)
-			return handle;
-	}
+	entry = nih_hash_lookup (watch->wd_index, &wd);
+	if (! entry)
+		return NULL;
 
-	return NULL;
+	return nih_watch_handle_listed (
+		NIH_LIST_ITER (entry, NihWatchHandle, wd_entry));
 }
 
 /**
@@ -216,7 +629,8 @@ nih_watch_handle_by_wd (NihWatch *watch,
  * @watch: watch to search,
  * @path: path being watched.
  *
- * Searches @watch for the watch descriptor that is handling @path.
+ * Looks up the watch descriptor that is handling @path in the index of
+ * @watch.
  *
  * Returns: NihWatchHandle for @path, or NULL if none known.
  **/
@@ -224,17 +638,91 @@ static NihWatchHandle *
 nih_watch_handle_by_path (NihWatch   *watch,
 			  const char *path)
 {
+	NihList *entry;
+
 	nih_assert (watch != NULL);
 	nih_assert (path != NULL);
 
-	NIH_LIST_FOREACH (&watch->watches, iter) {
-		NihWatchHandle *handle = (NihWatchHandle *)iter;
+	entry = nih_hash_lookup (watch->path_index, path);
+	if (! entry)
+		return NULL;
+
+	return nih_watch_handle_listed (
+		NIH_LIST_ITER (entry, NihWatchHandle, path_entry));
+}
+
+/**
+ * nih_watch_handle_untrack:
+ * @handle: handle to remove.
+ *
+ * Removes @handle from the indexes of its watch.
+ **/
+static void
+nih_watch_handle_untrack (NihWatchHandle *handle)
+{
+	nih_assert (handle != NULL);
+
+	nih_list_remove (&handle->wd_entry);
+	nih_list_remove (&handle->path_entry);
 
-		if (! strcmp (handle->path, path))
-			return handle;
+	if (handle->watch) {
+		handle->watch->nhandles--;
+		handle->watch = NULL;
 	}
+}
 
-	return NULL;
+/**
+ * nih_watch_handle_destroy:
+ * @handle: handle to be destroyed.
+ *
+ * Removes @handle from the list and indexes of its watch.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_watch_handle_destroy (NihWatchHandle *handle)
+{
+	nih_assert (handle != NULL);
+
+	nih_list_destroy (&handle->entry);
+	nih_watch_handle_untrack (handle);
+
+	return 0;
+}
+
+/**
+ * nih_watch_index_grow:
+ * @watch: watch index belongs to,
+ * @index: index to grow.
+ *
+ * Moves the entries in @index into a new hash table with twice as many
+ * bins as @count, and frees @index.
+ *
+ * Returns: new index.
+ **/
+static NihHash *
+nih_watch_index_grow (NihWatch *watch,
+		      NihHash  *index,
+		      size_t    count)
+{
+	NihHash *new_index;
+
+	nih_assert (watch != NULL);
+	nih_assert (index != NULL);
+
+	new_index = NIH_MUST (nih_hash_new (watch, count * 2,
+					    index->key_function,
+					    index->hash_function,
+					    index->cmp_function));
+
+	NIH_HASH_FOREACH_SAFE (index, iter)
+		nih_hash_add (new_index, iter);
+
+	nih_free (index);
+
+	return new_index;
 }
 
 
@@ -249,7 +737,12 @@ nih_watch_handle_by_path (NihWatch   *watch,
  * originally given to @watch.
  *
  * If @subdirs is TRUE, and @path is a directory, then sub-directories of
- * the path are also watched.
+ * the path are also watched; either way, when @watch is recording, the
+ * objects watched within it are recorded for nih_watch_rescan() and
+ * nih_watch_restore().
+ *
+ * When @watch uses fanotify, @path must be on the same filesystem as the
+ * path originally given to @watch.
  *
  * An NihWatchHandle structure is allocated and stored in the watches
  * member of @watch, it is also a child of that structure; there is no
@@ -273,178 +766,457 @@ nih_watch_add (NihWatch   *watch,
 
 	nih_list_init (&handle->entry);
 
-	nih_alloc_set_destructor (handle, nih_list_destroy);
+	handle->watch = NULL;
+	nih_list_init (&handle->wd_entry);
+	nih_list_init (&handle->path_entry);
 
-	/* Get a watch descriptor for the path */
-	handle->wd = inotify_add_watch (watch->fd, path, INOTIFY_EVENTS);
-	if (handle->wd < 0) {
-		nih_error_raise_system ();
-		nih_free (handle);
-		return -1;
-	}
+	handle->subdirs = subdirs;
+	handle->real_path = NULL;
+	handle->fid = NULL;
 
-	/* Check for duplicates in the list */
-	if (nih_watch_handle_by_wd (watch, handle->wd)) {
-		nih_free (handle);
-		return 0;
+	nih_alloc_set_destructor (handle, nih_watch_handle_destroy);
+
+	if (watch->fanotify) {
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+		/* The filesystem is already watched; just record the path
+		 * so that events may be matched against it.
+		 */
+		handle->wd = -1;
+		if (nih_watch_fanotify_root (watch, handle) < 0) {
+			nih_free (handle);
+			return -1;
+		}
+
+		if (nih_watch_handle_by_path (watch, path)) {
+			nih_free (handle);
+			return 0;
+		}
+
+		/* Directories found to be outside the paths watched may
+		 * be within this one, or contain it.
+		 */
+		nih_watch_dirs_forget (watch, handle->real_path, TRUE);
+#else /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+		nih_assert_not_reached ();
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
+	} else {
+		/* Get a watch descriptor for the path */
+		handle->wd = inotify_add_watch (watch->fd, path,
+						INOTIFY_EVENTS);
+		if (handle->wd < 0) {
+			nih_error_raise_system ();
+			nih_free (handle);
+			return -1;
+		}
+
+		/* Check for duplicates in the list */
+		if (nih_watch_handle_by_wd (watch, handle->wd)) {
+			nih_free (handle);
+			return 0;
+		}
+
+		nih_hash_add (watch->wd_index, &handle->wd_entry);
 	}
 
 	nih_list_add (&watch->watches, &handle->entry);
+	nih_hash_add (watch->path_index, &handle->path_entry);
 
-	/* Recurse into sub-directories, attempting to add a watch for each
-	 * one; errors within the walk are warned automatically, so if this
-	 * fails, it means we literally couldn't watch the top-level.
+	handle->watch = watch;
+	watch->nhandles++;
+
+	/* Keep the chains of the indexes short as the tree grows */
+	if (watch->nhandles > watch->wd_index->size * 2) {
+		watch->wd_index = nih_watch_index_grow (
+			watch, watch->wd_index, watch->nhandles);
+		watch->path_index = nih_watch_index_grow (
+			watch, watch->path_index, watch->nhandles);
+	}
+
+	/* The top of a tree is recorded before the objects within it, so
+	 * that they can be linked to it.
 	 */
-	if (subdirs && (nih_dir_walk (path, watch->filter,
-				      (NihFileVisitor)nih_watch_add_visitor,
-				      NULL, watch) < 0)) {
-		NihError *err;
+	if (watch->entries && subdirs) {
+		struct stat statbuf;
 
-		err = nih_error_get ();
-		if (err->number != ENOTDIR) {
-			nih_free (handle);
-			return -1;
-		} else
-			nih_free (err);
+		if (stat (path, &statbuf) == 0)
+			nih_watch_entry_set (watch, path, &statbuf);
+	}
+
+	/* Recurse into sub-directories, attempting to add a watch for each
+	 * one; with fanotify they're already watched, but existing objects
+	 * may still need to be recorded or created.
+	 */
+	if (subdirs && (nih_watch_walk (watch, path) < 0)) {
+		nih_free (handle);
+		return -1;
 	}
 
+	/* A directory watched without sub-directories still has its direct
+	 * contents recorded, so that a rescan or restore has something to
+	 * compare them against; unless it's within a tree being walked,
+	 * which records them itself.
+	 */
+	if (watch->entries && (! subdirs)
+	    && nih_watch_handle_is_root (watch, handle))
+		nih_watch_record_tree (watch, path, FALSE);
+
 	return 0;
 }
 
 /**
- * nih_watch_add_visitor:
- * @watch: watch to add to,
- * @dirname: top-level being watched,
- * @path: path to add,
- * @statbuf: stat of @path.
- *
- * Callback function for nih_dir_walk(), used by nih_watch_add() to add
- * sub-directories.  Just calls nih_watch_add() with subdirs as FALSE for
- * each directory found.
- *
- * If the create member of @watch is TRUE, it also calls the create handle
- * for each path found.
+ * nih_watch_record_tree:
+ * @watch: watch to record in,
+ * @path: path to record,
+ * @subdirs: also record within sub-directories?
  *
- * Returns: zero on success, negative value on raised error.
+ * Records @path in the entries of @watch and, if it is a directory, each
+ * object within it other than those excluded by its filter; objects
+ * within sub-directories are only recorded if @subdirs is TRUE.
  **/
-static int
-nih_watch_add_visitor (NihWatch    *watch,
-		       const char  *dirname,
-		       const char  *path,
-		       struct stat *statbuf)
+static void
+nih_watch_record_tree (NihWatch   *watch,
+		       const char *path,
+		       int         subdirs)
 {
+	struct stat statbuf;
+
 	nih_assert (watch != NULL);
-	nih_assert (dirname != NULL);
 	nih_assert (path != NULL);
-	nih_assert (statbuf != NULL);
 
-	if (watch->create && watch->create_handler)
-		watch->create_handler (watch->data, watch, path, statbuf);
+	if (stat (path, &statbuf) < 0)
+		return;
 
-	if (S_ISDIR (statbuf->st_mode)) {
-		int ret;
+	nih_watch_entry_set (watch, path, &statbuf);
 
-		ret = nih_watch_add (watch, path, FALSE);
-		if (ret < 0)
-			return ret;
-	}
+	if (! S_ISDIR (statbuf.st_mode))
+		return;
 
-	return 0;
-}
+	if (nih_dir_walk_at (AT_FDCWD, path,
+			     (NIH_DIR_WALK_STAT
+			      | (subdirs ? 0 : NIH_DIR_WALK_NOSUBDIRS)),
+			     watch->filter,
+			     (NihDirVisitor)nih_watch_record_visitor,
+			     (NihDirErrorHandler)nih_watch_record_error,
+			     watch) < 0) {
+		NihError *err;
 
+		err = nih_error_get ();
+		nih_free (err);
+	}
+}
 
 /**
- * nih_watch_destroy:
- * @watch: NihWatch to be destroyed.
- *
- * Closes the inotify descriptor and frees the NihIo instance handling it.
+ * nih_watch_record_visitor:
+ * @watch: watch to record in,
+ * @dirfd: descriptor of directory containing @path,
+ * @name: name of @path within @dirfd,
+ * @path: path to record,
+ * @is_dir: TRUE if @path is a directory,
+ * @statbuf: stat of @path.
  *
- * Normally used or called from an nih_alloc() destructor.
+ * Callback function for nih_dir_walk_at(), used by nih_watch_record_tree()
+ * to record each object found in the entries of @watch.
  *
  * Returns: zero.
  **/
-int
-nih_watch_destroy (NihWatch *watch)
+static int
+nih_watch_record_visitor (NihWatch    *watch,
+			  int          dirfd,
+			  const char  *name,
+			  const char  *path,
+			  int          is_dir,
+			  struct stat *statbuf)
 {
 	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
 
-	if (watch->free)
-		*watch->free = TRUE;
+	nih_watch_entry_set (watch, path, statbuf);
 
 	return 0;
 }
 
-
 /**
- * nih_watch_reader:
- * @watch: NihWatch for descriptor,
- * @io: NihIo with data to be read,
- * @buf: buffer data is available in,
- * @len: bytes in @buf.
+ * nih_watch_record_error:
+ * @watch: watch to record in,
+ * @dirfd: descriptor of directory containing @path,
+ * @name: name of @path within @dirfd,
+ * @path: path that could not be recorded,
+ * @statbuf: stat of @path, or NULL.
+ *
+ * Callback function for nih_dir_walk_at(), used by nih_watch_record_tree()
+ * to ignore objects that vanish or can't be read while they're being
+ * recorded; they're simply not recorded, and any that matter will be
+ * found by a later rescan.
  *
- * This function is called whenever there is data to be read on the inotify
- * file descriptor associated with @watch.  Each event in the buffer is read,
- * including the following name, and handled by calling one of the functions
- * in @watch.
+ * Returns: zero.
  **/
-static void
-nih_watch_reader (NihWatch   *watch,
-		  NihIo      *io,
-		  const char *buf,
-		  size_t      len)
+static int
+nih_watch_record_error (NihWatch    *watch,
+			int          dirfd,
+			const char  *name,
+			const char  *path,
+			struct stat *statbuf)
 {
-	int caught_free;
+	NihError *err;
 
 	nih_assert (watch != NULL);
-	nih_assert (io != NULL);
-	nih_assert (buf != NULL);
-	nih_assert (len > 0);
+	nih_assert (path != NULL);
 
-	caught_free = FALSE;
-	if (! watch->free)
-		watch->free = &caught_free;
+	err = nih_error_get ();
+	nih_free (err);
 
-	while (len > 0) {
-		NihWatchHandle       *handle;
-		struct inotify_event *event;
-		size_t                sz;
+	return 0;
+}
 
-		/* Wait until there's a complete event waiting
-		 * (should always be true, but better to be safe than sorry)
-		 */
-		sz = sizeof (struct inotify_event);
-		if (len < sz)
-			goto finish;
+/**
+ * nih_watch_walk:
+ * @watch: watch to add to,
+ * @path: path of directory.
+ *
+ * Walks the directory tree at @path calling nih_watch_add_visitor() for
+ * each object found; they're only stat()ed when they're to be recorded or
+ * passed to the create handler, and when @watch uses fanotify the tree
+ * isn't walked at all unless one of those is needed.
+ *
+ * Errors within the walk are warned automatically, so if this fails, it
+ * means we literally couldn't walk the top-level; that @path is not a
+ * directory is not an error.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_watch_walk (NihWatch   *watch,
+		const char *path)
+{
+	NihDirWalkFlags flags = 0;
 
-		/* Never read an event without its name (again should always
-		 * be true
-		 */
-		event = (struct inotify_event *) buf;
-		sz += event->len;
-		if (len < sz)
-			goto finish;
-
-		/* Find the handle for this watch */
-		handle = nih_watch_handle_by_wd (watch, event->wd);
-		if (handle)
-			nih_watch_handle (watch, handle, event->mask,
-					  event->cookie, event->name,
-					  &caught_free);
-
-		/* Check whether the user freed the watch from inside the
-		 * handler.  Just drop out now; everything we had has gone.
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (watch->entries
+	    || (watch->create && watch->create_handler && (! watch->changes)))
+		flags |= NIH_DIR_WALK_STAT;
+
+	if (watch->fanotify && (! watch->entries) && (! watch->create))
+		return 0;
+
+	if (nih_dir_walk_at (AT_FDCWD, path, flags, watch->filter,
+			     (NihDirVisitor)nih_watch_add_visitor,
+			     NULL, watch) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		if (err->number != ENOTDIR)
+			return -1;
+
+		nih_free (err);
+	}
+
+	return 0;
+}
+
+/**
+ * nih_watch_add_visitor:
+ * @watch: watch to add to,
+ * @dirfd: descriptor of directory containing @path,
+ * @name: name of @path within @dirfd,
+ * @path: path to add,
+ * @is_dir: TRUE if @path is a directory,
+ * @statbuf: stat of @path, or NULL.
+ *
+ * Callback function for nih_dir_walk_at(), used by nih_watch_add() to add
+ * sub-directories.  Just calls nih_watch_add() with subdirs as FALSE for
+ * each directory found, unless @watch uses fanotify.
+ *
+ * Each path found is recorded in the entries of @watch when it is
+ * recording, and if the create member of @watch is TRUE, it also calls
+ * the create handler for each; @statbuf is given in either case.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_watch_add_visitor (NihWatch    *watch,
+		       int          dirfd,
+		       const char  *name,
+		       const char  *path,
+		       int          is_dir,
+		       struct stat *statbuf)
+{
+	nih_assert (watch != NULL);
+	nih_assert (name != NULL);
+	nih_assert (path != NULL);
+
+	nih_watch_entry_set (watch, path, statbuf);
+
+	if (watch->create && watch->changes) {
+		nih_watch_change_add (watch, path, IN_CREATE, FALSE);
+	} else if (watch->create && watch->create_handler) {
+		watch->create_handler (watch->data, watch, path, statbuf);
+	}
+
+	if (is_dir && (! watch->fanotify)) {
+		int ret;
+
+		ret = nih_watch_add (watch, path, FALSE);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+/**
+ * nih_watch_coalesce:
+ * @watch: NihWatch to coalesce events for,
+ * @quiet: seconds without events before changes are delivered,
+ * @batch_handler: function called with all changes delivered, or NULL.
+ *
+ * Bursts of events, such as those from an editor saving a file or a
+ * package manager unpacking many, would otherwise each call a handler of
+ * @watch.  This function instead has them recorded for each path, and
+ * delivered once there have been no more for @quiet seconds, so that a
+ * single handler is called for each path changed according to whether
+ * it existed before the changes and exists afterwards; one created and
+ * removed again in that time is not delivered at all.  Once handlers have
+ * been called for each, @batch_handler is called with all of their paths.
+ *
+ * The handlers are called from a timer, which will be added to the
+ * current loop.
+ *
+ * This may be called again to change @quiet or @batch_handler, which
+ * applies to changes from then on; coalescing can't be turned off again.
+ **/
+void
+nih_watch_coalesce (NihWatch             *watch,
+		    time_t                quiet,
+		    NihWatchBatchHandler  batch_handler)
+{
+	nih_assert (watch != NULL);
+	nih_assert (quiet >= 0);
+
+	/* Bursts may change many paths, so allow for more than usual */
+	if (! watch->changes)
+		watch->changes = NIH_MUST (nih_hash_string_new (watch, 1024));
+
+	watch->quiet = quiet;
+	watch->batch_handler = batch_handler;
+}
+
+
+/**
+ * nih_watch_destroy:
+ * @watch: NihWatch to be destroyed.
+ *
+ * Closes the inotify or fanotify descriptors.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_watch_destroy (NihWatch *watch)
+{
+	nih_assert (watch != NULL);
+
+	if (watch->free)
+		*watch->free = TRUE;
+
+	close (watch->fd);
+	if (watch->fanotify)
+		close (watch->mount_fd);
+
+	return 0;
+}
+
+
+/**
+ * nih_watch_reader:
+ * @watch: NihWatch for descriptor,
+ * @io_watch: NihIoWatch for inotify descriptor,
+ * @events: events that occurred.
+ *
+ * This function is called whenever there are events to be read on the
+ * inotify file descriptor associated with @watch.  Events are read in
+ * large batches until none remain, each being handled by calling one of
+ * the functions in @watch.
+ *
+ * If the event queue overflowed, the trees being watched are rescanned
+ * once all of the events have been read.
+ **/
+static void
+nih_watch_reader (NihWatch    *watch,
+		  NihIoWatch  *io_watch,
+		  NihIoEvents  events)
+{
+	union {
+		struct inotify_event event;
+		char                 data[WATCH_BUFSIZ];
+	}       buf;
+	int     caught_free;
+	int     overflow = FALSE;
+	ssize_t len;
+
+	nih_assert (watch != NULL);
+	nih_assert (io_watch != NULL);
+
+	caught_free = FALSE;
+	if (! watch->free)
+		watch->free = &caught_free;
+
+	while ((len = read (watch->fd, &buf, sizeof (buf))) > 0) {
+		const char *ptr = buf.data;
+
+		/* The kernel only returns whole events, each followed by
+		 * its name, but better to be safe than sorry.
 		 */
+		while ((size_t)len >= sizeof (struct inotify_event)) {
+			struct inotify_event *event;
+			NihWatchHandle       *handle;
+			size_t                sz;
+
+			event = (struct inotify_event *)ptr;
+			sz = sizeof (struct inotify_event) + event->len;
+			if ((size_t)len < sz)
+				break;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				overflow = TRUE;
+			} else {
+				/* Find the handle for this watch */
+				handle = nih_watch_handle_by_wd (watch,
+								 event->wd);
+				if (handle)
+					nih_watch_handle (watch, handle,
+							  event->mask,
+							  event->cookie,
+							  event->name,
+							  &caught_free);
+
+				/* Check whether the user freed the watch
+				 * from inside the handler.  Just drop out
+				 * now; everything we had has gone.
+				 */
+				if (caught_free)
+					return;
+			}
+
+			ptr += sz;
+			len -= sz;
+		}
+	}
+
+	if ((len < 0) && (errno != EAGAIN) && (errno != EINTR))
+		nih_warn ("%s: %s", _("Unable to read inotify events"),
+			  strerror (errno));
+
+	if (overflow) {
+		nih_watch_overflow (watch, &caught_free);
 		if (caught_free)
 			return;
-
-		/* Remove the event from the front of the buffer, and
-		 * decrease our own length counter.
-		 */
-		nih_io_buffer_shrink (io->recv_buf, sz);
-		len -= sz;
 	}
 
-finish:
 	if (watch->free == &caught_free)
 		watch->free = NULL;
 }
@@ -470,9 +1242,6 @@ nih_watch_handle (NihWatch       *watch,
 		  const char     *name,
 		  int            *caught_free)
 {
-	NihListEntry   *entry;
-	int             delayed = FALSE;
-	struct stat     statbuf;
 	nih_local char *path = NULL;
 
 	nih_assert (watch != NULL);
@@ -483,9 +1252,16 @@ nih_watch_handle (NihWatch       *watch,
 	 * either case, we drop the watch because we've lost the path.
 	 */
 	if ((events & IN_IGNORED) || (events & IN_MOVE_SELF)) {
-		if (watch->delete_handler)
-			watch->delete_handler (watch->data, watch,
-					       handle->path);
+		if (watch->changes) {
+			nih_watch_change_add (watch, handle->path,
+					      IN_DELETE, FALSE);
+		} else {
+			nih_watch_entry_remove (watch, handle->path,
+						events & IN_MOVE_SELF);
+			if (watch->delete_handler)
+				watch->delete_handler (watch->data, watch,
+						       handle->path);
+		}
 		if (*caught_free)
 			return;
 
@@ -510,6 +1286,33 @@ nih_watch_handle (NihWatch       *watch,
 		path = NIH_MUST (nih_strdup (NULL, handle->path));
 	}
 
+	nih_watch_handle_path (watch, path, events, caught_free);
+}
+
+/**
+ * nih_watch_handle_path:
+ * @watch: NihWatch for descriptor,
+ * @path: path event occurred for,
+ * @events: event mask,
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * This function handles an event for @path, which is neither the path of
+ * a handle being deleted nor moved, calling the appropriate function in
+ * @watch.  The caller should check @caught_free afterwards.
+ **/
+static void
+nih_watch_handle_path (NihWatch *watch,
+		       char     *path,
+		       uint32_t  events,
+		       int      *caught_free)
+{
+	NihListEntry *entry;
+	int           delayed = FALSE;
+	struct stat   statbuf;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
 	/* Check the filter */
 	if (watch->filter && watch->filter (watch->data, path,
 					    events & IN_ISDIR))
@@ -525,6 +1328,31 @@ nih_watch_handle (NihWatch       *watch,
 		nih_free (entry);
 	}
 
+	/* When coalescing, just record the change to be delivered later;
+	 * new sub-directories must still be watched, and watches on removed
+	 * paths dropped, straight away.
+	 */
+	if (watch->changes) {
+		nih_watch_change_add (watch, path, events, delayed);
+
+		if (((events & IN_CREATE) || (events & IN_MOVED_TO))
+		    && watch->subdirs && (stat (path, &statbuf) == 0)
+		    && S_ISDIR (statbuf.st_mode)) {
+			nih_watch_subdir (watch, path);
+		} else if ((events & IN_DELETE) || (events & IN_MOVED_FROM)) {
+			NihWatchHandle *path_handle;
+
+			path_handle = nih_watch_handle_by_path (watch, path);
+			if (path_handle) {
+				nih_debug ("Ceasing watch on %s",
+					   path_handle->path);
+				nih_free (path_handle);
+			}
+		}
+
+		return;
+	}
+
 	/* Handle it differently depending on the events mask */
 	if ((events & IN_CREATE) || (events & IN_MOVED_TO)) {
 		if (stat (path, &statbuf) < 0)
@@ -540,6 +1368,8 @@ nih_watch_handle (NihWatch       *watch,
 			return;
 		}
 
+		nih_watch_entry_set (watch, path, &statbuf);
+
 		if (watch->create_handler)
 			watch->create_handler (watch->data, watch,
 					       path, &statbuf);
@@ -547,25 +1377,17 @@ nih_watch_handle (NihWatch       *watch,
 			return;
 
 		/* See if it's a sub-directory, and we're handling those
-		 * ourselves.  Add a watch to the directory and any
-		 * sub-directories within it.
+		 * ourselves.
 		 */
-		if (watch->subdirs && S_ISDIR (statbuf.st_mode)) {
-			if (nih_watch_add (watch, path, TRUE) < 0) {
-				NihError *err;
-
-				err = nih_error_get ();
-				nih_warn ("%s: %s: %s", path,
-					  _("Unable to watch directory"),
-					  err->message);
-				nih_free (err);
-			}
-		}
+		if (watch->subdirs && S_ISDIR (statbuf.st_mode))
+			nih_watch_subdir (watch, path);
 
 	} else if (events & IN_CLOSE_WRITE) {
 		if (stat (path, &statbuf) < 0)
 			return;
 
+		nih_watch_entry_set (watch, path, &statbuf);
+
 		/* Use the create handler when a newly created file is
 		 * closed.
 		 */
@@ -581,6 +1403,11 @@ nih_watch_handle (NihWatch       *watch,
 	} else if ((events & IN_DELETE) || (events & IN_MOVED_FROM)) {
 		NihWatchHandle *path_handle;
 
+		/* Only a directory moved away may still have objects
+		 * recorded within it.
+		 */
+		nih_watch_entry_remove (watch, path, events & IN_MOVED_FROM);
+
 		/* Suppress the handler if the file was newly created. */
 		if ((! delayed) && watch->delete_handler)
 			watch->delete_handler (watch->data, watch, path);
@@ -598,3 +1425,1959 @@ nih_watch_handle (NihWatch       *watch,
 		}
 	}
 }
+
+/**
+ * nih_watch_subdir:
+ * @watch: NihWatch for descriptor,
+ * @path: path of new sub-directory.
+ *
+ * Adds a watch to the new sub-directory @path and any sub-directories
+ * within it; with fanotify they're already watched, but existing objects
+ * must still be recorded.  Failure is only warned about.
+ **/
+static void
+nih_watch_subdir (NihWatch   *watch,
+		  const char *path)
+{
+	int ret;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (! watch->fanotify) {
+		ret = nih_watch_add (watch, path, TRUE);
+	} else {
+		ret = nih_watch_walk (watch, path);
+	}
+
+	if (ret < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s: %s", path,
+			  _("Unable to watch directory"), err->message);
+		nih_free (err);
+	}
+}
+
+
+/**
+ * nih_watch_change_add:
+ * @watch: NihWatch coalescing changes,
+ * @path: path changed,
+ * @events: event mask,
+ * @delayed: TRUE if @path was created but not yet handled.
+ *
+ * Records a change to @path to be delivered by nih_watch_flush(), and
+ * puts that back until @watch has been quiet for long enough, though no
+ * more than four times that since the first change so that a constant
+ * stream of events doesn't hold them back forever.
+ **/
+static void
+nih_watch_change_add (NihWatch   *watch,
+		      const char *path,
+		      uint32_t    events,
+		      int         delayed)
+{
+	NihWatchChange  *change;
+	struct timespec  now;
+
+	nih_assert (watch != NULL);
+	nih_assert (watch->changes != NULL);
+	nih_assert (path != NULL);
+
+	change = (NihWatchChange *)nih_hash_lookup (watch->changes, path);
+	if (! change) {
+		change = nih_watch_change_new (
+			watch, path, ! (delayed || (events & IN_CREATE)
+					|| (events & IN_MOVED_TO)));
+
+		nih_hash_add (watch->changes, &change->entry);
+		nih_list_add (&watch->change_order, &change->order);
+	}
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+	if (! watch->timer) {
+		watch->changes_since = now.tv_sec;
+		watch->timer = NIH_MUST (nih_timer_add_timeout (
+				watch, watch->quiet,
+				(NihTimerCb)nih_watch_flush, watch));
+	} else if (now.tv_sec + watch->quiet
+		   <= watch->changes_since + watch->quiet * 4) {
+		watch->timer->due = now.tv_sec + watch->quiet;
+	}
+}
+
+/**
+ * nih_watch_change_new:
+ * @watch: NihWatch change is for,
+ * @path: path changed,
+ * @existed: TRUE if @path existed before the change.
+ *
+ * Allocates a change to @path as a child of @watch, which is not yet in
+ * any hash table or list.
+ *
+ * Returns: new change.
+ **/
+static NihWatchChange *
+nih_watch_change_new (NihWatch   *watch,
+		      const char *path,
+		      int         existed)
+{
+	NihWatchChange *change;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	change = NIH_MUST (nih_new (watch, NihWatchChange));
+
+	nih_list_init (&change->entry);
+	change->path = NIH_MUST (nih_strdup (change, path));
+
+	nih_list_init (&change->order);
+	change->existed = existed;
+
+	nih_alloc_set_destructor (change, nih_watch_change_destroy);
+
+	return change;
+}
+
+/**
+ * nih_watch_change_destroy:
+ * @change: change to be destroyed.
+ *
+ * Removes @change from the hash table and list of changes it is in.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_watch_change_destroy (NihWatchChange *change)
+{
+	nih_assert (change != NULL);
+
+	nih_list_destroy (&change->entry);
+	nih_list_destroy (&change->order);
+
+	return 0;
+}
+
+/**
+ * nih_watch_flush:
+ * @watch: NihWatch coalescing changes,
+ * @timer: timer that triggered.
+ *
+ * Delivers the changes coalesced by @watch.
+ **/
+static void
+nih_watch_flush (NihWatch *watch,
+		 NihTimer *timer)
+{
+	int caught_free;
+
+	nih_assert (watch != NULL);
+	nih_assert (timer != NULL);
+
+	/* The timer is freed once we return */
+	watch->timer = NULL;
+
+	caught_free = FALSE;
+	if (! watch->free)
+		watch->free = &caught_free;
+
+	nih_watch_deliver (watch, &watch->change_order, &caught_free);
+	if (caught_free)
+		return;
+
+	if (watch->free == &caught_free)
+		watch->free = NULL;
+}
+
+/**
+ * nih_watch_deliver:
+ * @watch: NihWatch changes are for,
+ * @changes: list of changes to deliver,
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * Delivers and frees the changes in @changes, calling the create handler
+ * for each path that didn't exist before its changes and does now, the
+ * delete handler for each that did and doesn't, and the modify handler
+ * for each that did and still does.  The batch handler is then called
+ * with the paths that any were called for.  The caller should check
+ * @caught_free afterwards.
+ **/
+static void
+nih_watch_deliver (NihWatch *watch,
+		   NihList  *changes,
+		   int      *caught_free)
+{
+	nih_local char **paths = NULL;
+	size_t           len = 0;
+
+	nih_assert (watch != NULL);
+	nih_assert (changes != NULL);
+	nih_assert (caught_free != NULL);
+
+	paths = NIH_MUST (nih_str_array_new (NULL));
+
+	while (! NIH_LIST_EMPTY (changes)) {
+		NihWatchChange *change;
+		struct stat     statbuf;
+		int             existed, exists;
+		char           *path;
+
+		change = NIH_LIST_ITER (changes->next, NihWatchChange, order);
+
+		existed = change->existed;
+		exists = (stat (change->path, &statbuf) == 0);
+		if (exists || existed)
+			NIH_MUST (nih_str_array_add (&paths, NULL, &len,
+						     change->path));
+
+		nih_free (change);
+
+		/* Nothing to deliver for a path created and removed again */
+		if ((! exists) && (! existed))
+			continue;
+
+		path = paths[len - 1];
+
+		if (exists) {
+			nih_watch_entry_set (watch, path, &statbuf);
+		} else {
+			NihWatchHandle *path_handle;
+
+			nih_watch_entry_remove (watch, path, TRUE);
+
+			path_handle = nih_watch_handle_by_path (watch, path);
+			if (path_handle) {
+				nih_debug ("Ceasing watch on %s",
+					   path_handle->path);
+				nih_free (path_handle);
+			}
+		}
+
+		if (exists && (! existed)) {
+			if (watch->create_handler)
+				watch->create_handler (watch->data, watch,
+						       path, &statbuf);
+		} else if (exists) {
+			if (watch->modify_handler)
+				watch->modify_handler (watch->data, watch,
+						       path, &statbuf);
+		} else {
+			if (watch->delete_handler)
+				watch->delete_handler (watch->data, watch,
+						       path);
+		}
+
+		if (*caught_free)
+			return;
+	}
+
+	if (len && watch->batch_handler)
+		watch->batch_handler (watch->data, watch, paths);
+}
+
+
+/**
+ * nih_watch_entry_set:
+ * @watch: NihWatch recording objects,
+ * @path: path of object,
+ * @statbuf: stat of @path.
+ *
+ * Records @path in the entries of @watch as it is in @statbuf, marking it
+ * as seen in the current generation; does nothing unless @watch is
+ * recording.  A new entry is linked to that of the directory containing
+ * it, if there is one.
+ **/
+static void
+nih_watch_entry_set (NihWatch          *watch,
+		     const char        *path,
+		     const struct stat *statbuf)
+{
+	NihWatchEntry *entry;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (! watch->entries)
+		return;
+
+	nih_assert (statbuf != NULL);
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, path);
+	if (! entry) {
+		NihWatchEntry *parent = NULL;
+		char          *slash;
+
+		entry = NIH_MUST (nih_new (watch, NihWatchEntry));
+
+		nih_list_init (&entry->entry);
+		entry->path = NIH_MUST (nih_strdup (entry, path));
+		nih_list_init (&entry->children);
+		nih_list_init (&entry->child_entry);
+
+		entry->hash = 0;
+		entry->hashed = FALSE;
+
+		nih_alloc_set_destructor (entry, nih_watch_entry_destroy);
+
+		/* Look up the directory by truncating our own copy of the
+		 * path, rather than allocating another.
+		 */
+		slash = strrchr (entry->path, '/');
+		if (slash && (slash != entry->path)) {
+			*slash = '\0';
+			parent = (NihWatchEntry *)nih_hash_lookup (
+				watch->entries, entry->path);
+			*slash = '/';
+		}
+
+		if (parent)
+			nih_list_add (&parent->children, &entry->child_entry);
+
+		nih_hash_add (watch->entries, &entry->entry);
+		watch->nentries++;
+
+		if (watch->nentries > watch->entries->size * 2)
+			watch->entries = nih_watch_index_grow (
+				watch, watch->entries, watch->nentries);
+	} else if ((entry->ino != statbuf->st_ino)
+		   || (entry->mtime.tv_sec != statbuf->st_mtim.tv_sec)
+		   || (entry->mtime.tv_nsec != statbuf->st_mtim.tv_nsec)
+		   || (entry->size != statbuf->st_size)) {
+		entry->hashed = FALSE;
+	}
+
+	entry->ino = statbuf->st_ino;
+	entry->mtime = statbuf->st_mtim;
+	entry->size = statbuf->st_size;
+	entry->is_dir = S_ISDIR (statbuf->st_mode);
+	entry->generation = watch->generation;
+}
+
+/**
+ * nih_watch_entry_remove:
+ * @watch: NihWatch recording objects,
+ * @path: path of object,
+ * @tree: also remove objects within @path.
+ *
+ * Removes @path from the entries of @watch.  If @tree is TRUE and @path
+ * was a directory, any objects recorded within it are removed as well;
+ * this is only needed when a directory is moved away, since one can't
+ * be deleted until it is empty.
+ **/
+static void
+nih_watch_entry_remove (NihWatch   *watch,
+			const char *path,
+			int         tree)
+{
+	NihWatchEntry *entry;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (! watch->entries)
+		return;
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, path);
+	if (! entry)
+		return;
+
+	if (tree)
+		nih_watch_entry_remove_children (watch, entry);
+
+	nih_free (entry);
+	watch->nentries--;
+}
+
+/**
+ * nih_watch_entry_remove_children:
+ * @watch: NihWatch recording objects,
+ * @entry: entry for directory.
+ *
+ * Removes the objects recorded within the directory of @entry from the
+ * entries of @watch, and those within each of them in turn.
+ **/
+static void
+nih_watch_entry_remove_children (NihWatch      *watch,
+				 NihWatchEntry *entry)
+{
+	nih_assert (watch != NULL);
+	nih_assert (entry != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&entry->children, iter) {
+		NihWatchEntry *child = NIH_LIST_ITER (iter, NihWatchEntry,
+						      child_entry);
+
+		nih_watch_entry_remove_children (watch, child);
+
+		nih_free (child);
+		watch->nentries--;
+	}
+}
+
+/**
+ * nih_watch_entry_destroy:
+ * @entry: entry to be destroyed.
+ *
+ * Removes @entry from the hash table and from the children of the entry
+ * for its directory, and unlinks any entries of its own children, which
+ * are left recorded.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_watch_entry_destroy (NihWatchEntry *entry)
+{
+	nih_assert (entry != NULL);
+
+	nih_list_destroy (&entry->entry);
+	nih_list_destroy (&entry->child_entry);
+
+	NIH_LIST_FOREACH_SAFE (&entry->children, iter)
+		nih_list_remove (iter);
+
+	return 0;
+}
+
+
+/**
+ * nih_watch_record:
+ * @watch: NihWatch to record objects for.
+ *
+ * Starts @watch recording each object within the trees it watches,
+ * along with its inode and modification time, walking those trees now to
+ * record those that already exist.  This is needed for nih_watch_rescan()
+ * to find changes that were missed, including when events are lost
+ * because the event queue overflowed; nih_watch_save() and
+ * nih_watch_restore() call it themselves.
+ *
+ * Objects that can't be read are not recorded; calling this once @watch
+ * is already recording does nothing.
+ **/
+void
+nih_watch_record (NihWatch *watch)
+{
+	nih_assert (watch != NULL);
+
+	if (watch->entries)
+		return;
+
+	watch->entries = NIH_MUST (nih_hash_string_new (watch, 0));
+	watch->nentries = 0;
+
+	NIH_LIST_FOREACH (&watch->watches, iter) {
+		NihWatchHandle *handle = (NihWatchHandle *)iter;
+
+		if (! nih_watch_handle_is_root (watch, handle))
+			continue;
+
+		nih_watch_record_tree (watch, handle->path, handle->subdirs);
+	}
+}
+
+/**
+ * nih_watch_rescan:
+ * @watch: NihWatch to rescan.
+ *
+ * Walks every tree watched by @watch comparing the objects found against
+ * those recorded, and delivers the differences as though the events for
+ * them had been received: the create handler is called for those not
+ * recorded, the modify handler for those replaced or with a different
+ * modification time, and the delete handler for those recorded but not
+ * found.  When coalescing, the differences are coalesced with any other
+ * changes.
+ *
+ * This is done automatically when events have been lost because the
+ * event queue overflowed, and may also be called whenever the caller has
+ * reason to believe the events can't be relied upon.  Changes made while
+ * the trees are walked may be delivered again once their events are
+ * read.
+ *
+ * Objects are only recorded once nih_watch_record() has been called; if
+ * it hasn't, this calls it instead and so delivers nothing.
+ *
+ * It is safe to remove the watch with nih_free() from a handler called
+ * by this function.
+ **/
+void
+nih_watch_rescan (NihWatch *watch)
+{
+	int  caught_free;
+	int *freed;
+
+	nih_assert (watch != NULL);
+
+	if (! watch->entries) {
+		nih_watch_record (watch);
+		return;
+	}
+
+	caught_free = FALSE;
+	if (! watch->free)
+		watch->free = &caught_free;
+	freed = watch->free;
+
+	nih_watch_do_rescan (watch, freed);
+	if (*freed)
+		return;
+
+	if (watch->free == &caught_free)
+		watch->free = NULL;
+}
+
+/**
+ * nih_watch_overflow:
+ * @watch: NihWatch that lost events,
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * Called when the event queue of @watch has overflowed, counting it and,
+ * if @watch is recording, rescanning the trees watched to recover the
+ * events lost.  The caller should check @caught_free afterwards.
+ **/
+static void
+nih_watch_overflow (NihWatch *watch,
+		    int      *caught_free)
+{
+	nih_assert (watch != NULL);
+	nih_assert (caught_free != NULL);
+
+	watch->overflows++;
+
+	if (! watch->entries) {
+		nih_warn ("%s: %s", watch->path,
+			  _("Event queue overflowed, events lost"));
+		return;
+	}
+
+	nih_warn ("%s: %s", watch->path,
+		  _("Event queue overflowed, rescanning"));
+
+	nih_watch_do_rescan (watch, caught_free);
+}
+
+/**
+ * nih_watch_handle_is_root:
+ * @watch: NihWatch handle belongs to,
+ * @handle: handle to check.
+ *
+ * Checks whether @handle is for the top of a tree, rather than a
+ * directory within the tree of another handle that includes
+ * sub-directories.
+ *
+ * Returns: TRUE if @handle is the top of a tree.
+ **/
+static int
+nih_watch_handle_is_root (NihWatch       *watch,
+			  NihWatchHandle *handle)
+{
+	nih_local char *parent = NULL;
+	char           *slash;
+
+	nih_assert (watch != NULL);
+	nih_assert (handle != NULL);
+
+	parent = NIH_MUST (nih_strdup (NULL, handle->path));
+	while (((slash = strrchr (parent, '/')) != NULL) && (slash != parent)) {
+		NihWatchHandle *parent_handle;
+
+		*slash = '\0';
+
+		parent_handle = nih_watch_handle_by_path (watch, parent);
+		if (parent_handle && parent_handle->subdirs)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * nih_watch_do_rescan:
+ * @watch: NihWatch to rescan,
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * Does the work of nih_watch_rescan(), walking each tree watched with
+ * nih_watch_rescan_visitor() and then looking for recorded objects that
+ * weren't found.  The caller should check @caught_free afterwards.
+ **/
+static void
+nih_watch_do_rescan (NihWatch *watch,
+		     int      *caught_free)
+{
+	NihWatchRescan rescan;
+	NihList        changes;
+
+	nih_assert (watch != NULL);
+	nih_assert (caught_free != NULL);
+
+	nih_list_init (&changes);
+
+	rescan.watch = watch;
+	rescan.handle = NULL;
+	rescan.changes = watch->changes ? NULL : &changes;
+
+	watch->generation++;
+
+	NIH_LIST_FOREACH_SAFE (&watch->watches, iter) {
+		NihWatchHandle *handle = (NihWatchHandle *)iter;
+		struct stat     statbuf;
+
+		if (! nih_watch_handle_is_root (watch, handle))
+			continue;
+
+		/* Objects in a tree that has gone will be found to be
+		 * missing below.
+		 */
+		if (stat (handle->path, &statbuf) < 0)
+			continue;
+
+		rescan.handle = handle;
+		nih_watch_rescan_visitor (&rescan, AT_FDCWD, handle->path,
+					  handle->path,
+					  S_ISDIR (statbuf.st_mode), &statbuf);
+
+		if (S_ISDIR (statbuf.st_mode)
+		    && (nih_dir_walk_at (
+				AT_FDCWD, handle->path,
+				(NIH_DIR_WALK_STAT
+				 | (handle->subdirs ? 0
+				    : NIH_DIR_WALK_NOSUBDIRS)),
+				(NihFileFilter)nih_watch_rescan_filter,
+				(NihDirVisitor)nih_watch_rescan_visitor,
+				NULL, &rescan) < 0)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s: %s", handle->path,
+				  _("Unable to rescan directory"),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
+	NIH_HASH_FOREACH (watch->entries, iter) {
+		NihWatchEntry *entry = (NihWatchEntry *)iter;
+
+		if (entry->generation != watch->generation)
+			nih_watch_rescan_change (&rescan, entry->path, TRUE);
+	}
+
+	if (rescan.changes)
+		nih_watch_deliver (watch, rescan.changes, caught_free);
+}
+
+/**
+ * nih_watch_rescan_filter:
+ * @rescan: rescan in progress,
+ * @path: path to check,
+ * @is_dir: TRUE if @path is a directory.
+ *
+ * Filter function for the walk of a tree when rescanning; calls the
+ * filter of the watch.
+ *
+ * Returns: TRUE if @path should be ignored.
+ **/
+static int
+nih_watch_rescan_filter (NihWatchRescan *rescan,
+			 const char     *path,
+			 int             is_dir)
+{
+	NihWatch *watch;
+
+	nih_assert (rescan != NULL);
+	nih_assert (path != NULL);
+
+	watch = rescan->watch;
+
+	if (watch->filter && watch->filter (watch->data, path, is_dir))
+		return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * nih_watch_rescan_visitor:
+ * @rescan: rescan in progress,
+ * @dirfd: descriptor of directory containing @path,
+ * @name: name of @path within @dirfd,
+ * @path: path found,
+ * @is_dir: TRUE if @path is a directory,
+ * @statbuf: stat of @path.
+ *
+ * Visitor function for the walk of a tree when rescanning; compares
+ * @path with what was recorded for it, if anything, and marks it as
+ * seen.  New directories are watched.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_watch_rescan_visitor (NihWatchRescan *rescan,
+			  int             dirfd,
+			  const char     *name,
+			  const char     *path,
+			  int             is_dir,
+			  struct stat    *statbuf)
+{
+	NihWatch      *watch;
+	NihWatchEntry *entry;
+
+	nih_assert (rescan != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	watch = rescan->watch;
+
+	entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, path);
+	if (entry) {
+		entry->generation = watch->generation;
+
+		if ((entry->ino != statbuf->st_ino)
+		    || (entry->is_dir != S_ISDIR (statbuf->st_mode))
+		    || ((! entry->is_dir)
+			&& ((entry->mtime.tv_sec != statbuf->st_mtim.tv_sec)
+			    || (entry->mtime.tv_nsec
+				!= statbuf->st_mtim.tv_nsec)
+			    || (entry->size != statbuf->st_size))))
+			nih_watch_rescan_change (rescan, path, TRUE);
+
+		return 0;
+	}
+
+	nih_watch_rescan_change (rescan, path, FALSE);
+
+	if (is_dir && rescan->handle->subdirs && (! watch->fanotify)
+	    && (nih_watch_add (watch, path, FALSE) < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s: %s", path,
+			  _("Unable to watch directory"), err->message);
+		nih_free (err);
+	}
+
+	return 0;
+}
+
+/**
+ * nih_watch_rescan_change:
+ * @rescan: rescan in progress,
+ * @path: path changed,
+ * @existed: TRUE if @path was recorded.
+ *
+ * Records a change to @path found when rescanning, coalescing it with
+ * any others or adding it to the list to be delivered once the rescan is
+ * complete.  Any create handler delayed until @path is closed is no
+ * longer waited for, since that event may have been lost.
+ **/
+static void
+nih_watch_rescan_change (NihWatchRescan *rescan,
+			 const char     *path,
+			 int             existed)
+{
+	NihWatch       *watch;
+	NihListEntry   *created;
+	NihWatchChange *change;
+
+	nih_assert (rescan != NULL);
+	nih_assert (path != NULL);
+
+	watch = rescan->watch;
+
+	created = (NihListEntry *)nih_hash_lookup (watch->created, path);
+	if (created)
+		nih_free (created);
+
+	if (! rescan->changes) {
+		nih_watch_change_add (watch, path,
+				      existed ? IN_CLOSE_WRITE : IN_CREATE,
+				      FALSE);
+		return;
+	}
+
+	change = nih_watch_change_new (watch, path, existed);
+	nih_list_add (rescan->changes, &change->order);
+}
+
+
+/**
+ * nih_watch_save:
+ * @watch: NihWatch to save,
+ * @filename: file to save to.
+ *
+ * Saves the objects recorded by @watch to @filename, with the path, inode,
+ * modification time and size of each and a hash of the contents of each
+ * file, so that when the process is next started nih_watch_restore() can
+ * deliver only the changes made while it wasn't running.
+ *
+ * The hash of a file is only calculated the first time it is saved, or
+ * when it has been modified since, so each save after the first reads
+ * only the files that have changed.  If @watch isn't yet recording, it
+ * is started with nih_watch_record() so that there's something to save.
+ *
+ * The file is written to a temporary file that then replaces @filename,
+ * so that a crash never leaves one that is only partially written.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_watch_save (NihWatch   *watch,
+		const char *filename)
+{
+	nih_local char         *tmpname = NULL;
+	nih_local char         *buf = NULL;
+	NihWatchSnapshot       *snapshot;
+	NihWatchSnapshotRecord *record;
+	char                   *strings;
+	size_t                  strings_len, len, offset;
+	uint32_t                nrecords;
+	int                     fd;
+
+	nih_assert (watch != NULL);
+	nih_assert (filename != NULL);
+
+	nih_watch_record (watch);
+
+	nrecords = 0;
+	strings_len = 0;
+	NIH_HASH_FOREACH (watch->entries, iter) {
+		NihWatchEntry *entry = (NihWatchEntry *)iter;
+
+		/* A file that can't be read is saved without a hash, and
+		 * is delivered as modified if it has changed at all.
+		 */
+		if ((! entry->is_dir) && (! entry->hashed)
+		    && (nih_watch_entry_hash (entry) < 0)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_free (err);
+		}
+
+		strings_len += strlen (entry->path) + 1;
+		nrecords++;
+	}
+
+	if (strings_len > UINT32_MAX) {
+		errno = EFBIG;
+		nih_return_system_error (-1);
+	}
+
+	len = (sizeof (NihWatchSnapshot)
+	       + nrecords * sizeof (NihWatchSnapshotRecord) + strings_len);
+	buf = NIH_MUST (nih_alloc (NULL, len));
+	memset (buf, 0, len);
+
+	snapshot = (NihWatchSnapshot *)buf;
+	snapshot->magic = SNAPSHOT_MAGIC;
+	snapshot->version = SNAPSHOT_VERSION;
+	snapshot->nrecords = nrecords;
+	snapshot->strings_len = strings_len;
+
+	record = (NihWatchSnapshotRecord *)(snapshot + 1);
+	strings = (char *)(record + nrecords);
+
+	offset = 0;
+	NIH_HASH_FOREACH (watch->entries, iter) {
+		NihWatchEntry *entry = (NihWatchEntry *)iter;
+		size_t         path_len;
+
+		path_len = strlen (entry->path);
+
+		record->ino = entry->ino;
+		record->mtime_sec = entry->mtime.tv_sec;
+		record->mtime_nsec = entry->mtime.tv_nsec;
+		record->flags = ((entry->is_dir ? SNAPSHOT_DIR : 0)
+				 | (entry->hashed ? SNAPSHOT_HASHED : 0));
+		record->size = entry->size;
+		record->hash = entry->hash;
+		record->path_offset = offset;
+		record->path_len = path_len;
+		record++;
+
+		memcpy (strings + offset, entry->path, path_len + 1);
+		offset += path_len + 1;
+	}
+
+	tmpname = NIH_MUST (nih_sprintf (NULL, "%s.XXXXXX", filename));
+	fd = mkostemp (tmpname, O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	offset = 0;
+	while (offset < len) {
+		ssize_t ret;
+
+		ret = write (fd, buf + offset, len - offset);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret < 0)
+			goto error;
+
+		offset += ret;
+	}
+
+	if (fsync (fd) < 0)
+		goto error;
+
+	if (close (fd) < 0) {
+		fd = -1;
+		goto error;
+	}
+	fd = -1;
+
+	if (rename (tmpname, filename) < 0)
+		goto error;
+
+	return 0;
+error:
+	nih_error_raise_system ();
+	if (fd >= 0)
+		close (fd);
+	unlink (tmpname);
+	return -1;
+}
+
+/**
+ * nih_watch_restore:
+ * @watch: NihWatch to restore,
+ * @filename: file saved by nih_watch_save().
+ *
+ * Compares the objects recorded in @filename, when the watch was saved
+ * by an earlier run of the process, against those now in the trees
+ * watched by @watch and delivers the differences: the create handler is
+ * called for those not recorded, the delete handler for those recorded
+ * but no longer there, and the modify handler for directories that have
+ * been replaced and files whose contents are different.  A file that has
+ * only been touched, or replaced with an identical copy, is not delivered.
+ * When coalescing, the differences are coalesced with any other changes.
+ *
+ * @watch should have been created without calling the create handler for
+ * existing files, so that it is only called for the new ones.  Objects in
+ * @filename outside the trees watched are ignored.  If @filename doesn't
+ * exist, every object is new.  If @watch isn't yet recording, it is
+ * started with nih_watch_record() first, so that there's something to
+ * compare against; it then remains recording.
+ *
+ * It is safe to remove the watch with nih_free() from a handler called
+ * by this function.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+nih_watch_restore (NihWatch   *watch,
+		   const char *filename)
+{
+	int  caught_free;
+	int *freed;
+	int  ret;
+
+	nih_assert (watch != NULL);
+	nih_assert (filename != NULL);
+
+	caught_free = FALSE;
+	if (! watch->free)
+		watch->free = &caught_free;
+	freed = watch->free;
+
+	ret = nih_watch_do_restore (watch, filename, freed);
+	if (*freed)
+		return ret;
+
+	if (watch->free == &caught_free)
+		watch->free = NULL;
+
+	return ret;
+}
+
+/**
+ * nih_watch_do_restore:
+ * @watch: NihWatch to restore,
+ * @filename: file saved by nih_watch_save(),
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * Does the work of nih_watch_restore(), reading @filename into memory
+ * and comparing each record in it against what is now recorded by @watch,
+ * and then looking for recorded objects that weren't in it.  The caller
+ * should check @caught_free afterwards.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_watch_do_restore (NihWatch   *watch,
+		      const char *filename,
+		      int        *caught_free)
+{
+	const NihWatchSnapshot       *snapshot = NULL;
+	const NihWatchSnapshotRecord *records = NULL;
+	const char                   *strings = NULL;
+	nih_local char               *file = NULL;
+	size_t                        length = 0;
+	NihWatchRescan                rescan;
+	NihList                       changes;
+	uint32_t                      i;
+
+	nih_assert (watch != NULL);
+	nih_assert (filename != NULL);
+	nih_assert (caught_free != NULL);
+
+	nih_watch_record (watch);
+
+	/* The snapshot is read rather than mapped, since it may be
+	 * truncated by another process while we're comparing it.
+	 */
+	file = nih_file_read (NULL, filename, &length);
+	if (! file) {
+		NihError *err;
+
+		err = nih_error_get ();
+		if (err->number != ENOENT)
+			return -1;
+
+		nih_free (err);
+	}
+
+	if (file) {
+		if (nih_watch_snapshot_check (file, length) < 0)
+			nih_return_error (-1, NIH_WATCH_INVALID_SNAPSHOT,
+					  _(NIH_WATCH_INVALID_SNAPSHOT_STR));
+
+		snapshot = (const NihWatchSnapshot *)file;
+		records = (const NihWatchSnapshotRecord *)(snapshot + 1);
+		strings = (const char *)(records + snapshot->nrecords);
+	}
+
+	nih_list_init (&changes);
+
+	rescan.watch = watch;
+	rescan.handle = NULL;
+	rescan.changes = watch->changes ? NULL : &changes;
+
+	watch->generation++;
+
+	for (i = 0; snapshot && (i < snapshot->nrecords); i++) {
+		const NihWatchSnapshotRecord *record = &records[i];
+		const char                   *path;
+		NihWatchEntry                *entry;
+		int                           is_dir;
+
+		path = strings + record->path_offset;
+		is_dir = (record->flags & SNAPSHOT_DIR) ? TRUE : FALSE;
+
+		if (! nih_watch_path_is_watched (watch, path))
+			continue;
+
+		entry = (NihWatchEntry *)nih_hash_lookup (watch->entries, path);
+		if (! entry) {
+			if ((! watch->filter)
+			    || (! watch->filter (watch->data, path, is_dir)))
+				nih_watch_rescan_change (&rescan, path, TRUE);
+
+			continue;
+		}
+
+		entry->generation = watch->generation;
+
+		if (entry->is_dir != is_dir) {
+			nih_watch_rescan_change (&rescan, path, TRUE);
+			continue;
+		}
+
+		if (is_dir) {
+			if (entry->ino != record->ino)
+				nih_watch_rescan_change (&rescan, path, TRUE);
+
+			continue;
+		}
+
+		if ((entry->ino == record->ino)
+		    && (entry->mtime.tv_sec == record->mtime_sec)
+		    && (entry->mtime.tv_nsec == record->mtime_nsec)
+		    && (entry->size == (off_t)record->size))
+			continue;
+
+		/* Only the contents matter for a file that has been touched
+		 * or replaced, so compare the hash of those when the size
+		 * hasn't changed.
+		 */
+		if ((record->flags & SNAPSHOT_HASHED)
+		    && (entry->size == (off_t)record->size)) {
+			if ((! entry->hashed)
+			    && (nih_watch_entry_hash (entry) < 0)) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_free (err);
+			}
+
+			if (entry->hashed && (entry->hash == record->hash))
+				continue;
+		}
+
+		nih_watch_rescan_change (&rescan, path, TRUE);
+	}
+
+	NIH_HASH_FOREACH (watch->entries, iter) {
+		NihWatchEntry *entry = (NihWatchEntry *)iter;
+
+		if (entry->generation != watch->generation)
+			nih_watch_rescan_change (&rescan, entry->path, FALSE);
+	}
+
+	if (rescan.changes)
+		nih_watch_deliver (watch, rescan.changes, caught_free);
+
+	return 0;
+}
+
+/**
+ * nih_watch_snapshot_check:
+ * @data: file saved by nih_watch_save(),
+ * @length: length of @data.
+ *
+ * Checks that @data is a snapshot written by this version of
+ * nih_watch_save(), and that every record in it refers to a path within
+ * it, so that it may be read without further checks.
+ *
+ * Returns: zero if valid, negative value otherwise.
+ **/
+static int
+nih_watch_snapshot_check (const void *data,
+			  size_t      length)
+{
+	const NihWatchSnapshot       *snapshot;
+	const NihWatchSnapshotRecord *records;
+	const char                   *strings;
+	size_t                        max;
+	uint32_t                      i;
+
+	nih_assert (data != NULL);
+
+	if (length < sizeof (NihWatchSnapshot))
+		return -1;
+
+	snapshot = data;
+	if ((snapshot->magic != SNAPSHOT_MAGIC)
+	    || (snapshot->version != SNAPSHOT_VERSION))
+		return -1;
+
+	max = ((length - sizeof (NihWatchSnapshot))
+	       / sizeof (NihWatchSnapshotRecord));
+	if ((snapshot->nrecords > max)
+	    || (length != (sizeof (NihWatchSnapshot)
+			   + (snapshot->nrecords
+			      * sizeof (NihWatchSnapshotRecord))
+			   + snapshot->strings_len)))
+		return -1;
+
+	records = (const NihWatchSnapshotRecord *)(snapshot + 1);
+	strings = (const char *)(records + snapshot->nrecords);
+
+	for (i = 0; i < snapshot->nrecords; i++) {
+		const NihWatchSnapshotRecord *record = &records[i];
+
+		if ((record->path_len == 0)
+		    || (record->path_offset >= snapshot->strings_len)
+		    || (record->path_len
+			>= snapshot->strings_len - record->path_offset))
+			return -1;
+
+		if (memchr (strings + record->path_offset, '\0',
+			    record->path_len + 1)
+		    != strings + record->path_offset + record->path_len)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * nih_watch_entry_hash:
+ * @entry: entry to hash.
+ *
+ * Calculates the hash of the contents of the file recorded by @entry,
+ * using the 64-bit FNV-1a algorithm, and sets the hash and hashed members.
+ * If the file has been modified since it was recorded, it isn't hashed,
+ * since that would record contents that were never reported.
+ *
+ * The file is read in chunks rather than mapped, so that it being
+ * truncated while we hash it just means the hash isn't set.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_watch_entry_hash (NihWatchEntry *entry)
+{
+	NihFileReader *reader;
+	struct stat    before, after;
+	const char    *data;
+	ssize_t        len, i;
+	off_t          total;
+	uint64_t       hash;
+
+	nih_assert (entry != NULL);
+	nih_assert (! entry->is_dir);
+
+	reader = nih_file_reader_new (NULL, entry->path, 0,
+				      (NIH_FILE_READ_NOATIME
+				       | NIH_FILE_READ_SEQUENTIAL));
+	if (! reader)
+		return -1;
+
+	if (fstat (reader->fd, &before) < 0)
+		goto error;
+
+	if ((before.st_ino != entry->ino)
+	    || (before.st_mtim.tv_sec != entry->mtime.tv_sec)
+	    || (before.st_mtim.tv_nsec != entry->mtime.tv_nsec)
+	    || (before.st_size != entry->size)) {
+		nih_free (reader);
+		return 0;
+	}
+
+	hash = 0xcbf29ce484222325ULL;
+	total = 0;
+	while ((len = nih_file_reader_read (reader, &data)) > 0) {
+		for (i = 0; i < len; i++) {
+			hash ^= (unsigned char)data[i];
+			hash *= 0x100000001b3ULL;
+		}
+
+		total += len;
+	}
+
+	if (len < 0) {
+		nih_free (reader);
+		return -1;
+	}
+
+	if (fstat (reader->fd, &after) < 0)
+		goto error;
+
+	nih_free (reader);
+
+	if ((total != before.st_size)
+	    || (after.st_mtim.tv_sec != before.st_mtim.tv_sec)
+	    || (after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)
+	    || (after.st_size != before.st_size))
+		return 0;
+
+	entry->hash = hash;
+	entry->hashed = TRUE;
+
+	return 0;
+error:
+	nih_error_raise_system ();
+	nih_free (reader);
+	return -1;
+}
+
+/**
+ * nih_watch_path_is_watched:
+ * @watch: NihWatch to check,
+ * @path: path to check.
+ *
+ * Checks whether @path is one of those watched by @watch, within a
+ * directory watched by it, or within the tree of one watched with
+ * sub-directories; @path itself need not exist.
+ *
+ * Returns: TRUE if @path is watched.
+ **/
+static int
+nih_watch_path_is_watched (NihWatch   *watch,
+			   const char *path)
+{
+	nih_local char *parent = NULL;
+	char           *slash;
+	int             direct;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (nih_watch_handle_by_path (watch, path))
+		return TRUE;
+
+	direct = TRUE;
+	parent = NIH_MUST (nih_strdup (NULL, path));
+	while (((slash = strrchr (parent, '/')) != NULL) && (slash != parent)) {
+		NihWatchHandle *handle;
+
+		*slash = '\0';
+
+		handle = nih_watch_handle_by_path (watch, parent);
+		if (handle && (direct || handle->subdirs))
+			return TRUE;
+
+		direct = FALSE;
+	}
+
+	return FALSE;
+}
+
+#if HAVE_DECL_FAN_REPORT_DFID_NAME
+/**
+ * nih_watch_fanotify_init:
+ * @watch: NihWatch being created,
+ * @path: path to be watched.
+ *
+ * Attempts to watch the whole filesystem containing the directory @path
+ * with fanotify, setting the fanotify, fd and mount_fd members of @watch
+ * if successful.  Any failure, most commonly that the process lacks
+ * CAP_SYS_ADMIN, means that inotify should be used instead, so no error
+ * is raised.
+ **/
+static void
+nih_watch_fanotify_init (NihWatch   *watch,
+			 const char *path)
+{
+	struct file_handle *fh;
+	int                 mount_id;
+	int                 fd;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	watch->fd = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC
+				   | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+				   O_RDONLY | O_CLOEXEC);
+	if (watch->fd < 0)
+		return;
+
+	watch->mount_fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (watch->mount_fd < 0)
+		goto error;
+
+	if (fanotify_mark (watch->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			   FANOTIFY_EVENTS, watch->mount_fd, NULL) < 0)
+		goto error;
+
+	/* Make sure that the file handles we receive can be opened again,
+	 * since not every filesystem supports that.
+	 */
+	fh = NIH_MUST (nih_alloc (NULL, sizeof (struct file_handle)
+				  + MAX_HANDLE_SZ));
+	fh->handle_bytes = MAX_HANDLE_SZ;
+
+	if (name_to_handle_at (watch->mount_fd, "", fh, &mount_id,
+			       AT_EMPTY_PATH) < 0) {
+		nih_free (fh);
+		goto error;
+	}
+
+	fd = open_by_handle_at (watch->mount_fd, fh, O_PATH | O_CLOEXEC);
+	nih_free (fh);
+	if (fd < 0)
+		goto error;
+
+	close (fd);
+
+	watch->dirs = NIH_MUST (nih_hash_new (
+		watch, WATCH_DIRS_MAX, (NihKeyFunction)nih_watch_dir_key,
+		(NihHashFunction)nih_watch_dir_hash,
+		(NihCmpFunction)nih_watch_dir_cmp));
+	watch->ndirs = 0;
+
+	watch->fanotify = TRUE;
+	return;
+
+error:
+	close (watch->fd);
+	watch->fd = -1;
+
+	if (watch->mount_fd >= 0) {
+		close (watch->mount_fd);
+		watch->mount_fd = -1;
+	}
+}
+
+/**
+ * nih_watch_fanotify_root:
+ * @watch: NihWatch using fanotify,
+ * @handle: handle being added.
+ *
+ * Fills in the real_path and fid members of @handle, which are used to
+ * match events against its path.  Only paths on the filesystem watched
+ * by @watch may be added.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+nih_watch_fanotify_root (NihWatch       *watch,
+			 NihWatchHandle *handle)
+{
+	struct statfs       watch_statfs;
+	struct statfs       path_statfs;
+	struct file_handle *fh;
+	char               *real_path;
+	int                 mount_id;
+
+	nih_assert (watch != NULL);
+	nih_assert (handle != NULL);
+
+	if (statfs (handle->path, &path_statfs) < 0)
+		nih_return_system_error (-1);
+
+	if (fstatfs (watch->mount_fd, &watch_statfs) < 0)
+		nih_return_system_error (-1);
+
+	if (memcmp (&path_statfs.f_fsid, &watch_statfs.f_fsid,
+		    sizeof (path_statfs.f_fsid))) {
+		errno = EXDEV;
+		nih_return_system_error (-1);
+	}
+
+	real_path = realpath (handle->path, NULL);
+	if (! real_path)
+		nih_return_system_error (-1);
+
+	handle->real_path = NIH_MUST (nih_strdup (handle, real_path));
+	free (real_path);
+
+	fh = NIH_MUST (nih_alloc (handle, sizeof (struct file_handle)
+				  + MAX_HANDLE_SZ));
+	fh->handle_bytes = MAX_HANDLE_SZ;
+
+	if (name_to_handle_at (AT_FDCWD, handle->real_path, fh, &mount_id,
+			       0) < 0)
+		nih_return_system_error (-1);
+
+	handle->fid = fh;
+
+	return 0;
+}
+
+/**
+ * nih_watch_fanotify_reader:
+ * @watch: NihWatch for descriptor,
+ * @io_watch: NihIoWatch for fanotify descriptor,
+ * @events: events that occurred.
+ *
+ * This function is called whenever there are events to be read on the
+ * fanotify file descriptor associated with @watch.  Events are read until
+ * none remain, each being handled by nih_watch_fanotify_event(), and the
+ * tree rescanned afterwards if the event queue overflowed.
+ **/
+static void
+nih_watch_fanotify_reader (NihWatch    *watch,
+			   NihIoWatch  *io_watch,
+			   NihIoEvents  events)
+{
+	union {
+		struct fanotify_event_metadata meta;
+		char                           data[WATCH_BUFSIZ];
+	}       buf;
+	int     caught_free;
+	int     overflow = FALSE;
+	ssize_t len;
+
+	nih_assert (watch != NULL);
+	nih_assert (io_watch != NULL);
+
+	caught_free = FALSE;
+	if (! watch->free)
+		watch->free = &caught_free;
+
+	while ((len = read (watch->fd, &buf, sizeof (buf))) > 0) {
+		struct fanotify_event_metadata *meta;
+
+		meta = &buf.meta;
+		while (FAN_EVENT_OK (meta, len)) {
+			struct fanotify_event_info_fid *info;
+			struct file_handle             *fh;
+			const char                     *name;
+
+			/* Every event we ask for carries the file handle of
+			 * the directory as the first record, followed by the
+			 * name within it; "." or none for itself.
+			 */
+			info = (struct fanotify_event_info_fid *)(meta + 1);
+			fh = (struct file_handle *)info->handle;
+
+			if (meta->vers != FANOTIFY_METADATA_VERSION)
+				goto next;
+
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				overflow = TRUE;
+				goto next;
+			}
+
+			if (meta->event_len < (sizeof (*meta) + sizeof (*info)
+					       + sizeof (*fh)))
+				goto next;
+
+			if (info->hdr.info_type
+			    == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+				name = ((const char *)fh->f_handle
+					+ fh->handle_bytes);
+			} else if (info->hdr.info_type
+				   == FAN_EVENT_INFO_TYPE_DFID) {
+				name = ".";
+			} else {
+				goto next;
+			}
+
+			nih_watch_fanotify_event (watch, meta->mask, fh, name,
+						  &caught_free);
+
+			/* Check whether the user freed the watch from inside
+			 * the handler.
+			 */
+			if (caught_free)
+				return;
+
+		next:
+			meta = FAN_EVENT_NEXT (meta, len);
+		}
+	}
+
+	if ((len < 0) && (errno != EAGAIN) && (errno != EINTR))
+		nih_warn ("%s: %s", _("Unable to read fanotify events"),
+			  strerror (errno));
+
+	if (overflow) {
+		nih_watch_overflow (watch, &caught_free);
+		if (caught_free)
+			return;
+	}
+
+	if (watch->free == &caught_free)
+		watch->free = NULL;
+}
+
+/**
+ * nih_watch_fanotify_event:
+ * @watch: NihWatch for descriptor,
+ * @mask: fanotify event mask,
+ * @fh: file handle of directory event occurred in,
+ * @name: name within directory, or "." for the directory itself,
+ * @caught_free: set to TRUE if @watch is freed.
+ *
+ * Handles a single fanotify event.  Events for a directory being deleted
+ * or moved are matched against the file handles of the paths given to
+ * @watch; for all others the directory the event occurred in is opened
+ * from its file handle to find its path, and the event handled for the
+ * path it corresponds to under the closest path given to @watch.
+ *
+ * Whether that directory is within the paths given is remembered by its
+ * file handle, so that events from those outside are dropped without
+ * opening them; since moving a directory can change that for any below
+ * it, all are forgotten when one is moved.
+ **/
+static void
+nih_watch_fanotify_event (NihWatch           *watch,
+			  uint64_t            mask,
+			  struct file_handle *fh,
+			  const char         *name,
+			  int                *caught_free)
+{
+	struct stat     statbuf;
+	char            link[32];
+	char            dir_path[PATH_MAX];
+	nih_local char *real_path = NULL;
+	NihWatchHandle *root = NULL;
+	size_t          root_len = 0;
+	nih_local char *path = NULL;
+	NihWatchDir    *dir;
+	ssize_t         len;
+	uint32_t        isdir;
+	int             fd;
+
+	nih_assert (watch != NULL);
+	nih_assert (fh != NULL);
+	nih_assert (name != NULL);
+	nih_assert (caught_free != NULL);
+
+	isdir = (mask & FAN_ONDIR) ? IN_ISDIR : 0;
+
+	/* The directory itself was deleted or moved, so its handle can't
+	 * be opened; compare it against those of the paths being watched.
+	 */
+	if (mask & (FAN_DELETE_SELF | FAN_MOVE_SELF)) {
+		NIH_LIST_FOREACH (&watch->watches, iter) {
+			NihWatchHandle     *handle = (NihWatchHandle *)iter;
+			struct file_handle *fid = handle->fid;
+
+			if ((fid->handle_type == fh->handle_type)
+			    && (fid->handle_bytes == fh->handle_bytes)
+			    && (! memcmp (fid->f_handle, fh->f_handle,
+					  fh->handle_bytes))) {
+				root = handle;
+				break;
+			}
+		}
+
+		if (root)
+			nih_watch_handle (watch, root, IN_MOVE_SELF, 0,
+					  NULL, caught_free);
+
+		return;
+	}
+
+	/* Most events on the filesystem are in directories elsewhere,
+	 * drop those from one we've already looked at; unless a directory
+	 * was moved from or into it, in which case those within that one
+	 * may now be somewhere else.
+	 */
+	dir = (NihWatchDir *)nih_hash_lookup (watch->dirs, fh);
+	if (dir) {
+		nih_list_add (&watch->dir_order, &dir->order);
+
+		if (! dir->watched) {
+			if (isdir && (mask & FAN_MOVE)) {
+				nih_local char *moved_path = NULL;
+
+				moved_path = NIH_MUST (nih_sprintf (
+					NULL, "%s/%s", dir->path, name));
+				nih_watch_dirs_forget (watch, moved_path,
+						       FALSE);
+			}
+
+			return;
+		}
+	}
+
+	/* The directory may itself have been removed by the time we read
+	 * the event, in which case there's no path to give for it.
+	 */
+	fd = open_by_handle_at (watch->mount_fd, fh, O_PATH | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if ((fstat (fd, &statbuf) < 0) || (statbuf.st_nlink == 0)) {
+		close (fd);
+		return;
+	}
+
+	sprintf (link, "/proc/self/fd/%d", fd);
+	len = readlink (link, dir_path, sizeof (dir_path) - 1);
+	close (fd);
+	if (len < 0)
+		return;
+
+	dir_path[len] = '\0';
+
+	if (isdir && (mask & FAN_MOVE)) {
+		nih_local char *moved_path = NULL;
+
+		moved_path = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+						    dir_path, name));
+		nih_watch_dirs_forget (watch, moved_path, FALSE);
+	}
+
+	if (! dir) {
+		int watched;
+
+		watched = nih_watch_fanotify_watched (watch, dir_path);
+
+		dir = nih_watch_dir_new (watch, fh, dir_path, watched);
+		if (! dir->watched)
+			return;
+	}
+
+	if (strcmp (name, ".")) {
+		real_path = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+						   dir_path, name));
+	} else {
+		real_path = NIH_MUST (nih_strdup (NULL, dir_path));
+	}
+
+	/* Find the closest path being watched that contains the path,
+	 * directly unless sub-directories were included; the path itself
+	 * only matters if it's gone.
+	 */
+	NIH_LIST_FOREACH (&watch->watches, iter) {
+		NihWatchHandle *handle = (NihWatchHandle *)iter;
+		size_t          handle_len;
+		const char     *rest;
+
+		handle_len = strlen (handle->real_path);
+		if ((handle_len < root_len)
+		    || strncmp (real_path, handle->real_path, handle_len))
+			continue;
+
+		rest = real_path + handle_len;
+		if (*rest == '\0') {
+			if (! (mask & (FAN_DELETE | FAN_MOVED_FROM)))
+				continue;
+		} else if ((*rest != '/')
+			   || ((! handle->subdirs) && strchr (rest + 1, '/'))) {
+			continue;
+		}
+
+		root = handle;
+		root_len = handle_len;
+	}
+
+	if (! root)
+		return;
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s%s", root->path,
+				      real_path + root_len));
+
+	/* Events for the same object may have been merged, so handle each
+	 * in the most likely order.
+	 */
+	if (mask & FAN_CREATE) {
+		nih_watch_handle_path (watch, path, IN_CREATE | isdir,
+				       caught_free);
+		if (*caught_free)
+			return;
+	}
+
+	if (mask & FAN_MOVED_TO) {
+		nih_watch_handle_path (watch, path, IN_MOVED_TO | isdir,
+				       caught_free);
+		if (*caught_free)
+			return;
+	}
+
+	if (mask & FAN_CLOSE_WRITE) {
+		nih_watch_handle_path (watch, path, IN_CLOSE_WRITE | isdir,
+				       caught_free);
+		if (*caught_free)
+			return;
+	}
+
+	if (mask & FAN_DELETE) {
+		nih_watch_handle_path (watch, path, IN_DELETE | isdir,
+				       caught_free);
+		if (*caught_free)
+			return;
+	}
+
+	if (mask & FAN_MOVED_FROM)
+		nih_watch_handle_path (watch, path, IN_MOVED_FROM | isdir,
+				       caught_free);
+}
+
+/**
+ * nih_watch_fanotify_watched:
+ * @watch: NihWatch using fanotify,
+ * @dir_path: real path of directory.
+ *
+ * Checks whether events in the directory @dir_path might be for a path
+ * given to @watch: either the directory is within one, or one is within
+ * the directory.
+ *
+ * Returns: TRUE if events in @dir_path must be handled.
+ **/
+static int
+nih_watch_fanotify_watched (NihWatch   *watch,
+			   const char *dir_path)
+{
+	size_t dir_len;
+
+	nih_assert (watch != NULL);
+	nih_assert (dir_path != NULL);
+
+	dir_len = strlen (dir_path);
+
+	NIH_LIST_FOREACH (&watch->watches, iter) {
+		NihWatchHandle *handle = (NihWatchHandle *)iter;
+		const char     *shorter, *longer;
+		size_t          len;
+
+		len = strlen (handle->real_path);
+		if (len <= dir_len) {
+			shorter = handle->real_path;
+			longer = dir_path;
+		} else {
+			shorter = dir_path;
+			longer = handle->real_path;
+			len = dir_len;
+		}
+
+		if ((! strncmp (longer, shorter, len))
+		    && ((longer[len] == '\0') || (longer[len] == '/')
+			|| (len == 1)))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * nih_watch_dir_key:
+ * @entry: entry in dirs hash table.
+ *
+ * Key function for the dirs hash table of a watch.
+ *
+ * Returns: file handle of directory.
+ **/
+static const struct file_handle *
+nih_watch_dir_key (NihList *entry)
+{
+	nih_assert (entry != NULL);
+
+	return ((NihWatchDir *)entry)->fh;
+}
+
+/**
+ * nih_watch_dir_hash:
+ * @fh: file handle.
+ *
+ * Hash function for the dirs hash table of a watch, an FNV-1a hash of
+ * the type and bytes of @fh.
+ *
+ * Returns: hash of @fh.
+ **/
+static uint32_t
+nih_watch_dir_hash (const struct file_handle *fh)
+{
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	nih_assert (fh != NULL);
+
+	hash = (hash ^ (uint32_t)fh->handle_type) * 16777619U;
+	for (i = 0; i < fh->handle_bytes; i++)
+		hash = (hash ^ fh->f_handle[i]) * 16777619U;
+
+	return hash;
+}
+
+/**
+ * nih_watch_dir_cmp:
+ * @fh1: file handle,
+ * @fh2: file handle to compare against.
+ *
+ * Comparison function for the dirs hash table of a watch.
+ *
+ * Returns: zero if @fh1 and @fh2 are the same, non-zero otherwise.
+ **/
+static int
+nih_watch_dir_cmp (const struct file_handle *fh1,
+		   const struct file_handle *fh2)
+{
+	nih_assert (fh1 != NULL);
+	nih_assert (fh2 != NULL);
+
+	if (fh1->handle_type != fh2->handle_type)
+		return (fh1->handle_type > fh2->handle_type) ? 1 : -1;
+	if (fh1->handle_bytes != fh2->handle_bytes)
+		return (fh1->handle_bytes > fh2->handle_bytes) ? 1 : -1;
+
+	return memcmp (fh1->f_handle, fh2->f_handle, fh1->handle_bytes);
+}
+
+/**
+ * nih_watch_dir_new:
+ * @watch: NihWatch using fanotify,
+ * @fh: file handle of directory,
+ * @path: real path of directory,
+ * @watched: TRUE if the directory may be within a path watched.
+ *
+ * Remembers whether the directory with file handle @fh and real path
+ * @path is @watched in the dirs hash table of @watch, forgetting the
+ * least recently used first if there are already too many.
+ *
+ * Returns: new entry.
+ **/
+static NihWatchDir *
+nih_watch_dir_new (NihWatch                 *watch,
+		   const struct file_handle *fh,
+		   const char               *path,
+		   int                       watched)
+{
+	NihWatchDir *dir;
+
+	nih_assert (watch != NULL);
+	nih_assert (fh != NULL);
+	nih_assert (path != NULL);
+
+	if (watch->ndirs >= WATCH_DIRS_MAX) {
+		nih_assert (! NIH_LIST_EMPTY (&watch->dir_order));
+
+		nih_free (NIH_LIST_ITER (watch->dir_order.next,
+					 NihWatchDir, order));
+		watch->ndirs--;
+	}
+
+	dir = NIH_MUST (nih_new (watch->dirs, NihWatchDir));
+	nih_list_init (&dir->entry);
+	nih_list_init (&dir->order);
+	nih_alloc_set_destructor (dir, nih_watch_dir_destroy);
+
+	dir->fh = NIH_MUST (nih_alloc (dir, (sizeof (struct file_handle)
+					     + fh->handle_bytes)));
+	memcpy (dir->fh, fh, sizeof (struct file_handle) + fh->handle_bytes);
+	dir->path = NIH_MUST (nih_strdup (dir, path));
+	dir->watched = watched;
+
+	nih_hash_add (watch->dirs, &dir->entry);
+	nih_list_add (&watch->dir_order, &dir->order);
+	watch->ndirs++;
+
+	return dir;
+}
+
+/**
+ * nih_watch_dir_destroy:
+ * @dir: entry to be destroyed.
+ *
+ * Removes @dir from the dirs hash table and dir_order list of its watch.
+ *
+ * Returns: zero.
+ **/
+static int
+nih_watch_dir_destroy (NihWatchDir *dir)
+{
+	nih_assert (dir != NULL);
+
+	nih_list_destroy (&dir->entry);
+	nih_list_destroy (&dir->order);
+
+	return 0;
+}
+
+/**
+ * nih_watch_dirs_forget:
+ * @watch: NihWatch using fanotify,
+ * @path: real path of directory,
+ * @ancestors: also forget directories containing @path?
+ *
+ * Forgets each directory remembered in the dirs hash table of @watch
+ * whose path is @path or within it, and if @ancestors is TRUE, those
+ * that contain @path as well.  Used when a directory is moved, since
+ * that changes whether those within it are within the paths watched, and
+ * when a path is added to @watch, which can change that for any related
+ * to it.
+ **/
+static void
+nih_watch_dirs_forget (NihWatch   *watch,
+		       const char *path,
+		       int         ancestors)
+{
+	size_t len;
+
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (! watch->dirs)
+		return;
+
+	len = strlen (path);
+
+	NIH_HASH_FOREACH_SAFE (watch->dirs, iter) {
+		NihWatchDir *dir = (NihWatchDir *)iter;
+		size_t       dir_len;
+
+		dir_len = strlen (dir->path);
+		if ((dir_len >= len) && (! strncmp (dir->path, path, len))
+		    && ((dir->path[len] == '\0') || (dir->path[len] == '/')
+			|| (len == 1))) {
+			/* Within path */
+		} else if (ancestors && (dir_len < len)
+			   && (! strncmp (path, dir->path, dir_len))
+			   && ((path[dir_len] == '/') || (dir_len == 1))) {
+			/* Contains path */
+		} else {
+			continue;
+		}
+
+		nih_free (dir);
+		watch->ndirs--;
+	}
+}
+#endif /* HAVE_DECL_FAN_REPORT_DFID_NAME */
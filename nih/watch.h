@@ -29,6 +29,7 @@
 #include <nih/hash.h>
 #include <nih/file.h>
 #include <nih/io.h>
+#include <nih/timer.h>
 
 
 /* Predefine the typedefs as we use them in the callbacks */
@@ -89,13 +90,37 @@ typedef void (*NihModifyHandler) (void *data, NihWatch *watch,
 typedef void (*NihDeleteHandler) (void *data, NihWatch *watch,
 				  const char *path);
 
+/**
+ * NihWatchBatchHandler:
+ * @data: data pointer given when registered,
+ * @watch: NihWatch for directory tree,
+ * @paths: NULL-terminated array of full paths changed.
+ *
+ * A batch handler is a function that is called when changes coalesced by
+ * a watch are delivered, after the create, modify or delete handler has
+ * been called for each path in @paths, so that work such as reloading
+ * configuration need only be done once for any number of changes.
+ *
+ * It is safe to remove the watch with nih_free() from this function.
+ **/
+typedef void (*NihWatchBatchHandler) (void *data, NihWatch *watch,
+				      char * const *paths);
+
 
 /**
  * NihWatch:
- * @fd: inotify instance,
- * @io: NihIo structure to watch @fd,
+ * @fd: inotify or fanotify instance,
+ * @fanotify: TRUE if @fd is a fanotify instance,
+ * @io_watch: NihIoWatch to watch @fd,
+ * @mount_fd: descriptor of @path used to open fanotify file handles,
+ * @dirs: hash table of directories fanotify events were received from,
+ * @ndirs: number of entries in @dirs,
+ * @dir_order: list of @dirs, least recently used first,
  * @path: full path to be watched,
  * @watches: list of watch descriptors,
+ * @wd_index: hash table of @watches by watch descriptor,
+ * @path_index: hash table of @watches by path,
+ * @nhandles: number of handles in @wd_index and @path_index,
  * @subdirs: include sub-directories of @path,
  * @create: call @create_handler for existing files,
  * @filter: function to filter paths watched,
@@ -103,65 +128,245 @@ typedef void (*NihDeleteHandler) (void *data, NihWatch *watch,
  * @modify_handler: function called when a path is modified,
  * @delete_handler: function called when a path is deleted,
  * @created: hash table of created files,
+ * @quiet: seconds without events before coalesced changes are delivered,
+ * @batch_handler: function called with all coalesced changes,
+ * @changes: hash table of coalesced changes, or NULL,
+ * @change_order: list of @changes in the order they were first made,
+ * @changes_since: time the first of @changes was made,
+ * @timer: timer to deliver @changes,
+ * @entries: hash table of objects known to be in the tree, or NULL,
+ * @nentries: number of entries in @entries,
+ * @generation: incremented for each rescan of the tree,
+ * @overflows: number of times the event queue has overflowed,
  * @data: pointer to pass to functions,
  * @free: allows free to be called within a handler.
  *
  * This structure represents an inotify instance that is watching @path,
  * and optionally sub-directories underneath it.  It can also be used to
  * just watch multiple different files calling the same functions for each.
+ *
+ * Each event names the watch descriptor it occurred on, so the handles in
+ * @watches are also indexed by that, and by path, so that finding the one
+ * for an event need not search a list as long as the number of
+ * directories in the tree; the indexes are replaced by larger ones as
+ * @nhandles grows.  A handle removed from @watches with nih_list_remove()
+ * rather than freed is no longer watched, and is dropped from the indexes
+ * when next found there.
+ *
+ * Where nih_watch_use_fanotify is TRUE, the process may watch the whole
+ * filesystem of @path with fanotify and @subdirs is TRUE, @fanotify is
+ * set and the tree is watched without a watch for each directory in it;
+ * the handles in @watches are then only those for the paths given to
+ * nih_watch_new() and nih_watch_add(), and events are matched against
+ * them by path.  The path of the directory an event occurred in is found
+ * when it is read, so events within one that has since been removed are
+ * lost.  Whether each directory is within those paths is remembered in
+ * @dirs by its file handle, so events from others on the filesystem are
+ * dropped without finding their path; only the most recently used are
+ * kept, in @dir_order.
+ *
+ * When coalescing has been enabled with nih_watch_coalesce(), @changes is
+ * allocated and events are recorded there rather than handled at once;
+ * they are delivered by @timer once there have been none for @quiet
+ * seconds.
+ *
+ * Once recording has been enabled with nih_watch_record(), @entries is
+ * allocated and every object reported to the handlers is recorded there
+ * along with its inode and modification time, so that when events have
+ * been lost because the queue overflowed the tree can be rescanned and
+ * compared against them to find the changes that were missed.  They may
+ * also be saved with nih_watch_save() and compared against the tree by
+ * nih_watch_restore() when the process is next started.
  **/
 struct nih_watch {
-	int               fd;
-	NihIo            *io;
+	int                   fd;
 
-	char             *path;
-	NihList           watches;
+	int                   fanotify;
+	NihIoWatch           *io_watch;
+	int                   mount_fd;
+	NihHash              *dirs;
+	size_t                ndirs;
+	NihList               dir_order;
 
-	int               subdirs;
-	int               create;
-	NihFileFilter     filter;
+	char                 *path;
+	NihList               watches;
+	NihHash              *wd_index;
+	NihHash              *path_index;
+	size_t                nhandles;
 
-	NihCreateHandler  create_handler;
-	NihModifyHandler  modify_handler;
-	NihDeleteHandler  delete_handler;
+	int                   subdirs;
+	int                   create;
+	NihFileFilter         filter;
 
-	NihHash          *created;
+	NihCreateHandler      create_handler;
+	NihModifyHandler      modify_handler;
+	NihDeleteHandler      delete_handler;
 
-	void             *data;
-	int              *free;
+	NihHash              *created;
+
+	time_t                quiet;
+	NihWatchBatchHandler  batch_handler;
+	NihHash              *changes;
+	NihList               change_order;
+	time_t                changes_since;
+	NihTimer             *timer;
+
+	NihHash              *entries;
+	size_t                nentries;
+	unsigned int          generation;
+	size_t                overflows;
+
+	void                 *data;
+	int                  *free;
 };
 
 /**
  * NihWatchHandle:
  * @entry: entry in list,
  * @wd: inotify watch handle,
- * @path: path being watched.
+ * @path: path being watched,
+ * @watch: watch the handle belongs to,
+ * @wd_entry: entry in hash table by watch descriptor,
+ * @path_entry: entry in hash table by path,
+ * @subdirs: include sub-directories of @path,
+ * @real_path: canonical form of @path (fanotify only),
+ * @fid: file handle of @path (fanotify only).
  *
  * This structure represents an inotify watch on an individual @path with
  * a unique watch descriptor @wd.  They are stored in the watches list of
- * an NihWatch structure.
+ * an NihWatch structure, and its wd_index and path_index hash tables.
+ *
+ * When the watch uses fanotify, @wd is -1 and the handle instead records
+ * a path given to the watch; events are matched against @real_path, and
+ * against @fid for @path itself once it has been moved or deleted.
  **/
 typedef struct nih_watch_handle {
-	NihList  entry;
+	NihList   entry;
 
-	int      wd;
-	char    *path;
+	int       wd;
+	char     *path;
+
+	NihWatch *watch;
+	NihList   wd_entry;
+	NihList   path_entry;
+
+	int       subdirs;
+	char     *real_path;
+	void     *fid;
 } NihWatchHandle;
 
+/**
+ * NihWatchChange:
+ * @entry: entry in hash table,
+ * @path: path changed,
+ * @order: entry in list in order of change,
+ * @existed: TRUE if @path existed before the first change.
+ *
+ * This structure records the changes coalesced for @path.  Only whether
+ * it existed before they began is kept, since when they are delivered
+ * whether it exists then determines which handler is called.
+ **/
+typedef struct nih_watch_change {
+	NihList  entry;
+	char    *path;
+
+	NihList  order;
+	int      existed;
+} NihWatchChange;
+
+/**
+ * NihWatchDir:
+ * @entry: list header,
+ * @order: entry in dir_order list of watch,
+ * @fh: file handle of directory,
+ * @path: real path of directory,
+ * @watched: TRUE if the directory may be within a path watched.
+ *
+ * Remembers whether a directory that fanotify events have been received
+ * from was found to be within the paths watched, so that further events
+ * from one elsewhere on the filesystem can be dropped without opening it
+ * to find its path.  @path is kept so that those within a directory that
+ * is moved can be forgotten.
+ **/
+typedef struct nih_watch_dir {
+	NihList             entry;
+	NihList             order;
+	struct file_handle *fh;
+	char               *path;
+	int                 watched;
+} NihWatchDir;
+
+/**
+ * NihWatchEntry:
+ * @entry: entry in hash table,
+ * @path: path of object,
+ * @children: objects recorded within @path,
+ * @child_entry: entry in @children of the directory containing @path,
+ * @ino: inode number of @path,
+ * @mtime: modification time of @path,
+ * @size: size of @path,
+ * @is_dir: TRUE if @path is a directory,
+ * @generation: generation of the watch @path was last seen in,
+ * @hash: hash of the contents of @path,
+ * @hashed: TRUE if @hash is known.
+ *
+ * This structure records an object known to be within a watched tree,
+ * as it was when last reported to the handlers.  A different inode means
+ * the object was replaced, and a different modification time or size
+ * that a file was modified.
+ *
+ * @hash is only calculated when needed by nih_watch_save(), and is
+ * forgotten whenever the file is found to have been modified.
+ *
+ * Each object is linked into @children of the directory containing it,
+ * if that was recorded first, so that the objects within a directory
+ * moved away can be found without searching every entry.
+ **/
+typedef struct nih_watch_entry {
+	NihList          entry;
+	char            *path;
+	NihList          children;
+	NihList          child_entry;
+
+	ino_t            ino;
+	struct timespec  mtime;
+	off_t            size;
+	int              is_dir;
+
+	unsigned int     generation;
+
+	uint64_t         hash;
+	int              hashed;
+} NihWatchEntry;
+
 
 NIH_BEGIN_EXTERN
 
-NihWatch *nih_watch_new     (const void *parent, const char *path, int subdirs,
-			     int create, NihFileFilter filter,
-			     NihCreateHandler create_handler,
-			     NihModifyHandler modify_handler,
-			     NihDeleteHandler delete_handler, void *data)
+extern int nih_watch_use_fanotify;
+
+
+NihWatch *nih_watch_new      (const void *parent, const char *path,
+			      int subdirs, int create, NihFileFilter filter,
+			      NihCreateHandler create_handler,
+			      NihModifyHandler modify_handler,
+			      NihDeleteHandler delete_handler, void *data)
 	__attribute__ ((warn_unused_result, malloc));
 
-int       nih_watch_add     (NihWatch *watch, const char *path, int subdirs)
+int       nih_watch_add      (NihWatch *watch, const char *path,
+			      int subdirs)
+	__attribute__ ((warn_unused_result));
+
+void      nih_watch_coalesce (NihWatch *watch, time_t quiet,
+			      NihWatchBatchHandler batch_handler);
+void      nih_watch_record   (NihWatch *watch);
+void      nih_watch_rescan   (NihWatch *watch);
+
+int       nih_watch_save     (NihWatch *watch, const char *filename)
+	__attribute__ ((warn_unused_result));
+int       nih_watch_restore  (NihWatch *watch, const char *filename)
 	__attribute__ ((warn_unused_result));
 
-int       nih_watch_destroy (NihWatch *watch);
+int       nih_watch_destroy  (NihWatch *watch);
 
 NIH_END_EXTERN
 
@@ -0,0 +1,694 @@
+/* libnih
+ *
+ * workpool.c - worker thread pools
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/io.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "workpool.h"
+
+
+/**
+ * NihWorkState:
+ *
+ * State of a work item, changed only with the pool lock held.
+ **/
+typedef enum {
+	NIH_WORK_QUEUED,
+	NIH_WORK_RUNNING,
+	NIH_WORK_DONE,
+	NIH_WORK_CANCELLED
+} NihWorkState;
+
+/**
+ * NihWorkItem:
+ * @prev: previous item in deque,
+ * @next: next item in deque or completed list,
+ * @state: state of item,
+ * @func: work function,
+ * @data: pointer passed to @func,
+ * @error: error raised by @func,
+ * @job: job handle, or NULL if cancelled.
+ *
+ * This structure is the part of a job shared with the worker threads;
+ * it's allocated with malloc() rather than nih_alloc() since it may be
+ * freed by a worker when the job has been cancelled.  @job is only ever
+ * used by the main thread.
+ **/
+typedef struct nih_work_item {
+	struct nih_work_item *prev;
+	struct nih_work_item *next;
+
+	NihWorkState          state;
+
+	NihWorkFunc           func;
+	void                 *data;
+	NihError             *error;
+
+	NihWorkJob           *job;
+} NihWorkItem;
+
+/**
+ * NihWorkDispatch:
+ * @next: dispatch this one was started within,
+ * @pool: pool whose jobs are being dispatched,
+ * @freed: set to TRUE if @pool is freed.
+ *
+ * This structure is placed on the stack of nih_work_pool_watcher() while
+ * it calls done handlers, so that it can tell whether one of them freed
+ * the pool.
+ **/
+typedef struct nih_work_dispatch {
+	struct nih_work_dispatch *next;
+	NihWorkPool              *pool;
+	int                       freed;
+} NihWorkDispatch;
+
+/**
+ * NihWorkWorker:
+ * @pool: pool the worker belongs to,
+ * @index: index of worker in pool,
+ * @thread: worker thread,
+ * @started: TRUE if @thread was created,
+ * @lock: mutex protecting the deque,
+ * @head: front of deque,
+ * @tail: back of deque.
+ *
+ * This structure holds the state of a single worker thread and its deque
+ * of work items.
+ **/
+typedef struct nih_work_worker {
+	NihWorkPool    *pool;
+	size_t          index;
+
+	pthread_t       thread;
+	int             started;
+
+	pthread_mutex_t lock;
+	NihWorkItem    *head;
+	NihWorkItem    *tail;
+} NihWorkWorker;
+
+
+/* Prototypes for static functions */
+static void *       nih_work_worker_thread (NihWorkWorker *worker);
+static NihWorkItem *nih_work_worker_take   (NihWorkWorker *worker);
+static void         nih_work_pool_watcher  (NihWorkPool *pool,
+					    NihIoWatch *watch,
+					    NihIoEvents events);
+static void         nih_work_items_discard (NihWorkItem *items);
+
+
+/**
+ * dispatching:
+ *
+ * Done handlers being called by nih_work_pool_watcher() in this thread,
+ * innermost first.
+ **/
+static __thread NihWorkDispatch *dispatching = NULL;
+
+
+/**
+ * nih_work_pool_new:
+ * @parent: parent object for new pool,
+ * @nthreads: number of worker threads.
+ *
+ * Creates a new pool of @nthreads worker threads to which jobs may be
+ * submitted with nih_work_pool_submit(); completed jobs are delivered
+ * to the current loop, which must be run for their done handlers to be
+ * called.
+ *
+ * The pool structure is allocated using nih_alloc(); freeing it cancels
+ * all outstanding jobs, waiting for any that are running to finish, and
+ * then stops the worker threads.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned pool.  When all parents
+ * of the returned pool are freed, the returned pool will also be
+ * freed.
+ *
+ * Returns: new pool, or NULL on raised error.
+ **/
+NihWorkPool *
+nih_work_pool_new (const void *parent,
+		   size_t      nthreads)
+{
+	NihWorkPool *pool;
+	size_t       i;
+	int          ret;
+
+	nih_assert (nthreads > 0);
+
+	pool = nih_new (parent, NihWorkPool);
+	if (! pool)
+		nih_return_no_memory_error (NULL);
+
+	pool->nthreads = nthreads;
+	pool->queued = 0;
+	pool->next_worker = 0;
+	pool->done_head = NULL;
+	pool->done_tail = NULL;
+	pool->shutdown = FALSE;
+	pool->event_fd = -1;
+	pool->watch = NULL;
+
+	pool->workers = nih_alloc (pool, sizeof (NihWorkWorker) * nthreads);
+	if (! pool->workers) {
+		nih_free (pool);
+		nih_return_no_memory_error (NULL);
+	}
+
+	pthread_mutex_init (&pool->lock, NULL);
+	pthread_cond_init (&pool->work_cond, NULL);
+	pthread_cond_init (&pool->done_cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		NihWorkWorker *worker = &pool->workers[i];
+
+		worker->pool = pool;
+		worker->index = i;
+		worker->started = FALSE;
+
+		pthread_mutex_init (&worker->lock, NULL);
+		worker->head = NULL;
+		worker->tail = NULL;
+	}
+
+	nih_alloc_set_destructor (pool, nih_work_pool_destroy);
+
+	/* Completed jobs are delivered to the main loop by a write to
+	 * this descriptor, which we watch from the current loop.
+	 */
+	pool->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->event_fd < 0) {
+		nih_error_raise_system ();
+		nih_free (pool);
+		return NULL;
+	}
+
+	pool->watch = nih_io_add_watch (pool, pool->event_fd, NIH_IO_READ,
+					(NihIoWatcher)nih_work_pool_watcher,
+					pool);
+	if (! pool->watch) {
+		nih_free (pool);
+		nih_return_no_memory_error (NULL);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		NihWorkWorker *worker = &pool->workers[i];
+
+		ret = pthread_create (&worker->thread, NULL,
+				      (void *(*)(void *))nih_work_worker_thread,
+				      worker);
+		if (ret) {
+			errno = ret;
+			nih_error_raise_system ();
+			nih_free (pool);
+			return NULL;
+		}
+
+		worker->started = TRUE;
+	}
+
+	return pool;
+}
+
+/**
+ * nih_work_pool_destroy:
+ * @pool: pool to be destroyed.
+ *
+ * Stops the worker threads of @pool, waiting for any job they are running
+ * to finish, and discards all outstanding jobs without calling their done
+ * handlers; the handles of those jobs remain allocated but no longer
+ * refer to the pool.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_work_pool_destroy (NihWorkPool *pool)
+{
+	NihWorkDispatch *dispatch;
+	size_t           i;
+
+	nih_assert (pool != NULL);
+
+	for (dispatch = dispatching; dispatch; dispatch = dispatch->next)
+		if (dispatch->pool == pool)
+			dispatch->freed = TRUE;
+
+	pthread_mutex_lock (&pool->lock);
+	pool->shutdown = TRUE;
+	pthread_cond_broadcast (&pool->work_cond);
+	pthread_mutex_unlock (&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		NihWorkWorker *worker = &pool->workers[i];
+
+		if (worker->started)
+			pthread_join (worker->thread, NULL);
+
+		nih_work_items_discard (worker->head);
+		pthread_mutex_destroy (&worker->lock);
+	}
+
+	nih_work_items_discard (pool->done_head);
+
+	pthread_cond_destroy (&pool->done_cond);
+	pthread_cond_destroy (&pool->work_cond);
+	pthread_mutex_destroy (&pool->lock);
+
+	if (pool->event_fd != -1)
+		close (pool->event_fd);
+
+	return 0;
+}
+
+/**
+ * nih_work_items_discard:
+ * @items: list of items.
+ *
+ * Frees each of @items, which are linked by their next pointers, clearing
+ * the job handles that refer to them.  Must only be called from the main
+ * thread.
+ **/
+static void
+nih_work_items_discard (NihWorkItem *items)
+{
+	while (items) {
+		NihWorkItem *item = items;
+
+		items = item->next;
+
+		if (item->job) {
+			item->job->item = NULL;
+			item->job->pool = NULL;
+		}
+
+		if (item->error)
+			nih_free (item->error);
+
+		free (item);
+	}
+}
+
+
+/**
+ * nih_work_pool_submit:
+ * @pool: pool to submit job to,
+ * @parent: parent object for job handle,
+ * @func: function to call in worker thread,
+ * @done: function to call from the main loop when done,
+ * @data: pointer to pass to @func and @done.
+ *
+ * Queues a job on @pool, @func will be called with @data from one of the
+ * pool's worker threads and, once it has returned, @done will be called
+ * with @data from the main loop.  Jobs are not necessarily started in the
+ * order that they were submitted.
+ *
+ * The job handle is allocated using nih_alloc() and is automatically freed
+ * once @done has been called; freeing it beforehand cancels the job.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned job.  When all parents
+ * of the returned job are freed, the returned job will also be
+ * freed.
+ *
+ * Returns: job handle, or NULL if insufficient memory.
+ **/
+NihWorkJob *
+nih_work_pool_submit (NihWorkPool        *pool,
+		      const void         *parent,
+		      NihWorkFunc         func,
+		      NihWorkDoneHandler  done,
+		      void               *data)
+{
+	NihWorkJob    *job;
+	NihWorkItem   *item;
+	NihWorkWorker *worker;
+
+	nih_assert (pool != NULL);
+	nih_assert (func != NULL);
+	nih_assert (done != NULL);
+
+	job = nih_new (parent, NihWorkJob);
+	if (! job)
+		return NULL;
+
+	item = malloc (sizeof (NihWorkItem));
+	if (! item) {
+		nih_free (job);
+		return NULL;
+	}
+
+	item->prev = NULL;
+	item->next = NULL;
+	item->state = NIH_WORK_QUEUED;
+	item->func = func;
+	item->data = data;
+	item->error = NULL;
+	item->job = job;
+
+	job->pool = pool;
+	job->item = item;
+	job->done = done;
+	job->data = data;
+	job->error = NULL;
+
+	nih_alloc_set_destructor (job, nih_work_job_destroy);
+
+	/* Spread jobs across the worker deques; idle workers will steal
+	 * from busy ones, so this need not be any cleverer.
+	 */
+	worker = &pool->workers[pool->next_worker++ % pool->nthreads];
+
+	pthread_mutex_lock (&worker->lock);
+	item->prev = worker->tail;
+	if (worker->tail) {
+		worker->tail->next = item;
+	} else {
+		worker->head = item;
+	}
+	worker->tail = item;
+	pthread_mutex_unlock (&worker->lock);
+
+	pthread_mutex_lock (&pool->lock);
+	pool->queued++;
+	pthread_cond_signal (&pool->work_cond);
+	pthread_mutex_unlock (&pool->lock);
+
+	return job;
+}
+
+/**
+ * nih_work_job_destroy:
+ * @job: job to be destroyed.
+ *
+ * Cancels @job if it has not yet been completed; if it has not yet been
+ * started then it never will be, and if its work function is running in
+ * a worker thread, this waits for it to return.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+nih_work_job_destroy (NihWorkJob *job)
+{
+	NihWorkPool *pool;
+	NihWorkItem *item;
+
+	nih_assert (job != NULL);
+
+	if (! job->item)
+		return 0;
+
+	pool = job->pool;
+	item = job->item;
+
+	pthread_mutex_lock (&pool->lock);
+	switch (item->state) {
+	case NIH_WORK_QUEUED:
+		/* The worker that takes it from the deque frees it */
+		item->state = NIH_WORK_CANCELLED;
+		break;
+	case NIH_WORK_RUNNING:
+		while (item->state == NIH_WORK_RUNNING)
+			pthread_cond_wait (&pool->done_cond, &pool->lock);
+		/* fall through */
+	case NIH_WORK_DONE:
+		/* The main loop frees it from the completed list */
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	item->job = NULL;
+	pthread_mutex_unlock (&pool->lock);
+
+	job->item = NULL;
+	job->pool = NULL;
+
+	return 0;
+}
+
+
+/**
+ * nih_work_worker_thread:
+ * @worker: worker state.
+ *
+ * Body of each worker thread; waits for jobs to be queued, takes one and
+ * runs it, then places it on the completed list, waking the main loop if
+ * that list was empty.
+ *
+ * Returns: NULL once the pool is being freed.
+ **/
+static void *
+nih_work_worker_thread (NihWorkWorker *worker)
+{
+	NihWorkPool *pool;
+
+	nih_assert (worker != NULL);
+
+	pool = worker->pool;
+
+	for (;;) {
+		NihWorkItem *item;
+		uint64_t     value = 1;
+		int          wake;
+
+		pthread_mutex_lock (&pool->lock);
+		while ((! pool->shutdown) && (! pool->queued))
+			pthread_cond_wait (&pool->work_cond, &pool->lock);
+
+		if (pool->shutdown) {
+			pthread_mutex_unlock (&pool->lock);
+			break;
+		}
+
+		/* Reserve one of the queued items, there's guaranteed to be
+		 * one in some deque for us even if another worker steals the
+		 * one we'd have found first.
+		 */
+		pool->queued--;
+		pthread_mutex_unlock (&pool->lock);
+
+		item = NULL;
+		while (! item)
+			item = nih_work_worker_take (worker);
+
+		pthread_mutex_lock (&pool->lock);
+		if (item->state == NIH_WORK_CANCELLED) {
+			pthread_mutex_unlock (&pool->lock);
+			free (item);
+			continue;
+		}
+
+		item->state = NIH_WORK_RUNNING;
+		pthread_mutex_unlock (&pool->lock);
+
+		/* The error context stack is per-thread, so any error the
+		 * work function raised is in this thread's own context;
+		 * take it to be handed to the main loop.
+		 */
+		if (item->func (item->data) < 0)
+			item->error = nih_error_steal ();
+
+		pthread_mutex_lock (&pool->lock);
+		item->state = NIH_WORK_DONE;
+		item->prev = NULL;
+		item->next = NULL;
+
+		wake = (pool->done_head == NULL);
+		if (pool->done_tail) {
+			pool->done_tail->next = item;
+		} else {
+			pool->done_head = item;
+		}
+		pool->done_tail = item;
+
+		pthread_cond_broadcast (&pool->done_cond);
+		pthread_mutex_unlock (&pool->lock);
+
+		if (wake)
+			while ((write (pool->event_fd, &value, sizeof (value)) < 0)
+			       && (errno == EINTR))
+				;
+	}
+
+	return NULL;
+}
+
+/**
+ * nih_work_worker_take:
+ * @worker: worker state.
+ *
+ * Takes the item from the back of @worker's own deque or, if that is empty,
+ * steals the item from the front of another worker's deque.
+ *
+ * Returns: item taken, or NULL if all deques were empty.
+ **/
+static NihWorkItem *
+nih_work_worker_take (NihWorkWorker *worker)
+{
+	NihWorkPool *pool;
+	NihWorkItem *item;
+	size_t       i;
+
+	nih_assert (worker != NULL);
+
+	pool = worker->pool;
+
+	pthread_mutex_lock (&worker->lock);
+	item = worker->tail;
+	if (item) {
+		worker->tail = item->prev;
+		if (worker->tail) {
+			worker->tail->next = NULL;
+		} else {
+			worker->head = NULL;
+		}
+	}
+	pthread_mutex_unlock (&worker->lock);
+
+	for (i = 1; (! item) && (i < pool->nthreads); i++) {
+		NihWorkWorker *victim;
+
+		victim = &pool->workers[(worker->index + i) % pool->nthreads];
+
+		pthread_mutex_lock (&victim->lock);
+		item = victim->head;
+		if (item) {
+			victim->head = item->next;
+			if (victim->head) {
+				victim->head->prev = NULL;
+			} else {
+				victim->tail = NULL;
+			}
+		}
+		pthread_mutex_unlock (&victim->lock);
+	}
+
+	return item;
+}
+
+
+/**
+ * nih_work_pool_watcher:
+ * @pool: pool with completed jobs,
+ * @watch: I/O watch on event descriptor,
+ * @events: events that occurred.
+ *
+ * Called from the main loop when the worker threads have completed jobs,
+ * takes the completed list and calls the done handler of each job that
+ * wasn't cancelled before freeing it.
+ *
+ * It is safe to free the pool from a done handler.
+ **/
+static void
+nih_work_pool_watcher (NihWorkPool *pool,
+		       NihIoWatch  *watch,
+		       NihIoEvents  events)
+{
+	NihWorkDispatch  dispatch;
+	NihWorkItem     *items;
+	NihError        *error;
+	uint64_t         value;
+
+	nih_assert (pool != NULL);
+	nih_assert (watch != NULL);
+
+	while ((read (pool->event_fd, &value, sizeof (value)) < 0)
+	       && (errno == EINTR))
+		;
+
+	pthread_mutex_lock (&pool->lock);
+	items = pool->done_head;
+	pool->done_head = NULL;
+	pool->done_tail = NULL;
+	pthread_mutex_unlock (&pool->lock);
+
+	dispatch.pool = pool;
+	dispatch.freed = FALSE;
+	dispatch.next = dispatching;
+	dispatching = &dispatch;
+
+	while (items) {
+		NihWorkItem *item = items;
+		NihWorkJob  *job;
+
+		items = item->next;
+		job = item->job;
+		error = item->error;
+		free (item);
+
+		if (! job) {
+			if (error)
+				nih_free (error);
+			continue;
+		}
+
+		job->item = NULL;
+		job->pool = NULL;
+
+		/* Raise the error from the worker again, keeping where it
+		 * was originally raised.
+		 */
+		nih_error_push_context ();
+		if (error) {
+			_nih_error_raise_error (error->filename, error->line,
+						error->function, error);
+			job->error = error;
+		}
+
+		job->done (job->data, job);
+		job->error = NULL;
+		nih_error_pop_context ();
+
+		nih_free (job);
+
+		/* Check whether the pool was freed by the handler, in
+		 * which case the remaining jobs are cancelled too.
+		 */
+		if (dispatch.freed) {
+			nih_work_items_discard (items);
+			break;
+		}
+	}
+
+	dispatching = dispatch.next;
+}
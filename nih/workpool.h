@@ -0,0 +1,164 @@
+/* libnih
+ *
+ * Copyright © 2026 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NIH_WORKPOOL_H
+#define NIH_WORKPOOL_H
+
+/**
+ * A work pool runs jobs on a fixed set of worker threads, so that blocking
+ * or CPU-heavy work can be kept off the main loop, and delivers their
+ * completion back to the loop the pool was created in.
+ *
+ * Jobs are submitted with nih_work_pool_submit(), which returns an
+ * NihWorkJob handle.  The work function is called in a worker thread;
+ * once it returns, the done handler is called from the main loop and the
+ * handle is freed.
+ *
+ * Freeing the handle, or any of its parents, before the done handler is
+ * called cancels the job.  A job that has not yet started will never be
+ * started; if the work function is already running, the free waits for it
+ * to return so that anything it uses may safely be a child of the handle.
+ * In neither case is the done handler called.  Freeing the pool cancels
+ * all of its outstanding jobs in the same way.
+ *
+ * Each worker thread has its own error context, so the work function may
+ * raise errors and call functions that do, such as nih_config_parse();
+ * if it returns a negative value, the error it raised is handed back and
+ * raised again while the done handler is called.  It may use nih_alloc()
+ * with a parent so long as the main thread doesn't use that parent at
+ * the same time, and should keep its results in @data for the done
+ * handler to deal with.
+ **/
+
+#include <nih/macros.h>
+#include <nih/io.h>
+#include <nih/error.h>
+
+#include <pthread.h>
+
+
+/**
+ * NihWorkFunc:
+ * @data: pointer given with job.
+ *
+ * The work function is called in a worker thread of the pool to perform
+ * the work of a job.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+typedef int (*NihWorkFunc) (void *data);
+
+/**
+ * NihWorkDoneHandler:
+ * @data: pointer given with job,
+ * @job: job that has been completed.
+ *
+ * The done handler is called from the main loop once the work function
+ * of @job has returned; @job is freed once the handler returns.
+ *
+ * If the work function raised an error, it is raised again in a new
+ * context while the handler is called and also given in the error member
+ * of @job; the handler must deal with it as usual, e.g. by calling
+ * nih_error_get() and freeing it.
+ **/
+typedef struct nih_work_job NihWorkJob;
+typedef void (*NihWorkDoneHandler) (void *data, NihWorkJob *job);
+
+
+/**
+ * NihWorkPool:
+ * @nthreads: number of worker threads,
+ * @workers: array of worker thread state,
+ * @lock: mutex protecting job state and the members below,
+ * @work_cond: condition signalled when jobs are queued,
+ * @done_cond: condition signalled when jobs are completed,
+ * @queued: number of jobs in the worker deques,
+ * @next_worker: worker the next job will be queued to,
+ * @done_head: first completed job,
+ * @done_tail: last completed job,
+ * @shutdown: TRUE once the pool is being freed,
+ * @event_fd: eventfd used to wake the main loop,
+ * @watch: I/O watch on @event_fd.
+ *
+ * This structure holds a pool of worker threads; each worker has its own
+ * deque of jobs which it takes from the back of, taking from the front of
+ * another worker's deque when its own is empty.
+ *
+ * Completed jobs are placed on a single list, and @event_fd written only
+ * when that list was empty, so the main loop is woken once for each batch
+ * of completions.
+ **/
+typedef struct nih_work_pool {
+	size_t                  nthreads;
+	struct nih_work_worker *workers;
+
+	pthread_mutex_t         lock;
+	pthread_cond_t          work_cond;
+	pthread_cond_t          done_cond;
+
+	size_t                  queued;
+	size_t                  next_worker;
+
+	struct nih_work_item   *done_head;
+	struct nih_work_item   *done_tail;
+
+	int                     shutdown;
+
+	int                     event_fd;
+	NihIoWatch             *watch;
+} NihWorkPool;
+
+/**
+ * NihWorkJob:
+ * @pool: pool the job was submitted to,
+ * @item: queued work item,
+ * @done: function called once the job is complete,
+ * @data: pointer passed to work function and @done,
+ * @error: error raised by the work function, or NULL.
+ *
+ * This structure is the handle of a job submitted to a work pool, freeing
+ * it cancels the job.  @item and @pool are NULL once the job has been
+ * completed or cancelled; @error is only set while @done is called.
+ **/
+struct nih_work_job {
+	NihWorkPool          *pool;
+	struct nih_work_item *item;
+
+	NihWorkDoneHandler    done;
+	void                 *data;
+
+	NihError             *error;
+};
+
+
+NIH_BEGIN_EXTERN
+
+NihWorkPool *nih_work_pool_new     (const void *parent, size_t nthreads)
+	__attribute__ ((warn_unused_result, malloc));
+int          nih_work_pool_destroy (NihWorkPool *pool);
+
+NihWorkJob * nih_work_pool_submit  (NihWorkPool *pool, const void *parent,
+				    NihWorkFunc func, NihWorkDoneHandler done,
+				    void *data)
+	__attribute__ ((warn_unused_result, malloc));
+
+int          nih_work_job_destroy  (NihWorkJob *job);
+
+NIH_END_EXTERN
+
+#endif /* NIH_WORKPOOL_H */